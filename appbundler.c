@@ -25,8 +25,8 @@
  * foo.app/Contents/Info.plist
  * foo.app/Contents/MacOS/foo (can be script or real binary)
  * foo.app/Contents/Resources/appIcon.icns (Apple Icon format)
- * foo.app/Contents/Resources/English.lproj/infoPlist.strings
- * foo.app/Contents/Resources/English.lproj/MainMenu.nib (Menu Layout)
+ * foo.app/Contents/Resources/en.lproj/InfoPlist.strings (one per locale)
+ * foo.app/Contents/Resources/en.lproj/MainMenu.nib (Menu Layout)
  *
  * There can be more to a bundle depending on the target, what resources
  * it contains and what the target platform but this simplifed format
@@ -35,32 +35,27 @@
  * TODO:
  * - Add support for writing bundles to the Desktop
  * - Convert to using CoreFoundation API rather than standard unix file ops
- * - Fix up the extract_icon routine from main source file and see if we
- *   can convert to *.icns or use png directly
  * - See if there is anything else in the rsrc section of the target that
  *   we might want to dump in a *.plist. Version information for the target
  *   and or Wine Version information come to mind.
- * - Association Support
  * - sha1hash of target application in bundle plist
  */ 
 
 
 #include <stdio.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <CoreFoundation/CoreFoundation.h>
 
 #include "shared.h"
 
-extern char *mac_desktop_dir;
-char* heap_printf(const char *format, ...);
-BOOL create_directories(char *directory);
-
 CFPropertyListRef CreateMyPropertyListFromFile(CFURLRef fileURL);
-void WriteMyPropertyListToFile(CFPropertyListRef propertyList, CFURLRef fileURL );
+BOOL WriteMyPropertyListToFile(CFPropertyListRef propertyList, CFURLRef fileURL );
 
 
 /* Sanitize bundle name for use in identifier: lowercase, replace spaces with hyphens, remove special chars */
@@ -122,7 +117,7 @@ static CFStringRef generate_bundle_identifier(const char *linkname)
 }
 
 
-CFDictionaryRef CreateMyDictionary(const char *linkname, const char *category,
+CFMutableDictionaryRef CreateMyDictionary(const char *linkname, const char *category,
                                    const char *min_os_version, const char *version,
                                    const char *custom_identifier)
 {
@@ -175,7 +170,7 @@ CFDictionaryRef CreateMyDictionary(const char *linkname, const char *category,
        CFRelease(verStr);
    } else {
        CFDictionarySetValue( dict, CFSTR("CFBundleShortVersionString"), CFSTR("1.0.0") );
-       CFDictionarySetValue( dict, CFSTR("CFBundleVersion"), CFSTR("1") );
+       CFDictionarySetValue( dict, CFSTR("CFBundleVersion"), CFSTR("1.0.0") );
    }
 
    /* Signature is deprecated but kept for compatibility */
@@ -219,71 +214,730 @@ CFDictionaryRef CreateMyDictionary(const char *linkname, const char *category,
 
    return dict;
 }
- 
-void WriteMyPropertyListToFile( CFPropertyListRef propertyList, CFURLRef fileURL )
-{
-   CFDataRef data;
-   CFErrorRef error = NULL;
-   CFWriteStreamRef stream;
-
-   /* Convert the property list into binary data using modern API */
-   data = CFPropertyListCreateData(
-       kCFAllocatorDefault,
-       propertyList,
-       kCFPropertyListBinaryFormat_v1_0,  /* Binary format for faster parsing */
-       0,
-       &error
-   );
-
-   if (!data) {
-       if (error) {
-           CFStringRef errorDesc = CFErrorCopyDescription(error);
-           if (errorDesc) {
-               DEBUG_PRINT("Property list creation failed: %s\n",
-                          CFStringGetCStringPtr(errorDesc, kCFStringEncodingUTF8));
-               CFRelease(errorDesc);
+
+/* CF string for a string or key node, decoded straight from the mapped bytes */
+static CFStringRef create_string_from_node(const PlistNode *node)
+{
+   CFStringRef str = NULL;
+   char *decoded;
+
+   switch (node->encoding) {
+       case PLIST_TEXT_RAW:
+           return CFStringCreateWithBytes(NULL, (const UInt8 *)node->ptr, (CFIndex)node->len,
+                                          kCFStringEncodingUTF8, false);
+       case PLIST_TEXT_UTF16BE:
+           return CFStringCreateWithBytes(NULL, (const UInt8 *)node->ptr, (CFIndex)node->len,
+                                          kCFStringEncodingUTF16BE, false);
+       case PLIST_TEXT_NONE:
+           return CFStringCreateWithCString(NULL, "", kCFStringEncodingUTF8);
+       default:
+           /* XML entities have to be expanded first */
+           decoded = plist_string_dup(node);
+           if (decoded) {
+               str = CFStringCreateWithCString(NULL, decoded, kCFStringEncodingUTF8);
+               free(decoded);
            }
-           CFRelease(error);
-       }
-       return;
+           return str;
    }
+}
 
-   /* Write using CFWriteStream instead of deprecated API */
-   stream = CFWriteStreamCreateWithFile(kCFAllocatorDefault, fileURL);
-   if (!stream) {
-       CFRelease(data);
-       return;
-   }
+/* Convert a parsed node into CF objects; containers are mutable */
+static CFPropertyListRef create_property_from_node(const PlistDocument *doc, const PlistNode *node)
+{
+   const PlistNode *child;
+   CFPropertyListRef value = NULL;
+
+   switch (node->type) {
+       case PLIST_NODE_DICT: {
+           CFMutableDictionaryRef dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                                   &kCFTypeDictionaryKeyCallBacks,
+                                                                   &kCFTypeDictionaryValueCallBacks);
+
+           for (child = plist_first_child(doc, node); dict && child;
+                child = plist_next_sibling(doc, child)) {
+               const PlistNode *item = plist_next_sibling(doc, child);
+               CFStringRef key;
+               CFPropertyListRef item_value;
+
+               if (!item || child->type != PLIST_NODE_KEY) {
+                   CFRelease(dict);
+                   return NULL;
+               }
+               key = create_string_from_node(child);
+               item_value = create_property_from_node(doc, item);
+               if (key && item_value)
+                   CFDictionarySetValue(dict, key, item_value);
+               if (key) CFRelease(key);
+               if (item_value) CFRelease(item_value);
+               if (!key || !item_value) {
+                   CFRelease(dict);
+                   return NULL;
+               }
+               child = item;
+           }
+           return dict;
+       }
+
+       case PLIST_NODE_ARRAY: {
+           CFMutableArrayRef array = CFArrayCreateMutable(kCFAllocatorDefault, node->count,
+                                                          &kCFTypeArrayCallBacks);
+
+           for (child = plist_first_child(doc, node); array && child;
+                child = plist_next_sibling(doc, child)) {
+               CFPropertyListRef item_value = create_property_from_node(doc, child);
 
-   if (CFWriteStreamOpen(stream)) {
-       CFIndex dataLength = CFDataGetLength(data);
-       CFIndex bytesWritten = CFWriteStreamWrite(
-           stream,
-           CFDataGetBytePtr(data),
-           dataLength
-       );
+               if (!item_value) {
+                   CFRelease(array);
+                   return NULL;
+               }
+               CFArrayAppendValue(array, item_value);
+               CFRelease(item_value);
+           }
+           return array;
+       }
+
+       case PLIST_NODE_KEY:
+       case PLIST_NODE_STRING:
+           return create_string_from_node(node);
+
+       case PLIST_NODE_INTEGER:
+           return CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &node->value.integer);
+
+       case PLIST_NODE_REAL:
+           return CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &node->value.real);
+
+       case PLIST_NODE_BOOL:
+           return CFRetain(node->value.integer ? kCFBooleanTrue : kCFBooleanFalse);
 
-       if (bytesWritten != dataLength) {
-           DEBUG_PRINT("Warning: Incomplete write to plist file\n");
+       case PLIST_NODE_DATE: {
+           double seconds;
+
+           if (plist_date_value(node, &seconds))
+               value = CFDateCreate(kCFAllocatorDefault, seconds);
+           return value;
        }
 
-       CFWriteStreamClose(stream);
+       case PLIST_NODE_DATA: {
+           uint8_t *owned;
+           size_t len;
+           const uint8_t *bytes = plist_data_bytes(node, &len, &owned);
+
+           value = CFDataCreate(kCFAllocatorDefault, bytes ? bytes : (const UInt8 *)"", (CFIndex)len);
+           free(owned);
+           return value;
+       }
+
+       default:
+           return NULL;
    }
+}
+
+/*
+ * Read an XML or binary property list; caller releases the result.
+ * The file is mapped and parsed in one pass by plist_parse.c, then turned
+ * into CF objects with mutable containers.
+ */
+CFPropertyListRef CreateMyPropertyListFromFile( CFURLRef fileURL )
+{
+   char path[PATH_MAX];
+   CFPropertyListRef propertyList = NULL;
+   PlistDocument doc;
+
+   if (!CFURLGetFileSystemRepresentation(fileURL, true, (UInt8 *)path, sizeof(path)))
+       return NULL;
+
+   if (!plist_document_open(&doc, path)) {
+       DEBUG_PRINT("Property list parsing failed: %s\n", path);
+       return NULL;
+   }
+
+   if (plist_root(&doc))
+       propertyList = create_property_from_node(&doc, plist_root(&doc));
+   plist_document_close(&doc);
+
+   return propertyList;
+}
+
+/*
+ * Write a binary plist with sorted keys (plist_write.c), so an unchanged
+ * dictionary always gives an identical file.
+ */
+BOOL WriteMyPropertyListToFile( CFPropertyListRef propertyList, CFURLRef fileURL )
+{
+   char path[PATH_MAX];
+   PlistWriter *writer;
+   BOOL ret;
+
+   if (!CFURLGetFileSystemRepresentation(fileURL, true, (UInt8 *)path, sizeof(path)))
+       return FALSE;
+
+   writer = plist_writer_create();
+   if (!writer) return FALSE;
+
+   ret = plist_writer_write_file(writer, propertyList, path);
+   if (!ret)
+       DEBUG_PRINT("Property list write failed: %s\n", path);
+
+   plist_writer_destroy(writer);
+   return ret;
+}
+
+/* A readable PE file: an existing path ending in .exe or .dll */
+static BOOL is_pe_file(const char *path)
+{
+    return path && detect_icon_format(path) == ICON_FORMAT_PE && access(path, R_OK) == 0;
+}
+
+/*
+ * Copy the next word of a command line into word, honouring "..." and
+ * '...' quoting; returns where the scan stopped.
+ */
+static const char *next_command_word(const char *p, char *word, size_t size)
+{
+    size_t n = 0;
+    char quote = 0;
+
+    while (*p == ' ' || *p == '\t') p++;
+    while (*p && (quote || (*p != ' ' && *p != '\t'))) {
+        if (!quote && (*p == '"' || *p == '\'')) quote = *p;
+        else if (quote && *p == quote) quote = 0;
+        else if (n + 1 < size) word[n++] = *p;
+        p++;
+    }
+    word[n] = 0;
+    return p;
+}
+
+/*
+ * Pick the Windows binary whose version resource describes the bundle:
+ * the explicit source, the executable itself, the first .exe/.dll word of
+ * a command line such as `wine "C:/Program Files/App/app.exe"`, or a PE
+ * icon source. Returns a malloc'd path or NULL.
+ */
+static char *find_version_source(const AppBundleOptions *options)
+{
+    const char *p;
+
+    if (options->version_source)
+        return strdup(options->version_source);
+    if (is_pe_file(options->executable_path))
+        return strdup(options->executable_path);
+
+    for (p = options->executable_path; p && *p; ) {
+        char word[PATH_MAX];
+
+        p = next_command_word(p, word, sizeof(word));
+        if (*word && is_pe_file(word))
+            return strdup(word);
+    }
+
+    if (is_pe_file(options->icon_path))
+        return strdup(options->icon_path);
+    return NULL;
+}
+
+static void set_string_value(CFMutableDictionaryRef dict, CFStringRef key, const char *value)
+{
+    CFStringRef str = CFStringCreateWithCString(NULL, value, kCFStringEncodingUTF8);
+
+    if (str) {
+        CFDictionarySetValue(dict, key, str);
+        CFRelease(str);
+    }
+}
+
+/*
+ * The Mach-O the bundle runs: the executable itself, or the first word of
+ * a command line that is a path to one (`open -a Terminal /opt/bin/mc`).
+ * Bare names are not looked up in PATH, where they would find system
+ * tools such as open or env. Returns a malloc'd path, with its slices in
+ * info, or NULL.
+ */
+static char *find_macho_source(const AppBundleOptions *options, MachOInfo *info)
+{
+    const char *p;
+
+    if (!options->executable_path)
+        return NULL;
+    if (macho_read_info(options->executable_path, info))
+        return strdup(options->executable_path);
+
+    for (p = options->executable_path; *p; ) {
+        char word[PATH_MAX];
+
+        p = next_command_word(p, word, sizeof(word));
+        if (strchr(word, '/') && macho_read_info(word, info))
+            return strdup(word);
+    }
+    return NULL;
+}
+
+/*
+ * LSMinimumSystemVersion and LSArchitecturePriority from the binary's load
+ * commands. The lowest minimum of any slice is the first release the app
+ * runs on; an explicit --min-os below it only gets a warning. Priority is
+ * only meaningful when the binary is the bundle executable (--launcher
+ * direct); it lists native Arm slices first. LaunchServices has no arm64e
+ * entry, so those slices count as arm64 and the name is listed once.
+ */
+static void apply_macho_info(CFMutableDictionaryRef dict, const AppBundleOptions *options,
+                             const char *source, const MachOInfo *info)
+{
+    static const char *const preference[] = {"arm64", "x86_64", "i386", "ppc64", "ppc"};
+    uint32_t min_os = 0, given;
+    BOOL modern = FALSE;
+    char version[32];
+    size_t i;
+    int s;
+
+    for (s = 0; s < info->count; s++) {
+        const char *arch = macho_arch_name(&info->slices[s]);
+
+        if (info->slices[s].min_os && (!min_os || info->slices[s].min_os < min_os))
+            min_os = info->slices[s].min_os;
+        if (arch && (strncmp(arch, "arm64", 5) == 0 || strcmp(arch, "x86_64") == 0))
+            modern = TRUE;
+    }
+
+    if (!modern)
+        fprintf(stderr, "Warning: %s has no x86_64 or arm64 code and will not run on "
+                "macOS 10.15 or later\n", source);
+
+    if (min_os) {
+        macho_version_string(min_os, version, sizeof(version));
+        given = macho_parse_version(options->min_os_version);
+        if (!options->min_os_version) {
+            DEBUG_PRINT("Minimum macOS %s from %s\n", version, source);
+            set_string_value(dict, CFSTR("LSMinimumSystemVersion"), version);
+        } else if (given && given < min_os) {
+            fprintf(stderr, "Warning: --min-os %s is lower than macOS %s, which %s requires\n",
+                    options->min_os_version, version, source);
+        }
+    }
+
+    if (options->launcher_mode == LAUNCHER_DIRECT) {
+        CFMutableArrayRef archs = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+        for (i = 0; archs && i < sizeof(preference) / sizeof(preference[0]); i++) {
+            for (s = 0; s < info->count; s++) {
+                const char *arch = macho_arch_name(&info->slices[s]);
+
+                if (arch && strcmp(arch, "arm64e") == 0)
+                    arch = "arm64";
+                if (arch && strcmp(arch, preference[i]) == 0) {
+                    CFStringRef str = CFStringCreateWithCString(NULL, arch, kCFStringEncodingUTF8);
+
+                    CFArrayAppendValue(archs, str);
+                    CFRelease(str);
+                    break;
+                }
+            }
+        }
+        if (archs && CFArrayGetCount(archs) > 0)
+            CFDictionarySetValue(dict, CFSTR("LSArchitecturePriority"), archs);
+        if (archs)
+            CFRelease(archs);
+    }
+}
+
+static CFStringRef create_pe_string(const PeString *str)
+{
+    if (!str->utf16 || str->units == 0)
+        return NULL;
+    return CFStringCreateWithBytes(NULL, str->utf16, (CFIndex)(str->units * 2),
+                                   kCFStringEncodingUTF16LE, false);
+}
+
+/*
+ * Copy version, copyright and description from a Windows VS_VERSIONINFO.
+ * An explicit --version always wins; the numeric VS_FIXEDFILEINFO is
+ * preferred over the free-form strings, which are often "1, 0, 0, 1".
+ */
+static void apply_version_info(CFMutableDictionaryRef dict, const PeVersionInfo *info,
+                               BOOL keep_version)
+{
+    CFStringRef short_ver = NULL, bundle_ver = NULL, copyright, name, get_info;
+
+    if (!keep_version) {
+        if (info->has_fixed) {
+            const uint16_t *pv = info->product_version, *fv = info->file_version;
+
+            short_ver = CFStringCreateWithFormat(NULL, NULL, CFSTR("%u.%u.%u"),
+                                                 pv[0], pv[1], pv[2]);
+            bundle_ver = CFStringCreateWithFormat(NULL, NULL, CFSTR("%u.%u.%u.%u"),
+                                                  fv[0], fv[1], fv[2], fv[3]);
+        } else {
+            short_ver = create_pe_string(&info->product_version_str);
+            bundle_ver = create_pe_string(&info->file_version_str);
+            if (!short_ver && bundle_ver) short_ver = (CFStringRef)CFRetain(bundle_ver);
+            if (!bundle_ver && short_ver) bundle_ver = (CFStringRef)CFRetain(short_ver);
+        }
+
+        if (short_ver) {
+            CFDictionarySetValue(dict, CFSTR("CFBundleShortVersionString"), short_ver);
+            CFDictionarySetValue(dict, CFSTR("CFBundleVersion"), bundle_ver);
+        }
+    }
+
+    copyright = create_pe_string(&info->copyright);
+    if (copyright)
+        CFDictionarySetValue(dict, CFSTR("NSHumanReadableCopyright"), copyright);
+
+    /* CFBundleGetInfoString: "<description> <version>, <copyright>" */
+    name = create_pe_string(&info->description);
+    if (!name)
+        name = create_pe_string(&info->product_name);
+    if (name) {
+        CFStringRef ver = CFDictionaryGetValue(dict, CFSTR("CFBundleShortVersionString"));
+
+        get_info = copyright ?
+            CFStringCreateWithFormat(NULL, NULL, CFSTR("%@ %@, %@"), name, ver, copyright) :
+            CFStringCreateWithFormat(NULL, NULL, CFSTR("%@ %@"), name, ver);
+        if (get_info) {
+            CFDictionarySetValue(dict, CFSTR("CFBundleGetInfoString"), get_info);
+            CFRelease(get_info);
+        }
+        CFRelease(name);
+    }
+
+    if (copyright) CFRelease(copyright);
+    if (short_ver) CFRelease(short_ver);
+    if (bundle_ver) CFRelease(bundle_ver);
+}
+
+/* The array under key, created if missing; returned array is owned by dict */
+static CFMutableArrayRef dictionary_array(CFMutableDictionaryRef dict, CFStringRef key)
+{
+    CFTypeRef existing = CFDictionaryGetValue(dict, key);
+    CFMutableArrayRef array;
+
+    if (existing && CFGetTypeID(existing) == CFArrayGetTypeID())
+        array = CFArrayCreateMutableCopy(NULL, 0, (CFArrayRef)existing);
+    else
+        array = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+
+    CFDictionarySetValue(dict, key, array);
+    CFRelease(array);
+    return array;
+}
+
+static CFArrayRef create_single_string_array(const char *s)
+{
+    CFStringRef str = CFStringCreateWithCString(NULL, s, kCFStringEncodingUTF8);
+    CFArrayRef array = CFArrayCreate(NULL, (const void **)&str, 1, &kCFTypeArrayCallBacks);
+
+    CFRelease(str);
+    return array;
+}
+
+/*
+ * Add a CFBundleDocumentTypes entry for each extension in a comma-separated
+ * list. Known extensions are claimed by UTI, and types macOS does not
+ * declare itself get a UTImportedTypeDeclarations entry; unknown ones fall
+ * back to CFBundleTypeExtensions. The bundle registers as an Alternate
+ * viewer, so it shows up in Open With without taking over the default.
+ */
+static void add_document_types(CFMutableDictionaryRef dict, const char *extensions)
+{
+    CFMutableArrayRef doc_types = NULL, imported = NULL;
+    const char *p = extensions;
+    const char *seen_uti[64];
+    int seen = 0;
+
+    while (p && *p) {
+        const char *token = p;
+        size_t len = strcspn(p, ", ");
+        const UtiType *type;
+        char ext[32], *name;
+        CFMutableDictionaryRef doc;
+        CFStringRef str;
+        CFArrayRef array;
+        int i;
+
+        p += len;
+        if (*p) p++;
+        if (len > 0 && *token == '.') {
+            token++;
+            len--;
+        }
+        if (len == 0 || len >= sizeof(ext))
+            continue;
+        memcpy(ext, token, len);
+        ext[len] = '\0';
+
+        type = uti_lookup_extension(ext);
+        if (type) {
+            /* txt and text are one UTI; claim it once */
+            for (i = 0; i < seen && strcmp(seen_uti[i], type->uti) != 0; i++)
+                ;
+            if (i < seen) continue;
+            if (seen < (int)(sizeof(seen_uti) / sizeof(seen_uti[0])))
+                seen_uti[seen++] = type->uti;
+        }
+
+        if (!doc_types)
+            doc_types = dictionary_array(dict, CFSTR("CFBundleDocumentTypes"));
+
+        doc = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                        &kCFTypeDictionaryValueCallBacks);
+
+        for (i = 0; ext[i]; i++)
+            ext[i] = (char)tolower((unsigned char)ext[i]);
+        name = type ? strdup(type->description) : heap_printf("%s File", ext);
+        if (name && !type) {
+            for (i = 0; name[i] != ' '; i++)
+                name[i] = (char)toupper((unsigned char)name[i]);
+        }
+        str = CFStringCreateWithCString(NULL, name ? name : ext, kCFStringEncodingUTF8);
+        CFDictionarySetValue(doc, CFSTR("CFBundleTypeName"), str);
+        CFRelease(str);
+        free(name);
+
+        CFDictionarySetValue(doc, CFSTR("CFBundleTypeRole"), CFSTR("Viewer"));
+        CFDictionarySetValue(doc, CFSTR("LSHandlerRank"), CFSTR("Alternate"));
+
+        if (type) {
+            array = create_single_string_array(type->uti);
+            CFDictionarySetValue(doc, CFSTR("LSItemContentTypes"), array);
+            CFRelease(array);
+        } else {
+            array = create_single_string_array(ext);
+            CFDictionarySetValue(doc, CFSTR("CFBundleTypeExtensions"), array);
+            CFRelease(array);
+        }
+
+        CFArrayAppendValue(doc_types, doc);
+        CFRelease(doc);
+        DEBUG_PRINT("Associating .%s (%s)\n", ext, type ? type->uti : "by extension");
+
+        /* Types macOS does not know need declaring, with their tags */
+        if (type && type->conforms) {
+            CFMutableDictionaryRef decl, tags;
+
+            if (!imported)
+                imported = dictionary_array(dict, CFSTR("UTImportedTypeDeclarations"));
+
+            decl = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                             &kCFTypeDictionaryValueCallBacks);
+            tags = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks,
+                                             &kCFTypeDictionaryValueCallBacks);
+
+            str = CFStringCreateWithCString(NULL, type->uti, kCFStringEncodingUTF8);
+            CFDictionarySetValue(decl, CFSTR("UTTypeIdentifier"), str);
+            CFRelease(str);
+            str = CFStringCreateWithCString(NULL, type->description, kCFStringEncodingUTF8);
+            CFDictionarySetValue(decl, CFSTR("UTTypeDescription"), str);
+            CFRelease(str);
+            array = create_single_string_array(type->conforms);
+            CFDictionarySetValue(decl, CFSTR("UTTypeConformsTo"), array);
+            CFRelease(array);
+
+            array = create_single_string_array(type->ext);
+            CFDictionarySetValue(tags, CFSTR("public.filename-extension"), array);
+            CFRelease(array);
+            array = create_single_string_array(type->mime);
+            CFDictionarySetValue(tags, CFSTR("public.mime-type"), array);
+            CFRelease(array);
+            CFDictionarySetValue(decl, CFSTR("UTTypeTagSpecification"), tags);
+            CFRelease(tags);
+
+            CFArrayAppendValue(imported, decl);
+            CFRelease(decl);
+        }
+    }
+}
+
+/*
+ * CFBundleLocalizations lists the table's locales, so the app is offered
+ * in them even though it has no nibs, and LSHasLocalizedDisplayName makes
+ * Finder look up the localized CFBundleDisplayName.
+ */
+static void add_localization_keys(CFMutableDictionaryRef dict, const LocalizationTable *table)
+{
+    CFMutableArrayRef locales;
+    int i;
+
+    locales = CFArrayCreateMutable(NULL, table->count, &kCFTypeArrayCallBacks);
+    for (i = 0; locales && i < table->count; i++) {
+        CFStringRef str = CFStringCreateWithCString(NULL, table->locales[i].locale,
+                                                    kCFStringEncodingUTF8);
+
+        if (str) {
+            CFArrayAppendValue(locales, str);
+            CFRelease(str);
+        }
+    }
+    if (locales) {
+        CFDictionarySetValue(dict, CFSTR("CFBundleLocalizations"), locales);
+        CFRelease(locales);
+    }
+
+    if (localization_table_has_display_name(table))
+        CFDictionarySetValue(dict, CFSTR("LSHasLocalizedDisplayName"), kCFBooleanTrue);
+}
+
+/* Keys that must describe the bundle as built, whatever a template says */
+static BOOL is_build_owned_key(CFStringRef key)
+{
+    return CFEqual(key, CFSTR("CFBundleExecutable")) || CFEqual(key, CFSTR("CFBundlePackageType")) ||
+           CFEqual(key, CFSTR("CFBundleIconFile"));
+}
+
+/* Copy from's keys into dict; nested dictionaries merge key by key, anything else is replaced */
+static void merge_dictionary(CFMutableDictionaryRef dict, CFDictionaryRef from, BOOL top_level)
+{
+    CFIndex count = CFDictionaryGetCount(from), i;
+    const void **keys, **values;
+
+    keys = malloc(2 * (size_t)(count ? count : 1) * sizeof(void *));
+    if (!keys) return;
+    values = keys + count;
+    CFDictionaryGetKeysAndValues(from, keys, values);
+
+    for (i = 0; i < count; i++) {
+        CFTypeRef existing = CFDictionaryGetValue(dict, keys[i]);
+
+        if (CFGetTypeID(keys[i]) != CFStringGetTypeID())
+            continue;
+
+        if (top_level && is_build_owned_key(keys[i])) {
+            char name[64];
+
+            CFStringGetCString(keys[i], name, sizeof(name), kCFStringEncodingUTF8);
+            fprintf(stderr, "Warning: Info.plist template cannot override %s, ignored\n", name);
+            continue;
+        }
+
+        if (existing && CFGetTypeID(existing) == CFDictionaryGetTypeID() &&
+            CFGetTypeID(values[i]) == CFDictionaryGetTypeID()) {
+            CFMutableDictionaryRef merged = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, existing);
+
+            if (merged) {
+                merge_dictionary(merged, values[i], FALSE);
+                CFDictionarySetValue(dict, keys[i], merged);
+                CFRelease(merged);
+            }
+        } else {
+            CFDictionarySetValue(dict, keys[i], values[i]);
+        }
+    }
+
+    free(keys);
+}
+
+static BOOL apply_plist_template(CFMutableDictionaryRef dict, const char *template_path)
+{
+    CFURLRef url;
+    CFPropertyListRef template;
+
+    url = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (const UInt8 *)template_path,
+                                                  (CFIndex)strlen(template_path), false);
+    if (!url)
+        return FALSE;
+
+    template = CreateMyPropertyListFromFile(url);
+    CFRelease(url);
+
+    if (!template || CFGetTypeID(template) != CFDictionaryGetTypeID()) {
+        fprintf(stderr, "Error: %s is not a property list with a dictionary at the top\n", template_path);
+        if (template) CFRelease(template);
+        return FALSE;
+    }
+
+    merge_dictionary(dict, template, TRUE);
+    CFRelease(template);
+    return TRUE;
+}
+
+static CFPropertyListRef create_setting_value(const PlistSetting *setting)
+{
+    CFMutableArrayRef array;
+    const char *p;
+
+    switch (setting->type) {
+        case PLIST_NODE_INTEGER:
+            return CFNumberCreate(kCFAllocatorDefault, kCFNumberSInt64Type, &setting->integer);
+        case PLIST_NODE_REAL:
+            return CFNumberCreate(kCFAllocatorDefault, kCFNumberDoubleType, &setting->real);
+        case PLIST_NODE_BOOL:
+            return CFRetain(setting->integer ? kCFBooleanTrue : kCFBooleanFalse);
+        case PLIST_NODE_ARRAY:
+            array = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+            for (p = setting->value; array && *p; ) {
+                size_t len = strcspn(p, ",");
+                CFStringRef item = CFStringCreateWithBytes(NULL, (const UInt8 *)p, (CFIndex)len,
+                                                           kCFStringEncodingUTF8, false);
+                if (item) {
+                    CFArrayAppendValue(array, item);
+                    CFRelease(item);
+                }
+                p += len;
+                if (*p == ',') p++;
+            }
+            return array;
+        default:
+            return CFStringCreateWithCString(NULL, setting->value, kCFStringEncodingUTF8);
+    }
+}
+
+/* --plist-set values go in last and replace whatever was there */
+static BOOL apply_plist_settings(CFMutableDictionaryRef dict, const AppBundleOptions *options)
+{
+    int i;
+
+    for (i = 0; i < options->plist_setting_count; i++) {
+        PlistSetting setting;
+        CFStringRef key;
+        CFPropertyListRef value;
+
+        if (!plist_setting_parse(options->plist_settings[i], &setting)) {
+            fprintf(stderr, "Error: invalid --plist-set '%s'\n", options->plist_settings[i]);
+            return FALSE;
+        }
+
+        key = CFStringCreateWithBytes(NULL, (const UInt8 *)setting.key, (CFIndex)setting.key_len,
+                                      kCFStringEncodingUTF8, false);
+        if (key && is_build_owned_key(key)) {
+            fprintf(stderr, "Warning: --plist-set cannot override %.*s, ignored\n",
+                    (int)setting.key_len, setting.key);
+            CFRelease(key);
+            continue;
+        }
+        value = create_setting_value(&setting);
+        if (key && value)
+            CFDictionarySetValue(dict, key, value);
+        if (key) CFRelease(key);
+        if (value) CFRelease(value);
+        if (!key || !value)
+            return FALSE;
+    }
 
-   CFRelease(stream);
-   CFRelease(data);
+    return TRUE;
 }
 
-static BOOL generate_plist(const char *path_to_bundle_contents, const AppBundleOptions *options)
+/*
+ * Info.plist precedence, lowest first: the generated keys (options,
+ * defaults, version resource, associations), then --plist-template, then
+ * --plist-set. CFBundleExecutable, CFBundlePackageType and
+ * CFBundleIconFile always come from the build.
+ */
+static BOOL generate_plist(const char *path_to_bundle_contents, const AppBundleOptions *options,
+                           const LocalizationTable *localizations)
 {
     char *plist_path;
     static const char info_dot_plist_file[] = "Info.plist";
-    CFPropertyListRef propertyList;
+    CFMutableDictionaryRef propertyList;
     CFStringRef pathstr;
     CFURLRef fileURL;
+    PeVersionInfo version_info;
+    MachOInfo macho_info;
+    char *version_source, *macho_source;
+    BOOL ret;
 
     /* Append all of the filename and path stuff and shove it in to CFStringRef */
     plist_path = heap_printf("%s/%s", path_to_bundle_contents, info_dot_plist_file);
+    if (!plist_path)
+        return FALSE;
     pathstr = CFStringCreateWithCString(NULL, plist_path, kCFStringEncodingUTF8);
 
     /* Construct a complex dictionary object with all options */
@@ -294,7 +948,35 @@ static BOOL generate_plist(const char *path_to_bundle_contents, const AppBundleO
         options->version,
         options->bundle_identifier
     );
- 
+
+    /* Strings are converted straight out of the mapped binary, nothing is copied first */
+    version_source = find_version_source(options);
+    if (version_source && pe_version_info_open(version_source, &version_info)) {
+        DEBUG_PRINT("Using version information from %s\n", version_source);
+        apply_version_info(propertyList, &version_info, options->version != NULL);
+        pe_version_info_close(&version_info);
+    }
+    free(version_source);
+
+    macho_source = find_macho_source(options, &macho_info);
+    if (macho_source)
+        apply_macho_info(propertyList, options, macho_source, &macho_info);
+    free(macho_source);
+
+    if (options->associations)
+        add_document_types(propertyList, options->associations);
+
+    if (localizations)
+        add_localization_keys(propertyList, localizations);
+
+    if ((options->plist_template && !apply_plist_template(propertyList, options->plist_template)) ||
+        !apply_plist_settings(propertyList, options)) {
+        CFRelease(propertyList);
+        CFRelease(pathstr);
+        free(plist_path);
+        return FALSE;
+    }
+
     /* Create a URL that specifies the file we will create to hold the XML data. */
     fileURL = CFURLCreateWithFileSystemPath( kCFAllocatorDefault,
                                              pathstr,
@@ -302,70 +984,314 @@ static BOOL generate_plist(const char *path_to_bundle_contents, const AppBundleO
                                              false );
 
     /* Write the property list to the file */
-    WriteMyPropertyListToFile( propertyList, fileURL );
+    ret = WriteMyPropertyListToFile( propertyList, fileURL );
     CFRelease(propertyList);
     CFRelease(fileURL);
+    CFRelease(pathstr);
 
-    DEBUG_PRINT("Creating Bundle Info.plist at %s\n", wine_dbgstr_a(plist_path));
+    DEBUG_PRINT("Creating Bundle Info.plist at %s\n", plist_path);
+    free(plist_path);
 
-    return TRUE;
+    return ret;
+}
+
+/*
+ * --update: apply the Info.plist options to an existing bundle. Only keys
+ * the options name are touched (--associate replaces the document types
+ * wholesale). The file is rewritten only when the result differs, by
+ * writing a sibling file and renaming it over Info.plist, so a running
+ * Finder or Launch Services never reads half a plist.
+ */
+BOOL update_bundle_plist(const char *path_to_bundle_contents, const AppBundleOptions *options,
+                         BOOL set_icon_file, BOOL *changed)
+{
+    char *plist_path, *temp_path = NULL;
+    CFStringRef pathstr;
+    CFURLRef fileURL;
+    CFPropertyListRef propertyList = NULL;
+    CFMutableDictionaryRef dict;
+    PlistWriter *writer = NULL;
+    uint8_t *before = NULL;
+    const uint8_t *after;
+    size_t before_len = 0, after_len;
+    BOOL ret = FALSE;
+
+    *changed = FALSE;
+    plist_path = heap_printf("%s/Info.plist", path_to_bundle_contents);
+    if (!plist_path)
+        return FALSE;
+
+    pathstr = CFStringCreateWithCString(NULL, plist_path, kCFStringEncodingUTF8);
+    fileURL = CFURLCreateWithFileSystemPath(kCFAllocatorDefault, pathstr, kCFURLPOSIXPathStyle, false);
+    propertyList = CreateMyPropertyListFromFile(fileURL);
+    CFRelease(fileURL);
+    CFRelease(pathstr);
+
+    if (!propertyList || CFGetTypeID(propertyList) != CFDictionaryGetTypeID()) {
+        fprintf(stderr, "Error: %s is missing or not a dictionary\n", plist_path);
+        goto cleanup;
+    }
+    dict = (CFMutableDictionaryRef)propertyList;
+
+    /* Compare canonical serializations, so key order and XML vs binary do not count */
+    writer = plist_writer_create();
+    if (!writer || !(after = plist_writer_serialize(writer, dict, &before_len)) ||
+        !(before = malloc(before_len)))
+        goto cleanup;
+    memcpy(before, after, before_len);
+
+    if (options->bundle_identifier)
+        set_string_value(dict, CFSTR("CFBundleIdentifier"), options->bundle_identifier);
+    if (options->version) {
+        set_string_value(dict, CFSTR("CFBundleShortVersionString"), options->version);
+        set_string_value(dict, CFSTR("CFBundleVersion"), options->version);
+    }
+    if (options->min_os_version)
+        set_string_value(dict, CFSTR("LSMinimumSystemVersion"), options->min_os_version);
+    if (options->app_category)
+        set_string_value(dict, CFSTR("LSApplicationCategoryType"), options->app_category);
+    if (set_icon_file)
+        CFDictionarySetValue(dict, CFSTR("CFBundleIconFile"), CFSTR("icon.icns"));
+    if (options->associations) {
+        CFDictionaryRemoveValue(dict, CFSTR("CFBundleDocumentTypes"));
+        CFDictionaryRemoveValue(dict, CFSTR("UTImportedTypeDeclarations"));
+        add_document_types(dict, options->associations);
+    }
+    if ((options->plist_template && !apply_plist_template(dict, options->plist_template)) ||
+        !apply_plist_settings(dict, options))
+        goto cleanup;
+
+    after = plist_writer_serialize(writer, dict, &after_len);
+    if (!after)
+        goto cleanup;
+
+    if (after_len == before_len && memcmp(after, before, before_len) == 0) {
+        ret = TRUE;
+        goto cleanup;
+    }
+
+    temp_path = heap_printf("%s.update", plist_path);
+    if (!temp_path || !write_file(temp_path, after, after_len, FALSE) ||
+        rename(temp_path, plist_path) != 0) {
+        if (temp_path) unlink(temp_path);
+        goto cleanup;
+    }
+
+    *changed = TRUE;
+    ret = TRUE;
+
+cleanup:
+    if (propertyList) CFRelease(propertyList);
+    plist_writer_destroy(writer);
+    free(before);
+    free(temp_path);
+    free(plist_path);
+    return ret;
 }
 
 /* TODO: If I understand this file correctly, it is used for associations */
 static BOOL generate_pkginfo_file(const char* path_to_bundle_contents)
 {
-    FILE *file;
+    static const char pkginfo[] = "APPL????";
     char *bundle_and_pkginfo;
+    BOOL ret;
     static const char pkginfo_file[] = "PkgInfo";
 
     bundle_and_pkginfo = heap_printf("%s/%s", path_to_bundle_contents, pkginfo_file);
 
-    DEBUG_PRINT("Creating Bundle PkgInfo at %s\n", wine_dbgstr_a(bundle_and_pkginfo));
-
-    file = fopen(bundle_and_pkginfo, "w");
-    if (file == NULL)
+    if (!bundle_and_pkginfo)
         return FALSE;
 
-    fprintf(file, "APPL????");
+    DEBUG_PRINT("Creating Bundle PkgInfo at %s\n", bundle_and_pkginfo);
 
-    fclose(file);
-    return TRUE;
+    ret = write_file(bundle_and_pkginfo, pkginfo, sizeof(pkginfo) - 1, FALSE);
+    free(bundle_and_pkginfo);
+    return ret;
 }
 
 
+/*
+ * Where "exec " goes in a launcher command: before the program of its last
+ * simple command, after any VAR=value words, so "cd DIR && FOO=1 app"
+ * becomes "cd DIR && FOO=1 exec app". -2 when that command already
+ * starts with exec. -1 when exec cannot be placed safely and the command
+ * should run as a plain script: the last command is a builtin such as cd
+ * or a pipeline stage, or the line uses subshells, substitutions, here-documents, reserved
+ * words or unbalanced quotes, which this scan does not follow.
+ */
+static long exec_insert_offset(const char *command)
+{
+    static const char *const unexecable[] = {
+        "cd", "export", "unset", "set", "shift", "alias", "umask", "ulimit", "wait",
+        "read", "eval", ".", "source", "exit", "return", "trap", "readonly", "local",
+        "if", "then", "else", "elif", "fi", "while", "until", "for", "do", "done", "case",
+        "esac", "!", "{", "}", NULL
+    };
+    const char *p, *start = command, *word;
+    char quote = 0;
+    size_t len;
+    int i;
+
+    for (p = command; *p; p++) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+            else if (quote == '"' && *p == '\\' && p[1]) p++;
+            else if (quote == '"' && (*p == '`' || (*p == '$' && p[1] == '('))) return -1;
+            continue;
+        }
+        switch (*p) {
+            case '\'': case '"':
+                quote = *p;
+                break;
+            case '\\':
+                if (p[1]) p++;
+                break;
+            case '(': case ')': case '`': case '#':
+                return -1;
+            case '$':
+                if (p[1] == '(') return -1;
+                break;
+            case '<':
+                if (p[1] == '<') return -1;
+                break;
+            case '|':
+                /* A pipeline's last stage runs in a subshell; exec gains nothing there */
+                if (p[1] != '|') return -1;
+                p++;
+                start = p + 1;
+                break;
+            case '&':
+                if (p[1] == '&') p++;
+                else if (p > command && (p[-1] == '>' || p[-1] == '<')) break;  /* 2>&1 */
+                start = p + 1;
+                break;
+            case ';': case '\n':
+                start = p + 1;
+                break;
+        }
+    }
+    if (quote)
+        return -1;
+
+    /* Skip blanks and VAR=value words to the program name */
+    word = start;
+    for (;;) {
+        const char *end;
+
+        while (*word == ' ' || *word == '\t') word++;
+        for (p = word; isalnum((unsigned char)*p) || *p == '_'; p++) ;
+        if (p == word || isdigit((unsigned char)*word) || *p != '=')
+            break;
+        /* The value may be quoted (checked balanced above) */
+        for (end = p + 1, quote = 0; *end && (quote || (*end != ' ' && *end != '\t')); end++) {
+            if (quote) {
+                if (*end == quote) quote = 0;
+                else if (quote == '"' && *end == '\\' && end[1]) end++;
+            } else if (*end == '\'' || *end == '"') {
+                quote = *end;
+            } else if (*end == '\\' && end[1]) {
+                end++;
+            }
+        }
+        word = end;
+    }
+
+    for (len = 0; word[len] && word[len] != ' ' && word[len] != '\t'; len++) ;
+    if (len == 0)
+        return -1;
+    if (len == 4 && strncmp(word, "exec", 4) == 0)
+        return -2;
+    for (i = 0; unexecable[i]; i++) {
+        if (strlen(unexecable[i]) == len && strncmp(word, unexecable[i], len) == 0)
+            return -1;
+    }
+    return (long)(word - command);
+}
+
 /* inspired by write_desktop_entry() in xdg support code */
 static BOOL generate_bundle_script(const char *path_to_bundle_macos, const char *path,
-                                   const char *args __attribute__((unused)), const char *linkname)
+                                   const char *args __attribute__((unused)), const char *linkname,
+                                   LauncherMode mode)
 {
-    FILE *file;
-    char *bundle_and_script;
+    char *bundle_and_script, *script;
+    long offset;
+    BOOL ret;
 
     bundle_and_script = heap_printf("%s/%s", path_to_bundle_macos, linkname);
 
-    DEBUG_PRINT("Creating Bundle helper script at %s\n", wine_dbgstr_a(bundle_and_script));
-
-    file = fopen(bundle_and_script, "w");
-    if (file == NULL)
-        return FALSE;
-
-    fprintf(file, "#!/bin/sh\n");
-    fprintf(file, "#Helper script for %s\n\n", linkname);
+    DEBUG_PRINT("Creating Bundle helper script at %s\n", bundle_and_script);
 
     /* Just like xdg-menus we DO NOT support running a wine binary other
      * than one that is already present in the path
      */
-    fprintf(file, "%s \n\n", path );
+    /* In exec mode the shell replaces itself with the command instead of
+     * waiting on it as a child, so no sh process stays resident
+     */
+    offset = mode == LAUNCHER_EXEC ? exec_insert_offset(path) : -1;
+    if (mode == LAUNCHER_EXEC && offset == -1)
+        fprintf(stderr, "Warning: cannot exec the last command of '%s', %s runs it as a script\n",
+                path, linkname);
+    if (offset >= 0)
+        script = heap_printf("#!/bin/sh\n#Helper script for %s\n\n%.*sexec %s \n\n#EOF", linkname,
+                             (int)offset, path, path + offset);
+    else
+        script = heap_printf("#!/bin/sh\n#Helper script for %s\n\n%s \n\n#EOF", linkname, path);
+
+    /* A new file, not a rewrite: an older build may have left a link to the user's binary here */
+    if (bundle_and_script)
+        unlink(bundle_and_script);
+    ret = bundle_and_script && script &&
+          write_file(bundle_and_script, script, strlen(script), TRUE);
+    free(script);
+    free(bundle_and_script);
 
-    fprintf(file, "#EOF");
-    
-    fclose(file);    
-    chmod(bundle_and_script,0755);
-    
-    return TRUE;
+    return ret;
+}
+
+/*
+ * Place the real executable at Contents/MacOS/<linkname> so launching the
+ * bundle runs it directly with no interpreter in between.
+ *
+ * copy_file() clones it where the volume allows and copies it otherwise.
+ * Never a hard link: codesign, normalizing and later rebuilds all write
+ * the file in place, and would modify the original binary through the link.
+ */
+static BOOL install_bundle_executable(const char *path_to_bundle_macos, const char *path,
+                                      const char *linkname)
+{
+    char *bundle_and_exe;
+    struct stat st;
+    BOOL ret;
+
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Error: direct launcher needs an existing executable file, got '%s'\n", path);
+        return FALSE;
+    }
+
+    bundle_and_exe = heap_printf("%s/%s", path_to_bundle_macos, linkname);
+    if (!bundle_and_exe)
+        return FALSE;
+
+    /* A new file, not a rewrite: an older build may have left a link to the user's binary here */
+    unlink(bundle_and_exe);
+
+    ret = copy_file(path, bundle_and_exe);
+    if (!ret) {
+        fprintf(stderr, "Error: could not copy '%s' into the bundle\n", path);
+    } else if (chmod(bundle_and_exe, (st.st_mode & 0777) | 0755) != 0) {
+        fprintf(stderr, "Error: could not make '%s' executable\n", bundle_and_exe);
+        ret = FALSE;
+    } else {
+        DEBUG_PRINT("Placed executable in bundle: %s\n", bundle_and_exe);
+    }
+
+    free(bundle_and_exe);
+    return ret;
 }
 
 /* Add icon to bundle - now fully implemented with PNG/SVG/ICNS support */
-BOOL add_icns_for_bundle(const char *icon_src, const char *path_to_bundle_resources)
+BOOL add_icns_for_bundle(const char *icon_src, const char *path_to_bundle_resources,
+                         const IconRenderOptions *opts)
 {
     IconFormat format;
     char *output_icns;
@@ -376,16 +1302,16 @@ BOOL add_icns_for_bundle(const char *icon_src, const char *path_to_bundle_resour
         return FALSE;
     }
 
-    /* Check if source file exists and is readable */
-    if (access(icon_src, R_OK) != 0) {
-        DEBUG_PRINT("Icon source file not accessible: %s\n", icon_src);
-        return FALSE;
-    }
-
     /* Detect the icon format */
     format = detect_icon_format(icon_src);
     if (format == ICON_FORMAT_UNKNOWN) {
-        DEBUG_PRINT("Unknown icon format: %s (supported: .png, .svg, .icns)\n", icon_src);
+        DEBUG_PRINT("Unknown icon format: %s (supported: .png, .svg, .icns, .ico, .exe, .dll, .iconset)\n", icon_src);
+        return FALSE;
+    }
+
+    /* Check if source file exists and is readable (a PNG list is checked file by file) */
+    if (access(icon_src, R_OK) != 0 && format != ICON_FORMAT_ICONSET) {
+        DEBUG_PRINT("Icon source file not accessible: %s\n", icon_src);
         return FALSE;
     }
 
@@ -405,12 +1331,27 @@ BOOL add_icns_for_bundle(const char *icon_src, const char *path_to_bundle_resour
 
         case ICON_FORMAT_PNG:
             DEBUG_PRINT("Converting PNG icon to ICNS\n");
-            ret = convert_png_to_icns(icon_src, output_icns);
+            ret = convert_png_to_icns(icon_src, output_icns, opts);
             break;
 
         case ICON_FORMAT_SVG:
             DEBUG_PRINT("Converting SVG icon to ICNS\n");
-            ret = convert_svg_to_icns(icon_src, output_icns);
+            ret = convert_svg_to_icns(icon_src, output_icns, opts);
+            break;
+
+        case ICON_FORMAT_PE:
+            DEBUG_PRINT("Extracting icon from Windows executable\n");
+            ret = convert_pe_to_icns(icon_src, output_icns, opts);
+            break;
+
+        case ICON_FORMAT_ICO:
+            DEBUG_PRINT("Converting Windows ICO to ICNS\n");
+            ret = convert_ico_to_icns(icon_src, output_icns, opts);
+            break;
+
+        case ICON_FORMAT_ICONSET:
+            DEBUG_PRINT("Packing pre-rendered PNG sizes into ICNS\n");
+            ret = convert_iconset_to_icns(icon_src, output_icns, opts);
             break;
 
         default:
@@ -429,75 +1370,370 @@ BOOL add_icns_for_bundle(const char *icon_src, const char *path_to_bundle_resour
     return ret;
 }
 
-/* build out the directory structure for the bundle and then populate */
-BOOL build_app_bundle(const AppBundleOptions *options)
+/* State shared by the build steps of one bundle */
+typedef struct {
+    AppBundleContext *ctx;
+    const AppBundleOptions *options;
+    char *path_to_bundle;
+    char *path_to_bundle_contents;
+    char *path_to_bundle_macos;
+    char *path_to_bundle_resources;
+    char *temp_entitlements;        /* generated by entitlements_task */
+    LocalizationTable *localizations; /* --localizations, read before the steps start */
+} BundleJob;
+
+/* Contents/MacOS/<name>: the launcher script or the executable itself */
+static BOOL payload_task(void *arg)
 {
-    BOOL ret = FALSE;
-    char *bundle, *path_to_bundle, *path_to_bundle_contents, *path_to_bundle_macos;
-    char *path_to_bundle_resources, *path_to_bundle_resources_lang;
+    BundleJob *job = arg;
+    const AppBundleOptions *options = job->options;
+
+    if (options->launcher_mode == LAUNCHER_DIRECT) {
+        char *bundle_exe;
+        BOOL ret;
+
+        if (!install_bundle_executable(job->path_to_bundle_macos, options->executable_path,
+                                       options->bundle_name))
+            return FALSE;
+        if (!options->bundle_dylibs)
+            return TRUE;
+
+        bundle_exe = heap_printf("%s/%s", job->path_to_bundle_macos, options->bundle_name);
+        ret = bundle_exe && bundle_dylibs(job->path_to_bundle_contents, options->executable_path,
+                                          bundle_exe, context_thread_budget(job->ctx),
+                                          !options->signing_identity);
+        free(bundle_exe);
+        return ret;
+    }
+    return generate_bundle_script(job->path_to_bundle_macos, options->executable_path, NULL,
+                                  options->bundle_name, options->launcher_mode);
+}
+
+static BOOL pkginfo_task(void *arg)
+{
+    BundleJob *job = arg;
+
+    return generate_pkginfo_file(job->path_to_bundle_contents);
+}
+
+static BOOL plist_task(void *arg)
+{
+    BundleJob *job = arg;
+
+    return generate_plist(job->path_to_bundle_contents, job->options, job->localizations);
+}
+
+/* <locale>.lproj/InfoPlist.strings, or the development region's empty en.lproj */
+static BOOL strings_task(void *arg)
+{
+    BundleJob *job = arg;
+    char *lproj;
+    BOOL ret;
+
+    if (job->localizations)
+        return write_localizations(job->path_to_bundle_resources, job->localizations);
+
+    lproj = heap_printf("%s/en.lproj", job->path_to_bundle_resources);
+    ret = lproj && create_directories(lproj);
+    free(lproj);
+    return ret;
+}
+
+/* Icon pipeline settings for a build with these options */
+void icon_render_options(AppBundleContext *ctx, const AppBundleOptions *options,
+                         IconRenderOptions *icon_opts)
+{
+    memset(icon_opts, 0, sizeof(IconRenderOptions));
+    icon_opts->compression = options->icon_compression;
+    icon_opts->legacy_chunks = options->icns_legacy;
+    icon_opts->scratch_dir = context_scratch_dir(ctx);
+    icon_opts->reproducible = options->reproducible;
+    icon_opts->memory_limit = (size_t)options->icon_memory_mb << 20;
+    icon_opts->threads = context_thread_budget(ctx);
+}
+
+/*
+ * --async-icon: a render this context already did, else the system's
+ * generic app icon. ICNS sources are only copied, so they go in as is.
+ */
+static BOOL add_placeholder_icon(BundleJob *job, const IconRenderOptions *icon_opts)
+{
+    static const char generic_icon[] =
+        "/System/Library/CoreServices/CoreTypes.bundle/Contents/Resources/GenericApplicationIcon.icns";
+    const char *icon_path = job->options->icon_path;
+    char *output_icns;
+    BOOL ret;
+
+    if (detect_icon_format(icon_path) == ICON_FORMAT_ICNS)
+        return add_icns_for_bundle(icon_path, job->path_to_bundle_resources, icon_opts);
+    if (context_copy_cached_icon(job->ctx, icon_path, job->path_to_bundle_resources, icon_opts))
+        return TRUE;
+
+    output_icns = heap_printf("%s/icon.icns", job->path_to_bundle_resources);
+    ret = output_icns && access(generic_icon, R_OK) == 0 && copy_file(generic_icon, output_icns);
+    free(output_icns);
+    return ret;
+}
+
+/* A failed icon does not fail the bundle */
+static BOOL icon_task(void *arg)
+{
+    BundleJob *job = arg;
+    IconRenderOptions icon_opts;
+
+    icon_render_options(job->ctx, job->options, &icon_opts);
+    if (job->options->async_icon) {
+        if (!add_placeholder_icon(job, &icon_opts))
+            DEBUG_PRINT("No placeholder icon, Finder shows the generic one\n");
+    } else if (!context_add_icon(job->ctx, job->options->icon_path, job->path_to_bundle_resources,
+                                 &icon_opts)) {
+        DEBUG_PRINT("Failed to add icon to Application Bundle\n");
+    }
+    return TRUE;
+}
+
+static BOOL entitlements_task(void *arg)
+{
+    BundleJob *job = arg;
+    const AppBundleOptions *options = job->options;
+
+    job->temp_entitlements = context_scratch_path(job->ctx, ".entitlements");
+    return job->temp_entitlements &&
+           generate_entitlements_file(job->temp_entitlements, options->enable_hardened_runtime,
+                                      options->allow_jit, options->allow_unsigned_memory,
+                                      options->allow_dyld_vars);
+}
+
+/* Runs last: the signature seals everything the other steps wrote */
+static BOOL sign_task(void *arg)
+{
+    BundleJob *job = arg;
+    const AppBundleOptions *options = job->options;
+    CodeSignOptions sign_opts = {0};
+
+    sign_opts.identity = options->signing_identity;
+    sign_opts.enable_hardened_runtime = options->enable_hardened_runtime;
+    sign_opts.entitlements_path = options->entitlements_file ? options->entitlements_file
+                                                             : job->temp_entitlements;
+    sign_opts.force = options->force_sign;
+    sign_opts.timestamp = !options->reproducible;  /* Timestamp for distribution */
+    sign_opts.jobs = options->jobs;
+    sign_opts.threads = context_thread_budget(job->ctx);
+
+    return codesign_bundle(job->path_to_bundle, &sign_opts) && verify_codesign(job->path_to_bundle);
+}
+
+/* Reproducible builds: fixed modes and mtimes once nothing else writes to the bundle */
+static BOOL normalize_task(void *arg)
+{
+    BundleJob *job = arg;
+
+    return normalize_tree(job->path_to_bundle, (time_t)job->options->source_date_epoch);
+}
+
+/*
+ * build out the directory structure for the bundle and then populate
+ * ctx supplies scratch space, the icon cache and the worker pool; all other
+ * state is local so any number of bundles may be built concurrently.
+ *
+ * Once the directories exist the rest is a task graph: the launcher,
+ * PkgInfo, Info.plist, icon and entitlements are independent and run in
+ * parallel, and signing waits for all of them. Rendering the icon is
+ * usually the slowest step, so a bundle takes about as long as its icon.
+ * A reproducible build ends with normalizing the finished tree.
+ */
+ErrorCode build_app_bundle(AppBundleContext *ctx, const AppBundleOptions *options)
+{
+    ErrorCode ret = ERR_DIR_CREATION_FAILED;
+    BundleJob job = {0};
+    TaskGraph *graph = NULL;
+    LocalizationTable localizations;
+    int payload, pkginfo, plist, strings, icon = -1, entitlements = -1, sign = -1, normalize = -1;
     static const char extension[] = "app";
     static const char contents[] = "Contents";
     static const char macos[] = "MacOS";
     static const char resources[] = "Resources";
-    static const char resources_lang[] = "English.lproj"; /* FIXME */
 
     if (!options) {
         DEBUG_PRINT("Invalid options passed to build_app_bundle\n");
-        return FALSE;
+        return ERR_INVALID_ARGS;
     }
 
     DEBUG_PRINT("bundle file name %s\n", options->bundle_name);
 
-    bundle = heap_printf("%s.%s", options->bundle_name, extension);
-    path_to_bundle = heap_printf("%s/%s", options->bundle_dest, bundle);
-    path_to_bundle_contents = heap_printf("%s/%s", path_to_bundle, contents);
-    path_to_bundle_macos =  heap_printf("%s/%s", path_to_bundle_contents, macos);
-    path_to_bundle_resources = heap_printf("%s/%s", path_to_bundle_contents, resources);
-    path_to_bundle_resources_lang = heap_printf("%s/%s", path_to_bundle_resources, resources_lang);
+    job.ctx = ctx;
+    job.options = options;
+    job.path_to_bundle = heap_printf("%s/%s.%s", options->bundle_dest, options->bundle_name, extension);
+    job.path_to_bundle_contents = heap_printf("%s/%s", job.path_to_bundle, contents);
+    job.path_to_bundle_macos = heap_printf("%s/%s", job.path_to_bundle_contents, macos);
+    job.path_to_bundle_resources = heap_printf("%s/%s", job.path_to_bundle_contents, resources);
+
+    if (!job.path_to_bundle || !job.path_to_bundle_contents || !job.path_to_bundle_macos ||
+        !job.path_to_bundle_resources)
+        goto cleanup;
+
+    /* Info.plist and the strings files both need it, so it is read once up front */
+    if (options->localizations) {
+        if (!localization_table_load(options->localizations, &localizations)) {
+            ret = ERR_INVALID_ARGS;
+            goto cleanup;
+        }
+        job.localizations = &localizations;
+    }
 
-    create_directories(path_to_bundle);
-    create_directories(path_to_bundle_contents);
-    create_directories(path_to_bundle_macos);
-    create_directories(path_to_bundle_resources);
-    create_directories(path_to_bundle_resources_lang);
+    /* Outermost first, so each is a single mkdir */
+    if (!create_directories(job.path_to_bundle) ||
+        !create_directories(job.path_to_bundle_contents) ||
+        !create_directories(job.path_to_bundle_macos) ||
+        !create_directories(job.path_to_bundle_resources))
+        goto cleanup;
+
+    DEBUG_PRINT("created bundle %s\n", job.path_to_bundle);
+
+    graph = task_graph_create();
+    if (!graph)
+        goto cleanup;
+
+    payload = task_graph_add(graph, "payload", payload_task, &job);
+    pkginfo = task_graph_add(graph, "PkgInfo", pkginfo_task, &job);
+    plist = task_graph_add(graph, "Info.plist", plist_task, &job);
+    strings = task_graph_add(graph, "InfoPlist.strings", strings_task, &job);
+    if (options->icon_path)
+        icon = task_graph_add(graph, "icon", icon_task, &job);
+
+    if (options->signing_identity) {
+        if (!options->entitlements_file && options->enable_hardened_runtime)
+            entitlements = task_graph_add(graph, "entitlements", entitlements_task, &job);
+
+        sign = task_graph_add(graph, "codesign", sign_task, &job);
+        task_graph_depend(graph, sign, payload);
+        task_graph_depend(graph, sign, pkginfo);
+        task_graph_depend(graph, sign, plist);
+        task_graph_depend(graph, sign, strings);
+        if (icon >= 0) task_graph_depend(graph, sign, icon);
+        if (entitlements >= 0) task_graph_depend(graph, sign, entitlements);
+    }
+
+    if (options->reproducible) {
+        normalize = task_graph_add(graph, "normalize", normalize_task, &job);
+        task_graph_depend(graph, normalize, payload);
+        task_graph_depend(graph, normalize, pkginfo);
+        task_graph_depend(graph, normalize, plist);
+        task_graph_depend(graph, normalize, strings);
+        if (icon >= 0) task_graph_depend(graph, normalize, icon);
+        if (sign >= 0) task_graph_depend(graph, normalize, sign);
+    }
 
-    DEBUG_PRINT("created bundle %s\n", path_to_bundle);
+    task_graph_run(graph, context_queue(ctx));
+
+    if (!task_graph_succeeded(graph, payload) || !task_graph_succeeded(graph, pkginfo))
+        ret = ERR_DIR_CREATION_FAILED;
+    else if (!task_graph_succeeded(graph, plist) || !task_graph_succeeded(graph, strings))
+        ret = ERR_PLIST_GENERATION_FAILED;
+    else if (sign >= 0 && !task_graph_succeeded(graph, sign))
+        ret = ERR_CODE_SIGNING_FAILED;
+    else if (normalize >= 0 && !task_graph_succeeded(graph, normalize))
+        ret = ERR_DIR_CREATION_FAILED;
+    else
+        ret = ERR_SUCCESS;
+
+cleanup:
+    task_graph_destroy(graph);
+    if (job.temp_entitlements) {
+        unlink(job.temp_entitlements);
+        free(job.temp_entitlements);
+    }
+    free(job.path_to_bundle);
+    free(job.path_to_bundle_contents);
+    free(job.path_to_bundle_macos);
+    free(job.path_to_bundle_resources);
+    if (job.localizations)
+        localization_table_free(job.localizations);
 
-    ret = generate_bundle_script(path_to_bundle_macos, options->executable_path, NULL, options->bundle_name);
-    if(ret==FALSE)
-       return ret;
+    return ret;
+}
 
-    ret = generate_pkginfo_file(path_to_bundle_contents);
-    if(ret==FALSE)
-       return ret;
+/*
+ * Second half of an --async-icon build. The bundle is already published
+ * with its placeholder; render the real icon (once per context), rename it
+ * over the placeholder, touch the bundle so Finder redraws it and re-sign.
+ * Nothing is touched if the placeholder already was the real icon.
+ */
+ErrorCode finish_bundle_icon(AppBundleContext *ctx, const AppBundleOptions *options)
+{
+    IconRenderOptions icon_opts;
+    MappedFile icon = {0};
+    char *bundle, *render_dir = NULL, *rendered = NULL, *output_icns = NULL, *entitlements = NULL;
+    CodeSignOptions sign_opts = {0};
+    BOOL changed = FALSE;
+    ErrorCode ret = ERR_ICON_CONVERSION_FAILED;
+
+    bundle = heap_printf("%s/%s.app", options->bundle_dest, options->bundle_name);
+    render_dir = context_scratch_path(ctx, ".icon");
+    if (!bundle || !render_dir || !create_directories(render_dir))
+        goto cleanup;
+
+    icon_render_options(ctx, options, &icon_opts);
+    rendered = heap_printf("%s/icon.icns", render_dir);
+    output_icns = heap_printf("%s/Contents/Resources/icon.icns", bundle);
+    if (!rendered || !output_icns ||
+        !context_add_icon(ctx, options->icon_path, render_dir, &icon_opts) ||
+        !map_file(rendered, &icon) ||
+        !replace_file(output_icns, icon.data, icon.len, &changed)) {
+        DEBUG_PRINT("Could not finish the icon of %s\n", bundle);
+        goto cleanup;
+    }
 
-    ret = generate_plist(path_to_bundle_contents, options);
-    if(ret==FALSE)
-       return ret;
+    ret = ERR_SUCCESS;
+    if (!changed)
+        goto cleanup;
+
+    DEBUG_PRINT("Swapped the real icon into %s\n", bundle);
+    utimes(bundle, NULL);
+
+    if (options->signing_identity) {
+        if (!options->entitlements_file) {
+            entitlements = context_scratch_path(ctx, ".entitlements");
+            if (!entitlements ||
+                !generate_entitlements_file(entitlements, options->enable_hardened_runtime,
+                                            options->allow_jit, options->allow_unsigned_memory,
+                                            options->allow_dyld_vars)) {
+                ret = ERR_CODE_SIGNING_FAILED;
+                goto cleanup;
+            }
+        }
 
-    /* Add icon if provided */
-    if (options->icon_path) {
-        ret = add_icns_for_bundle(options->icon_path, path_to_bundle_resources);
-        if(ret==FALSE)
-           DEBUG_PRINT("Failed to add icon to Application Bundle\n");
+        sign_opts.identity = options->signing_identity;
+        sign_opts.enable_hardened_runtime = options->enable_hardened_runtime;
+        sign_opts.entitlements_path = options->entitlements_file ? options->entitlements_file
+                                                                 : entitlements;
+        sign_opts.force = TRUE;         /* the placeholder's signature no longer matches */
+        sign_opts.timestamp = !options->reproducible;
+        sign_opts.jobs = options->jobs;
+        sign_opts.threads = context_thread_budget(ctx);
+        if (!codesign_bundle(bundle, &sign_opts) || !verify_codesign(bundle))
+            ret = ERR_CODE_SIGNING_FAILED;
     }
 
-    /* Cleanup allocated paths */
+cleanup:
+    if (icon.data) unmap_file(&icon);
+    if (entitlements) unlink(entitlements);
+    free(entitlements);
+    free(output_icns);
+    free(rendered);
+    free(render_dir);
     free(bundle);
-    free(path_to_bundle);
-    free(path_to_bundle_contents);
-    free(path_to_bundle_macos);
-    free(path_to_bundle_resources);
-    free(path_to_bundle_resources_lang);
-
-    return TRUE;
+    return ret;
 }
 
-/* Code sign a bundle with specified options */
+/*
+ * Code sign a bundle with specified options. Helpers, frameworks and
+ * libraries inside it are signed first, since codesign refuses to seal a
+ * bundle around unsigned nested code.
+ */
 BOOL codesign_bundle(const char *bundle_path, const CodeSignOptions *options)
 {
-    char cmd[4096];
-    int offset = 0;
+    const char *argv[CODESIGN_MAX_ARGS];
     int result;
 
     if (!bundle_path) {
@@ -512,48 +1748,21 @@ BOOL codesign_bundle(const char *bundle_path, const CodeSignOptions *options)
 
     DEBUG_PRINT("Code signing bundle: %s\n", bundle_path);
     DEBUG_PRINT("  Identity: %s\n", options->identity);
-
-    /* Build codesign command */
-    offset = snprintf(cmd, sizeof(cmd), "codesign -s '%s'", options->identity);
-
-    /* Add hardened runtime flag */
-    if (options->enable_hardened_runtime) {
-        DEBUG_PRINT("  Hardened runtime: enabled\n");
-        offset += snprintf(cmd + offset, sizeof(cmd) - offset, " -o runtime");
-    }
-
-    /* Add force flag to replace existing signature */
-    if (options->force) {
-        DEBUG_PRINT("  Force: replacing existing signature\n");
-        offset += snprintf(cmd + offset, sizeof(cmd) - offset, " --force");
-    }
-
-    /* Add timestamp for distribution (recommended) */
-    if (options->timestamp) {
-        DEBUG_PRINT("  Timestamp: enabled\n");
-        offset += snprintf(cmd + offset, sizeof(cmd) - offset, " --timestamp");
-    }
-
-    /* Add entitlements if provided */
-    if (options->entitlements_path) {
+    DEBUG_PRINT("  Hardened runtime: %s\n", options->enable_hardened_runtime ? "enabled" : "disabled");
+    DEBUG_PRINT("  Force: %s\n", options->force ? "replacing existing signature" : "no");
+    DEBUG_PRINT("  Timestamp: %s\n", options->timestamp ? "enabled" : "none");
+    if (options->entitlements_path)
         DEBUG_PRINT("  Entitlements: %s\n", options->entitlements_path);
-        offset += snprintf(cmd + offset, sizeof(cmd) - offset,
-                         " --entitlements '%s'", options->entitlements_path);
-    }
 
-    /* Add verbose output for debugging */
-    offset += snprintf(cmd + offset, sizeof(cmd) - offset, " --verbose");
-
-    /* Add bundle path */
-    offset += snprintf(cmd + offset, sizeof(cmd) - offset, " '%s'", bundle_path);
-
-    /* Redirect stderr to stdout for better error capture */
-    offset += snprintf(cmd + offset, sizeof(cmd) - offset, " 2>&1");
+    if (!codesign_nested_code(bundle_path, options)) {
+        DEBUG_PRINT("Code signing of nested code failed\n");
+        return FALSE;
+    }
 
-    DEBUG_PRINT("Executing: %s\n", cmd);
+    codesign_arguments(argv, bundle_path, options);
 
-    /* Execute codesign command */
-    result = system(cmd);
+    /* stderr goes to stdout for better error capture */
+    result = run_command(argv, RUN_STDERR_STDOUT);
 
     if (result != 0) {
         DEBUG_PRINT("Code signing failed with exit code %d\n", result);
@@ -567,7 +1776,7 @@ BOOL codesign_bundle(const char *bundle_path, const CodeSignOptions *options)
 /* Verify the code signature of a bundle */
 BOOL verify_codesign(const char *bundle_path)
 {
-    char cmd[2048];
+    const char *argv[] = {"codesign", "--verify", "--verbose=2", bundle_path, NULL};
     int result;
 
     if (!bundle_path) {
@@ -577,13 +1786,8 @@ BOOL verify_codesign(const char *bundle_path)
 
     DEBUG_PRINT("Verifying code signature: %s\n", bundle_path);
 
-    /* Build verification command */
-    snprintf(cmd, sizeof(cmd),
-            "codesign --verify --verbose=2 '%s' 2>&1",
-            bundle_path);
-
     /* Execute verification */
-    result = system(cmd);
+    result = run_command(argv, RUN_STDERR_STDOUT);
 
     if (result != 0) {
         DEBUG_PRINT("Code signature verification failed (exit code: %d)\n", result);
@@ -0,0 +1,149 @@
+/*
+ * libappbundler - public interface
+ *
+ * Builds macOS application bundles from inside another process. All
+ * per-build state (scratch space, icon cache, worker threads) lives in an
+ * AppBundleContext; one context may be shared by any number of threads,
+ * and separate contexts never share anything.
+ *
+ *   AppBundleContext *ctx = appbundle_context_create(0);
+ *   AppBundleOptions opts;
+ *
+ *   appbundle_options_init(&opts);
+ *   opts.bundle_name = "My App";
+ *   opts.bundle_dest = "/Applications";
+ *   opts.executable_path = "/usr/local/bin/myapp";
+ *   if (appbundle_build(ctx, &opts) != ERR_SUCCESS) ...
+ *   appbundle_context_destroy(ctx);
+ */
+
+#ifndef _APPBUNDLER_H
+#define _APPBUNDLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Error codes for better error handling */
+typedef enum {
+    ERR_SUCCESS = 0,
+    ERR_INVALID_ARGS,
+    ERR_DIR_CREATION_FAILED,
+    ERR_PLIST_GENERATION_FAILED,
+    ERR_SCRIPT_GENERATION_FAILED,
+    ERR_ICON_CONVERSION_FAILED,
+    ERR_CODE_SIGNING_FAILED,
+    ERR_FILE_NOT_FOUND,
+    ERR_PERMISSION_DENIED
+} ErrorCode;
+
+/* PNG encoder presets for generated icons */
+typedef enum {
+    ICON_COMPRESS_BALANCED,         /* default */
+    ICON_COMPRESS_FAST,             /* favor encode speed (CI) */
+    ICON_COMPRESS_SMALL             /* favor ICNS size (release) */
+} IconCompression;
+
+/* How Contents/MacOS/<name> starts the target */
+typedef enum {
+    LAUNCHER_SCRIPT,                /* sh helper script runs the command as a child */
+    LAUNCHER_EXEC,                  /* sh helper script execs the command */
+    LAUNCHER_DIRECT                 /* the executable itself is placed in the bundle */
+} LauncherMode;
+
+/* Application bundle options structure; the int flags are on when nonzero */
+typedef struct {
+    /* Required arguments */
+    const char *bundle_name;
+    const char *bundle_dest;
+    const char *executable_path;
+
+    /* Optional - launcher */
+    LauncherMode launcher_mode;
+    int bundle_dylibs;              /* direct launcher: copy non-system libraries into Frameworks */
+
+    /* Optional - icon */
+    const char *icon_path;
+    IconCompression icon_compression;
+    int icns_legacy;
+    int icon_memory_mb;             /* decode budget per icon source (0 = 64) */
+    int async_icon;                 /* placeholder icon now, real one via appbundle_finish_icon */
+
+    /* Optional - code signing */
+    const char *signing_identity;
+    int enable_hardened_runtime;
+    const char *entitlements_file;
+    int force_sign;
+
+    /* Optional - Info.plist customization */
+    const char *bundle_identifier;
+    const char *min_os_version;     /* NULL = from the wrapped Mach-O, else 12.0 */
+    const char *app_category;
+    const char *version;            /* NULL = from version_source, else 1.0.0 */
+    const char *short_version;
+    const char *version_source;     /* Windows .exe/.dll to read VS_VERSIONINFO from */
+    const char *associations;       /* comma-separated extensions for CFBundleDocumentTypes */
+    const char *localizations;      /* [locale] table of names, copyright and usage strings */
+    const char *plist_template;     /* XML or binary plist merged over the generated keys */
+    const char *const *plist_settings; /* KEY=TYPE:VALUE entries, applied last */
+    int plist_setting_count;
+
+    /* Optional - reproducible output */
+    int reproducible;               /* sorted plists, no timestamps, fixed modes and mtimes */
+    long long source_date_epoch;    /* mtime for every file when reproducible */
+
+    /* Optional - entitlement exceptions */
+    int allow_jit;
+    int allow_unsigned_memory;
+    int allow_dyld_vars;
+
+    /* Optional - parallelism */
+    int jobs;                       /* worker threads for parallel modes (0 = online CPUs) */
+} AppBundleOptions;
+
+/* Opaque build context: scratch directory, icon cache and worker pool */
+typedef struct AppBundleContext AppBundleContext;
+
+/*
+ * Create a context. worker_threads sizes the pool shared by its builds
+ * (0 = online CPUs); the pool is started on first use.
+ * Returns NULL if the scratch directory cannot be created.
+ */
+AppBundleContext *appbundle_context_create(int worker_threads);
+
+/* Remove the context's scratch directory and free everything it owns */
+void appbundle_context_destroy(AppBundleContext *ctx);
+
+/* Fill options with the same defaults the command line uses */
+void appbundle_options_init(AppBundleOptions *options);
+
+/*
+ * Build, and if options->signing_identity is set sign and verify, one
+ * bundle. Safe to call from several threads on the same context.
+ */
+ErrorCode appbundle_build(AppBundleContext *ctx, const AppBundleOptions *options);
+
+/*
+ * Build count bundles on the context's worker pool and wait for all of
+ * them. results (optional) receives one ErrorCode per entry. Returns the
+ * number of failed builds. Must not be called from a pool task.
+ */
+int appbundle_build_many(AppBundleContext *ctx, const AppBundleOptions *options,
+                         int count, ErrorCode *results);
+
+/*
+ * Second half of a build with options->async_icon, which publishes the
+ * bundle with a placeholder icon: render the real icon, rename it over
+ * the placeholder, touch the bundle and re-sign if an identity is set.
+ * May run later and on another thread; icons are rendered once per context.
+ */
+ErrorCode appbundle_finish_icon(AppBundleContext *ctx, const AppBundleOptions *options);
+
+/* Human-readable description of an error code */
+const char *error_code_to_string(ErrorCode code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
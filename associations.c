@@ -0,0 +1,122 @@
+/*
+ * Document Type Associations for AppBundleGenerator
+ * Maps file extensions and MIME types to Uniform Type Identifiers using
+ * the perfect hashes generated from uti_types.txt at build time, so a
+ * lookup is two hashes and one string compare with no setup at run time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "shared.h"
+#include "uti_table.h"
+
+#define UTI_MAX_KEY 128
+
+/* FNV-1a with a seed mixed into the basis; must match tools/gen_uti_table.c */
+static uint32_t uti_hash(uint32_t seed, const char *s)
+{
+    uint32_t h = 2166136261u ^ seed;
+
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int perfect_hash_lookup(const char *key, const uint32_t *seeds, int buckets,
+                               const int16_t *slots, int nslots)
+{
+    uint32_t seed = seeds[uti_hash(0, key) % (uint32_t)buckets];
+
+    return slots[uti_hash(seed, key) % (uint32_t)nslots];
+}
+
+/* Extension with or without the leading dot, any case; NULL if unknown */
+const UtiType *uti_lookup_extension(const char *ext)
+{
+    char key[UTI_MAX_KEY];
+    size_t i;
+    int index;
+
+    if (!ext) return NULL;
+    if (*ext == '.') ext++;
+
+    for (i = 0; ext[i] && i < sizeof(key) - 1; i++)
+        key[i] = (char)tolower((unsigned char)ext[i]);
+    if (i == 0 || ext[i]) return NULL;
+    key[i] = '\0';
+
+    index = perfect_hash_lookup(key, uti_ext_seeds, UTI_EXT_BUCKETS, uti_ext_slots, UTI_EXT_SLOTS);
+    if (index < 0 || strcmp(uti_types[index].ext, key) != 0)
+        return NULL;
+    return &uti_types[index];
+}
+
+/*
+ * All types registered under a MIME type. The table is ordered by MIME,
+ * so the matches are *count consecutive entries starting at the result.
+ */
+const UtiType *uti_lookup_mime(const char *mime, int *count)
+{
+    char key[UTI_MAX_KEY];
+    size_t i;
+    int index, n;
+
+    *count = 0;
+    if (!mime) return NULL;
+
+    for (i = 0; mime[i] && i < sizeof(key) - 1; i++)
+        key[i] = (char)tolower((unsigned char)mime[i]);
+    if (i == 0 || mime[i]) return NULL;
+    key[i] = '\0';
+
+    index = perfect_hash_lookup(key, uti_mime_seeds, UTI_MIME_BUCKETS, uti_mime_slots, UTI_MIME_SLOTS);
+    if (index < 0 || strcmp(uti_types[index].mime, key) != 0)
+        return NULL;
+
+    for (n = 1; index + n < UTI_TYPE_COUNT && strcmp(uti_types[index + n].mime, key) == 0; n++)
+        ;
+    *count = n;
+    return &uti_types[index];
+}
+
+/*
+ * Turn a desktop-entry MimeType= list ("text/plain;image/png;") into the
+ * comma-separated extension list --associate takes. Unknown MIME types are
+ * skipped. Returns NULL if nothing matched; caller frees.
+ */
+char *extensions_for_mime_types(const char *mime_types)
+{
+    char *result = NULL;
+    const char *p = mime_types;
+
+    while (p && *p) {
+        size_t len = strcspn(p, ";");
+        char mime[UTI_MAX_KEY];
+        const UtiType *types;
+        int count = 0, i;
+
+        if (len > 0 && len < sizeof(mime)) {
+            memcpy(mime, p, len);
+            mime[len] = '\0';
+            types = uti_lookup_mime(mime, &count);
+
+            for (i = 0; i < count; i++) {
+                char *joined = result ? heap_printf("%s,%s", result, types[i].ext)
+                                      : strdup(types[i].ext);
+                free(result);
+                result = joined;
+                if (!result) return NULL;
+            }
+        }
+
+        p += len;
+        if (*p == ';') p++;
+    }
+
+    return result;
+}
@@ -0,0 +1,720 @@
+/*
+ * Bundle Audit for AppBundleGenerator
+ * Walks directory trees in parallel, checks every .app against the layout
+ * build_app_bundle() produces and prints one JSON object per bundle.
+ *
+ * The walk itself is parallel: each directory is a work item that queues
+ * its subdirectories and any bundles it finds, so wide trees fan out
+ * across the pool instead of serializing on a single readdir loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+typedef struct {
+    WorkQueue *queue;
+    pthread_mutex_t output_lock;
+    pthread_mutex_t stats_lock;
+    size_t bundles;
+    size_t failures;
+    size_t directories;
+} AuditState;
+
+typedef struct {
+    AuditState *state;
+    char *path;
+} AuditTask;
+
+/* Growable output buffer so each bundle is emitted with a single write */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} JsonBuffer;
+
+static void json_reserve(JsonBuffer *buf, size_t extra)
+{
+    char *data;
+    size_t cap;
+
+    if (buf->len + extra + 1 <= buf->cap) return;
+
+    cap = buf->cap ? buf->cap : 512;
+    while (cap < buf->len + extra + 1) cap *= 2;
+    data = realloc(buf->data, cap);
+    if (!data) return;
+    buf->data = data;
+    buf->cap = cap;
+}
+
+static void json_raw(JsonBuffer *buf, const char *s, size_t n)
+{
+    json_reserve(buf, n);
+    if (buf->len + n + 1 > buf->cap) return;
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+    buf->data[buf->len] = '\0';
+}
+
+static void json_literal(JsonBuffer *buf, const char *s)
+{
+    json_raw(buf, s, strlen(s));
+}
+
+/*
+ * Length of the well-formed UTF-8 sequence at p, or 0: overlong forms,
+ * surrogates and values past U+10FFFF are not well-formed
+ */
+static size_t utf8_sequence_length(const unsigned char *p)
+{
+    size_t len, i;
+    uint32_t cp;
+
+    if (*p >= 0xC2 && *p <= 0xDF) { len = 2; cp = *p & 0x1F; }
+    else if (*p >= 0xE0 && *p <= 0xEF) { len = 3; cp = *p & 0x0F; }
+    else if (*p >= 0xF0 && *p <= 0xF4) { len = 4; cp = *p & 0x07; }
+    else return 0;
+
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+
+    if ((len == 3 && cp < 0x800) || (len == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+        (cp >= 0xD800 && cp < 0xE000))
+        return 0;
+    return len;
+}
+
+/* Invalid UTF-8 from a malformed Info.plist becomes U+FFFD, keeping the line valid JSON */
+static void json_string(JsonBuffer *buf, const char *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p;
+
+    if (!s) {
+        json_literal(buf, "null");
+        return;
+    }
+
+    json_raw(buf, "\"", 1);
+    for (p = (const unsigned char *)s; *p; p++) {
+        char esc[6];
+
+        switch (*p) {
+            case '"':  json_raw(buf, "\\\"", 2); break;
+            case '\\': json_raw(buf, "\\\\", 2); break;
+            case '\n': json_raw(buf, "\\n", 2); break;
+            case '\r': json_raw(buf, "\\r", 2); break;
+            case '\t': json_raw(buf, "\\t", 2); break;
+            default:
+                if (*p < 0x20) {
+                    memcpy(esc, "\\u00", 4);
+                    esc[4] = hex[*p >> 4];
+                    esc[5] = hex[*p & 0xF];
+                    json_raw(buf, esc, 6);
+                } else if (*p < 0x80) {
+                    json_raw(buf, (const char *)p, 1);
+                } else {
+                    size_t len = utf8_sequence_length(p);
+
+                    if (len) {
+                        json_raw(buf, (const char *)p, len);
+                        p += len - 1;
+                    } else {
+                        json_raw(buf, "\xef\xbf\xbd", 3);
+                    }
+                }
+        }
+    }
+    json_raw(buf, "\"", 1);
+}
+
+static void json_field(JsonBuffer *buf, const char *key, const char *value)
+{
+    json_raw(buf, ",", 1);
+    json_string(buf, key);
+    json_raw(buf, ":", 1);
+    json_string(buf, value);
+}
+
+static void json_bool_field(JsonBuffer *buf, const char *key, BOOL value)
+{
+    json_raw(buf, ",", 1);
+    json_string(buf, key);
+    json_literal(buf, value ? ":true" : ":false");
+}
+
+/* Per-bundle findings collected before the JSON line is rendered */
+typedef struct {
+    char *identifier;
+    char *name;
+    char *executable;
+    char *version;
+    char *short_version;
+    char *min_os;
+    char *icon_file;
+    char *launcher_command;
+    const char *plist_format;
+    const char *launcher_kind;      /* script, binary, missing */
+    const char *icon_header;        /* ok, missing, invalid, none: the ICNS header only */
+    BOOL has_contents;
+    BOOL has_plist;
+    BOOL pkginfo_ok;
+    BOOL has_resources;
+    BOOL launcher_executable;
+    BOOL launcher_target_ok;
+    char errors[512];
+} AuditResult;
+
+static void audit_error(AuditResult *r, const char *fmt, ...)
+{
+    size_t len = strlen(r->errors);
+    va_list args;
+
+    if (len + 2 >= sizeof(r->errors)) return;
+    if (len) {
+        r->errors[len++] = '\n';
+        r->errors[len] = '\0';
+    }
+
+    va_start(args, fmt);
+    vsnprintf(r->errors + len, sizeof(r->errors) - len, fmt, args);
+    va_end(args);
+}
+
+static char *audit_plist_string(const PlistDocument *doc, const PlistNode *dict, const char *key)
+{
+    const PlistNode *value = plist_dict_get(doc, dict, key);
+
+    if (!value || value->type != PLIST_NODE_STRING) return NULL;
+    return plist_string_dup(value);
+}
+
+/*
+ * Next shell word of a launcher command, with quotes and backslashes
+ * removed. Control operators (&&, ||, ;, |, &, < and >) come back as words
+ * of their own with *op set. FALSE at the end of the command.
+ */
+static BOOL next_word(const char **command, char *word, size_t size, BOOL *op)
+{
+    const char *p = *command;
+    size_t len = 0;
+    char quote = 0;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (!*p) return FALSE;
+
+    *op = strchr("&|;<>", *p) != NULL;
+    if (*op) {
+        word[len++] = *p++;
+        if ((word[0] == '&' || word[0] == '|') && *p == word[0])
+            word[len++] = *p++;
+    } else {
+        while (*p && (quote || (*p != ' ' && *p != '\t' && !strchr("&|;<>", *p)))) {
+            char c = *p++;
+
+            if (!quote && (c == '"' || c == '\'')) {
+                quote = c;
+                continue;
+            }
+            if (c == quote) {
+                quote = 0;
+                continue;
+            }
+            /* Backslash escapes everything unquoted, and only these inside double quotes */
+            if (c == '\\' && *p && quote != '\'' && (!quote || strchr("\"\\$`", *p)))
+                c = *p++;
+            if (len < size - 1)
+                word[len++] = c;
+        }
+    }
+
+    word[len] = '\0';
+    *command = p;
+    return TRUE;
+}
+
+static BOOL is_assignment(const char *word)
+{
+    const char *eq = strchr(word, '=');
+    const char *p;
+
+    if (!eq || eq == word || (*word >= '0' && *word <= '9')) return FALSE;
+    for (p = word; p < eq; p++) {
+        if (!(*p == '_' || (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9')))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL program_resolves(const char *word)
+{
+    const char *path_env, *p;
+    size_t len = strlen(word);
+
+    if (strchr(word, '/'))
+        return access(word, X_OK) == 0;
+
+    path_env = getenv("PATH");
+    if (!path_env) path_env = "/usr/bin:/bin:/usr/sbin:/sbin";
+
+    for (p = path_env; *p; ) {
+        const char *colon = strchr(p, ':');
+        size_t dirlen = colon ? (size_t)(colon - p) : strlen(p);
+        char candidate[2048];
+
+        if (dirlen > 0 && dirlen + len + 2 < sizeof(candidate)) {
+            memcpy(candidate, p, dirlen);
+            candidate[dirlen] = '/';
+            memcpy(candidate + dirlen + 1, word, len + 1);
+            if (access(candidate, X_OK) == 0) return TRUE;
+        }
+
+        if (!colon) break;
+        p = colon + 1;
+    }
+
+    return FALSE;
+}
+
+static BOOL is_directory(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Can the launcher command still run what it ran when it was built? Past
+ * the "cd DIR &&", "exec", "env" and VAR=value words that script, Wine and
+ * desktop launchers put in front, the program must resolve on PATH, a
+ * WINEPREFIX must still be a directory, and every absolute path among the
+ * program's arguments (the .exe Wine runs, a script an interpreter runs)
+ * must still exist. Single-component words such as /Unix are Windows
+ * switches, not paths. The first word that fails is copied to missing.
+ */
+static BOOL audit_command_resolves(const char *command, char *missing, size_t size)
+{
+    char word[1024];
+    BOOL op, ok = TRUE, found = FALSE;
+
+    *missing = '\0';
+
+    while (!found && next_word(&command, word, sizeof(word), &op)) {
+        if (op) {
+            continue;   /* the && after a cd */
+        } else if (strcmp(word, "cd") == 0) {
+            if (next_word(&command, word, sizeof(word), &op) && !op && !is_directory(word))
+                ok = FALSE;
+        } else if (strcmp(word, "exec") == 0 || strcmp(word, "env") == 0) {
+            /* prefixes from the exec launcher mode and Wine launchers */
+        } else if (is_assignment(word)) {
+            if (strncmp(word, "WINEPREFIX=", 11) == 0 && !is_directory(word + 11))
+                ok = FALSE;
+        } else {
+            found = TRUE;
+            ok = program_resolves(word);
+        }
+        if (!ok) break;
+    }
+
+    /* The program's own arguments, up to the end of its command */
+    while (ok && found && next_word(&command, word, sizeof(word), &op) && !op) {
+        if (word[0] == '/' && strchr(word + 1, '/') && access(word, F_OK) != 0)
+            ok = FALSE;
+    }
+
+    if (!ok || !found)
+        snprintf(missing, size, "%s", ok ? "(no command)" : word);
+    return ok && found;
+}
+
+/* Classify Contents/MacOS/<executable> and pull the command out of helper scripts */
+static void audit_launcher(AuditResult *r, const char *macos_dir)
+{
+    char *launcher;
+    char head[4096], missing[1024];
+    struct stat st;
+    ssize_t n;
+    int fd;
+
+    r->launcher_kind = "missing";
+    if (!r->executable) {
+        audit_error(r, "CFBundleExecutable not set");
+        return;
+    }
+
+    launcher = heap_printf("%s/%s", macos_dir, r->executable);
+    fd = launcher ? open(launcher, O_RDONLY) : -1;
+    free(launcher);
+
+    if (fd < 0) {
+        audit_error(r, "launcher Contents/MacOS/%s missing", r->executable);
+        return;
+    }
+
+    if (fstat(fd, &st) == 0)
+        r->launcher_executable = S_ISREG(st.st_mode) && (st.st_mode & 0111);
+    if (!r->launcher_executable)
+        audit_error(r, "launcher is not an executable file");
+
+    n = read(fd, head, sizeof(head) - 1);
+    close(fd);
+    if (n < 4) {
+        r->launcher_kind = "invalid";
+        audit_error(r, "launcher is truncated");
+        return;
+    }
+    head[n] = '\0';
+
+    if (head[0] == '#' && head[1] == '!') {
+        char *line, *save = NULL;
+
+        r->launcher_kind = "script";
+
+        /* Helper scripts carry the command on the first non-comment line */
+        for (line = strtok_r(head, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+            size_t len;
+
+            if (line[0] == '#' || line[0] == '\0') continue;
+            len = strlen(line);
+            while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) line[--len] = '\0';
+            if (len == 0) continue;
+            r->launcher_command = strdup(line);
+            break;
+        }
+
+        r->launcher_target_ok = r->launcher_command &&
+                                audit_command_resolves(r->launcher_command, missing, sizeof(missing));
+        if (!r->launcher_target_ok)
+            audit_error(r, "launcher target does not resolve: %s",
+                        r->launcher_command ? missing : "(no command)");
+    } else {
+        uint32_t magic;
+
+        memcpy(&magic, head, sizeof(magic));
+        if (magic == 0xfeedfacf || magic == 0xcffaedfe || magic == 0xfeedface ||
+            magic == 0xcefaedfe || magic == 0xcafebabe || magic == 0xbebafeca) {
+            r->launcher_kind = "binary";
+            r->launcher_target_ok = TRUE;
+        } else {
+            r->launcher_kind = "invalid";
+            audit_error(r, "launcher is neither a script nor a Mach-O binary");
+        }
+    }
+}
+
+/*
+ * Icon named by CFBundleIconFile must exist and carry a consistent ICNS
+ * header. Nothing records the source it was rendered from, so this says
+ * the file is intact, not that it is still the icon the app should have.
+ */
+static void audit_icon(AuditResult *r, const char *resources_dir)
+{
+    unsigned char header[8];
+    struct stat st;
+    char *icon_path;
+    const char *name = r->icon_file;
+    int fd;
+
+    if (!name) {
+        r->icon_header = "none";
+        return;
+    }
+
+    if (strchr(name, '.'))
+        icon_path = heap_printf("%s/%s", resources_dir, name);
+    else
+        icon_path = heap_printf("%s/%s.icns", resources_dir, name);
+
+    fd = icon_path ? open(icon_path, O_RDONLY) : -1;
+    free(icon_path);
+
+    if (fd < 0) {
+        r->icon_header = "missing";
+        audit_error(r, "icon %s missing", name);
+        return;
+    }
+
+    r->icon_header = "invalid";
+    if (fstat(fd, &st) == 0 && read(fd, header, sizeof(header)) == (ssize_t)sizeof(header)) {
+        uint32_t length = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) |
+                          ((uint32_t)header[6] << 8) | header[7];
+        if (memcmp(header, "icns", 4) == 0 && length == (uint64_t)st.st_size)
+            r->icon_header = "ok";
+    }
+    close(fd);
+
+    if (strcmp(r->icon_header, "ok") != 0)
+        audit_error(r, "icon %s is not a valid ICNS file", name);
+}
+
+static void audit_one_bundle(AuditState *state, const char *bundle_path)
+{
+    AuditResult r;
+    PlistDocument doc;
+    JsonBuffer out = {0};
+    char *contents, *macos, *resources, *plist_path, *pkginfo_path;
+    struct stat st;
+    BOOL ok;
+    int fd;
+
+    memset(&r, 0, sizeof(r));
+    r.launcher_kind = "missing";
+    r.icon_header = "none";
+
+    contents = heap_printf("%s/Contents", bundle_path);
+    macos = heap_printf("%s/Contents/MacOS", bundle_path);
+    resources = heap_printf("%s/Contents/Resources", bundle_path);
+    plist_path = heap_printf("%s/Contents/Info.plist", bundle_path);
+    pkginfo_path = heap_printf("%s/Contents/PkgInfo", bundle_path);
+    if (!contents || !macos || !resources || !plist_path || !pkginfo_path) {
+        audit_error(&r, "out of memory");
+        goto report;
+    }
+
+    r.has_contents = stat(contents, &st) == 0 && S_ISDIR(st.st_mode);
+    r.has_resources = stat(resources, &st) == 0 && S_ISDIR(st.st_mode);
+    if (!r.has_contents)
+        audit_error(&r, "Contents directory missing");
+    else if (!r.has_resources)
+        audit_error(&r, "Resources directory missing");
+
+    if (plist_document_open(&doc, plist_path)) {
+        const PlistNode *root = plist_root(&doc);
+
+        r.has_plist = root && root->type == PLIST_NODE_DICT;
+        r.plist_format = doc.format == PLIST_FORMAT_BINARY ? "binary" : "xml";
+        if (r.has_plist) {
+            r.identifier = audit_plist_string(&doc, root, "CFBundleIdentifier");
+            r.name = audit_plist_string(&doc, root, "CFBundleName");
+            r.executable = audit_plist_string(&doc, root, "CFBundleExecutable");
+            r.version = audit_plist_string(&doc, root, "CFBundleVersion");
+            r.short_version = audit_plist_string(&doc, root, "CFBundleShortVersionString");
+            r.min_os = audit_plist_string(&doc, root, "LSMinimumSystemVersion");
+            r.icon_file = audit_plist_string(&doc, root, "CFBundleIconFile");
+            if (!r.identifier)
+                audit_error(&r, "CFBundleIdentifier not set");
+        } else {
+            audit_error(&r, "Info.plist root is not a dictionary");
+        }
+        plist_document_close(&doc);
+    } else {
+        audit_error(&r, "Info.plist missing or unparsable");
+    }
+
+    /* PkgInfo is always the eight bytes "APPL????" */
+    fd = open(pkginfo_path, O_RDONLY);
+    if (fd >= 0) {
+        char pkginfo[9];
+        ssize_t n = read(fd, pkginfo, sizeof(pkginfo));
+        r.pkginfo_ok = (n == 8 && memcmp(pkginfo, "APPL", 4) == 0);
+        close(fd);
+    }
+    if (!r.pkginfo_ok)
+        audit_error(&r, "PkgInfo missing or not APPL");
+
+    if (r.has_plist)
+        audit_launcher(&r, macos);
+    audit_icon(&r, resources);
+
+report:
+    ok = r.errors[0] == '\0';
+
+    /* Render the JSON line */
+    json_literal(&out, "{\"path\":");
+    json_string(&out, bundle_path);
+    json_bool_field(&out, "ok", ok);
+    json_field(&out, "identifier", r.identifier);
+    json_field(&out, "name", r.name);
+    json_field(&out, "executable", r.executable);
+    json_field(&out, "version", r.version);
+    json_field(&out, "short_version", r.short_version);
+    json_field(&out, "min_os", r.min_os);
+    json_field(&out, "plist_format", r.plist_format);
+    json_field(&out, "launcher", r.launcher_kind);
+    json_field(&out, "launcher_command", r.launcher_command);
+    json_bool_field(&out, "launcher_target_ok", r.launcher_target_ok);
+    json_field(&out, "icon_file", r.icon_file);
+    json_field(&out, "icon_header", r.icon_header);
+    json_literal(&out, ",\"errors\":[");
+    if (!ok) {
+        char *save = NULL, *msg;
+        BOOL first = TRUE;
+
+        for (msg = strtok_r(r.errors, "\n", &save); msg; msg = strtok_r(NULL, "\n", &save)) {
+            if (!first) json_raw(&out, ",", 1);
+            json_string(&out, msg);
+            first = FALSE;
+        }
+    }
+    json_literal(&out, "]}\n");
+
+    if (out.data) {
+        pthread_mutex_lock(&state->output_lock);
+        fwrite(out.data, 1, out.len, stdout);
+        pthread_mutex_unlock(&state->output_lock);
+        free(out.data);
+    }
+
+    pthread_mutex_lock(&state->stats_lock);
+    state->bundles++;
+    if (!ok) state->failures++;
+    pthread_mutex_unlock(&state->stats_lock);
+
+    free(r.identifier);
+    free(r.name);
+    free(r.executable);
+    free(r.version);
+    free(r.short_version);
+    free(r.min_os);
+    free(r.icon_file);
+    free(r.launcher_command);
+    free(contents);
+    free(macos);
+    free(resources);
+    free(plist_path);
+    free(pkginfo_path);
+}
+
+static BOOL has_app_extension(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".app") == 0;
+}
+
+static void audit_submit(AuditState *state, WorkFunc fn, char *path)
+{
+    AuditTask *task = malloc(sizeof(AuditTask));
+
+    if (!task || !path) {
+        free(task);
+        free(path);
+        return;
+    }
+
+    task->state = state;
+    task->path = path;
+    if (!work_queue_submit(state->queue, fn, task)) {
+        free(task->path);
+        free(task);
+    }
+}
+
+static void audit_bundle_task(void *arg)
+{
+    AuditTask *task = arg;
+
+    audit_one_bundle(task->state, task->path);
+    free(task->path);
+    free(task);
+}
+
+static void audit_dir_task(void *arg)
+{
+    AuditTask *task = arg;
+    AuditState *state = task->state;
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir(task->path);
+    if (!dir) {
+        DEBUG_PRINT("Cannot open directory %s\n", task->path);
+        free(task->path);
+        free(task);
+        return;
+    }
+
+    pthread_mutex_lock(&state->stats_lock);
+    state->directories++;
+    pthread_mutex_unlock(&state->stats_lock);
+
+    while ((entry = readdir(dir)) != NULL) {
+        BOOL is_dir;
+
+        if (entry->d_name[0] == '.' &&
+            (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+            continue;
+
+        /* d_type avoids a stat per entry; symlinks are never followed */
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode);
+        } else {
+            is_dir = entry->d_type == DT_DIR;
+        }
+        if (!is_dir) continue;
+
+        if (has_app_extension(entry->d_name))
+            audit_submit(state, audit_bundle_task, heap_printf("%s/%s", task->path, entry->d_name));
+        else
+            audit_submit(state, audit_dir_task, heap_printf("%s/%s", task->path, entry->d_name));
+    }
+
+    closedir(dir);
+    free(task->path);
+    free(task);
+}
+
+/*
+ * Audit every bundle under root_dir, writing JSON lines to stdout and a
+ * summary to stderr. root_dir may itself be a bundle. FALSE if root_dir
+ * cannot be read or any bundle has problems, so scripts can gate on it.
+ */
+BOOL audit_bundles(const char *root_dir, int jobs)
+{
+    AuditState state;
+    struct stat st;
+    size_t len;
+    char *root;
+
+    if (!root_dir || stat(root_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        print_error(ERR_FILE_NOT_FOUND, root_dir);
+        return FALSE;
+    }
+
+    memset(&state, 0, sizeof(state));
+    pthread_mutex_init(&state.output_lock, NULL);
+    pthread_mutex_init(&state.stats_lock, NULL);
+
+    state.queue = work_queue_create(jobs);
+    if (!state.queue) {
+        pthread_mutex_destroy(&state.output_lock);
+        pthread_mutex_destroy(&state.stats_lock);
+        return FALSE;
+    }
+
+    /* Trailing slashes would otherwise double up in every reported path */
+    root = strdup(root_dir);
+    len = root ? strlen(root) : 0;
+    while (len > 1 && root[len - 1] == '/') root[--len] = '\0';
+
+    if (root && has_app_extension(root))
+        audit_submit(&state, audit_bundle_task, root);
+    else
+        audit_submit(&state, audit_dir_task, root);
+
+    work_queue_wait(state.queue);
+    work_queue_destroy(state.queue);
+    fflush(stdout);
+
+    fprintf(stderr, "Audited %zu bundle(s) in %zu directories: %zu with problems\n",
+            state.bundles, state.directories, state.failures);
+
+    pthread_mutex_destroy(&state.output_lock);
+    pthread_mutex_destroy(&state.stats_lock);
+
+    return state.failures == 0;
+}
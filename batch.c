@@ -0,0 +1,427 @@
+/*
+ * Batch Manifests for AppBundleGenerator
+ * Builds many bundles described in one file. Each [Section] is a bundle,
+ * named by the section header, with desktop-entry style Key=Value lines:
+ *
+ *   [Notepad++]
+ *   Exec=wine "C:/Program Files/Notepad++/notepad++.exe"
+ *   Icon=/opt/icons/notepad++.ico
+ *   Associate=txt,log,ini
+ *
+ * Keys a record leaves out take the command line setting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+static void free_record(BatchRecord *record)
+{
+    free(record->name);
+    free(record->exec);
+    free(record->icon);
+    free(record->associations);
+    free(record->identifier);
+    free(record->version);
+    free(record->category);
+    free(record->min_os);
+}
+
+void batch_manifest_free(BatchManifest *manifest)
+{
+    int i;
+
+    for (i = 0; i < manifest->count; i++)
+        free_record(&manifest->records[i]);
+    free(manifest->records);
+    memset(manifest, 0, sizeof(BatchManifest));
+}
+
+static BatchRecord *add_record(BatchManifest *manifest, const char *name, size_t len, int line)
+{
+    BatchRecord *record;
+
+    if (manifest->count == manifest->capacity) {
+        int capacity = manifest->capacity ? manifest->capacity * 2 : 64;
+        BatchRecord *records = realloc(manifest->records, capacity * sizeof(BatchRecord));
+
+        if (!records) return NULL;
+        manifest->records = records;
+        manifest->capacity = capacity;
+    }
+
+    record = &manifest->records[manifest->count];
+    memset(record, 0, sizeof(BatchRecord));
+    record->name = strndup(name, len);
+    record->launcher = -1;
+    record->line = line;
+    if (!record->name) return NULL;
+
+    manifest->count++;
+    return record;
+}
+
+static BOOL parse_launcher(const char *value, size_t len, int *mode)
+{
+    if (len == 6 && memcmp(value, "script", 6) == 0) *mode = LAUNCHER_SCRIPT;
+    else if (len == 4 && memcmp(value, "exec", 4) == 0) *mode = LAUNCHER_EXEC;
+    else if (len == 6 && memcmp(value, "direct", 6) == 0) *mode = LAUNCHER_DIRECT;
+    else return FALSE;
+    return TRUE;
+}
+
+/* Records by name, ignoring case, then in file order */
+static int compare_record_names(const void *a, const void *b)
+{
+    const BatchRecord *ra = *(const BatchRecord *const *)a;
+    const BatchRecord *rb = *(const BatchRecord *const *)b;
+    int cmp = strcasecmp(ra->name, rb->name);
+
+    if (cmp != 0) return cmp;
+    return ra < rb ? -1 : ra > rb;
+}
+
+/*
+ * Check the records once everything is read: every bundle needs Exec= and
+ * a unique name. Names differing only in case are duplicates, since
+ * default macOS volumes are case-insensitive and both would build into
+ * one .app. Duplicates are found by sorting, as manifests may hold tens of
+ * thousands of records.
+ */
+static BOOL validate_manifest(const char *path, const BatchManifest *manifest)
+{
+    const BatchRecord **sorted, *duplicate = NULL, *first = NULL;
+    int i;
+
+    for (i = 0; i < manifest->count; i++) {
+        const BatchRecord *record = &manifest->records[i];
+
+        if (!*record->name || strchr(record->name, '/')) {
+            fprintf(stderr, "%s:%d: invalid bundle name '%s'\n", path, record->line, record->name);
+            return FALSE;
+        }
+        if (!record->exec || !*record->exec) {
+            fprintf(stderr, "%s:%d: [%s] has no Exec=\n", path, record->line, record->name);
+            return FALSE;
+        }
+    }
+
+    if (manifest->count < 2)
+        return TRUE;
+    sorted = malloc(manifest->count * sizeof(BatchRecord *));
+    if (!sorted) {
+        fprintf(stderr, "%s: out of memory checking bundle names\n", path);
+        return FALSE;
+    }
+    for (i = 0; i < manifest->count; i++)
+        sorted[i] = &manifest->records[i];
+    qsort(sorted, manifest->count, sizeof(BatchRecord *), compare_record_names);
+
+    /* Report the duplicate that comes first in the file, against the first record of its name */
+    for (i = 1; i < manifest->count; i++) {
+        if (strcasecmp(sorted[i - 1]->name, sorted[i]->name) != 0)
+            continue;
+        if (!duplicate || sorted[i] < duplicate) {
+            int j = i - 1;
+
+            while (j > 0 && strcasecmp(sorted[j - 1]->name, sorted[i]->name) == 0)
+                j--;
+            duplicate = sorted[i];
+            first = sorted[j];
+        }
+    }
+    free(sorted);
+
+    if (duplicate) {
+        fprintf(stderr, "%s:%d: [%s] already defined on line %d\n", path, duplicate->line,
+                duplicate->name, first->line);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Read a file in manifest syntax, line by line: [Section] headers and
+ * Key=Value lines, blank lines and # comments, with spaces around keys and
+ * values and CR line ends trimmed, and a leading UTF-8 byte order mark
+ * skipped. Syntax errors are reported here with file and line; the
+ * callbacks report their own and return FALSE to stop. section_label
+ * names a section in the error for keys that come before the first one.
+ */
+BOOL read_manifest_file(const char *path, const char *section_label, ManifestSectionFunc section,
+                        ManifestKeyFunc key, void *arg)
+{
+    MappedFile file;
+    const char *p, *end;
+    BOOL in_section = FALSE, ok = TRUE;
+    int line = 0;
+
+    if (!map_file(path, &file)) {
+        print_error(ERR_FILE_NOT_FOUND, path);
+        return FALSE;
+    }
+
+    p = (const char *)file.data;
+    end = p + file.len;
+
+    /* Common in files exported from spreadsheets */
+    if (end - p >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0)
+        p += 3;
+
+    while (ok && p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        const char *line_end = eol ? eol : end;
+        const char *eq, *key_end, *value;
+
+        line++;
+        while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+        while (line_end > p && (line_end[-1] == '\r' || line_end[-1] == ' ' || line_end[-1] == '\t'))
+            line_end--;
+
+        if (p == line_end || *p == '#') {
+            /* blank or comment */
+        } else if (*p == '[') {
+            if (line_end[-1] != ']' || line_end - p < 2) {
+                fprintf(stderr, "%s:%d: malformed section header\n", path, line);
+                ok = FALSE;
+            } else {
+                ok = section(arg, p + 1, (size_t)(line_end - p - 2), line);
+                in_section = TRUE;
+            }
+        } else if ((eq = memchr(p, '=', (size_t)(line_end - p))) == NULL) {
+            fprintf(stderr, "%s:%d: expected Key=Value\n", path, line);
+            ok = FALSE;
+        } else if (!in_section) {
+            fprintf(stderr, "%s:%d: Key=Value before the first [%s]\n", path, line, section_label);
+            ok = FALSE;
+        } else {
+            key_end = eq;
+            while (key_end > p && (key_end[-1] == ' ' || key_end[-1] == '\t')) key_end--;
+            value = eq + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+            ok = key(arg, p, (size_t)(key_end - p), value, (size_t)(line_end - value), line);
+        }
+
+        p = eol ? eol + 1 : end;
+    }
+
+    unmap_file(&file);
+    return ok;
+}
+
+typedef struct {
+    const char *path;
+    BatchManifest *manifest;
+    BatchRecord *record;
+} ManifestLoad;
+
+static BOOL manifest_section(void *arg, const char *name, size_t len, int line)
+{
+    ManifestLoad *load = arg;
+
+    load->record = add_record(load->manifest, name, len, line);
+    return load->record != NULL;
+}
+
+static BOOL manifest_key(void *arg, const char *key, size_t key_len, const char *value,
+                         size_t value_len, int line)
+{
+    ManifestLoad *load = arg;
+    BatchRecord *record = load->record;
+    char **field = NULL;
+
+    if (key_len == 4 && memcmp(key, "Exec", 4) == 0) field = &record->exec;
+    else if (key_len == 4 && memcmp(key, "Icon", 4) == 0) field = &record->icon;
+    else if (key_len == 9 && memcmp(key, "Associate", 9) == 0) field = &record->associations;
+    else if (key_len == 10 && memcmp(key, "Identifier", 10) == 0) field = &record->identifier;
+    else if (key_len == 7 && memcmp(key, "Version", 7) == 0) field = &record->version;
+    else if (key_len == 8 && memcmp(key, "Category", 8) == 0) field = &record->category;
+    else if (key_len == 5 && memcmp(key, "MinOS", 5) == 0) field = &record->min_os;
+    else if (key_len == 8 && memcmp(key, "Launcher", 8) == 0) {
+        if (!parse_launcher(value, value_len, &record->launcher)) {
+            fprintf(stderr, "%s:%d: unknown launcher mode (script, exec, direct)\n", load->path, line);
+            return FALSE;
+        }
+        return TRUE;
+    } else {
+        fprintf(stderr, "%s:%d: unknown key '%.*s'\n", load->path, line, (int)key_len, key);
+        return FALSE;
+    }
+
+    free(*field);
+    *field = strndup(value, value_len);
+    return *field != NULL;
+}
+
+/*
+ * Read a manifest. Errors are reported with file and line; nothing is
+ * built from a manifest that does not parse completely.
+ */
+BOOL batch_manifest_load(const char *path, BatchManifest *manifest)
+{
+    ManifestLoad load;
+    BOOL ok;
+
+    memset(manifest, 0, sizeof(BatchManifest));
+    load.path = path;
+    load.manifest = manifest;
+    load.record = NULL;
+    ok = read_manifest_file(path, "Section", manifest_section, manifest_key, &load);
+
+    if (ok)
+        ok = validate_manifest(path, manifest);
+    if (!ok)
+        batch_manifest_free(manifest);
+    return ok;
+}
+
+/* Options for one record: the command line settings with the record's keys on top */
+void batch_record_options(const BatchRecord *record, const AppBundleOptions *base,
+                          AppBundleOptions *options)
+{
+    *options = *base;
+    options->bundle_name = record->name;
+    options->executable_path = record->exec;
+    if (record->icon) options->icon_path = record->icon;
+    if (record->associations) options->associations = record->associations;
+    if (record->identifier) options->bundle_identifier = record->identifier;
+    if (record->version) options->version = record->version;
+    if (record->category) options->app_category = record->category;
+    if (record->min_os) options->min_os_version = record->min_os;
+    if (record->launcher >= 0) options->launcher_mode = (LauncherMode)record->launcher;
+}
+
+typedef struct {
+    AppBundleContext *ctx;
+    const AppBundleOptions *options;
+    BatchJournal *journal;
+    uint64_t digest;
+    ErrorCode result;
+    BOOL skipped;                   /* --resume found it already built */
+} BatchTask;
+
+static void batch_build_task(void *arg)
+{
+    BatchTask *task = arg;
+    char *bundle_path;
+
+    task->result = appbundle_build(task->ctx, task->options);
+    if (task->result != ERR_SUCCESS || !task->journal)
+        return;
+
+    bundle_path = heap_printf("%s/%s.app", task->options->bundle_dest, task->options->bundle_name);
+    if (bundle_path)
+        batch_journal_record(task->journal, task->digest, bundle_path, task->options->bundle_name);
+    free(bundle_path);
+}
+
+/* <dest>/.<manifest name>.journal, so manifests sharing a destination keep separate journals */
+static char *journal_path(const char *manifest_path, const char *bundle_dest)
+{
+    const char *name = strrchr(manifest_path, '/');
+
+    return heap_printf("%s/.%s.journal", bundle_dest, name ? name + 1 : manifest_path);
+}
+
+/*
+ * Build every record of manifest_path into base->bundle_dest on the worker
+ * pool, logging each finished record in the batch journal. With
+ * resume, records the journal shows as built are skipped.
+ */
+BOOL run_batch(const char *manifest_path, const AppBundleOptions *base, BOOL resume)
+{
+    BatchManifest manifest;
+    AppBundleOptions *options = NULL;
+    BatchTask *tasks = NULL;
+    AppBundleContext *ctx = NULL;
+    BatchJournal *journal = NULL;
+    WorkQueue *queue;
+    char *journal_file = NULL;
+    int i, failures = 0, skipped = 0, icons_skipped = 0, signatures_skipped = 0;
+
+    if (!batch_manifest_load(manifest_path, &manifest))
+        return FALSE;
+
+    printf("Found %d bundle(s) in %s\n", manifest.count, manifest_path);
+    if (manifest.count == 0)
+        goto cleanup;
+
+    options = calloc(manifest.count, sizeof(AppBundleOptions));
+    tasks = calloc(manifest.count, sizeof(BatchTask));
+    ctx = appbundle_context_create(base->jobs);
+    if (!options || !tasks || !ctx || !create_directories((char *)base->bundle_dest)) {
+        failures = manifest.count;
+        goto cleanup;
+    }
+
+    journal_file = journal_path(manifest_path, base->bundle_dest);
+    journal = journal_file ? batch_journal_open(journal_file, resume) : NULL;
+    if (!journal)
+        fprintf(stderr, "Warning: cannot open batch journal %s; this run %s\n",
+                journal_file ? journal_file : manifest_path,
+                resume ? "rebuilds everything" : "cannot be resumed");
+
+    queue = context_queue(ctx);
+    for (i = 0; i < manifest.count; i++) {
+        BatchTask *task = &tasks[i];
+        char *bundle_path;
+
+        batch_record_options(&manifest.records[i], base, &options[i]);
+        task->ctx = ctx;
+        task->options = &options[i];
+        task->journal = journal;
+        task->digest = batch_options_digest(&options[i]);
+
+        if (resume && journal) {
+            bundle_path = heap_printf("%s/%s.app", base->bundle_dest, options[i].bundle_name);
+            task->skipped = bundle_path && batch_journal_done(journal, task->digest, bundle_path);
+            free(bundle_path);
+            if (task->skipped) {
+                skipped++;
+                icons_skipped += options[i].icon_path != NULL;
+                signatures_skipped += options[i].signing_identity != NULL;
+                continue;
+            }
+        }
+
+        if (!queue || !work_queue_submit(queue, batch_build_task, task))
+            batch_build_task(task);
+    }
+    if (queue)
+        work_queue_wait(queue);
+
+    for (i = 0; i < manifest.count; i++) {
+        const BatchRecord *record = &manifest.records[i];
+
+        if (tasks[i].skipped)
+            continue;
+        if (tasks[i].result == ERR_SUCCESS) {
+            printf("  %s.app\n", record->name);
+        } else {
+            failures++;
+            fprintf(stderr, "ERROR: %s:%d [%s]: %s\n", manifest_path, record->line, record->name,
+                    error_code_to_string(tasks[i].result));
+        }
+    }
+
+    if (resume)
+        printf("Resumed from %s: skipped %d of %d bundle(s) already built "
+               "(%d icon render(s), %d signature(s))\n", journal_file, skipped, manifest.count,
+               icons_skipped, signatures_skipped);
+    printf("Built %d of %d bundle(s) into %s\n", manifest.count - skipped - failures,
+           manifest.count - skipped, base->bundle_dest);
+
+cleanup:
+    appbundle_context_destroy(ctx);
+    batch_journal_close(journal);
+    batch_manifest_free(&manifest);
+    free(journal_file);
+    free(options);
+    free(tasks);
+
+    return failures == 0;
+}
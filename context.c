@@ -0,0 +1,669 @@
+/*
+ * Build Contexts for AppBundleGenerator
+ * libappbundler entry points and the per-context state they share:
+ * a private scratch directory, a rendered-icon cache and a worker pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/stat.h>
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#include "shared.h"
+
+extern char **environ;
+
+/* Where the background icon renders of --async-icon report, in the destination */
+#define ICON_LOG_NAME ".AppBundleGenerator-icons.log"
+
+/* One rendered icon, keyed by source file identity and render settings */
+typedef struct {
+    char *source;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    IconCompression compression;
+    BOOL legacy_chunks;
+    BOOL reproducible;
+    size_t memory_limit;
+    char *icns_path;                /* rendered copy inside the scratch directory */
+} IconCacheEntry;
+
+struct AppBundleContext {
+    pthread_mutex_t lock;           /* guards everything below */
+    char *scratch_dir;
+    unsigned long next_scratch_id;
+    IconCacheEntry *icons;
+    int icon_count;
+    int icon_capacity;
+    int threads;
+    WorkQueue *queue;               /* started by the first build that needs it */
+    ThreadBudget *helpers;          /* threads - 1, shared by fan-outs inside builds */
+};
+
+AppBundleContext *appbundle_context_create(int worker_threads)
+{
+    AppBundleContext *ctx = calloc(1, sizeof(AppBundleContext));
+
+    if (!ctx) return NULL;
+
+    ctx->scratch_dir = create_scratch_dir(NULL, "appbundler");
+    if (!ctx->scratch_dir) {
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->threads = worker_threads > 0 ? worker_threads : work_queue_default_threads();
+    ctx->helpers = thread_budget_create(ctx->threads - 1);
+    if (!ctx->helpers) {
+        remove_tree(ctx->scratch_dir);
+        free(ctx->scratch_dir);
+        free(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    DEBUG_PRINT("Build context scratch directory: %s\n", ctx->scratch_dir);
+    return ctx;
+}
+
+void appbundle_context_destroy(AppBundleContext *ctx)
+{
+    int i;
+
+    if (!ctx) return;
+
+    if (ctx->queue)
+        work_queue_destroy(ctx->queue);
+
+    for (i = 0; i < ctx->icon_count; i++) {
+        free(ctx->icons[i].source);
+        free(ctx->icons[i].icns_path);
+    }
+    free(ctx->icons);
+
+    remove_tree(ctx->scratch_dir);
+    free(ctx->scratch_dir);
+    thread_budget_destroy(ctx->helpers);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+void appbundle_options_init(AppBundleOptions *options)
+{
+    memset(options, 0, sizeof(AppBundleOptions));
+    options->app_category = "public.app-category.utilities";
+}
+
+const char *context_scratch_dir(const AppBundleContext *ctx)
+{
+    return ctx ? ctx->scratch_dir : NULL;
+}
+
+/*
+ * Threads a step inside a build may add to its own, such as the deflate
+ * threads of an icon encode. Shared by every build on the context, so a
+ * batch stays within --jobs however many of its builds encode at once.
+ */
+ThreadBudget *context_thread_budget(const AppBundleContext *ctx)
+{
+    return ctx ? ctx->helpers : NULL;
+}
+
+/* A fresh, unused path inside the scratch directory; caller frees it */
+char *context_scratch_path(AppBundleContext *ctx, const char *suffix)
+{
+    unsigned long id;
+
+    pthread_mutex_lock(&ctx->lock);
+    id = ++ctx->next_scratch_id;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return heap_printf("%s/%lu%s", ctx->scratch_dir, id, suffix ? suffix : "");
+}
+
+/* The context's worker pool, started on first use; NULL if it cannot be */
+WorkQueue *context_queue(AppBundleContext *ctx)
+{
+    WorkQueue *queue;
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->queue)
+        ctx->queue = work_queue_create(ctx->threads);
+    queue = ctx->queue;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return queue;
+}
+
+static IconCacheEntry *find_cached_icon(AppBundleContext *ctx, const char *icon_src,
+                                        const struct stat *st, const IconRenderOptions *opts)
+{
+    int i;
+
+    for (i = 0; i < ctx->icon_count; i++) {
+        IconCacheEntry *e = &ctx->icons[i];
+
+        if (e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+            e->mtime == st->st_mtime && e->compression == opts->compression &&
+            e->legacy_chunks == opts->legacy_chunks && e->reproducible == opts->reproducible &&
+            e->memory_limit == opts->memory_limit &&
+            strcmp(e->source, icon_src) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static BOOL grow_icon_cache(AppBundleContext *ctx)
+{
+    int capacity = ctx->icon_capacity ? ctx->icon_capacity * 2 : 8;
+    IconCacheEntry *icons = realloc(ctx->icons, capacity * sizeof(IconCacheEntry));
+
+    if (!icons) return FALSE;
+    ctx->icons = icons;
+    ctx->icon_capacity = capacity;
+    return TRUE;
+}
+
+/* Path of the rendered copy of icon_src, or NULL if it has not been rendered; caller frees it */
+static char *cached_icon_path(AppBundleContext *ctx, const char *icon_src, const struct stat *st,
+                              const IconRenderOptions *opts)
+{
+    IconCacheEntry *entry;
+    char *cached = NULL;
+
+    pthread_mutex_lock(&ctx->lock);
+    entry = find_cached_icon(ctx, icon_src, st, opts);
+    if (entry)
+        cached = strdup(entry->icns_path);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return cached;
+}
+
+/* Copy icon_src's icon into a bundle if this context already rendered it; never renders */
+BOOL context_copy_cached_icon(AppBundleContext *ctx, const char *icon_src,
+                              const char *path_to_bundle_resources, const IconRenderOptions *opts)
+{
+    struct stat st;
+    char *cached, *output_icns;
+    BOOL ret;
+
+    if (!ctx || stat(icon_src, &st) != 0 || !(cached = cached_icon_path(ctx, icon_src, &st, opts)))
+        return FALSE;
+
+    output_icns = heap_printf("%s/icon.icns", path_to_bundle_resources);
+    ret = output_icns && copy_file(cached, output_icns);
+    free(output_icns);
+    free(cached);
+    return ret;
+}
+
+/*
+ * Add icon.icns to a bundle, rendering each distinct source only once per
+ * context. Renders run outside the lock; if two builds race on the same
+ * icon both render and the first to finish is kept.
+ */
+BOOL context_add_icon(AppBundleContext *ctx, const char *icon_src,
+                      const char *path_to_bundle_resources, const IconRenderOptions *opts)
+{
+    IconCacheEntry *entry;
+    IconRenderOptions render_opts = *opts;
+    struct stat st;
+    char *cached = NULL, *render_dir = NULL, *output_icns;
+    BOOL ret;
+
+    /* ICNS sources are only copied, caching them gains nothing */
+    if (!ctx || detect_icon_format(icon_src) == ICON_FORMAT_ICNS || stat(icon_src, &st) != 0)
+        return add_icns_for_bundle(icon_src, path_to_bundle_resources, opts);
+
+    output_icns = heap_printf("%s/icon.icns", path_to_bundle_resources);
+    if (!output_icns) return FALSE;
+
+    cached = cached_icon_path(ctx, icon_src, &st, opts);
+    if (cached) {
+        DEBUG_PRINT("Reusing rendered icon for %s\n", icon_src);
+        ret = copy_file(cached, output_icns);
+        free(cached);
+        free(output_icns);
+        return ret;
+    }
+
+    render_opts.scratch_dir = ctx->scratch_dir;
+    render_dir = context_scratch_path(ctx, ".icon");
+    if (!render_dir || !create_directories(render_dir)) {
+        free(render_dir);
+        free(output_icns);
+        return add_icns_for_bundle(icon_src, path_to_bundle_resources, &render_opts);
+    }
+
+    ret = add_icns_for_bundle(icon_src, render_dir, &render_opts);
+    if (ret) {
+        cached = heap_printf("%s/icon.icns", render_dir);
+        ret = cached && copy_file(cached, output_icns);
+    }
+
+    if (ret) {
+        pthread_mutex_lock(&ctx->lock);
+        if (!find_cached_icon(ctx, icon_src, &st, opts) &&
+            (ctx->icon_count < ctx->icon_capacity || grow_icon_cache(ctx))) {
+            entry = &ctx->icons[ctx->icon_count];
+            entry->source = strdup(icon_src);
+            if (entry->source) {
+                entry->dev = st.st_dev;
+                entry->ino = st.st_ino;
+                entry->size = st.st_size;
+                entry->mtime = st.st_mtime;
+                entry->compression = opts->compression;
+                entry->legacy_chunks = opts->legacy_chunks;
+                entry->reproducible = opts->reproducible;
+                entry->memory_limit = opts->memory_limit;
+                entry->icns_path = cached;
+                cached = NULL;
+                ctx->icon_count++;
+            }
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    /* Lost the race or could not record it; the rendered copy is not needed */
+    if (cached) {
+        unlink(cached);
+        free(cached);
+    }
+    free(render_dir);
+    free(output_icns);
+    return ret;
+}
+
+/* Build one bundle, then sign and verify it if an identity was given */
+ErrorCode appbundle_build(AppBundleContext *ctx, const AppBundleOptions *options)
+{
+    if (!ctx || !options || !options->bundle_name || !options->bundle_dest ||
+        !options->executable_path)
+        return ERR_INVALID_ARGS;
+
+    return build_app_bundle(ctx, options);
+}
+
+/* Completion tracking for one appbundle_build_many call */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int remaining;
+    int failures;
+} BuildBatch;
+
+typedef ErrorCode (*BuildFunc)(AppBundleContext *ctx, const AppBundleOptions *options);
+
+typedef struct {
+    AppBundleContext *ctx;
+    BuildFunc fn;
+    const AppBundleOptions *options;
+    ErrorCode *result;
+    BuildBatch *batch;
+} BuildTask;
+
+static void build_task(void *arg)
+{
+    BuildTask *task = arg;
+    ErrorCode code = task->fn(task->ctx, task->options);
+
+    if (task->result)
+        *task->result = code;
+
+    pthread_mutex_lock(&task->batch->lock);
+    if (code != ERR_SUCCESS)
+        task->batch->failures++;
+    if (--task->batch->remaining == 0)
+        pthread_cond_signal(&task->batch->done);
+    pthread_mutex_unlock(&task->batch->lock);
+}
+
+/*
+ * Waits on its own counter rather than work_queue_wait, so concurrent
+ * callers sharing the pool only wait for their own builds.
+ */
+static int run_many(AppBundleContext *ctx, BuildFunc fn, const AppBundleOptions *options,
+                    int count, ErrorCode *results)
+{
+    BuildBatch batch;
+    BuildTask *tasks;
+    WorkQueue *queue;
+    int i, failures;
+
+    if (!ctx || !options || count <= 0)
+        return count > 0 ? count : 0;
+
+    tasks = calloc(count, sizeof(BuildTask));
+    if (!tasks) return count;
+
+    queue = context_queue(ctx);
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.remaining = count;
+    batch.failures = 0;
+
+    for (i = 0; i < count; i++) {
+        tasks[i].ctx = ctx;
+        tasks[i].fn = fn;
+        tasks[i].options = &options[i];
+        tasks[i].result = results ? &results[i] : NULL;
+        tasks[i].batch = &batch;
+
+        /* Without a pool (or if queueing fails) build on this thread */
+        if (!queue || !work_queue_submit(queue, build_task, &tasks[i]))
+            build_task(&tasks[i]);
+    }
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.remaining > 0)
+        pthread_cond_wait(&batch.done, &batch.lock);
+    failures = batch.failures;
+    pthread_mutex_unlock(&batch.lock);
+
+    pthread_cond_destroy(&batch.done);
+    pthread_mutex_destroy(&batch.lock);
+    free(tasks);
+    return failures;
+}
+
+int appbundle_build_many(AppBundleContext *ctx, const AppBundleOptions *options,
+                         int count, ErrorCode *results)
+{
+    return run_many(ctx, appbundle_build, options, count, results);
+}
+
+/* Render the real icon of an async_icon build and swap it in */
+ErrorCode appbundle_finish_icon(AppBundleContext *ctx, const AppBundleOptions *options)
+{
+    if (!ctx || !options || !options->bundle_name || !options->bundle_dest)
+        return ERR_INVALID_ARGS;
+    if (!options->icon_path)
+        return ERR_SUCCESS;
+
+    return finish_bundle_icon(ctx, options);
+}
+
+/* This program, for re-running it in the background */
+static char *self_executable(void)
+{
+#ifdef __APPLE__
+    uint32_t size = 0;
+    char *path;
+
+    _NSGetExecutablePath(NULL, &size);
+    path = malloc(size);
+    if (path && _NSGetExecutablePath(path, &size) != 0) {
+        free(path);
+        path = NULL;
+    }
+    return path;
+#else
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+    if (len <= 0)
+        return NULL;
+    path[len] = '\0';
+    return strdup(path);
+#endif
+}
+
+/* dest, name and icon of every bundle, each NUL-terminated */
+static char *write_icon_list(const AppBundleOptions *pending, int count)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    char *path, *data = NULL;
+    size_t len = 0, size;
+    int fd, i;
+    BOOL ok = TRUE;
+
+    path = heap_printf("%s/appbundler-icons.XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    if (!path || (fd = mkstemp(path)) < 0) {
+        free(path);
+        return NULL;
+    }
+    close(fd);
+
+    for (i = 0; ok && i < count; i++) {
+        size = strlen(pending[i].bundle_dest) + strlen(pending[i].bundle_name) +
+               strlen(pending[i].icon_path) + 3;
+        ok = (data = realloc(data, len + size)) != NULL;
+        if (ok)
+            len += (size_t)sprintf(data + len, "%s%c%s%c%s", pending[i].bundle_dest, 0,
+                                   pending[i].bundle_name, 0, pending[i].icon_path) + 1;
+    }
+
+    if (!ok || !write_file(path, data, len, FALSE)) {
+        unlink(path);
+        free(path);
+        path = NULL;
+    }
+    free(data);
+    return path;
+}
+
+/*
+ * Start this program again with --finish-icons and the options the icon
+ * render and re-signing read. Its output is appended to log_path.
+ */
+static pid_t spawn_icon_finisher(const char *self, const char *list, const AppBundleOptions *options,
+                                 const char *log_path)
+{
+    static const char *const compression_names[] = {"balanced", "fast", "small"};
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    const char *argv[32];
+    char jobs[16], memory[16];
+    int argc = 0, log_fd;
+    pid_t pid;
+
+    argv[argc++] = self;
+    argv[argc++] = "--finish-icons";
+    argv[argc++] = list;
+    if (options->jobs > 0) {
+        snprintf(jobs, sizeof(jobs), "%d", options->jobs);
+        argv[argc++] = "--jobs";
+        argv[argc++] = jobs;
+    }
+    argv[argc++] = "--icon-compress";
+    argv[argc++] = compression_names[options->icon_compression];
+    if (options->icns_legacy)
+        argv[argc++] = "--icns-legacy";
+    if (options->icon_memory_mb > 0) {
+        snprintf(memory, sizeof(memory), "%d", options->icon_memory_mb);
+        argv[argc++] = "--icon-memory";
+        argv[argc++] = memory;
+    }
+    if (options->signing_identity) {
+        argv[argc++] = "--sign";
+        argv[argc++] = options->signing_identity;
+        if (options->enable_hardened_runtime) argv[argc++] = "--hardened-runtime";
+        if (options->entitlements_file) {
+            argv[argc++] = "--entitlements";
+            argv[argc++] = options->entitlements_file;
+        }
+        if (options->allow_jit) argv[argc++] = "--allow-jit";
+        if (options->allow_unsigned_memory) argv[argc++] = "--allow-unsigned";
+        if (options->allow_dyld_vars) argv[argc++] = "--allow-dyld-vars";
+    }
+    argv[argc] = NULL;
+
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        fprintf(stderr, "Warning: cannot write %s; icon errors will not be logged\n", log_path);
+        log_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    }
+
+    /* Its own process group, so ^C on this run does not stop the renders */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (log_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, log_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, log_fd, STDERR_FILENO);
+    }
+
+    if (posix_spawn(&pid, self, &actions, &attr, (char *const *)argv, environ) != 0)
+        pid = -1;
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (log_fd >= 0) close(log_fd);
+    return pid;
+}
+
+/*
+ * --async-icon from the command line: the bundles are published, so their
+ * icons are finished by a fresh copy of this program (--finish-icons) while
+ * the caller exits. Failures go to .AppBundleGenerator-icons.log in the
+ * destination. If it cannot be started the icons are finished here.
+ * results (optional) skips failed builds.
+ */
+void finish_icons_in_background(const AppBundleOptions *options, const ErrorCode *results,
+                                int count)
+{
+    AppBundleOptions *pending;
+    AppBundleContext *ctx;
+    char *self = NULL, *list = NULL, *log_path = NULL;
+    int i, n = 0;
+    pid_t pid = -1;
+
+    pending = calloc(count > 0 ? count : 1, sizeof(AppBundleOptions));
+    if (!pending) return;
+    for (i = 0; i < count; i++) {
+        if (options[i].icon_path && (!results || results[i] == ERR_SUCCESS))
+            pending[n++] = options[i];
+    }
+    if (n == 0) {
+        free(pending);
+        return;
+    }
+
+    self = self_executable();
+    list = self ? write_icon_list(pending, n) : NULL;
+    log_path = heap_printf("%s/" ICON_LOG_NAME, pending[0].bundle_dest);
+    fflush(NULL);
+    if (list && log_path)
+        pid = spawn_icon_finisher(self, list, &pending[0], log_path);
+
+    if (pid > 0) {
+        printf("Rendering %d icon(s) in the background (process %d); errors go to %s\n",
+               n, (int)pid, log_path);
+    } else {
+        fprintf(stderr, "Warning: cannot start a background process, rendering icons now\n");
+        if (list) unlink(list);
+        ctx = appbundle_context_create(pending[0].jobs);
+        if (!ctx || run_many(ctx, appbundle_finish_icon, pending, n, NULL) > 0)
+            fprintf(stderr, "ERROR: could not finish every icon\n");
+        appbundle_context_destroy(ctx);
+    }
+
+    free(log_path);
+    free(list);
+    free(self);
+    free(pending);
+}
+
+/*
+ * The background half of --async-icon: finish the icons of the bundles
+ * listed by finish_icons_in_background, with base's render and signing
+ * options, and report each failure. The list is removed once read.
+ */
+BOOL finish_icons_from_list(const char *list_path, const AppBundleOptions *base)
+{
+    AppBundleOptions *pending = NULL;
+    ErrorCode *results = NULL;
+    AppBundleContext *ctx = NULL;
+    MappedFile file;
+    const char *p, *end;
+    char stamp[32];
+    time_t now;
+    int i, n = 0, failures = 0;
+
+    if (!map_file(list_path, &file)) {
+        fprintf(stderr, "ERROR: cannot read icon list %s\n", list_path);
+        return FALSE;
+    }
+    unlink(list_path);
+
+    /* Three strings per bundle; the mapping holds them for the whole run */
+    p = (const char *)file.data;
+    end = p + file.len;
+    pending = calloc(file.len / 3 + 1, sizeof(AppBundleOptions));
+    while (pending && p < end) {
+        const char *fields[3];
+
+        for (i = 0; i < 3; i++) {
+            const char *nul = p < end ? memchr(p, '\0', (size_t)(end - p)) : NULL;
+
+            if (!nul)
+                break;
+            fields[i] = p;
+            p = nul + 1;
+        }
+        if (i < 3)
+            break;
+        pending[n] = *base;
+        pending[n].bundle_dest = fields[0];
+        pending[n].bundle_name = fields[1];
+        pending[n].icon_path = fields[2];
+        n++;
+    }
+
+    now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    printf("%s [%d]: finishing %d icon(s)\n", stamp, (int)getpid(), n);
+    fflush(stdout);
+
+    results = calloc(n > 0 ? n : 1, sizeof(ErrorCode));
+    ctx = appbundle_context_create(base->jobs);
+    if (!pending || !results || !ctx) {
+        fprintf(stderr, "ERROR: out of memory finishing icons\n");
+        failures = n > 0 ? n : 1;
+    } else {
+        failures = run_many(ctx, appbundle_finish_icon, pending, n, results);
+        for (i = 0; i < n; i++) {
+            if (results[i] != ERR_SUCCESS)
+                fprintf(stderr, "ERROR [%d]: %s/%s.app: icon %s: %s\n", (int)getpid(), pending[i].bundle_dest,
+                        pending[i].bundle_name, pending[i].icon_path, error_code_to_string(results[i]));
+        }
+    }
+    appbundle_context_destroy(ctx);
+
+    now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    printf("%s [%d]: finished %d of %d icon(s)\n", stamp, (int)getpid(), n - failures, n);
+
+    free(results);
+    free(pending);
+    unmap_file(&file);
+    return failures == 0;
+}
+
+/*
+ * appbundle_build_many for the command line modes, which also hand the
+ * icons of --async-icon builds to the background. Returns the failures.
+ */
+int build_many_finishing_icons(AppBundleContext *ctx, const AppBundleOptions *options,
+                               int count, ErrorCode *results)
+{
+    int failures = appbundle_build_many(ctx, options, count, results);
+
+    if (count > 0 && options[0].async_icon)
+        finish_icons_in_background(options, results, count);
+    return failures;
+}
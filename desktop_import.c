@@ -0,0 +1,663 @@
+/*
+ * Desktop Entry Import for AppBundleGenerator
+ * Mirrors XDG .desktop launchers (including the ones Wine writes under
+ * ~/.local/share/applications/wine) into application bundles.
+ *
+ * Icon= names are resolved against an index of every icon theme built
+ * once per run, so each lookup is a hash probe instead of a series of
+ * stat() calls across theme/size/context directories.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+/* Fields taken from the [Desktop Entry] group of one file */
+typedef struct {
+    char *path;
+    char *name;
+    char *exec;
+    char *icon;
+    char *categories;
+    char *mime_types;
+    char *bundle_name;
+    char *icon_path;                /* resolved icon file, NULL if none */
+    char *associations;             /* extensions for MimeType=, NULL if none */
+} DesktopEntry;
+
+/* freedesktop.org main and additional categories, first match wins */
+static const struct {
+    const char *category;
+    const char *app_category;
+} category_map[] = {
+    {"Development",       "public.app-category.developer-tools"},
+    {"Game",              "public.app-category.games"},
+    {"Graphics",          "public.app-category.graphics-design"},
+    {"Office",            "public.app-category.productivity"},
+    {"Finance",           "public.app-category.finance"},
+    {"Education",         "public.app-category.education"},
+    {"Science",           "public.app-category.education"},
+    {"Audio",             "public.app-category.music"},
+    {"Video",             "public.app-category.video"},
+    {"AudioVideo",        "public.app-category.entertainment"},
+    {"Network",           "public.app-category.social-networking"},
+    {"Utility",           "public.app-category.utilities"},
+    {"System",            "public.app-category.utilities"},
+    {"Settings",          "public.app-category.utilities"},
+};
+
+static const char *map_categories(const char *categories)
+{
+    const char *p = categories;
+    size_t i;
+
+    while (p && *p) {
+        const char *end = strchr(p, ';');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+
+        for (i = 0; i < sizeof(category_map) / sizeof(category_map[0]); i++) {
+            if (strlen(category_map[i].category) == len &&
+                strncmp(category_map[i].category, p, len) == 0)
+                return category_map[i].app_category;
+        }
+        p = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
+
+/* ---- Icon theme index ---- */
+
+typedef struct {
+    char *name;                     /* icon name without extension */
+    char *path;
+    int score;
+} IconIndexEntry;
+
+typedef struct {
+    IconIndexEntry *slots;
+    size_t capacity;                /* power of two */
+    size_t count;
+} IconIndex;
+
+static uint32_t icon_name_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static IconIndexEntry *icon_index_slot(IconIndex *index, const char *name, size_t len)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = icon_name_hash(name, len) & mask;
+
+    while (index->slots[i].name) {
+        if (strlen(index->slots[i].name) == len && memcmp(index->slots[i].name, name, len) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return &index->slots[i];
+}
+
+static BOOL icon_index_grow(IconIndex *index)
+{
+    IconIndex bigger;
+    size_t i;
+
+    bigger.capacity = index->capacity ? index->capacity * 2 : 1024;
+    bigger.count = index->count;
+    bigger.slots = calloc(bigger.capacity, sizeof(IconIndexEntry));
+    if (!bigger.slots) return FALSE;
+
+    for (i = 0; i < index->capacity; i++) {
+        if (index->slots[i].name)
+            *icon_index_slot(&bigger, index->slots[i].name, strlen(index->slots[i].name)) =
+                index->slots[i];
+    }
+
+    free(index->slots);
+    *index = bigger;
+    return TRUE;
+}
+
+/* Keep the candidate with the highest score for each name */
+static void icon_index_add(IconIndex *index, const char *name, size_t len,
+                           const char *dir, const char *file, int score)
+{
+    IconIndexEntry *slot;
+
+    if ((index->count + 1) * 10 > index->capacity * 7 && !icon_index_grow(index))
+        return;
+
+    slot = icon_index_slot(index, name, len);
+    if (slot->name && slot->score >= score)
+        return;
+
+    if (!slot->name) {
+        slot->name = strndup(name, len);
+        if (!slot->name) return;
+        index->count++;
+    }
+    free(slot->path);
+    slot->path = heap_printf("%s/%s", dir, file);
+    slot->score = score;
+}
+
+static const char *icon_index_lookup(IconIndex *index, const char *name)
+{
+    IconIndexEntry *slot;
+
+    if (!index->capacity) return NULL;
+    slot = icon_index_slot(index, name, strlen(name));
+    return slot->name ? slot->path : NULL;
+}
+
+static void icon_index_free(IconIndex *index)
+{
+    size_t i;
+
+    for (i = 0; i < index->capacity; i++) {
+        free(index->slots[i].name);
+        free(index->slots[i].path);
+    }
+    free(index->slots);
+    memset(index, 0, sizeof(IconIndex));
+}
+
+/*
+ * Rank a candidate: ICNS is used as-is, PNG is rendered natively (bigger is
+ * better), SVG needs qlmanage so only beats PNGs under 256px. hicolor wins
+ * ties since it is every theme's fallback.
+ */
+static int icon_score(const char *ext, int size, BOOL hicolor)
+{
+    int score;
+
+    if (strcasecmp(ext, ".icns") == 0) score = 4000;
+    else if (strcasecmp(ext, ".png") == 0) score = (size > 0 ? size : 32) * 2;
+    else if (strcasecmp(ext, ".svg") == 0) score = 300;
+    else return -1;
+
+    return score + (hicolor ? 1 : 0);
+}
+
+/* "256x256", "256x256@2" or "48" -> pixel size; "scalable" and others -> 0 */
+static int parse_size_dir(const char *name)
+{
+    int size = atoi(name), scale = 1;
+    const char *at = strchr(name, '@');
+
+    if (size <= 0) return 0;
+    if (at) scale = atoi(at + 1);
+    return size * (scale > 0 ? scale : 1);
+}
+
+static void index_icon_dir(IconIndex *index, const char *path, int depth, int size, BOOL hicolor)
+{
+    struct dirent *entry;
+    DIR *dir;
+
+    if (depth > 4) return;
+
+    dir = opendir(path);
+    if (!dir) return;
+
+    while ((entry = readdir(dir)) != NULL) {
+        const char *dot;
+        BOOL is_dir;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        } else {
+            is_dir = entry->d_type == DT_DIR;
+        }
+
+        if (is_dir) {
+            char *child = heap_printf("%s/%s", path, entry->d_name);
+
+            /* Theme layout is <theme>/<size>/<context>/<name>.<ext> */
+            if (child) {
+                int child_size = size;
+                BOOL child_hicolor = hicolor;
+
+                if (depth == 0)
+                    child_hicolor = strcmp(entry->d_name, "hicolor") == 0;
+                else if (depth == 1)
+                    child_size = parse_size_dir(entry->d_name);
+
+                index_icon_dir(index, child, depth + 1, child_size, child_hicolor);
+                free(child);
+            }
+            continue;
+        }
+
+        dot = strrchr(entry->d_name, '.');
+        if (dot && dot != entry->d_name) {
+            int score = icon_score(dot, size, hicolor);
+
+            if (score >= 0)
+                icon_index_add(index, entry->d_name, (size_t)(dot - entry->d_name),
+                               path, entry->d_name, score);
+        }
+    }
+
+    closedir(dir);
+}
+
+/* Index every theme under the XDG data directories, ~/.icons and pixmaps */
+static void build_icon_index(IconIndex *index)
+{
+    const char *home = getenv("HOME");
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *data_dirs = getenv("XDG_DATA_DIRS");
+    char *dirs, *cursor, *dir;
+    char *path;
+
+    if (!icon_index_grow(index)) return;
+
+    if (data_home && *data_home) {
+        path = heap_printf("%s/icons", data_home);
+    } else {
+        path = home ? heap_printf("%s/.local/share/icons", home) : NULL;
+    }
+    if (path) {
+        index_icon_dir(index, path, 0, 0, FALSE);
+        free(path);
+    }
+
+    if (home && (path = heap_printf("%s/.icons", home)) != NULL) {
+        index_icon_dir(index, path, 0, 0, FALSE);
+        free(path);
+    }
+
+    dirs = strdup(data_dirs && *data_dirs ? data_dirs : "/usr/local/share:/usr/share");
+    for (cursor = dirs; cursor && (dir = strsep(&cursor, ":")) != NULL; ) {
+        if (!*dir) continue;
+        if ((path = heap_printf("%s/icons", dir)) != NULL) {
+            index_icon_dir(index, path, 0, 0, FALSE);
+            free(path);
+        }
+        /* pixmaps holds loose files, no theme/size levels */
+        if ((path = heap_printf("%s/pixmaps", dir)) != NULL) {
+            index_icon_dir(index, path, 3, 0, FALSE);
+            free(path);
+        }
+    }
+    free(dirs);
+
+    DEBUG_PRINT("Indexed %zu icon names\n", index->count);
+}
+
+static char *resolve_icon(IconIndex *index, BOOL *indexed, const char *icon)
+{
+    const char *found;
+    const char *dot;
+    char *name;
+
+    if (!icon || !*icon) return NULL;
+
+    if (icon[0] == '/')
+        return access(icon, R_OK) == 0 && detect_icon_format(icon) != ICON_FORMAT_UNKNOWN ?
+               strdup(icon) : NULL;
+
+    if (!*indexed) {
+        build_icon_index(index);
+        *indexed = TRUE;
+    }
+
+    /* Icon= should be a bare name, but an extension is common in practice */
+    dot = strrchr(icon, '.');
+    if (dot && (strcasecmp(dot, ".png") == 0 || strcasecmp(dot, ".svg") == 0 ||
+                strcasecmp(dot, ".xpm") == 0 || strcasecmp(dot, ".icns") == 0))
+        name = strndup(icon, (size_t)(dot - icon));
+    else
+        name = strdup(icon);
+    if (!name) return NULL;
+
+    found = icon_index_lookup(index, name);
+    free(name);
+    return found ? strdup(found) : NULL;
+}
+
+/* ---- .desktop parsing ---- */
+
+/* Undo the string escapes allowed in values: \s \n \t \r \\ */
+static char *unescape_value(const char *p, size_t len)
+{
+    char *out = malloc(len + 1);
+    size_t i, o = 0;
+
+    if (!out) return NULL;
+
+    for (i = 0; i < len; i++) {
+        if (p[i] == '\\' && i + 1 < len) {
+            switch (p[++i]) {
+                case 's': out[o++] = ' '; break;
+                case 'n': out[o++] = '\n'; break;
+                case 't': out[o++] = '\t'; break;
+                case 'r': out[o++] = '\r'; break;
+                case '\\': out[o++] = '\\'; break;
+                default: out[o++] = '\\'; out[o++] = p[i]; break;
+            }
+        } else {
+            out[o++] = p[i];
+        }
+    }
+    out[o] = '\0';
+    return out;
+}
+
+/*
+ * Drop Exec field codes (%f %U %i ...) since a bundle is launched without
+ * arguments, and turn %% into %. Quoting is left alone: the Exec quoting
+ * rules are the sh double-quote rules the launcher script runs under.
+ */
+static void strip_field_codes(char *exec)
+{
+    char *r = exec, *w = exec;
+
+    while (*r) {
+        if (r[0] == '%' && r[1]) {
+            if (r[1] == '%')
+                *w++ = '%';
+            r += 2;
+            continue;
+        }
+        *w++ = *r++;
+    }
+
+    /* Trim what a trailing field code leaves behind */
+    while (w > exec && (w[-1] == ' ' || w[-1] == '\t'))
+        w--;
+    *w = '\0';
+}
+
+static BOOL parse_desktop_file(const char *path, DesktopEntry *entry)
+{
+    MappedFile file;
+    const char *p, *end;
+    BOOL in_group = FALSE, application = TRUE, hidden = FALSE;
+
+    if (!map_file(path, &file))
+        return FALSE;
+
+    p = (const char *)file.data;
+    end = p + file.len;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        const char *line_end = eol ? eol : end;
+        const char *eq, *key_end, *value;
+
+        if (line_end > p && line_end[-1] == '\r') line_end--;
+
+        if (p < line_end && *p == '[') {
+            in_group = (size_t)(line_end - p) == 15 && memcmp(p, "[Desktop Entry]", 15) == 0;
+        } else if (in_group && p < line_end && *p != '#' &&
+                   (eq = memchr(p, '=', (size_t)(line_end - p))) != NULL) {
+            char **field = NULL;
+            size_t key_len;
+
+            key_end = eq;
+            while (key_end > p && (key_end[-1] == ' ' || key_end[-1] == '\t')) key_end--;
+            value = eq + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+            key_len = (size_t)(key_end - p);
+
+            /* Localized keys (Name[de]) are skipped, the bundle takes the default */
+            if (key_len == 4 && memcmp(p, "Name", 4) == 0) field = &entry->name;
+            else if (key_len == 4 && memcmp(p, "Exec", 4) == 0) field = &entry->exec;
+            else if (key_len == 4 && memcmp(p, "Icon", 4) == 0) field = &entry->icon;
+            else if (key_len == 10 && memcmp(p, "Categories", 10) == 0) field = &entry->categories;
+            else if (key_len == 8 && memcmp(p, "MimeType", 8) == 0) field = &entry->mime_types;
+            else if (key_len == 4 && memcmp(p, "Type", 4) == 0)
+                application = (size_t)(line_end - value) == 11 && memcmp(value, "Application", 11) == 0;
+            else if (key_len == 6 && memcmp(p, "Hidden", 6) == 0)
+                hidden = (size_t)(line_end - value) == 4 && memcmp(value, "true", 4) == 0;
+
+            if (field && !*field)
+                *field = unescape_value(value, (size_t)(line_end - value));
+        }
+
+        p = eol ? eol + 1 : end;
+    }
+
+    unmap_file(&file);
+
+    if (entry->exec)
+        strip_field_codes(entry->exec);
+
+    return application && !hidden && entry->name && *entry->name &&
+           entry->exec && *entry->exec;
+}
+
+static BOOL has_desktop_extension(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 8 && strcmp(name + len - 8, ".desktop") == 0;
+}
+
+typedef struct {
+    DesktopEntry *items;
+    int count;
+    int capacity;
+} DesktopEntryList;
+
+static void collect_desktop_files(const char *path, DesktopEntryList *list)
+{
+    struct dirent *entry;
+    DIR *dir;
+
+    dir = opendir(path);
+    if (!dir) {
+        DEBUG_PRINT("Cannot open directory %s\n", path);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        BOOL is_dir;
+        char *child;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        if (entry->d_type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode);
+        } else {
+            is_dir = entry->d_type == DT_DIR;
+        }
+
+        if (!is_dir && !has_desktop_extension(entry->d_name))
+            continue;
+
+        child = heap_printf("%s/%s", path, entry->d_name);
+        if (!child) continue;
+
+        if (is_dir) {
+            collect_desktop_files(child, list);
+            free(child);
+            continue;
+        }
+
+        if (list->count == list->capacity) {
+            int capacity = list->capacity ? list->capacity * 2 : 32;
+            DesktopEntry *items = realloc(list->items, capacity * sizeof(DesktopEntry));
+            if (!items) {
+                free(child);
+                break;
+            }
+            list->items = items;
+            list->capacity = capacity;
+        }
+
+        memset(&list->items[list->count], 0, sizeof(DesktopEntry));
+        list->items[list->count++].path = child;
+    }
+
+    closedir(dir);
+}
+
+static int compare_entry_paths(const void *a, const void *b)
+{
+    return strcmp(((const DesktopEntry *)a)->path, ((const DesktopEntry *)b)->path);
+}
+
+static void free_desktop_entry(DesktopEntry *entry)
+{
+    free(entry->path);
+    free(entry->name);
+    free(entry->exec);
+    free(entry->icon);
+    free(entry->categories);
+    free(entry->mime_types);
+    free(entry->bundle_name);
+    free(entry->icon_path);
+    free(entry->associations);
+}
+
+/*
+ * Bundle names come from Name=, with '/' replaced and duplicates numbered
+ * so two launchers never build into the same .app. Names differing only in
+ * case are duplicates too: default macOS volumes are case-insensitive, so
+ * Foo.app and foo.app are one directory.
+ */
+static char *unique_bundle_name(const DesktopEntry *entries, int count, const char *name)
+{
+    char *base = strdup(name), *candidate, *p;
+    int n = 1, i;
+
+    if (!base) return NULL;
+    for (p = base; *p; p++) {
+        if (*p == '/') *p = '-';
+    }
+
+    candidate = strdup(base);
+    while (candidate) {
+        for (i = 0; i < count; i++) {
+            if (entries[i].bundle_name && strcasecmp(entries[i].bundle_name, candidate) == 0)
+                break;
+        }
+        if (i == count) break;
+
+        free(candidate);
+        candidate = heap_printf("%s (%d)", base, ++n);
+    }
+
+    free(base);
+    return candidate;
+}
+
+/*
+ * Import every .desktop file under desktop_dir into base->bundle_dest.
+ * base supplies signing, launcher and icon settings shared by all bundles.
+ */
+BOOL import_desktop_entries(const char *desktop_dir, const AppBundleOptions *base)
+{
+    DesktopEntryList list = {0};
+    AppBundleOptions *options = NULL;
+    ErrorCode *results = NULL;
+    AppBundleContext *ctx = NULL;
+    IconIndex index = {0};
+    BOOL indexed = FALSE;
+    int i, count = 0, failures = 0, skipped = 0;
+    struct stat st;
+
+    if (!desktop_dir || stat(desktop_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        print_error(ERR_FILE_NOT_FOUND, desktop_dir);
+        return FALSE;
+    }
+
+    collect_desktop_files(desktop_dir, &list);
+
+    /* readdir order varies; sort so duplicate names are numbered the same every run */
+    if (list.count > 1)
+        qsort(list.items, list.count, sizeof(DesktopEntry), compare_entry_paths);
+
+    /* Parse, then keep only launchable application entries */
+    for (i = 0; i < list.count; i++) {
+        DesktopEntry entry = list.items[i];
+
+        if (!parse_desktop_file(entry.path, &entry)) {
+            DEBUG_PRINT("Skipping %s\n", entry.path);
+            free_desktop_entry(&entry);
+            skipped++;
+            continue;
+        }
+
+        entry.bundle_name = unique_bundle_name(list.items, count, entry.name);
+        entry.icon_path = resolve_icon(&index, &indexed, entry.icon);
+        entry.associations = extensions_for_mime_types(entry.mime_types);
+        if (entry.icon && !entry.icon_path)
+            DEBUG_PRINT("No icon found for '%s' (%s)\n", entry.name, entry.icon);
+        list.items[count++] = entry;
+    }
+    icon_index_free(&index);
+
+    printf("Found %d launcher(s) in %s (%d skipped)\n", count, desktop_dir, skipped);
+    if (count == 0)
+        goto cleanup;
+
+    options = calloc(count, sizeof(AppBundleOptions));
+    results = calloc(count, sizeof(ErrorCode));
+    ctx = appbundle_context_create(base->jobs);
+    if (!options || !results || !ctx) {
+        failures = count;
+        goto cleanup;
+    }
+
+    for (i = 0; i < count; i++) {
+        const char *category = map_categories(list.items[i].categories);
+
+        options[i] = *base;
+        options[i].bundle_name = list.items[i].bundle_name;
+        options[i].executable_path = list.items[i].exec;
+        if (list.items[i].icon_path)
+            options[i].icon_path = list.items[i].icon_path;
+        if (category)
+            options[i].app_category = category;
+        if (list.items[i].associations)
+            options[i].associations = list.items[i].associations;
+        /* Exec= is a shell line (env VAR=... wine ...), not a file to place in the bundle */
+        if (options[i].launcher_mode == LAUNCHER_DIRECT)
+            options[i].launcher_mode = LAUNCHER_SCRIPT;
+    }
+
+    failures = build_many_finishing_icons(ctx, options, count, results);
+
+    for (i = 0; i < count; i++) {
+        if (results[i] == ERR_SUCCESS)
+            printf("  %s.app <- %s\n", list.items[i].bundle_name, list.items[i].path);
+        else
+            fprintf(stderr, "ERROR: %s: %s\n", list.items[i].path, error_code_to_string(results[i]));
+    }
+
+    printf("Imported %d of %d launcher(s) into %s\n", count - failures, count, base->bundle_dest);
+
+cleanup:
+    appbundle_context_destroy(ctx);
+    for (i = 0; i < count; i++)
+        free_desktop_entry(&list.items[i]);
+    free(list.items);
+    free(options);
+    free(results);
+
+    return failures == 0;
+}
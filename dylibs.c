@@ -0,0 +1,581 @@
+/*
+ * Dylib Bundling for AppBundleGenerator
+ * Makes a --launcher direct bundle self-contained: every non-system library
+ * the executable needs, directly or through other libraries, is copied into
+ * Contents/Frameworks and the references to it are rewritten to point
+ * there, the job dylibbundler does with otool and install_name_tool.
+ *
+ * Load commands are read natively. The closure is walked once, breadth
+ * first, over a table keyed by each library's real path, so a library
+ * reached along many paths is read and copied once. Copies are clones where
+ * the file system allows, and each binary's install names are then edited
+ * in place through a shared writable mapping; only its header pages are
+ * touched. Libraries are copied and rewritten in parallel.
+ *
+ * Rewriting invalidates the signature a binary came with, and Apple silicon
+ * will not load code without a valid one. When no identity will sign the
+ * bundle's nested code afterwards, each rewritten binary is re-signed
+ * ad-hoc as soon as it is rewritten.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+#define FRAMEWORKS_DIR      "Frameworks"
+
+typedef struct {
+    char *install_name;             /* as written in the load command */
+    int image;                      /* resolved image, -1 for system and missing weak libraries */
+} DylibRef;
+
+typedef struct {
+    char *path;                     /* real path of the original */
+    char *name;                     /* file name under Contents/Frameworks; NULL for the executable */
+    int loader;                     /* image that first needed it, -1 for the executable */
+    char **rpaths;                  /* expanded LC_RPATHs: own, then those of the first loader */
+    int rpath_count;
+    int rpath_capacity;
+    DylibRef *refs;
+    int ref_count;
+    int ref_capacity;
+    BOOL failed;
+} DylibImage;
+
+typedef struct {
+    DylibImage *images;
+    int count;
+    int capacity;
+    char *executable_dir;           /* @executable_path of the original */
+    char *frameworks_dir;
+    const char *bundle_executable;  /* Contents/MacOS copy of images[0] */
+    BOOL adhoc_sign;                /* re-sign rewritten binaries with "-" */
+} DylibClosure;
+
+/* Libraries every macOS install has; the dyld shared cache serves them */
+static BOOL is_system_library(const char *path)
+{
+    return strncmp(path, "/usr/lib/", 9) == 0 || strncmp(path, "/System/", 8) == 0;
+}
+
+static char *dir_of(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (!slash)
+        return strdup(".");
+    if (slash == path)
+        return strdup("/");
+    return strndup(path, (size_t)(slash - path));
+}
+
+static const char *base_of(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+}
+
+/* Expand the @executable_path and @loader_path prefixes dyld understands */
+static char *expand_load_path(const DylibClosure *closure, const DylibImage *loader, const char *path)
+{
+    char *dir, *ret;
+
+    if (strncmp(path, "@executable_path/", 17) == 0)
+        return heap_printf("%s/%s", closure->executable_dir, path + 17);
+    if (strncmp(path, "@loader_path/", 13) == 0) {
+        dir = dir_of(loader->path);
+        ret = dir ? heap_printf("%s/%s", dir, path + 13) : NULL;
+        free(dir);
+        return ret;
+    }
+    return strdup(path);
+}
+
+/* Real path of an install name as loader would find it, or NULL */
+static char *resolve_install_name(const DylibClosure *closure, const DylibImage *loader,
+                                  const char *install_name)
+{
+    char resolved[PATH_MAX];
+    char *candidate;
+    int i;
+
+    if (strncmp(install_name, "@rpath/", 7) != 0) {
+        candidate = expand_load_path(closure, loader, install_name);
+        if (candidate && realpath(candidate, resolved)) {
+            free(candidate);
+            return strdup(resolved);
+        }
+        free(candidate);
+        return NULL;
+    }
+
+    for (i = 0; i < loader->rpath_count; i++) {
+        candidate = heap_printf("%s/%s", loader->rpaths[i], install_name + 7);
+        if (candidate && realpath(candidate, resolved)) {
+            free(candidate);
+            return strdup(resolved);
+        }
+        free(candidate);
+    }
+    return NULL;
+}
+
+static int find_image(const DylibClosure *closure, const char *path)
+{
+    int i;
+
+    for (i = 0; i < closure->count; i++) {
+        if (strcmp(closure->images[i].path, path) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Add the image at real path, taking ownership of path; its index or -1 */
+static int add_image(DylibClosure *closure, char *path, const char *name, int loader)
+{
+    DylibImage *image;
+
+    if (closure->count == closure->capacity) {
+        int capacity = closure->capacity ? closure->capacity * 2 : 16;
+        DylibImage *images = realloc(closure->images, capacity * sizeof(DylibImage));
+
+        if (!images) {
+            free(path);
+            return -1;
+        }
+        closure->images = images;
+        closure->capacity = capacity;
+    }
+
+    image = &closure->images[closure->count];
+    memset(image, 0, sizeof(DylibImage));
+    image->path = path;
+    image->loader = loader;
+    if (name && !(image->name = strdup(name))) {
+        free(path);
+        return -1;
+    }
+    return closure->count++;
+}
+
+/* Load commands of one image, gathered before any of them is resolved */
+typedef struct {
+    const DylibClosure *closure;
+    DylibImage *image;
+    char **names;
+    BOOL *weak;
+    int count;
+    int capacity;
+    BOOL ok;
+} CommandScan;
+
+static BOOL append_string(char ***list, int *count, int *capacity, const char *s, BOOL **flags, BOOL flag)
+{
+    int i;
+
+    /* A universal binary repeats its load commands per slice */
+    for (i = 0; i < *count; i++) {
+        if (strcmp((*list)[i], s) == 0) {
+            if (flags && !flag)
+                (*flags)[i] = FALSE;
+            return TRUE;
+        }
+    }
+
+    if (*count == *capacity) {
+        int n = *capacity ? *capacity * 2 : 8;
+        char **grown = realloc(*list, n * sizeof(char *));
+
+        if (!grown)
+            return FALSE;
+        *list = grown;
+        if (flags) {
+            BOOL *grown_flags = realloc(*flags, n * sizeof(BOOL));
+
+            if (!grown_flags)
+                return FALSE;
+            *flags = grown_flags;
+        }
+        *capacity = n;
+    }
+
+    if (!((*list)[*count] = strdup(s)))
+        return FALSE;
+    if (flags)
+        (*flags)[*count] = flag;
+    (*count)++;
+    return TRUE;
+}
+
+static BOOL scan_command(void *arg, MachOPathKind kind, char *path, size_t room)
+{
+    CommandScan *scan = arg;
+    DylibImage *image = scan->image;
+    char *expanded;
+
+    (void)room;
+
+    switch (kind) {
+        case MACHO_PATH_DYLIB:
+        case MACHO_PATH_WEAK_DYLIB:
+            scan->ok = append_string(&scan->names, &scan->count, &scan->capacity, path,
+                                     &scan->weak, kind == MACHO_PATH_WEAK_DYLIB);
+            break;
+        case MACHO_PATH_RPATH:
+            /* @loader_path in an LC_RPATH is the image that declares it */
+            expanded = expand_load_path(scan->closure, image, path);
+            scan->ok = expanded && append_string(&image->rpaths, &image->rpath_count,
+                                                 &image->rpath_capacity, expanded, NULL, FALSE);
+            free(expanded);
+            break;
+        case MACHO_PATH_ID:
+            break;
+    }
+    return scan->ok;
+}
+
+static BOOL add_ref(DylibImage *image, const char *install_name, int target)
+{
+    DylibRef *ref;
+
+    if (image->ref_count == image->ref_capacity) {
+        int capacity = image->ref_capacity ? image->ref_capacity * 2 : 8;
+        DylibRef *refs = realloc(image->refs, capacity * sizeof(DylibRef));
+
+        if (!refs)
+            return FALSE;
+        image->refs = refs;
+        image->ref_capacity = capacity;
+    }
+
+    ref = &image->refs[image->ref_count];
+    if (!(ref->install_name = strdup(install_name)))
+        return FALSE;
+    ref->image = target;
+    image->ref_count++;
+    return TRUE;
+}
+
+/*
+ * Read the load commands of image index and add the libraries it needs to
+ * the closure. An image inherits the run paths of the loader that first
+ * reached it, which is how dyld searches @rpath from a dependent library.
+ */
+static BOOL scan_image(DylibClosure *closure, int index)
+{
+    int loader = closure->images[index].loader;
+    CommandScan scan = {0};
+    MappedFile file;
+    BOOL ret = TRUE;
+    int i;
+
+    if (!map_file(closure->images[index].path, &file)) {
+        fprintf(stderr, "Error: cannot read %s\n", closure->images[index].path);
+        return FALSE;
+    }
+
+    scan.closure = closure;
+    scan.image = &closure->images[index];
+    scan.ok = TRUE;
+    /* Read-only mapping: scan_command never writes through the path */
+    if (!macho_for_each_path((uint8_t *)file.data, file.len, scan_command, &scan)) {
+        if (scan.ok)
+            fprintf(stderr, "Error: %s is not a Mach-O binary\n", closure->images[index].path);
+        ret = FALSE;
+    }
+    unmap_file(&file);
+
+    for (i = 0; ret && loader >= 0 && i < closure->images[loader].rpath_count; i++) {
+        DylibImage *image = &closure->images[index];
+
+        ret = append_string(&image->rpaths, &image->rpath_count, &image->rpath_capacity,
+                            closure->images[loader].rpaths[i], NULL, FALSE);
+    }
+
+    for (i = 0; ret && i < scan.count; i++) {
+        const char *install_name = scan.names[i];
+        char *resolved;
+        int target = -1;
+
+        if (is_system_library(install_name)) {
+            ret = add_ref(&closure->images[index], install_name, -1);
+            continue;
+        }
+
+        resolved = resolve_install_name(closure, &closure->images[index], install_name);
+        if (!resolved) {
+            if (scan.weak[i]) {
+                DEBUG_PRINT("  Weak library %s not found, left as is\n", install_name);
+                ret = add_ref(&closure->images[index], install_name, -1);
+                continue;
+            }
+            fprintf(stderr, "Error: cannot find %s, needed by %s\n",
+                    install_name, closure->images[index].path);
+            ret = FALSE;
+            break;
+        }
+
+        if (is_system_library(resolved)) {
+            free(resolved);
+        } else if ((target = find_image(closure, resolved)) >= 0) {
+            free(resolved);
+        } else {
+            const char *name = base_of(install_name);
+            int j;
+
+            /*
+             * Everything lands in one directory, so file names must be
+             * unique, ignoring case as the default volume format does
+             */
+            for (j = 1; j < closure->count; j++) {
+                if (strcasecmp(closure->images[j].name, name) == 0) {
+                    fprintf(stderr, "Error: %s and %s would both be bundled as %s\n",
+                            closure->images[j].path, resolved, name);
+                    ret = FALSE;
+                }
+            }
+            if (!ret) {
+                free(resolved);
+                break;
+            }
+            target = add_image(closure, resolved, name, index);
+            ret = target >= 0;
+        }
+
+        ret = ret && add_ref(&closure->images[index], install_name, target);
+    }
+
+    for (i = 0; i < scan.count; i++)
+        free(scan.names[i]);
+    free(scan.names);
+    free(scan.weak);
+    return ret;
+}
+
+/* Rewrite one image's install names in place */
+typedef struct {
+    const DylibClosure *closure;
+    const DylibImage *image;
+    const char *target;
+    BOOL ok;
+} Rewrite;
+
+static BOOL store_install_name(Rewrite *rewrite, char *path, size_t room, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len + 1 > room) {
+        /* install_name_tool would grow the header into the padding; we only reuse the command */
+        fprintf(stderr, "Error: no room in %s to rewrite %s as %s (relink with -headerpad_max_install_names)\n",
+                rewrite->target, path, name);
+        rewrite->ok = FALSE;
+        return FALSE;
+    }
+    memcpy(path, name, len);
+    memset(path + len, 0, room - len);
+    return TRUE;
+}
+
+static BOOL rewrite_command(void *arg, MachOPathKind kind, char *path, size_t room)
+{
+    Rewrite *rewrite = arg;
+    const DylibImage *image = rewrite->image;
+    char *name = NULL;
+    BOOL ret = TRUE;
+    int i;
+
+    if (kind == MACHO_PATH_ID) {
+        /* Only read by binaries linked against the copy later; keep it if it does not fit */
+        name = heap_printf("@rpath/%s", image->name ? image->name : base_of(path));
+        if (name && strlen(name) < room)
+            ret = store_install_name(rewrite, path, room, name);
+        free(name);
+        return ret;
+    }
+    if (kind == MACHO_PATH_RPATH)
+        return TRUE;
+
+    for (i = 0; i < image->ref_count; i++) {
+        const DylibRef *ref = &image->refs[i];
+
+        /* A plugin's reference to the executable that loads it stays as it is */
+        if (ref->image <= 0 || strcmp(ref->install_name, path) != 0)
+            continue;
+
+        /* Libraries all sit in Frameworks, so their references are siblings */
+        if (image->name)
+            name = heap_printf("@loader_path/%s", rewrite->closure->images[ref->image].name);
+        else
+            name = heap_printf("@executable_path/../%s/%s", FRAMEWORKS_DIR,
+                               rewrite->closure->images[ref->image].name);
+        ret = name && store_install_name(rewrite, path, room, name);
+        free(name);
+        break;
+    }
+    return ret;
+}
+
+static BOOL rewrite_install_names(const DylibClosure *closure, const DylibImage *image, const char *target)
+{
+    Rewrite rewrite;
+    struct stat st;
+    void *data;
+    BOOL ret;
+    int fd;
+
+    fd = open(target, O_RDWR | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Error: cannot open %s for rewriting\n", target);
+        if (fd >= 0) close(fd);
+        return FALSE;
+    }
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot map %s for rewriting\n", target);
+        return FALSE;
+    }
+
+    rewrite.closure = closure;
+    rewrite.image = image;
+    rewrite.target = target;
+    rewrite.ok = TRUE;
+    ret = macho_for_each_path(data, (size_t)st.st_size, rewrite_command, &rewrite) && rewrite.ok;
+
+    munmap(data, (size_t)st.st_size);
+    return ret;
+}
+
+/* Replace the signature rewriting broke, as codesign --force -s - */
+static BOOL adhoc_resign(const char *target)
+{
+    CodeSignOptions options = {0};
+    const char *argv[CODESIGN_MAX_ARGS];
+
+    options.identity = "-";
+    options.force = TRUE;
+    codesign_arguments(argv, target, &options);
+    if (run_command(argv, RUN_STDERR_STDOUT) != 0) {
+        fprintf(stderr, "Error: could not ad-hoc sign %s\n", target);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL rewrite_and_sign(const DylibClosure *closure, const DylibImage *image, const char *target)
+{
+    return rewrite_install_names(closure, image, target) &&
+           (!closure->adhoc_sign || adhoc_resign(target));
+}
+
+/* Copy one library into Frameworks (the executable is already in place) and rewrite it */
+static void install_image(void *arg, int index)
+{
+    DylibClosure *closure = arg;
+    DylibImage *image = &closure->images[index];
+    char *target;
+
+    if (index == 0) {
+        image->failed = !rewrite_and_sign(closure, image, closure->bundle_executable);
+        return;
+    }
+
+    target = heap_printf("%s/%s", closure->frameworks_dir, image->name);
+    if (!target || !copy_file(image->path, target) || chmod(target, 0755) != 0) {
+        fprintf(stderr, "Error: cannot copy %s into the bundle\n", image->path);
+        image->failed = TRUE;
+    } else {
+        DEBUG_PRINT("  Bundled %s\n", image->name);
+        image->failed = !rewrite_and_sign(closure, image, target);
+    }
+    free(target);
+}
+
+static void free_closure(DylibClosure *closure)
+{
+    int i, j;
+
+    for (i = 0; i < closure->count; i++) {
+        DylibImage *image = &closure->images[i];
+
+        for (j = 0; j < image->rpath_count; j++)
+            free(image->rpaths[j]);
+        for (j = 0; j < image->ref_count; j++)
+            free(image->refs[j].install_name);
+        free(image->rpaths);
+        free(image->refs);
+        free(image->path);
+        free(image->name);
+    }
+    free(closure->images);
+    free(closure->executable_dir);
+    free(closure->frameworks_dir);
+}
+
+/*
+ * Bundle the non-system libraries executable_path needs into
+ * <contents>/Frameworks and point bundle_executable, its copy in the
+ * bundle, and the copied libraries at them. Libraries are copied on the
+ * calling thread plus whatever threads can be borrowed from the budget
+ * (without one, up to the online CPUs). With adhoc_sign, for bundles that
+ * will not be signed, every rewritten binary is re-signed ad-hoc.
+ */
+BOOL bundle_dylibs(const char *path_to_bundle_contents, const char *executable_path,
+                   const char *bundle_executable, ThreadBudget *threads, BOOL adhoc_sign)
+{
+    DylibClosure closure = {0};
+    char resolved[PATH_MAX];
+    char *path;
+    BOOL ret = TRUE;
+    int i, jobs = 0, borrowed = 0;
+
+    if (!realpath(executable_path, resolved) || !(path = strdup(resolved)))
+        return FALSE;
+
+    /* dyld sets @executable_path from the path it was started with */
+    closure.executable_dir = dir_of(executable_path);
+    closure.frameworks_dir = heap_printf("%s/%s", path_to_bundle_contents, FRAMEWORKS_DIR);
+    closure.bundle_executable = bundle_executable;
+    closure.adhoc_sign = adhoc_sign;
+    if (!closure.executable_dir || !closure.frameworks_dir || add_image(&closure, path, NULL, -1) < 0) {
+        free_closure(&closure);
+        return FALSE;
+    }
+
+    /* Breadth first: images appended while scanning are scanned in turn */
+    for (i = 0; ret && i < closure.count; i++)
+        ret = scan_image(&closure, i);
+
+    if (ret && closure.count == 1)
+        DEBUG_PRINT("No libraries to bundle for %s\n", executable_path);
+
+    if (ret && closure.count > 1) {
+        DEBUG_PRINT("Bundling %d librar%s into %s\n", closure.count - 1,
+                    closure.count == 2 ? "y" : "ies", closure.frameworks_dir);
+        ret = create_directories(closure.frameworks_dir);
+        if (ret && threads) {
+            borrowed = thread_budget_take(threads, closure.count - 1);
+            jobs = borrowed + 1;
+        }
+        if (ret)
+            parallel_for(closure.count, jobs, install_image, &closure);
+        if (borrowed)
+            thread_budget_return(threads, borrowed);
+        for (i = 0; i < closure.count; i++)
+            ret = ret && !closure.images[i].failed;
+    }
+
+    free_closure(&closure);
+    return ret;
+}
@@ -0,0 +1,467 @@
+/*
+ * Native ICNS Writer for AppBundleGenerator
+ * Renders every iconset size in-process, from one source image or from
+ * the images of a Windows icon, and writes the .icns container directly,
+ * without sips or iconutil.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared.h"
+
+/*
+ * Iconset members and the ICNS chunk each one is stored in. Sizes that
+ * appear twice (32, 256, 512) are rendered and encoded once.
+ */
+const IconSlot icon_slots[ICON_SLOT_COUNT] = {
+    {16,   "icon_16x16.png",      "icp4"},
+    {32,   "icon_16x16@2x.png",   "ic11"},
+    {32,   "icon_32x32.png",      "icp5"},
+    {64,   "icon_32x32@2x.png",   "ic12"},
+    {128,  "icon_128x128.png",    "ic07"},
+    {256,  "icon_128x128@2x.png", "ic13"},
+    {256,  "icon_256x256.png",    "ic08"},
+    {512,  "icon_256x256@2x.png", "ic14"},
+    {512,  "icon_512x512.png",    "ic09"},
+    {1024, "icon_512x512@2x.png", "ic10"}
+};
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* Write an ICNS container holding the given chunks, in order */
+BOOL icns_write_file(const char *path, const IcnsChunk *chunks, int count)
+{
+    uint8_t header[8];
+    uint64_t total = 8;
+    FILE *file;
+    BOOL ret = TRUE;
+    int i;
+
+    for (i = 0; i < count; i++)
+        total += 8 + chunks[i].len;
+    if (total > UINT32_MAX) return FALSE;
+
+    file = fopen(path, "wb");
+    if (!file) {
+        DEBUG_PRINT("Failed to open ICNS output %s\n", path);
+        return FALSE;
+    }
+
+    memcpy(header, "icns", 4);
+    put_be32(header + 4, (uint32_t)total);
+    if (fwrite(header, 1, 8, file) != 8) ret = FALSE;
+
+    for (i = 0; ret && i < count; i++) {
+        memcpy(header, chunks[i].type, 4);
+        put_be32(header + 4, (uint32_t)(8 + chunks[i].len));
+        if (fwrite(header, 1, 8, file) != 8 ||
+            fwrite(chunks[i].data, 1, chunks[i].len, file) != chunks[i].len)
+            ret = FALSE;
+    }
+
+    if (fclose(file) != 0) ret = FALSE;
+    if (!ret) {
+        DEBUG_PRINT("Failed to write ICNS file %s\n", path);
+        unlink(path);
+    }
+    return ret;
+}
+
+/*
+ * Pre-PNG chunk encodings Apple still reads for the 1x small sizes. Each
+ * is an RLE-packed RGB chunk plus an 8-bit mask chunk, or for 16 and 32
+ * a single RLE-packed ARGB chunk.
+ */
+typedef struct {
+    const char *png_type;
+    const char *rgb_type;
+    const char *mask_type;
+    const char *argb_type;          /* NULL when the size has no ARGB form */
+    BOOL rgb_prefix;                /* it32 data starts with four zero bytes */
+} LegacyEncoding;
+
+static const LegacyEncoding legacy_encodings[] = {
+    {"icp4", "is32", "s8mk", "ic04", FALSE},
+    {"icp5", "il32", "l8mk", "ic05", FALSE},
+    {"ic07", "it32", "t8mk", NULL,   TRUE}
+};
+
+static const LegacyEncoding *find_legacy_encoding(const char *png_type)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(legacy_encodings) / sizeof(legacy_encodings[0]); i++) {
+        if (strcmp(legacy_encodings[i].png_type, png_type) == 0)
+            return &legacy_encodings[i];
+    }
+    return NULL;
+}
+
+/*
+ * ICNS flavor of PackBits over one channel (stride bytes apart):
+ * 0x00-0x7F copy the next n+1 bytes, 0x80-0xFF repeat the next byte n-125 times.
+ * out must hold at least count + count / 128 + 1 bytes.
+ */
+static size_t icns_rle_channel(const uint8_t *src, size_t count, size_t stride, uint8_t *out)
+{
+    size_t i = 0, o = 0;
+
+    while (i < count) {
+        size_t run = 1;
+
+        while (i + run < count && run < 130 && src[(i + run) * stride] == src[i * stride])
+            run++;
+
+        if (run >= 3) {
+            out[o++] = (uint8_t)(run + 125);
+            out[o++] = src[i * stride];
+            i += run;
+        } else {
+            /* Literal until the next run of three or 128 bytes */
+            size_t start = i, lit = 0;
+
+            while (i < count && lit < 128) {
+                if (i + 2 < count && src[i * stride] == src[(i + 1) * stride] &&
+                    src[i * stride] == src[(i + 2) * stride])
+                    break;
+                i++;
+                lit++;
+            }
+            out[o++] = (uint8_t)(lit - 1);
+            while (start < i)
+                out[o++] = src[start++ * stride];
+        }
+    }
+
+    return o;
+}
+
+/* RLE-packed planar channels; channels lists RGBA byte offsets in output order */
+static uint8_t *icns_pack_channels(const RgbaImage *image, const int *channels, int nchannels,
+                                   const char *magic, size_t *len)
+{
+    size_t npix = (size_t)image->width * image->height;
+    size_t prefix = magic ? 4 : 0;
+    uint8_t *out = malloc(prefix + nchannels * (npix + npix / 128 + 1));
+    size_t o = prefix;
+    int c;
+
+    if (!out) return NULL;
+    if (magic) memcpy(out, magic, 4);
+
+    for (c = 0; c < nchannels; c++)
+        o += icns_rle_channel(image->pixels + channels[c], npix, 4, out + o);
+
+    *len = o;
+    return out;
+}
+
+/*
+ * Slot output for one icon size: either the PNG or the smallest legacy
+ * encoding. Owned buffers are freed by the caller.
+ */
+typedef struct {
+    IcnsChunk chunks[2];
+    int count;
+    uint8_t *owned[2];
+} SlotOutput;
+
+static void choose_slot_encoding(const RgbaImage *image, const LegacyEncoding *legacy,
+                                 const uint8_t *png, size_t png_len, SlotOutput *out)
+{
+    static const int rgb_channels[] = {0, 1, 2};
+    static const int argb_channels[] = {3, 0, 1, 2};
+    size_t npix = (size_t)image->width * image->height;
+    size_t best = png_len + 8, rgb_len = 0, argb_len = 0, i;
+    uint8_t *rgb = NULL, *mask = NULL, *argb = NULL;
+
+    memset(out, 0, sizeof(SlotOutput));
+    out->chunks[0].type = legacy->png_type;
+    out->chunks[0].data = png;
+    out->chunks[0].len = png_len;
+    out->count = 1;
+
+    /* RGB + mask pair */
+    rgb = icns_pack_channels(image, rgb_channels, 3, NULL, &rgb_len);
+    mask = malloc(npix);
+    if (rgb && mask) {
+        if (legacy->rgb_prefix) {
+            /* it32 carries four zero bytes ahead of the packed channels */
+            uint8_t *prefixed = malloc(rgb_len + 4);
+            if (prefixed) {
+                memset(prefixed, 0, 4);
+                memcpy(prefixed + 4, rgb, rgb_len);
+                rgb_len += 4;
+            }
+            free(rgb);
+            rgb = prefixed;
+        }
+        for (i = 0; i < npix; i++)
+            mask[i] = image->pixels[i * 4 + 3];
+    }
+
+    if (rgb && mask && rgb_len + 8 + npix + 8 < best) {
+        best = rgb_len + 8 + npix + 8;
+        out->chunks[0].type = legacy->rgb_type;
+        out->chunks[0].data = rgb;
+        out->chunks[0].len = rgb_len;
+        out->chunks[1].type = legacy->mask_type;
+        out->chunks[1].data = mask;
+        out->chunks[1].len = npix;
+        out->count = 2;
+        out->owned[0] = rgb;
+        out->owned[1] = mask;
+        rgb = mask = NULL;
+    }
+
+    /* Single ARGB chunk */
+    if (legacy->argb_type) {
+        argb = icns_pack_channels(image, argb_channels, 4, "ARGB", &argb_len);
+        if (argb && argb_len + 8 < best) {
+            free(out->owned[0]);
+            free(out->owned[1]);
+            memset(out, 0, sizeof(SlotOutput));
+            out->chunks[0].type = legacy->argb_type;
+            out->chunks[0].data = argb;
+            out->chunks[0].len = argb_len;
+            out->count = 1;
+            out->owned[0] = argb;
+            argb = NULL;
+        }
+    }
+
+    DEBUG_PRINT("%ux%u: using %s (PNG %zu bytes)\n", image->width, image->height,
+                out->chunks[0].type, png_len);
+
+    free(rgb);
+    free(mask);
+    free(argb);
+}
+
+/* TRUE if any slot of this size is stored in a legacy encoding, which needs pixels */
+static BOOL size_needs_pixels(uint32_t size, BOOL legacy)
+{
+    int i;
+
+    if (!legacy) return FALSE;
+    for (i = 0; i < ICON_SLOT_COUNT; i++) {
+        if (icon_slots[i].size == size && find_legacy_encoding(icon_slots[i].icns_type))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* An exact-size PNG supplied under this slot's .iconset file name */
+static const IconEntry *find_slot_entry(const IconEntry *entries, int count, const IconSlot *slot)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const IconEntry *e = &entries[i];
+
+        if (e->slot_name && e->is_png && e->width == slot->size && e->height == slot->size &&
+            strcmp(e->slot_name, slot->iconset_name) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * Render all iconset sizes from a set of source images (one for a PNG or
+ * SVG, several for a Windows icon or an iconset) and write them to
+ * output_icns.
+ *
+ * A PNG supplied under a slot's iconset name fills that slot. Otherwise
+ * each distinct size is taken from the best-matching source: an exact-size
+ * PNG is copied into the chunk verbatim, anything else is decoded once and
+ * resampled straight to the target, never from the previous size, so small
+ * icons do not accumulate blur.
+ */
+BOOL icns_render_from_entries(const IconEntry *entries, int count, const char *output_icns,
+                              const IconRenderOptions *opts)
+{
+    IcnsChunk chunks[ICON_SLOT_COUNT * 2];
+    RgbaImage scaled[ICON_SLOT_COUNT];
+    RgbaImage *decoded = NULL;
+    uint8_t *encoded[ICON_SLOT_COUNT] = {0};
+    const uint8_t *slot_png[ICON_SLOT_COUNT] = {0};
+    const IconEntry *slot_src[ICON_SLOT_COUNT] = {0};
+    size_t encoded_len[ICON_SLOT_COUNT] = {0};
+    SlotOutput legacy_out[ICON_SLOT_COUNT];
+    IconCompression preset = opts ? opts->compression : ICON_COMPRESS_BALANCED;
+    BOOL legacy = opts && opts->legacy_chunks;
+    int nchunks = 0;
+    BOOL ret = FALSE;
+    int i, j, k;
+
+    memset(scaled, 0, sizeof(scaled));
+    memset(legacy_out, 0, sizeof(legacy_out));
+
+    if (count <= 0) return FALSE;
+    decoded = calloc(count, sizeof(RgbaImage));
+    if (!decoded) return FALSE;
+
+    for (i = 0; i < ICON_SLOT_COUNT; i++) {
+        uint32_t size = icon_slots[i].size;
+        const LegacyEncoding *alt = legacy ? find_legacy_encoding(icon_slots[i].icns_type) : NULL;
+        const IconEntry *src = find_slot_entry(entries, count, &icon_slots[i]);
+
+        if (!src)
+            src = icon_entry_pick(entries, count, size);
+        if (!src) {
+            DEBUG_PRINT("No decodable source image for %ux%u\n", size, size);
+            goto cleanup;
+        }
+        slot_src[i] = src;
+
+        /* Reuse the pixels and bytes of an earlier slot rendered from the same image */
+        for (j = 0; j < i; j++) {
+            if (icon_slots[j].size == size && slot_src[j] == src) break;
+        }
+
+        if (j == i) {
+            int e = (int)(src - entries);
+
+            /* Exact-size PNG: the stored stream is already what ICNS wants */
+            if (src->is_png && src->width == size && src->height == size) {
+                slot_png[i] = src->data;
+                if (opts && opts->reproducible &&
+                    png_strip_metadata(src->data, src->len, &encoded[i], &encoded_len[i]))
+                    slot_png[i] = encoded[i];
+                else
+                    encoded_len[i] = src->len;
+                DEBUG_PRINT("Passing %ux%u PNG through (%zu bytes)\n", size, size, encoded_len[i]);
+            }
+
+            if (!slot_png[i] || size_needs_pixels(size, legacy)) {
+                if (!src->image && !decoded[e].pixels && !icon_entry_decode(src, &decoded[e])) {
+                    DEBUG_PRINT("Failed to decode %ux%u source image\n", src->width, src->height);
+                    goto cleanup;
+                }
+
+                if (!rgba_image_resize(src->image ? src->image : &decoded[e], &scaled[i],
+                                       size, size)) {
+                    DEBUG_PRINT("Failed to resample icon to %ux%u\n", size, size);
+                    goto cleanup;
+                }
+            }
+
+            if (!slot_png[i]) {
+                if (!png_encode(&scaled[i], preset, opts ? opts->threads : NULL, &encoded[i],
+                                &encoded_len[i])) {
+                    DEBUG_PRINT("Failed to encode %ux%u icon\n", size, size);
+                    goto cleanup;
+                }
+                slot_png[i] = encoded[i];
+
+                DEBUG_PRINT("Encoded %s (%ux%u): %zu bytes\n", icon_slots[i].iconset_name,
+                            size, size, encoded_len[i]);
+            }
+        }
+
+        if (alt) {
+            choose_slot_encoding(&scaled[j], alt, slot_png[j], encoded_len[j], &legacy_out[i]);
+            for (k = 0; k < legacy_out[i].count; k++)
+                chunks[nchunks++] = legacy_out[i].chunks[k];
+        } else {
+            chunks[nchunks].type = icon_slots[i].icns_type;
+            chunks[nchunks].data = slot_png[j];
+            chunks[nchunks].len = encoded_len[j];
+            nchunks++;
+        }
+    }
+
+    ret = icns_write_file(output_icns, chunks, nchunks);
+
+cleanup:
+    for (i = 0; i < ICON_SLOT_COUNT; i++) {
+        free(encoded[i]);
+        free(legacy_out[i].owned[0]);
+        free(legacy_out[i].owned[1]);
+        rgba_image_free(&scaled[i]);
+    }
+    for (i = 0; i < count; i++)
+        rgba_image_free(&decoded[i]);
+    free(decoded);
+    return ret;
+}
+
+/* Render all iconset sizes from one decoded source image */
+BOOL icns_render_from_image(const RgbaImage *source, const char *output_icns,
+                            const IconRenderOptions *opts)
+{
+    IconEntry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.width = source->width;
+    entry.height = source->height;
+    entry.bit_count = 32;
+    entry.image = source;
+    return icns_render_from_entries(&entry, 1, output_icns, opts);
+}
+
+/*
+ * Decode a PNG and render the ICNS natively; FALSE lets callers fall back to sips.
+ *
+ * A source whose full decode would exceed the memory limit is streamed
+ * through the resampler to the largest slot size instead, so an 8K or 16K
+ * image costs about as much as a 1024px one. That includes long, thin
+ * sources with one side under the slot size: 1024x100000 is 400 MB
+ * decoded. Only sources that fit in the largest slot both ways are always
+ * decoded whole, since streaming would hold as much.
+ */
+BOOL icns_render_from_png(const char *png_path, const char *output_icns,
+                          const IconRenderOptions *opts)
+{
+    size_t limit = opts && opts->memory_limit ? opts->memory_limit : ICON_MEMORY_LIMIT_DEFAULT;
+    uint32_t max_size = icon_slots[ICON_SLOT_COUNT - 1].size;
+    MappedFile file;
+    PngHeader header;
+    RgbaImage source;
+    BOOL ret;
+
+    if (!map_file(png_path, &file))
+        return FALSE;
+
+    if (!png_read_header(file.data, file.len, &header)) {
+        DEBUG_PRINT("Native PNG decode failed for %s\n", png_path);
+        unmap_file(&file);
+        return FALSE;
+    }
+
+    if (header.width != header.height)
+        DEBUG_PRINT("Warning: icon source is not square (%ux%u), it will be stretched\n",
+                    header.width, header.height);
+
+    if ((size_t)header.width * header.height * 4 <= limit ||
+        (header.width <= max_size && header.height <= max_size)) {
+        ret = png_decode(file.data, file.len, &source);
+    } else if (png_decode_scaled_footprint(&header, max_size, max_size) > limit) {
+        fprintf(stderr, "Warning: %s (%ux%u) cannot be decoded within the %zu MB icon memory limit\n",
+                png_path, header.width, header.height, limit >> 20);
+        ret = FALSE;
+    } else {
+        DEBUG_PRINT("Streaming %ux%u source down to %ux%u\n", header.width, header.height,
+                    max_size, max_size);
+        ret = png_decode_scaled(file.data, file.len, max_size, max_size, &source);
+    }
+    unmap_file(&file);
+
+    if (!ret) {
+        DEBUG_PRINT("Native PNG decode failed for %s\n", png_path);
+        return FALSE;
+    }
+
+    ret = icns_render_from_image(&source, output_icns, opts);
+    rgba_image_free(&source);
+    return ret;
+}
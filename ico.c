@@ -0,0 +1,276 @@
+/*
+ * Windows Icon Images for AppBundleGenerator
+ * Describes the individual images of a Windows icon (PNG streams or DIBs,
+ * from .ico files or PE RT_ICON resources) and decodes them to RGBA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+static const uint8_t png_magic[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Fill in an entry from one icon image. Dimensions come from the image
+ * itself (PNG IHDR or BITMAPINFOHEADER), not the directory entry, which
+ * uses 0 for 256 and is often wrong in the wild.
+ */
+BOOL icon_entry_init(IconEntry *entry, const uint8_t *data, size_t len)
+{
+    memset(entry, 0, sizeof(IconEntry));
+    entry->data = data;
+    entry->len = len;
+
+    if (len >= 8 && memcmp(data, png_magic, 8) == 0) {
+        PngHeader header;
+
+        if (!png_read_header(data, len, &header))
+            return FALSE;
+        entry->is_png = TRUE;
+        entry->width = header.width;
+        entry->height = header.height;
+        entry->bit_count = 32;
+        return TRUE;
+    }
+
+    /* BITMAPINFOHEADER or a later version; height covers XOR + AND masks */
+    if (len < 40 || get_le32(data) < 40 || get_le32(data) > len)
+        return FALSE;
+
+    entry->width = get_le32(data + 4);
+    entry->height = (uint32_t)((int32_t)get_le32(data + 8) / 2);
+    entry->bit_count = get_le16(data + 14);
+
+    return entry->width > 0 && entry->width <= 1024 &&
+           entry->height > 0 && entry->height <= 1024;
+}
+
+static BOOL dib_depth_supported(uint16_t bit_count)
+{
+    return bit_count == 1 || bit_count == 4 || bit_count == 8 ||
+           bit_count == 24 || bit_count == 32;
+}
+
+BOOL icon_entry_decodable(const IconEntry *entry)
+{
+    if (entry->image || entry->is_png)
+        return TRUE;
+    return dib_depth_supported(entry->bit_count);
+}
+
+/*
+ * Uncompressed BI_RGB DIB, bottom-up, followed by a 1-bit AND mask.
+ * 1/4/8 bpp index a BGRX palette that follows the header; 24 and 32 bpp
+ * are BGR(A). Only 32 bpp carries alpha, and only if some pixel uses it;
+ * everything else takes transparency from the AND mask.
+ */
+static BOOL decode_dib(const IconEntry *entry, RgbaImage *image)
+{
+    const uint8_t *data = entry->data;
+    uint32_t header_size = get_le32(data);
+    uint32_t width = entry->width, height = entry->height;
+    uint16_t bpp = entry->bit_count;
+    uint32_t colors = 0;
+    const uint8_t *palette, *xor_bits, *and_bits;
+    size_t xor_stride = (((size_t)width * bpp + 31) / 32) * 4;
+    size_t and_stride = ((width + 31) / 32) * 4;
+    size_t offset;
+    BOOL have_mask, any_alpha = FALSE;
+    uint32_t x, y;
+
+    if (!dib_depth_supported(bpp) || get_le32(data + 16) != 0 /* BI_RGB */)
+        return FALSE;
+
+    if (bpp <= 8) {
+        colors = get_le32(data + 32);
+        if (colors == 0 || colors > (1u << bpp))
+            colors = 1u << bpp;
+    }
+
+    offset = (size_t)header_size + (size_t)colors * 4;
+    if (offset + xor_stride * height > entry->len)
+        return FALSE;
+    palette = data + header_size;
+    xor_bits = data + offset;
+    and_bits = xor_bits + xor_stride * height;
+    have_mask = offset + (xor_stride + and_stride) * height <= entry->len;
+
+    if (!rgba_image_alloc(image, width, height))
+        return FALSE;
+
+    for (y = 0; y < height; y++) {
+        const uint8_t *src = xor_bits + (size_t)(height - 1 - y) * xor_stride;
+        uint8_t *dst = image->pixels + (size_t)y * width * 4;
+
+        for (x = 0; x < width; x++, dst += 4) {
+            const uint8_t *bgr;
+            uint32_t index;
+
+            switch (bpp) {
+            case 32:
+                bgr = src + x * 4;
+                dst[3] = bgr[3];
+                any_alpha |= bgr[3] != 0;
+                break;
+            case 24:
+                bgr = src + x * 3;
+                break;
+            default:
+                /* Pixels are packed most significant bits first */
+                index = (src[(x * bpp) >> 3] >> (8 - bpp - ((x * bpp) & 7))) & ((1u << bpp) - 1);
+                bgr = palette + (index < colors ? index : 0) * 4;
+                break;
+            }
+            dst[0] = bgr[2];
+            dst[1] = bgr[1];
+            dst[2] = bgr[0];
+        }
+    }
+
+    /* Pre-XP 32-bit icons leave alpha zero and rely on the AND mask too */
+    if (!any_alpha) {
+        for (y = 0; y < height; y++) {
+            const uint8_t *mask = and_bits + (size_t)(height - 1 - y) * and_stride;
+            uint8_t *dst = image->pixels + (size_t)y * width * 4;
+
+            for (x = 0; x < width; x++) {
+                BOOL transparent = have_mask && (mask[x >> 3] & (0x80 >> (x & 7)));
+                dst[x * 4 + 3] = transparent ? 0 : 255;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+BOOL icon_entry_decode(const IconEntry *entry, RgbaImage *image)
+{
+    if (entry->image) {
+        if (!rgba_image_alloc(image, entry->image->width, entry->image->height))
+            return FALSE;
+        memcpy(image->pixels, entry->image->pixels,
+               (size_t)image->width * image->height * 4);
+        return TRUE;
+    }
+
+    if (entry->is_png)
+        return png_decode(entry->data, entry->len, image);
+
+    return decode_dib(entry, image);
+}
+
+/*
+ * Choose the entry to render a size x size icon from: an exact size if
+ * there is one (deepest color first, PNG on ties since it can be copied
+ * as-is), otherwise the smallest larger entry, otherwise the largest.
+ */
+const IconEntry *icon_entry_pick(const IconEntry *entries, int count, uint32_t size)
+{
+    const IconEntry *best = NULL;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const IconEntry *e = &entries[i];
+        uint32_t e_size = e->width > e->height ? e->width : e->height;
+        uint32_t b_size;
+
+        if (!icon_entry_decodable(e))
+            continue;
+        if (!best) {
+            best = e;
+            continue;
+        }
+
+        b_size = best->width > best->height ? best->width : best->height;
+
+        if (e_size == b_size) {
+            if (e->bit_count > best->bit_count || (e->bit_count == best->bit_count && e->is_png))
+                best = e;
+        } else if (b_size == size) {
+            continue;
+        } else if (e_size == size) {
+            best = e;
+        } else if (e_size > size) {
+            if (b_size < size || e_size < b_size)
+                best = e;
+        } else if (b_size < size && e_size > b_size) {
+            best = e;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * Convert a .ico file. ICONDIR is a 6-byte header followed by 16-byte
+ * ICONDIRENTRYs, each pointing at a PNG stream or DIB elsewhere in the file.
+ */
+BOOL convert_ico_to_icns(const char *ico_path, const char *output_icns, const IconRenderOptions *opts)
+{
+    MappedFile file;
+    IconEntry *entries;
+    uint16_t count, i;
+    int n = 0;
+    BOOL ret = FALSE;
+
+    if (!map_file(ico_path, &file)) {
+        DEBUG_PRINT("Cannot map %s\n", ico_path);
+        return FALSE;
+    }
+
+    if (file.len < 6 || get_le16(file.data) != 0 || get_le16(file.data + 2) != 1) {
+        DEBUG_PRINT("%s is not an ICO file\n", ico_path);
+        unmap_file(&file);
+        return FALSE;
+    }
+
+    count = get_le16(file.data + 4);
+    if (count == 0 || 6 + (size_t)count * 16 > file.len) {
+        DEBUG_PRINT("Truncated ICO directory in %s\n", ico_path);
+        unmap_file(&file);
+        return FALSE;
+    }
+
+    entries = calloc(count, sizeof(IconEntry));
+    if (!entries) {
+        unmap_file(&file);
+        return FALSE;
+    }
+
+    for (i = 0; i < count; i++) {
+        const uint8_t *dir_entry = file.data + 6 + (size_t)i * 16;
+        uint32_t size = get_le32(dir_entry + 8);
+        uint32_t offset = get_le32(dir_entry + 12);
+
+        if (offset > file.len || size > file.len - offset) {
+            DEBUG_PRINT("ICO image %u lies outside the file\n", i);
+            continue;
+        }
+        if (icon_entry_init(&entries[n], file.data + offset, size)) {
+            DEBUG_PRINT("ICO image %u: %ux%u, %u bpp%s\n", i, entries[n].width,
+                        entries[n].height, entries[n].bit_count, entries[n].is_png ? " (PNG)" : "");
+            n++;
+        }
+    }
+
+    if (n > 0)
+        ret = icns_render_from_entries(entries, n, output_icns, opts);
+    else
+        DEBUG_PRINT("No usable images in %s\n", ico_path);
+
+    free(entries);
+    unmap_file(&file);
+    return ret;
+}
@@ -1,6 +1,6 @@
 /*
  * Icon Utilities for AppBundleGenerator
- * Handles PNG, SVG, and ICNS format conversion for macOS app bundles
+ * Handles PNG, SVG, ICNS, ICO, iconset and Windows executable icon conversion for macOS app bundles
  */
 
 #include <stdio.h>
@@ -8,21 +8,30 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
-#include "shared.h"
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
 
-/* External heap_printf function from main.c */
-extern char* heap_printf(const char *format, ...);
-extern BOOL create_directories(char *directory);
+#include "shared.h"
 
 /* Detect icon format based on file extension */
 IconFormat detect_icon_format(const char *path)
 {
     const char *ext;
 
+    struct stat st;
+
     if (!path) return ICON_FORMAT_UNKNOWN;
 
+    /* A directory (normally NAME.iconset) or a comma-separated list of PNGs */
+    if (stat(path, &st) == 0 ? S_ISDIR(st.st_mode) : strchr(path, ',') != NULL)
+        return ICON_FORMAT_ICONSET;
+
     /* Find the extension */
     ext = strrchr(path, '.');
     if (!ext) return ICON_FORMAT_UNKNOWN;
@@ -31,20 +40,39 @@ IconFormat detect_icon_format(const char *path)
     if (strcasecmp(ext, ".png") == 0) return ICON_FORMAT_PNG;
     if (strcasecmp(ext, ".svg") == 0) return ICON_FORMAT_SVG;
     if (strcasecmp(ext, ".icns") == 0) return ICON_FORMAT_ICNS;
+    if (strcasecmp(ext, ".exe") == 0 || strcasecmp(ext, ".dll") == 0) return ICON_FORMAT_PE;
+    if (strcasecmp(ext, ".ico") == 0) return ICON_FORMAT_ICO;
 
     return ICON_FORMAT_UNKNOWN;
 }
 
-/* Simple file copy utility */
+/*
+ * Copy src over dst: an APFS clone when possible (no data is copied),
+ * else the mapped source in one write, else a read/write loop.
+ */
 BOOL copy_file(const char *src, const char *dst)
 {
     FILE *source, *dest;
+    MappedFile map;
     char buffer[8192];
     size_t bytes;
     BOOL ret = TRUE;
 
     if (!src || !dst) return FALSE;
 
+#ifdef __APPLE__
+    /* clonefile() refuses to replace an existing file */
+    unlink(dst);
+    if (clonefile(src, dst, CLONE_NOOWNERCOPY) == 0)
+        return TRUE;
+#endif
+
+    if (map_file(src, &map)) {
+        ret = write_file(dst, map.data, map.len, FALSE);
+        unmap_file(&map);
+        return ret;
+    }
+
     source = fopen(src, "rb");
     if (!source) {
         DEBUG_PRINT("Failed to open source file: %s\n", src);
@@ -77,6 +105,42 @@ BOOL copy_file(const char *src, const char *dst)
     return ret;
 }
 
+/* Map a whole file read-only; empty files are rejected */
+BOOL map_file(const char *path, MappedFile *file)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    file->data = NULL;
+    file->len = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return FALSE;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return FALSE;
+    }
+
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return FALSE;
+
+    file->data = map;
+    file->len = (size_t)st.st_size;
+    return TRUE;
+}
+
+void unmap_file(MappedFile *file)
+{
+    if (file && file->data) {
+        munmap((void *)file->data, file->len);
+        file->data = NULL;
+        file->len = 0;
+    }
+}
+
 /* Generate all required icon sizes from a high-resolution PNG */
 BOOL generate_iconset_from_png(const char *source_png, const char *iconset_dir)
 {
@@ -98,7 +162,7 @@ BOOL generate_iconset_from_png(const char *source_png, const char *iconset_dir)
         {0, NULL}
     };
 
-    char cmd[2048];
+    char size_arg[16];
     char *output;
     int i;
     int result;
@@ -107,17 +171,24 @@ BOOL generate_iconset_from_png(const char *source_png, const char *iconset_dir)
 
     /* Generate each required icon size using sips */
     for (i = 0; icons[i].name != NULL; i++) {
+        const char *argv[8];
+
         output = heap_printf("%s/%s", iconset_dir, icons[i].name);
+        snprintf(size_arg, sizeof(size_arg), "%d", icons[i].size);
 
         /* Use sips to resize the image */
-        snprintf(cmd, sizeof(cmd),
-            "sips -z %d %d '%s' --out '%s' 2>/dev/null",
-            icons[i].size, icons[i].size, source_png, output
-        );
+        argv[0] = "sips";
+        argv[1] = "-z";
+        argv[2] = size_arg;
+        argv[3] = size_arg;
+        argv[4] = source_png;
+        argv[5] = "--out";
+        argv[6] = output;
+        argv[7] = NULL;
 
         DEBUG_PRINT("Creating icon: %s (%dx%d)\n", icons[i].name, icons[i].size, icons[i].size);
 
-        result = system(cmd);
+        result = run_command(argv, RUN_STDERR_NULL);
         if (result != 0) {
             DEBUG_PRINT("sips failed for size %d (exit code: %d)\n", icons[i].size, result);
             free(output);
@@ -132,18 +203,38 @@ BOOL generate_iconset_from_png(const char *source_png, const char *iconset_dir)
 }
 
 /* Convert PNG to ICNS format */
-BOOL convert_png_to_icns(const char *png_path, const char *output_icns)
+BOOL convert_png_to_icns(const char *png_path, const char *output_icns, const IconRenderOptions *opts)
 {
+    char *temp_dir;
     char *temp_iconset;
-    char cmd[2048];
     BOOL ret = FALSE;
     int result;
 
     DEBUG_PRINT("Converting PNG to ICNS: %s -> %s\n", png_path, output_icns);
 
-    /* Create temporary iconset directory */
-    temp_iconset = heap_printf("/tmp/appbundle_%d.iconset", getpid());
-    create_directories(temp_iconset);
+    /* Render and encode every size in-process; sips/iconutil only as a fallback */
+    if (icns_render_from_png(png_path, output_icns, opts)) {
+        DEBUG_PRINT("Successfully converted PNG to ICNS natively\n");
+        return TRUE;
+    }
+
+    /* sips output carries tool versions and dates; better no icon than a varying one */
+    if (opts && opts->reproducible) {
+        fprintf(stderr, "Warning: %s could not be rendered natively; no sips fallback in reproducible mode\n",
+                png_path);
+        return FALSE;
+    }
+
+    DEBUG_PRINT("Falling back to sips/iconutil\n");
+
+    /* Create a private temporary iconset directory */
+    temp_dir = create_scratch_dir(opts ? opts->scratch_dir : NULL, "iconset");
+    if (!temp_dir) return FALSE;
+    temp_iconset = heap_printf("%s/icon.iconset", temp_dir);
+    if (!temp_iconset || !create_directories(temp_iconset)) {
+        DEBUG_PRINT("Failed to create temporary iconset directory\n");
+        goto cleanup;
+    }
 
     /* Generate iconset from PNG */
     if (!generate_iconset_from_png(png_path, temp_iconset)) {
@@ -152,14 +243,12 @@ BOOL convert_png_to_icns(const char *png_path, const char *output_icns)
     }
 
     /* Convert iconset to icns using iconutil */
-    snprintf(cmd, sizeof(cmd),
-        "iconutil -c icns '%s' -o '%s' 2>/dev/null",
-        temp_iconset, output_icns
-    );
-
     DEBUG_PRINT("Running iconutil to create ICNS file\n");
 
-    result = system(cmd);
+    {
+        const char *argv[] = {"iconutil", "-c", "icns", temp_iconset, "-o", output_icns, NULL};
+        result = run_command(argv, RUN_STDERR_NULL);
+    }
     if (result != 0) {
         DEBUG_PRINT("iconutil failed (exit code: %d)\n", result);
         goto cleanup;
@@ -170,44 +259,194 @@ BOOL convert_png_to_icns(const char *png_path, const char *output_icns)
 
 cleanup:
     /* Clean up temporary iconset directory */
-    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", temp_iconset);
-    system(cmd);
+    remove_tree(temp_dir);
+    free(temp_dir);
     free(temp_iconset);
 
     return ret;
 }
 
+/* Pre-rendered PNGs of an .iconset directory or an explicit list */
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} PngSet;
+
+static BOOL png_set_add(PngSet *set, char *path)
+{
+    if (!path) return FALSE;
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 16;
+        char **paths = realloc(set->paths, capacity * sizeof(char *));
+
+        if (!paths) {
+            free(path);
+            return FALSE;
+        }
+        set->paths = paths;
+        set->capacity = capacity;
+    }
+    set->paths[set->count++] = path;
+    return TRUE;
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Every *.png in the directory, sorted so ties between equal sizes are stable */
+static BOOL collect_iconset_dir(const char *dir_path, PngSet *set)
+{
+    DIR *dir = opendir(dir_path);
+    struct dirent *entry;
+    BOOL ret = TRUE;
+
+    if (!dir) return FALSE;
+
+    while (ret && (entry = readdir(dir)) != NULL) {
+        const char *ext = strrchr(entry->d_name, '.');
+
+        if (entry->d_name[0] != '.' && ext && strcasecmp(ext, ".png") == 0)
+            ret = png_set_add(set, heap_printf("%s/%s", dir_path, entry->d_name));
+    }
+    closedir(dir);
+
+    if (set->count > 1)
+        qsort(set->paths, set->count, sizeof(char *), compare_paths);
+    return ret;
+}
+
+static BOOL collect_png_list(const char *list, PngSet *set)
+{
+    const char *p = list;
+
+    while (*p) {
+        size_t len = strcspn(p, ",");
+
+        if (len > 0 && !png_set_add(set, strndup(p, len)))
+            return FALSE;
+        p += len;
+        if (*p == ',') p++;
+    }
+    return TRUE;
+}
+
+/*
+ * Build an ICNS from hand-tuned PNG sizes. Only each file's IHDR is read;
+ * sizes present in the set are copied into their chunks byte for byte, and
+ * only the missing ones are decoded and resampled. Files named like
+ * iconset members (icon_16x16@2x.png) go to exactly that slot, so a 1x and
+ * a 2x variant of the same pixel size both survive.
+ */
+BOOL convert_iconset_to_icns(const char *source, const char *output_icns,
+                             const IconRenderOptions *opts)
+{
+    PngSet set = {0};
+    MappedFile *maps = NULL;
+    IconEntry *entries = NULL;
+    struct stat st;
+    int i, n = 0;
+    BOOL is_dir = stat(source, &st) == 0 && S_ISDIR(st.st_mode);
+    BOOL ret = FALSE;
+
+    if (!(is_dir ? collect_iconset_dir(source, &set) : collect_png_list(source, &set)) ||
+        set.count == 0) {
+        DEBUG_PRINT("No PNG images found in %s\n", source);
+        goto cleanup;
+    }
+
+    maps = calloc(set.count, sizeof(MappedFile));
+    entries = calloc(set.count, sizeof(IconEntry));
+    if (!maps || !entries) goto cleanup;
+
+    for (i = 0; i < set.count; i++) {
+        const char *name = strrchr(set.paths[i], '/');
+        int k;
+
+        name = name ? name + 1 : set.paths[i];
+
+        if (!map_file(set.paths[i], &maps[i])) {
+            DEBUG_PRINT("Cannot read icon image %s\n", set.paths[i]);
+            if (!is_dir) goto cleanup;
+            continue;
+        }
+        if (!icon_entry_init(&entries[n], maps[i].data, maps[i].len) || !entries[n].is_png) {
+            DEBUG_PRINT("Skipping %s: not a PNG image\n", set.paths[i]);
+            if (!is_dir) goto cleanup;
+            continue;
+        }
+
+        for (k = 0; k < ICON_SLOT_COUNT; k++) {
+            if (strcmp(name, icon_slots[k].iconset_name) != 0) continue;
+            if (entries[n].width == icon_slots[k].size && entries[n].height == icon_slots[k].size)
+                entries[n].slot_name = icon_slots[k].iconset_name;
+            else
+                fprintf(stderr, "Warning: %s is %ux%u, expected %ux%u; using it by size only\n",
+                        set.paths[i], entries[n].width, entries[n].height,
+                        icon_slots[k].size, icon_slots[k].size);
+            break;
+        }
+
+        DEBUG_PRINT("Iconset image %s: %ux%u\n", name, entries[n].width, entries[n].height);
+        n++;
+    }
+
+    if (n > 0)
+        ret = icns_render_from_entries(entries, n, output_icns, opts);
+
+    /* iconutil understands real .iconset directories, e.g. with interlaced PNGs */
+    if (!ret && is_dir && !(opts && opts->reproducible)) {
+        const char *ext = strrchr(source, '.');
+
+        if (ext && strcmp(ext, ".iconset") == 0) {
+            const char *argv[] = {"iconutil", "-c", "icns", source, "-o", output_icns, NULL};
+
+            DEBUG_PRINT("Falling back to iconutil for %s\n", source);
+            ret = run_command(argv, RUN_STDERR_NULL) == 0;
+        }
+    }
+
+cleanup:
+    for (i = 0; i < set.count; i++) {
+        if (maps) unmap_file(&maps[i]);
+        free(set.paths[i]);
+    }
+    free(set.paths);
+    free(maps);
+    free(entries);
+    return ret;
+}
+
 /* Convert SVG to ICNS format (via PNG intermediate) */
-BOOL convert_svg_to_icns(const char *svg_path, const char *output_icns)
+BOOL convert_svg_to_icns(const char *svg_path, const char *output_icns, const IconRenderOptions *opts)
 {
     char *temp_dir;
     char *iconset_dir;
     char *base_png;
     char *ql_output;
-    char cmd[4096];
     int result;
     BOOL ret = FALSE;
     const char *svg_filename;
 
     DEBUG_PRINT("Converting SVG to ICNS: %s -> %s\n", svg_path, output_icns);
 
-    /* Create temporary working directories */
-    temp_dir = heap_printf("/tmp/appbundle_%d", getpid());
+    /* Create private temporary working directories */
+    temp_dir = create_scratch_dir(opts ? opts->scratch_dir : NULL, "svg");
+    if (!temp_dir) return FALSE;
     iconset_dir = heap_printf("%s/temp.iconset", temp_dir);
     base_png = heap_printf("%s/base.png", temp_dir);
-
-    create_directories(temp_dir);
-    create_directories(iconset_dir);
+    if (!iconset_dir || !base_png || !create_directories(iconset_dir))
+        goto cleanup;
 
     /* Step 1: Convert SVG to high-res PNG using qlmanage */
     DEBUG_PRINT("Step 1: Converting SVG to PNG using qlmanage\n");
 
-    snprintf(cmd, sizeof(cmd),
-        "qlmanage -t -s 1024 -o '%s' '%s' 2>/dev/null",
-        temp_dir, svg_path
-    );
-
-    result = system(cmd);
+    {
+        const char *argv[] = {"qlmanage", "-t", "-s", "1024", "-o", temp_dir, svg_path, NULL};
+        result = run_command(argv, RUN_STDERR_NULL);
+    }
     if (result != 0) {
         DEBUG_PRINT("qlmanage failed for SVG (exit code: %d)\n", result);
         goto cleanup;
@@ -251,7 +490,18 @@ BOOL convert_svg_to_icns(const char *svg_path, const char *output_icns)
         goto cleanup;
     }
 
-    /* Step 2: Generate iconset from the PNG */
+    /* Step 2: Render the ICNS natively from the PNG when possible */
+    if (icns_render_from_png(base_png, output_icns, opts)) {
+        ret = TRUE;
+        DEBUG_PRINT("Successfully converted SVG to ICNS natively\n");
+        goto cleanup;
+    }
+    if (opts && opts->reproducible) {
+        fprintf(stderr, "Warning: %s could not be rendered natively; no sips fallback in reproducible mode\n",
+                svg_path);
+        goto cleanup;
+    }
+
     DEBUG_PRINT("Step 2: Generating iconset from PNG\n");
 
     if (!generate_iconset_from_png(base_png, iconset_dir)) {
@@ -262,12 +512,10 @@ BOOL convert_svg_to_icns(const char *svg_path, const char *output_icns)
     /* Step 3: Convert iconset to icns using iconutil */
     DEBUG_PRINT("Step 3: Converting iconset to ICNS\n");
 
-    snprintf(cmd, sizeof(cmd),
-        "iconutil -c icns '%s' -o '%s' 2>/dev/null",
-        iconset_dir, output_icns
-    );
-
-    result = system(cmd);
+    {
+        const char *argv[] = {"iconutil", "-c", "icns", iconset_dir, "-o", output_icns, NULL};
+        result = run_command(argv, RUN_STDERR_NULL);
+    }
     if (result != 0) {
         DEBUG_PRINT("iconutil failed (exit code: %d)\n", result);
         goto cleanup;
@@ -278,8 +526,7 @@ BOOL convert_svg_to_icns(const char *svg_path, const char *output_icns)
 
 cleanup:
     /* Clean up temporary directory */
-    snprintf(cmd, sizeof(cmd), "rm -rf '%s'", temp_dir);
-    system(cmd);
+    remove_tree(temp_dir);
 
     free(temp_dir);
     free(iconset_dir);
@@ -0,0 +1,342 @@
+/*
+ * In-Memory Images for AppBundleGenerator
+ * RGBA buffers and the resampler used by the native icon pipeline
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "shared.h"
+
+BOOL rgba_image_alloc(RgbaImage *image, uint32_t width, uint32_t height)
+{
+    memset(image, 0, sizeof(RgbaImage));
+
+    if (width == 0 || height == 0 || width > 65535 || height > 65535)
+        return FALSE;
+
+    image->pixels = malloc((size_t)width * height * 4);
+    if (!image->pixels)
+        return FALSE;
+
+    image->width = width;
+    image->height = height;
+    return TRUE;
+}
+
+void rgba_image_free(RgbaImage *image)
+{
+    if (!image) return;
+    free(image->pixels);
+    memset(image, 0, sizeof(RgbaImage));
+}
+
+/* Source span and weights feeding one output sample along one axis */
+typedef struct {
+    uint32_t first;
+    uint32_t count;
+    float *weights;
+} Contribution;
+
+/*
+ * Area averaging when shrinking (each output pixel is the exact coverage-
+ * weighted mean of the source pixels under it), linear interpolation when
+ * enlarging.
+ */
+static Contribution *build_contributions(uint32_t src, uint32_t dst)
+{
+    Contribution *contrib = calloc(dst, sizeof(Contribution));
+    double scale = (double)src / dst;
+    uint32_t i;
+
+    if (!contrib) return NULL;
+
+    for (i = 0; i < dst; i++) {
+        Contribution *c = &contrib[i];
+
+        if (scale >= 1.0) {
+            double start = i * scale, end = (i + 1) * scale;
+            uint32_t first = (uint32_t)floor(start);
+            uint32_t last = (uint32_t)ceil(end);
+            uint32_t j;
+
+            if (last > src) last = src;
+            c->first = first;
+            c->count = last - first;
+            c->weights = malloc(c->count * sizeof(float));
+            if (!c->weights) goto fail;
+
+            for (j = 0; j < c->count; j++) {
+                double lo = first + j, hi = lo + 1.0;
+                if (lo < start) lo = start;
+                if (hi > end) hi = end;
+                c->weights[j] = (float)((hi - lo) / scale);
+            }
+        } else {
+            double center = (i + 0.5) * scale - 0.5;
+            int left = (int)floor(center);
+            float frac = (float)(center - left);
+
+            c->weights = malloc(2 * sizeof(float));
+            if (!c->weights) goto fail;
+
+            if (left < 0) {
+                c->first = 0;
+                c->count = 1;
+                c->weights[0] = 1.0f;
+            } else if ((uint32_t)left + 1 >= src) {
+                c->first = src - 1;
+                c->count = 1;
+                c->weights[0] = 1.0f;
+            } else {
+                c->first = (uint32_t)left;
+                c->count = 2;
+                c->weights[0] = 1.0f - frac;
+                c->weights[1] = frac;
+            }
+        }
+    }
+
+    return contrib;
+
+fail:
+    for (i = 0; i < dst; i++) free(contrib[i].weights);
+    free(contrib);
+    return NULL;
+}
+
+static void free_contributions(Contribution *contrib, uint32_t n)
+{
+    uint32_t i;
+
+    if (!contrib) return;
+    for (i = 0; i < n; i++) free(contrib[i].weights);
+    free(contrib);
+}
+
+static uint8_t clamp_channel(float v)
+{
+    if (v <= 0.0f) return 0;
+    if (v >= 255.0f) return 255;
+    return (uint8_t)(v + 0.5f);
+}
+
+/* Horizontal pass over one source row, premultiplied */
+static void resample_row(const uint8_t *srow, const Contribution *cx, uint32_t width, float *row)
+{
+    uint32_t x, j;
+
+    for (x = 0; x < width; x++) {
+        float r = 0, g = 0, b = 0, a = 0;
+
+        for (j = 0; j < cx[x].count; j++) {
+            const uint8_t *p = srow + (size_t)(cx[x].first + j) * 4;
+            float w = cx[x].weights[j];
+            float pa = p[3] * w;
+
+            r += p[0] * pa;
+            g += p[1] * pa;
+            b += p[2] * pa;
+            a += pa;
+        }
+
+        row[x * 4 + 0] = r;
+        row[x * 4 + 1] = g;
+        row[x * 4 + 2] = b;
+        row[x * 4 + 3] = a;
+    }
+}
+
+/* Un-premultiply one finished output row */
+static void store_row(const float *accum, uint32_t width, uint8_t *out)
+{
+    uint32_t x;
+
+    for (x = 0; x < width; x++, out += 4) {
+        float a = accum[x * 4 + 3];
+
+        if (a <= 0.0f) {
+            memset(out, 0, 4);
+            continue;
+        }
+        out[0] = clamp_channel(accum[x * 4 + 0] / a);
+        out[1] = clamp_channel(accum[x * 4 + 1] / a);
+        out[2] = clamp_channel(accum[x * 4 + 2] / a);
+        out[3] = clamp_channel(a);
+    }
+}
+
+/*
+ * Streaming resampler: source rows are pushed top to bottom and each is
+ * resampled horizontally once, then added to every output row it covers.
+ * Only the output rows still being accumulated are kept, so a source of
+ * any height costs the output image plus a few rows of floats.
+ */
+struct RgbaScaler {
+    uint32_t src_width;
+    uint32_t src_height;
+    uint32_t width;
+    uint32_t height;
+    Contribution *cx;
+    Contribution *cy;
+    float *row;                     /* current source row, resampled */
+    float *accum;                   /* ring of ring_size output rows */
+    uint32_t ring_size;
+    uint32_t next_src;              /* source row expected next */
+    uint32_t next_out;              /* first output row not yet stored */
+    RgbaImage image;
+};
+
+RgbaScaler *rgba_scaler_create(uint32_t src_width, uint32_t src_height,
+                               uint32_t width, uint32_t height)
+{
+    RgbaScaler *scaler;
+    uint32_t y, next;
+
+    if (src_width == 0 || src_height == 0)
+        return NULL;
+
+    scaler = calloc(1, sizeof(RgbaScaler));
+    if (!scaler) return NULL;
+
+    scaler->src_width = src_width;
+    scaler->src_height = src_height;
+    scaler->width = width;
+    scaler->height = height;
+    if (!rgba_image_alloc(&scaler->image, width, height))
+        goto fail;
+
+    scaler->cx = build_contributions(src_width, width);
+    scaler->cy = build_contributions(src_height, height);
+    if (!scaler->cx || !scaler->cy)
+        goto fail;
+
+    /* Most output rows that are ever open at once */
+    scaler->ring_size = 1;
+    for (y = 0; y < height; y++) {
+        uint32_t end = scaler->cy[y].first + scaler->cy[y].count;
+
+        for (next = y + 1; next < height && scaler->cy[next].first < end; next++)
+            ;
+        if (next - y > scaler->ring_size)
+            scaler->ring_size = next - y;
+    }
+
+    scaler->row = malloc((size_t)width * 4 * sizeof(float));
+    scaler->accum = malloc((size_t)scaler->ring_size * width * 4 * sizeof(float));
+    if (!scaler->row || !scaler->accum)
+        goto fail;
+
+    return scaler;
+
+fail:
+    rgba_scaler_destroy(scaler);
+    return NULL;
+}
+
+void rgba_scaler_destroy(RgbaScaler *scaler)
+{
+    if (!scaler) return;
+    free_contributions(scaler->cx, scaler->width);
+    free_contributions(scaler->cy, scaler->height);
+    free(scaler->row);
+    free(scaler->accum);
+    rgba_image_free(&scaler->image);
+    free(scaler);
+}
+
+/* Feed the next source row (src_width RGBA pixels) */
+BOOL rgba_scaler_push_row(RgbaScaler *scaler, const uint8_t *rgba)
+{
+    uint32_t width = scaler->width, height = scaler->height;
+    uint32_t s = scaler->next_src, y, x;
+
+    if (s >= scaler->src_height)
+        return FALSE;
+
+    resample_row(rgba, scaler->cx, width, scaler->row);
+
+    for (y = scaler->next_out; y < height && scaler->cy[y].first <= s; y++) {
+        const Contribution *c = &scaler->cy[y];
+        float *accum = scaler->accum + (size_t)(y % scaler->ring_size) * width * 4;
+        float wy;
+
+        if (s >= c->first + c->count)
+            continue;
+        if (s == c->first)
+            memset(accum, 0, (size_t)width * 4 * sizeof(float));
+
+        wy = c->weights[s - c->first];
+        for (x = 0; x < width * 4; x++)
+            accum[x] += scaler->row[x] * wy;
+    }
+
+    /* Store the output rows this source row completed */
+    while (scaler->next_out < height &&
+           scaler->cy[scaler->next_out].first + scaler->cy[scaler->next_out].count - 1 == s) {
+        y = scaler->next_out++;
+        store_row(scaler->accum + (size_t)(y % scaler->ring_size) * width * 4, width,
+                  scaler->image.pixels + (size_t)y * width * 4);
+    }
+
+    scaler->next_src++;
+    return TRUE;
+}
+
+/* Hand over the finished image; FALSE if rows are still missing */
+BOOL rgba_scaler_finish(RgbaScaler *scaler, RgbaImage *dst)
+{
+    if (scaler->next_src != scaler->src_height || scaler->next_out != scaler->height ||
+        !scaler->image.pixels)
+        return FALSE;
+
+    *dst = scaler->image;
+    memset(&scaler->image, 0, sizeof(RgbaImage));
+    return TRUE;
+}
+
+/* Rough upper bound on what a scaler allocates, for memory budgets */
+size_t rgba_scaler_footprint(uint32_t src_width, uint32_t src_height,
+                             uint32_t width, uint32_t height)
+{
+    size_t ring = (size_t)src_height / height + 2;
+    size_t weights = (size_t)src_width + width * 2 + src_height + height * 2;
+
+    return (size_t)width * height * 4 + (ring + 1) * width * 4 * sizeof(float) +
+           weights * sizeof(float) + ((size_t)width + height) * sizeof(Contribution);
+}
+
+/*
+ * Resample src into a new width x height image. Color is averaged in
+ * premultiplied form so transparent pixels do not bleed dark fringes.
+ */
+BOOL rgba_image_resize(const RgbaImage *src, RgbaImage *dst, uint32_t width, uint32_t height)
+{
+    RgbaScaler *scaler;
+    uint32_t y;
+    BOOL ret = TRUE;
+
+    memset(dst, 0, sizeof(RgbaImage));
+    if (!src || !src->pixels)
+        return FALSE;
+
+    if (src->width == width && src->height == height) {
+        if (!rgba_image_alloc(dst, width, height))
+            return FALSE;
+        memcpy(dst->pixels, src->pixels, (size_t)width * height * 4);
+        return TRUE;
+    }
+
+    scaler = rgba_scaler_create(src->width, src->height, width, height);
+    if (!scaler)
+        return FALSE;
+
+    for (y = 0; y < src->height && ret; y++)
+        ret = rgba_scaler_push_row(scaler, src->pixels + (size_t)y * src->width * 4);
+
+    ret = ret && rgba_scaler_finish(scaler, dst);
+    rgba_scaler_destroy(scaler);
+    return ret;
+}
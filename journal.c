@@ -0,0 +1,362 @@
+/*
+ * Batch Journals for AppBundleGenerator
+ * An append-only log of the batch records that were built, so a run that
+ * dies part way can be resumed (--resume) without redoing finished work.
+ *
+ * Each line is "<digest> <mtime> <size> <name>": a digest of everything
+ * that goes into the bundle (options plus the identity of every input
+ * file) and the size and mtime of the Info.plist it produced. A record is
+ * skipped on resume only if its digest is logged and that Info.plist is
+ * still the one the logged build wrote.
+ *
+ * Lines are buffered and written with one write and one fdatasync per
+ * JOURNAL_SYNC_LINES records or JOURNAL_SYNC_SECONDS, whichever is first.
+ * A crash loses at most that batch, which is simply built again; a torn
+ * last line is ignored when the journal is read back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+#define JOURNAL_SYNC_LINES      64
+#define JOURNAL_SYNC_SECONDS    1
+
+static const char journal_header[] = "# appbundler batch journal v1\n";
+
+typedef struct {
+    uint64_t digest;
+    long long mtime;
+    long long size;
+} JournalEntry;
+
+struct BatchJournal {
+    int fd;
+    pthread_mutex_t lock;           /* guards the buffer and sync state */
+    char *buffer;
+    size_t len;
+    size_t cap;
+    int pending;                    /* lines in buffer */
+    time_t last_sync;
+    JournalEntry *entries;          /* from the previous run, sorted by digest */
+    int entry_count;
+    BOOL torn;                      /* the previous run died mid-line */
+};
+
+/* FNV-1a, 64 bits */
+static uint64_t digest_bytes(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* NULL and "" must differ, so every string carries its length */
+static uint64_t digest_string(uint64_t h, const char *s)
+{
+    int64_t len = s ? (int64_t)strlen(s) : -1;
+
+    h = digest_bytes(h, &len, sizeof(len));
+    return s ? digest_bytes(h, s, (size_t)len) : h;
+}
+
+static uint64_t digest_int(uint64_t h, long long value)
+{
+    return digest_bytes(h, &value, sizeof(value));
+}
+
+/* A changed input file gets a new digest, even if its path stayed the same */
+static uint64_t digest_file(uint64_t h, const char *path)
+{
+    struct stat st;
+
+    h = digest_string(h, path);
+    if (path && stat(path, &st) == 0) {
+        h = digest_int(h, (long long)st.st_dev);
+        h = digest_int(h, (long long)st.st_ino);
+        h = digest_int(h, (long long)st.st_size);
+        h = digest_int(h, (long long)st.st_mtime);
+    }
+    return h;
+}
+
+/* Icons may be a comma-separated list of PNGs; each file counts */
+static uint64_t digest_icon_files(uint64_t h, const char *icon_path)
+{
+    const char *p = icon_path;
+    char path[4096];
+
+    if (!icon_path || !strchr(icon_path, ','))
+        return digest_file(h, icon_path);
+
+    while (*p) {
+        size_t len = strcspn(p, ",");
+
+        if (len < sizeof(path)) {
+            memcpy(path, p, len);
+            path[len] = '\0';
+            h = digest_file(h, path);
+        }
+        p += len;
+        if (*p) p++;
+    }
+    return h;
+}
+
+/* Digest of one record's options and inputs; equal digests build equal bundles */
+uint64_t batch_options_digest(const AppBundleOptions *options)
+{
+    uint64_t h = 14695981039346656037ull;
+    int i;
+
+    h = digest_string(h, options->bundle_name);
+    h = digest_string(h, options->bundle_dest);
+    h = digest_file(h, options->executable_path);
+    h = digest_int(h, options->launcher_mode);
+    h = digest_int(h, options->bundle_dylibs);
+    h = digest_icon_files(h, options->icon_path);
+    h = digest_int(h, options->icon_compression);
+    h = digest_int(h, options->icns_legacy);
+    h = digest_int(h, options->icon_memory_mb);
+    h = digest_string(h, options->signing_identity);
+    h = digest_int(h, options->enable_hardened_runtime);
+    h = digest_file(h, options->entitlements_file);
+    h = digest_int(h, options->force_sign);
+    h = digest_string(h, options->bundle_identifier);
+    h = digest_string(h, options->min_os_version);
+    h = digest_string(h, options->app_category);
+    h = digest_string(h, options->version);
+    h = digest_string(h, options->short_version);
+    h = digest_file(h, options->version_source);
+    h = digest_string(h, options->associations);
+    h = digest_file(h, options->localizations);
+    h = digest_file(h, options->plist_template);
+    for (i = 0; i < options->plist_setting_count; i++)
+        h = digest_string(h, options->plist_settings[i]);
+    h = digest_int(h, options->plist_setting_count);
+    h = digest_int(h, options->reproducible);
+    h = digest_int(h, options->source_date_epoch);
+    h = digest_int(h, options->allow_jit);
+    h = digest_int(h, options->allow_unsigned_memory);
+    h = digest_int(h, options->allow_dyld_vars);
+    return h;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    const JournalEntry *ea = a, *eb = b;
+
+    return ea->digest < eb->digest ? -1 : ea->digest > eb->digest;
+}
+
+/* Only complete lines count; anything after the last newline is a torn write */
+static BOOL load_entries(BatchJournal *journal, const char *path)
+{
+    MappedFile file;
+    const char *p, *end;
+    int capacity = 0;
+
+    if (!map_file(path, &file))
+        return TRUE;
+
+    p = (const char *)file.data;
+    end = p + file.len;
+    while (p < end) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        char line[128];
+        size_t len;
+        JournalEntry entry;
+        unsigned long long digest;
+
+        if (!eol) break;
+        len = (size_t)(eol - p);
+        if (*p != '#' && len < sizeof(line)) {
+            memcpy(line, p, len);
+            line[len] = '\0';
+            if (sscanf(line, "%16llx %lld %lld", &digest, &entry.mtime, &entry.size) == 3) {
+                if (journal->entry_count == capacity) {
+                    int grown = capacity ? capacity * 2 : 256;
+                    JournalEntry *entries = realloc(journal->entries, grown * sizeof(JournalEntry));
+
+                    if (!entries) {
+                        unmap_file(&file);
+                        return FALSE;
+                    }
+                    journal->entries = entries;
+                    capacity = grown;
+                }
+                entry.digest = digest;
+                journal->entries[journal->entry_count++] = entry;
+            }
+        }
+        p = eol + 1;
+    }
+    journal->torn = file.len > 0 && file.data[file.len - 1] != '\n';
+    unmap_file(&file);
+
+    if (journal->entry_count > 0)
+        qsort(journal->entries, journal->entry_count, sizeof(JournalEntry), compare_entries);
+    return TRUE;
+}
+
+/*
+ * Open the journal at path. With resume, the entries already in it are
+ * read first and new ones are appended; otherwise it starts empty.
+ */
+BatchJournal *batch_journal_open(const char *path, BOOL resume)
+{
+    BatchJournal *journal = calloc(1, sizeof(BatchJournal));
+
+    if (!journal) return NULL;
+
+    if (resume && !load_entries(journal, path)) {
+        free(journal);
+        return NULL;
+    }
+
+    journal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0666);
+    if (journal->fd < 0) {
+        free(journal->entries);
+        free(journal);
+        return NULL;
+    }
+    /* End a torn line so it does not run into the first new one */
+    if ((lseek(journal->fd, 0, SEEK_END) == 0 &&
+         write(journal->fd, journal_header, sizeof(journal_header) - 1) < 0) ||
+        (journal->torn && write(journal->fd, "\n", 1) < 0))
+        DEBUG_PRINT("Could not write to journal %s\n", path);
+
+    pthread_mutex_init(&journal->lock, NULL);
+    journal->last_sync = time(NULL);
+    return journal;
+}
+
+/* TRUE if a build with this digest was logged and produced bundle_path as it is now */
+BOOL batch_journal_done(const BatchJournal *journal, uint64_t digest, const char *bundle_path)
+{
+    JournalEntry key, *entry;
+    char *plist_path;
+    struct stat st;
+    BOOL ret = FALSE;
+
+    key.digest = digest;
+    entry = journal->entry_count ? bsearch(&key, journal->entries, journal->entry_count,
+                                           sizeof(JournalEntry), compare_entries) : NULL;
+    if (!entry)
+        return FALSE;
+
+    /* Several lines may share a digest (an earlier build of the same record) */
+    while (entry > journal->entries && entry[-1].digest == digest)
+        entry--;
+
+    plist_path = heap_printf("%s/Contents/Info.plist", bundle_path);
+    if (plist_path && stat(plist_path, &st) == 0) {
+        for (; !ret && entry < journal->entries + journal->entry_count &&
+               entry->digest == digest; entry++)
+            ret = entry->mtime == (long long)st.st_mtime && entry->size == (long long)st.st_size;
+    }
+    free(plist_path);
+    return ret;
+}
+
+/* Called with the lock held */
+static BOOL flush_locked(BatchJournal *journal)
+{
+    const char *p = journal->buffer;
+    size_t len = journal->len;
+    BOOL ret = TRUE;
+
+    while (len > 0) {
+        ssize_t n = write(journal->fd, p, len);
+
+        if (n <= 0) {
+            ret = FALSE;
+            break;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+
+#ifdef __APPLE__
+    if (ret && journal->len > 0 && fsync(journal->fd) != 0)
+#else
+    if (ret && journal->len > 0 && fdatasync(journal->fd) != 0)
+#endif
+        ret = FALSE;
+
+    journal->len = 0;
+    journal->pending = 0;
+    journal->last_sync = time(NULL);
+    return ret;
+}
+
+/* Log a finished record; safe to call from any number of build threads */
+void batch_journal_record(BatchJournal *journal, uint64_t digest, const char *bundle_path,
+                          const char *name)
+{
+    char *plist_path = heap_printf("%s/Contents/Info.plist", bundle_path);
+    char *line;
+    size_t line_len;
+    struct stat st;
+
+    if (!plist_path || stat(plist_path, &st) != 0) {
+        free(plist_path);
+        return;
+    }
+    free(plist_path);
+
+    line = heap_printf("%016llx %lld %lld %s\n", (unsigned long long)digest,
+                       (long long)st.st_mtime, (long long)st.st_size, name);
+    if (!line) return;
+    line_len = strlen(line);
+
+    pthread_mutex_lock(&journal->lock);
+    if (journal->len + line_len > journal->cap) {
+        size_t cap = journal->cap ? journal->cap * 2 : 8192;
+        char *buffer;
+
+        while (cap < journal->len + line_len) cap *= 2;
+        buffer = realloc(journal->buffer, cap);
+        if (buffer) {
+            journal->buffer = buffer;
+            journal->cap = cap;
+        }
+    }
+    if (journal->len + line_len <= journal->cap) {
+        memcpy(journal->buffer + journal->len, line, line_len);
+        journal->len += line_len;
+        journal->pending++;
+    }
+    if (journal->pending >= JOURNAL_SYNC_LINES ||
+        time(NULL) - journal->last_sync >= JOURNAL_SYNC_SECONDS) {
+        if (!flush_locked(journal))
+            DEBUG_PRINT("Could not write the batch journal\n");
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    free(line);
+}
+
+/* Write out anything still buffered and close the journal */
+void batch_journal_close(BatchJournal *journal)
+{
+    if (!journal) return;
+
+    if (!flush_locked(journal))
+        fprintf(stderr, "Warning: could not write the batch journal\n");
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal->entries);
+    free(journal->buffer);
+    free(journal);
+}
@@ -0,0 +1,330 @@
+/*
+ * Localizations for AppBundleGenerator
+ * Reads a --localizations table and writes <locale>.lproj/InfoPlist.strings
+ * for every locale in it. The table uses the batch manifest syntax, one
+ * [locale] section per language:
+ *
+ *   [fr]
+ *   Name=Bloc-notes
+ *   Copyright=© 2024 Exemple
+ *   NSMicrophoneUsageDescription=Pour enregistrer des notes vocales.
+ *
+ * The strings files are binary plists, which LaunchServices reads without
+ * a text parse. All locales of a bundle are written in one pass through one
+ * PlistWriter and one dictionary, so the serializer's tables and output
+ * buffer are allocated once, not per language.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "shared.h"
+
+/* Old-style lproj names, still common in tables copied from older bundles */
+static const struct {
+    const char *legacy;
+    const char *locale;
+} legacy_locales[] = {
+    { "English", "en" }, { "French", "fr" }, { "German", "de" }, { "Italian", "it" },
+    { "Japanese", "ja" }, { "Spanish", "es" }, { "Dutch", "nl" }, { NULL, NULL }
+};
+
+static void free_locale(LocaleStrings *locale)
+{
+    int i;
+
+    for (i = 0; i < locale->count; i++) {
+        free(locale->keys[i]);
+        free(locale->values[i]);
+    }
+    free(locale->keys);
+    free(locale->values);
+    free(locale->locale);
+}
+
+void localization_table_free(LocalizationTable *table)
+{
+    int i;
+
+    for (i = 0; i < table->count; i++)
+        free_locale(&table->locales[i]);
+    free(table->locales);
+    memset(table, 0, sizeof(LocalizationTable));
+}
+
+/* ll, lll, ll-Scrp or ll_RR style: letters, then [-_] separated letters and digits */
+static BOOL is_locale_name(const char *name)
+{
+    const char *p = name;
+    int len = 0;
+
+    while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')) {
+        p++;
+        len++;
+    }
+    if (len < 2 || len > 3)
+        return FALSE;
+
+    while (*p == '-' || *p == '_') {
+        p++;
+        len = 0;
+        while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')) {
+            p++;
+            len++;
+        }
+        if (len == 0)
+            return FALSE;
+    }
+    return *p == '\0';
+}
+
+static LocaleStrings *add_locale(LocalizationTable *table, const char *name, size_t len, int line)
+{
+    LocaleStrings *locale;
+    int i;
+
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 32;
+        LocaleStrings *locales = realloc(table->locales, capacity * sizeof(LocaleStrings));
+
+        if (!locales) return NULL;
+        table->locales = locales;
+        table->capacity = capacity;
+    }
+
+    locale = &table->locales[table->count];
+    memset(locale, 0, sizeof(LocaleStrings));
+    locale->line = line;
+    for (i = 0; legacy_locales[i].legacy; i++) {
+        if (strlen(legacy_locales[i].legacy) == len && memcmp(legacy_locales[i].legacy, name, len) == 0)
+            break;
+    }
+    locale->locale = legacy_locales[i].legacy ? strdup(legacy_locales[i].locale) : strndup(name, len);
+    if (!locale->locale) return NULL;
+
+    table->count++;
+    return locale;
+}
+
+/* Table keys: Name and Copyright for short, or the InfoPlist.strings key itself */
+static const char *strings_key(const char *key, size_t len)
+{
+    static const char *const keys[] = {
+        "CFBundleDisplayName", "CFBundleName", "NSHumanReadableCopyright", "CFBundleGetInfoString", NULL
+    };
+    int i;
+
+    if (len == 4 && memcmp(key, "Name", 4) == 0)
+        return "CFBundleDisplayName";
+    if (len == 9 && memcmp(key, "Copyright", 9) == 0)
+        return "NSHumanReadableCopyright";
+    for (i = 0; keys[i]; i++) {
+        if (strlen(keys[i]) == len && memcmp(keys[i], key, len) == 0)
+            return keys[i];
+    }
+    return NULL;
+}
+
+/* Privacy prompts: NSCameraUsageDescription and the like */
+static BOOL is_usage_key(const char *key, size_t len)
+{
+    return len > 18 && memcmp(key, "NS", 2) == 0 &&
+           memcmp(key + len - 16, "UsageDescription", 16) == 0;
+}
+
+static BOOL set_string(LocaleStrings *locale, const char *key, size_t key_len,
+                       const char *value, size_t value_len)
+{
+    char *copy;
+    int i;
+
+    if (!(copy = strndup(value, value_len)))
+        return FALSE;
+
+    /* A key given twice keeps the later value */
+    for (i = 0; i < locale->count; i++) {
+        if (strlen(locale->keys[i]) == key_len && memcmp(locale->keys[i], key, key_len) == 0) {
+            free(locale->values[i]);
+            locale->values[i] = copy;
+            return TRUE;
+        }
+    }
+
+    if (locale->count == locale->capacity) {
+        int capacity = locale->capacity ? locale->capacity * 2 : 8;
+        char **keys = realloc(locale->keys, capacity * sizeof(char *));
+        char **values;
+
+        if (keys) locale->keys = keys;
+        values = keys ? realloc(locale->values, capacity * sizeof(char *)) : NULL;
+        if (!values) {
+            free(copy);
+            return FALSE;
+        }
+        locale->values = values;
+        locale->capacity = capacity;
+    }
+
+    if (!(locale->keys[locale->count] = strndup(key, key_len))) {
+        free(copy);
+        return FALSE;
+    }
+    locale->values[locale->count++] = copy;
+    return TRUE;
+}
+
+/* Every section needs a valid, unique locale name */
+static BOOL validate_table(const char *path, const LocalizationTable *table)
+{
+    int i, j;
+
+    for (i = 0; i < table->count; i++) {
+        const LocaleStrings *locale = &table->locales[i];
+
+        if (!is_locale_name(locale->locale)) {
+            fprintf(stderr, "%s:%d: invalid locale '%s' (use codes like en, pt-BR or zh-Hans)\n",
+                    path, locale->line, locale->locale);
+            return FALSE;
+        }
+        for (j = 0; j < i; j++) {
+            if (strcmp(table->locales[j].locale, locale->locale) == 0) {
+                fprintf(stderr, "%s:%d: [%s] already defined on line %d\n", path, locale->line,
+                        locale->locale, table->locales[j].line);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+typedef struct {
+    const char *path;
+    LocalizationTable *table;
+    LocaleStrings *locale;
+} TableLoad;
+
+static BOOL table_section(void *arg, const char *name, size_t len, int line)
+{
+    TableLoad *load = arg;
+
+    load->locale = add_locale(load->table, name, len, line);
+    return load->locale != NULL;
+}
+
+static BOOL table_key(void *arg, const char *key, size_t key_len, const char *value,
+                      size_t value_len, int line)
+{
+    TableLoad *load = arg;
+    const char *strings;
+    BOOL ok;
+
+    if ((strings = strings_key(key, key_len)) != NULL) {
+        ok = set_string(load->locale, strings, strlen(strings), value, value_len);
+        /* Name= localizes both names Finder may show */
+        if (ok && key_len == 4 && memcmp(key, "Name", 4) == 0)
+            ok = set_string(load->locale, "CFBundleName", 12, value, value_len);
+        return ok;
+    }
+    if (is_usage_key(key, key_len))
+        return set_string(load->locale, key, key_len, value, value_len);
+
+    fprintf(stderr, "%s:%d: unknown key '%.*s'\n", load->path, line, (int)key_len, key);
+    return FALSE;
+}
+
+/*
+ * Read a localization table. Errors are reported with file and line, and
+ * a table that does not parse completely is not used.
+ */
+BOOL localization_table_load(const char *path, LocalizationTable *table)
+{
+    TableLoad load;
+    BOOL ok;
+
+    memset(table, 0, sizeof(LocalizationTable));
+    load.path = path;
+    load.table = table;
+    load.locale = NULL;
+    ok = read_manifest_file(path, "locale", table_section, table_key, &load);
+
+    if (ok)
+        ok = validate_table(path, table);
+    if (!ok)
+        localization_table_free(table);
+    return ok;
+}
+
+/* TRUE if some locale gives the app its own name */
+BOOL localization_table_has_display_name(const LocalizationTable *table)
+{
+    int i, j;
+
+    for (i = 0; i < table->count; i++) {
+        for (j = 0; j < table->locales[i].count; j++) {
+            if (strcmp(table->locales[i].keys[j], "CFBundleDisplayName") == 0)
+                return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+ * Write <locale>.lproj/InfoPlist.strings under path_to_bundle_resources for
+ * every locale of the table. Locales without strings get the directory
+ * only, which is enough for CFBundleLocalizations to list them.
+ */
+BOOL write_localizations(const char *path_to_bundle_resources, const LocalizationTable *table)
+{
+    CFMutableDictionaryRef strings;
+    PlistWriter *writer;
+    BOOL ret = TRUE;
+    int i, j;
+
+    writer = plist_writer_create();
+    strings = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                        &kCFTypeDictionaryValueCallBacks);
+    if (!writer || !strings) {
+        plist_writer_destroy(writer);
+        if (strings) CFRelease(strings);
+        return FALSE;
+    }
+
+    for (i = 0; ret && i < table->count; i++) {
+        const LocaleStrings *locale = &table->locales[i];
+        char *lproj = heap_printf("%s/%s.lproj", path_to_bundle_resources, locale->locale);
+        char *strings_path = lproj ? heap_printf("%s/InfoPlist.strings", lproj) : NULL;
+
+        ret = strings_path && create_directories(lproj);
+
+        CFDictionaryRemoveAllValues(strings);
+        for (j = 0; ret && j < locale->count; j++) {
+            CFStringRef key = CFStringCreateWithCString(NULL, locale->keys[j], kCFStringEncodingUTF8);
+            CFStringRef value = CFStringCreateWithCString(NULL, locale->values[j], kCFStringEncodingUTF8);
+
+            if (key && value) {
+                CFDictionarySetValue(strings, key, value);
+            } else {
+                fprintf(stderr, "Error: %s string for [%s] is not valid UTF-8\n",
+                        locale->keys[j], locale->locale);
+                ret = FALSE;
+            }
+            if (key) CFRelease(key);
+            if (value) CFRelease(value);
+        }
+
+        if (ret && locale->count > 0) {
+            ret = plist_writer_write_file(writer, strings, strings_path);
+            DEBUG_PRINT("Wrote %d string(s) for %s\n", locale->count, locale->locale);
+        }
+
+        free(strings_path);
+        free(lproj);
+    }
+
+    CFRelease(strings);
+    plist_writer_destroy(writer);
+    return ret;
+}
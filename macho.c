@@ -0,0 +1,297 @@
+/*
+ * Mach-O Inspection for AppBundleGenerator
+ * Reads the architectures and minimum macOS version of thin and universal
+ * Mach-O binaries, the way `lipo -archs` and `otool -l` report them, and
+ * walks the paths in their load commands (`otool -L`, install_name_tool).
+ *
+ * The file is mapped and only the headers and load commands of each
+ * slice are touched, so a large binary costs a few page faults and no
+ * reads of its code.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define FAT_MAGIC               0xcafebabe
+#define FAT_MAGIC_64            0xcafebabf
+#define MH_MAGIC                0xfeedface
+#define MH_MAGIC_64             0xfeedfacf
+
+#define LC_LOAD_DYLIB           0x0c
+#define LC_ID_DYLIB             0x0d
+#define LC_LAZY_LOAD_DYLIB      0x20
+#define LC_VERSION_MIN_MACOSX   0x24
+#define LC_BUILD_VERSION        0x32
+#define LC_LOAD_WEAK_DYLIB      0x80000018
+#define LC_RPATH                0x8000001c
+#define LC_REEXPORT_DYLIB       0x8000001f
+#define LC_LOAD_UPWARD_DYLIB    0x80000023
+#define PLATFORM_MACOS          1
+
+#define CPU_ARCH_ABI64          0x01000000
+#define CPU_TYPE_X86            7
+#define CPU_TYPE_ARM            12
+#define CPU_TYPE_POWERPC        18
+#define CPU_SUBTYPE_MASK        0xff000000
+#define CPU_SUBTYPE_ARM64E      2
+
+static uint32_t read_u32(const uint8_t *p, BOOL big_endian)
+{
+    if (big_endian)
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static uint64_t read_u64(const uint8_t *p, BOOL big_endian)
+{
+    uint64_t hi = read_u32(p, big_endian), lo = read_u32(p + 4, big_endian);
+
+    return big_endian ? hi << 32 | lo : lo << 32 | hi;
+}
+
+/*
+ * TRUE if the first 8 bytes of a file are a Mach-O or universal header.
+ * 0xcafebabe is also the Java class file magic; there the next word is
+ * the class file version (45 and up), never a plausible slice count.
+ */
+BOOL macho_check_magic(const uint8_t *header, size_t len)
+{
+    uint32_t magic, count;
+
+    if (len < 8)
+        return FALSE;
+
+    magic = read_u32(header, TRUE);
+    switch (magic) {
+        case FAT_MAGIC:
+        case FAT_MAGIC_64:
+            count = read_u32(header + 4, TRUE);
+            return count > 0 && count < 20;
+        default:
+            return magic == MH_MAGIC || magic == MH_MAGIC_64 ||
+                   read_u32(header, FALSE) == MH_MAGIC || read_u32(header, FALSE) == MH_MAGIC_64;
+    }
+}
+
+typedef struct {
+    BOOL big_endian;
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint32_t ncmds;
+    uint8_t *commands;              /* first load command */
+    uint8_t *end;                   /* end of the load commands */
+} SliceHeader;
+
+/* Header of the slice at base, checked to hold its load commands within len */
+static BOOL read_slice_header(uint8_t *base, uint64_t len, SliceHeader *slice)
+{
+    uint32_t magic, sizeofcmds;
+    size_t header_size;
+
+    if (len < 28)
+        return FALSE;
+
+    magic = read_u32(base, FALSE);
+    slice->big_endian = magic != MH_MAGIC && magic != MH_MAGIC_64;
+    magic = read_u32(base, slice->big_endian);
+    if (magic != MH_MAGIC && magic != MH_MAGIC_64)
+        return FALSE;
+
+    header_size = magic == MH_MAGIC_64 ? 32 : 28;
+    slice->cputype = read_u32(base + 4, slice->big_endian);
+    slice->cpusubtype = read_u32(base + 8, slice->big_endian);
+    slice->ncmds = read_u32(base + 16, slice->big_endian);
+    sizeofcmds = read_u32(base + 20, slice->big_endian);
+    if (header_size + (uint64_t)sizeofcmds > len)
+        return FALSE;
+
+    slice->commands = base + header_size;
+    slice->end = slice->commands + sizeofcmds;
+    return TRUE;
+}
+
+/* Next load command of a slice, or NULL; *size is its cmdsize */
+static uint8_t *next_command(const SliceHeader *slice, uint8_t *cmd, uint32_t *index,
+                             uint32_t *type, uint32_t *size)
+{
+    if (*index >= slice->ncmds || cmd + 8 > slice->end)
+        return NULL;
+
+    *type = read_u32(cmd, slice->big_endian);
+    *size = read_u32(cmd + 4, slice->big_endian);
+    if (*size < 8 || *size > (size_t)(slice->end - cmd))
+        return NULL;
+    (*index)++;
+    return cmd;
+}
+
+/*
+ * Find the slices of a mapped file: one for a thin binary, else each
+ * architecture of a universal one that lies within the file. Returns how
+ * many were stored in bases and lens.
+ */
+static int find_slices(uint8_t *data, size_t len, uint8_t **bases, uint64_t *lens)
+{
+    uint32_t magic, count, i;
+    int found = 0;
+
+    if (!macho_check_magic(data, len))
+        return 0;
+
+    magic = read_u32(data, TRUE);
+    if (magic != FAT_MAGIC && magic != FAT_MAGIC_64) {
+        bases[0] = data;
+        lens[0] = len;
+        return 1;
+    }
+
+    count = read_u32(data + 4, TRUE);
+    for (i = 0; i < count && found < MACHO_MAX_SLICES; i++) {
+        size_t entry = magic == FAT_MAGIC_64 ? 32 : 20;
+        const uint8_t *arch = data + 8 + i * entry;
+        uint64_t offset, size;
+
+        if (8 + (i + 1) * entry > len)
+            break;
+        if (magic == FAT_MAGIC_64) {
+            offset = read_u64(arch + 8, TRUE);
+            size = read_u64(arch + 16, TRUE);
+        } else {
+            offset = read_u32(arch + 8, TRUE);
+            size = read_u32(arch + 12, TRUE);
+        }
+        if (offset >= len || size > len - offset)
+            continue;
+
+        bases[found] = data + offset;
+        lens[found++] = size;
+    }
+    return found;
+}
+
+/* Read every slice of the binary at path; FALSE if it is not Mach-O */
+BOOL macho_read_info(const char *path, MachOInfo *info)
+{
+    uint8_t *bases[MACHO_MAX_SLICES];
+    uint64_t lens[MACHO_MAX_SLICES];
+    MappedFile file;
+    int count, s;
+
+    memset(info, 0, sizeof(MachOInfo));
+    if (!path || !map_file(path, &file))
+        return FALSE;
+
+    /* Read-only mapping: nothing below writes through these pointers */
+    count = find_slices((uint8_t *)file.data, file.len, bases, lens);
+    for (s = 0; s < count; s++) {
+        MachOSlice *out = &info->slices[info->count];
+        SliceHeader slice;
+        uint32_t index = 0, type, size;
+        uint8_t *cmd;
+
+        if (!read_slice_header(bases[s], lens[s], &slice))
+            continue;
+        out->cputype = slice.cputype;
+        out->cpusubtype = slice.cpusubtype;
+
+        for (cmd = slice.commands; next_command(&slice, cmd, &index, &type, &size); cmd += size) {
+            /* LC_BUILD_VERSION (macOS 10.14+) supersedes LC_VERSION_MIN_MACOSX */
+            if (type == LC_BUILD_VERSION && size >= 24 &&
+                read_u32(cmd + 8, slice.big_endian) == PLATFORM_MACOS) {
+                out->min_os = read_u32(cmd + 12, slice.big_endian);
+                out->sdk = read_u32(cmd + 16, slice.big_endian);
+            } else if (type == LC_VERSION_MIN_MACOSX && size >= 16 && out->min_os == 0) {
+                out->min_os = read_u32(cmd + 8, slice.big_endian);
+                out->sdk = read_u32(cmd + 12, slice.big_endian);
+            }
+        }
+        info->count++;
+    }
+
+    unmap_file(&file);
+    return info->count > 0;
+}
+
+/*
+ * Call fn for every path-carrying load command (dependent libraries, the
+ * library's own install name, run path entries) of every slice of a
+ * mapped binary. fn gets the NUL-terminated string in place and the room
+ * the command has for it, so a writable mapping can be edited through it.
+ * Stops and returns FALSE when fn does; FALSE too if data is not Mach-O.
+ */
+BOOL macho_for_each_path(uint8_t *data, size_t len, MachOPathFunc fn, void *arg)
+{
+    uint8_t *bases[MACHO_MAX_SLICES];
+    uint64_t lens[MACHO_MAX_SLICES];
+    int count = find_slices(data, len, bases, lens), s;
+
+    for (s = 0; s < count; s++) {
+        SliceHeader slice;
+        uint32_t index = 0, type, size;
+        uint8_t *cmd;
+
+        if (!read_slice_header(bases[s], lens[s], &slice))
+            continue;
+
+        for (cmd = slice.commands; next_command(&slice, cmd, &index, &type, &size); cmd += size) {
+            MachOPathKind kind;
+            uint32_t offset;
+
+            switch (type) {
+                case LC_LOAD_DYLIB:
+                case LC_REEXPORT_DYLIB:
+                case LC_LAZY_LOAD_DYLIB:
+                case LC_LOAD_UPWARD_DYLIB:  kind = MACHO_PATH_DYLIB; break;
+                case LC_LOAD_WEAK_DYLIB:    kind = MACHO_PATH_WEAK_DYLIB; break;
+                case LC_ID_DYLIB:           kind = MACHO_PATH_ID; break;
+                case LC_RPATH:              kind = MACHO_PATH_RPATH; break;
+                default:                    continue;
+            }
+
+            /* lc_str: an offset from the start of the command */
+            offset = read_u32(cmd + 8, slice.big_endian);
+            if (size < 12 || offset < 12 || offset >= size || !memchr(cmd + offset, 0, size - offset))
+                continue;
+            if (!fn(arg, kind, (char *)cmd + offset, size - offset))
+                return FALSE;
+        }
+    }
+    return count > 0;
+}
+
+/* The name lipo uses for a slice, or NULL */
+const char *macho_arch_name(const MachOSlice *slice)
+{
+    switch (slice->cputype) {
+        case CPU_TYPE_X86:                      return "i386";
+        case CPU_TYPE_X86 | CPU_ARCH_ABI64:     return "x86_64";
+        case CPU_TYPE_POWERPC:                  return "ppc";
+        case CPU_TYPE_POWERPC | CPU_ARCH_ABI64: return "ppc64";
+        case CPU_TYPE_ARM | CPU_ARCH_ABI64:
+            return (slice->cpusubtype & ~CPU_SUBTYPE_MASK) == CPU_SUBTYPE_ARM64E ? "arm64e" : "arm64";
+        default:
+            return NULL;
+    }
+}
+
+/* X.Y or X.Y.Z from the nibble-packed xxxx.yy.zz of the load commands */
+void macho_version_string(uint32_t version, char *buf, size_t size)
+{
+    if (version & 0xff)
+        snprintf(buf, size, "%u.%u.%u", version >> 16, (version >> 8) & 0xff, version & 0xff);
+    else
+        snprintf(buf, size, "%u.%u", version >> 16, (version >> 8) & 0xff);
+}
+
+/* Pack "X", "X.Y" or "X.Y.Z" the same way; 0 if it is not a version */
+uint32_t macho_parse_version(const char *s)
+{
+    unsigned major = 0, minor = 0, patch = 0;
+
+    if (!s || sscanf(s, "%u.%u.%u", &major, &minor, &patch) < 1 ||
+        major > 0xffff || minor > 0xff || patch > 0xff)
+        return 0;
+    return major << 16 | minor << 8 | patch;
+}
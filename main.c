@@ -9,55 +9,11 @@
 
 #include "shared.h"
 
-char* heap_printf(const char *format, ...)
-{
-    va_list args;
-    int size = 4096;
-    char *buffer, *ret;
-    int n;
-
-    while (1)
-    {
-        buffer = malloc(size);
-        if (buffer == NULL)
-            break;
-        va_start(args, format);
-        n = vsnprintf(buffer, size, format, args);
-        va_end(args);
-        if (n == -1)
-            size *= 2;
-        else if (n >= size)
-            size = n + 1;
-        else
-            break;
-        free(buffer);
-    }
-
-    if (!buffer) return NULL;
-    ret = realloc( buffer, strlen(buffer) + 1 );
-    if (!ret) ret = buffer;
-    return ret;
-}
-
-BOOL create_directories(char *directory)
-{
-    BOOL ret = TRUE;
-    int i;
-
-    for (i = 0; directory[i]; i++)
-    {
-        if (i > 0 && directory[i] == '/')
-        {
-            directory[i] = 0;
-            mkdir(directory, 0777);
-            directory[i] = '/';
-        }
-    }
-    if (mkdir(directory, 0777) && errno != EEXIST)
-       ret = FALSE;
+/* More workers than this only adds threads waiting on the same disks */
+#define MAX_JOBS 256
 
-    return ret;
-}
+/* A terabyte: past any real budget, and the byte count stays well inside size_t */
+#define MAX_ICON_MEMORY_MB (1024 * 1024)
 
 /* Modern usage function with comprehensive help */
 int usage(char *progname)
@@ -73,9 +29,33 @@ int usage(char *progname)
    printf("  DestinationDir       Directory where .app bundle will be created\n");
    printf("  ExecutableOrCommand  Command or path to execute when launched\n\n");
 
+   printf("Launcher Options:\n");
+   printf("  --launcher MODE      How the bundle starts the command (default: script)\n");
+   printf("                       script: shell helper runs the command as a child\n");
+   printf("                       exec:   shell helper execs the command (no resident sh)\n");
+   printf("                       direct: copy/clone the executable into the bundle,\n");
+   printf("                               no interpreter at all (path must be a file)\n");
+   printf("  --bundle-dylibs      With the direct launcher: copy the non-system dylibs\n");
+   printf("                       the executable needs into Contents/Frameworks and\n");
+   printf("                       point its load commands at the copies\n\n");
+
    printf("Icon Options:\n");
-   printf("  --icon PATH          Icon file (PNG, SVG, or ICNS format)\n");
-   printf("                       Automatically converts PNG/SVG to .icns\n\n");
+   printf("  --icon PATH          Icon file (PNG, SVG, ICNS or ICO format), or a Windows\n");
+   printf("                       .exe/.dll whose embedded icon is used, or an\n");
+   printf("                       .iconset directory / comma-separated PNG list of\n");
+   printf("                       pre-rendered sizes (copied without re-encoding)\n");
+   printf("                       Automatically converts PNG/SVG/EXE to .icns\n");
+   printf("  --icon-compress MODE PNG encoding preset for generated icons\n");
+   printf("                       fast: quickest encode (CI builds)\n");
+   printf("                       balanced: default\n");
+   printf("                       small: smallest ICNS (release builds)\n");
+   printf("  --icns-legacy        Store 16/32/128px icons in the RLE (is32/il32/it32)\n");
+   printf("                       or ARGB (ic04/ic05) encodings when smaller than PNG\n");
+   printf("  --icon-memory MB     Memory for decoding one PNG source (default: 64);\n");
+   printf("                       larger sources are streamed down to 1024px\n");
+   printf("  --async-icon         Publish the bundle at once with a placeholder icon;\n");
+   printf("                       a background process renders the real one, swaps\n");
+   printf("                       it in and re-signs\n\n");
 
    printf("Code Signing Options:\n");
    printf("  --sign IDENTITY      Code signing identity\n");
@@ -88,18 +68,86 @@ int usage(char *progname)
    printf("Info.plist Options:\n");
    printf("  --identifier ID      Custom bundle identifier\n");
    printf("                       Default: auto-generated from bundle name\n");
-   printf("  --min-os VERSION     Minimum macOS version (default: 12.0)\n");
+   printf("  --min-os VERSION     Minimum macOS version (default: what the wrapped\n");
+   printf("                       binary's load commands require, else 12.0)\n");
    printf("                       Examples: 12.0, 13.0, 14.0\n");
    printf("  --category TYPE      App category for Gatekeeper\n");
    printf("                       Default: public.app-category.utilities\n");
    printf("                       Other: developer-tools, productivity, graphics-design\n");
-   printf("  --version VER        Bundle version (default: 1.0.0)\n\n");
+   printf("  --version VER        Bundle version (default: 1.0.0)\n");
+   printf("  --version-from EXE   Read version, copyright and description from a\n");
+   printf("                       Windows .exe/.dll (default: the .exe being bundled)\n");
+   printf("  --associate EXTS     Register as a handler for these file extensions\n");
+   printf("                       (comma-separated, e.g. txt,log,ini)\n");
+   printf("  --localizations FILE Per-locale names, copyright and usage strings,\n");
+   printf("                       one [locale] section each; written as binary\n");
+   printf("                       <locale>.lproj/InfoPlist.strings\n");
+   printf("  --plist-template FILE\n");
+   printf("                       Merge an XML or binary plist over the generated keys\n");
+   printf("  --plist-set KEY=TYPE:VALUE\n");
+   printf("                       Set one key, overriding everything else (repeatable)\n");
+   printf("                       TYPE: string, integer, real, bool or array\n");
+   printf("                       (array values are comma-separated strings)\n\n");
+
+   printf("Reproducible Builds:\n");
+   printf("  --reproducible       Same inputs give a byte-identical bundle: sorted\n");
+   printf("                       plist keys, no timestamps in icons or signatures,\n");
+   printf("                       fixed permissions, every mtime set to\n");
+   printf("                       $SOURCE_DATE_EPOCH (default 0)\n\n");
 
    printf("Entitlement Exceptions (for hardened runtime):\n");
    printf("  --allow-jit          Allow JIT compilation\n");
    printf("  --allow-unsigned     Allow unsigned executable memory\n");
    printf("  --allow-dyld-vars    Allow DYLD environment variables\n\n");
 
+   printf("Audit Mode:\n");
+   printf("  --audit DIR          Scan DIR for existing .app bundles and print a\n");
+   printf("                       JSON-lines report (no positional arguments)\n");
+   printf("  --jobs N             Worker threads for parallel modes (default: CPUs)\n\n");
+
+   printf("Desktop Import Mode:\n");
+   printf("  --import-desktop DIR Build a bundle for every XDG .desktop file under DIR\n");
+   printf("                       into DestinationDir (the only positional argument).\n");
+   printf("                       Name, Exec, Icon and Categories are taken from each\n");
+   printf("                       entry; Icon names are looked up in the icon themes.\n");
+   printf("                       Signing, launcher and icon options apply to all.\n");
+   printf("                       MimeType entries become document associations.\n\n");
+
+   printf("Wine Prefix Mode:\n");
+   printf("  --scan-wine-prefix PREFIX\n");
+   printf("                       Build a bundle for every Start Menu shortcut (.lnk)\n");
+   printf("                       in a Wine prefix into DestinationDir (the only\n");
+   printf("                       positional argument). Target, arguments, working\n");
+   printf("                       directory and icon are read from each shortcut;\n");
+   printf("                       bundles run it with WINEPREFIX set to PREFIX.\n\n");
+
+   printf("Batch Mode:\n");
+   printf("  --batch FILE         Build every bundle listed in a manifest into\n");
+   printf("                       DestinationDir (the only positional argument).\n");
+   printf("                       Each [Name] section takes Exec=, Icon=, Associate=,\n");
+   printf("                       Identifier=, Version=, Category=, MinOS= and\n");
+   printf("                       Launcher=; other options are defaults for all.\n");
+   printf("  --resume             Skip records the batch journal shows as already\n");
+   printf("                       built with the same options and inputs\n\n");
+
+   printf("Reconcile Mode:\n");
+   printf("  --reconcile FILE     Make DestinationDir match a batch manifest: create\n");
+   printf("                       missing bundles, update identifier, version and\n");
+   printf("                       icon in place, rebuild bundles whose command or\n");
+   printf("                       options changed, delete bundles it built that the\n");
+   printf("                       manifest no longer lists. Other bundles are kept.\n");
+   printf("  --dry-run            Print the plan and its estimated cost only\n\n");
+
+   printf("Update Mode:\n");
+   printf("  --update TARGET...   Change existing bundles in place instead of building.\n");
+   printf("                       TARGETs are bundle paths or quoted glob patterns\n");
+   printf("                       ('-' reads paths from stdin). Only the Info.plist\n");
+   printf("                       options given (--identifier, --version, --min-os,\n");
+   printf("                       --category, --associate, --plist-template,\n");
+   printf("                       --plist-set) and --icon are applied; the icon is\n");
+   printf("                       rendered once for all. With --sign, bundles that\n");
+   printf("                       changed are re-signed.\n\n");
+
    printf("Other Options:\n");
    printf("  --help, -h           Show this help message\n\n");
 
@@ -128,9 +176,33 @@ int usage(char *progname)
    printf("     %s 'Midnight Commander' /Applications \\\n", progname);
    printf("       'open -b com.apple.terminal /usr/local/bin/mc' Terminal.png\n\n");
 
+   printf("  6. Inventory existing bundles:\n");
+   printf("     %s --audit /Applications > bundles.jsonl\n\n", progname);
+
+   printf("  7. Mirror Wine's menu entries:\n");
+   printf("     %s --import-desktop ~/.local/share/applications/wine \\\n", progname);
+   printf("       ~/Applications/Wine\n\n");
+
+   printf("  8. Wine program that opens text files:\n");
+   printf("     %s --associate txt,log,ini --icon notepad++.exe 'Notepad++' \\\n", progname);
+   printf("       ~/Applications 'wine \"C:/Program Files/Notepad++/notepad++.exe\"'\n\n");
+
+   printf("  9. Every program installed in a Wine prefix:\n");
+   printf("     %s --scan-wine-prefix ~/.wine ~/Applications/Wine\n\n", progname);
+
+   printf(" 10. Build from a manifest:\n");
+   printf("     %s --batch apps.manifest ~/Applications\n\n", progname);
+
+   printf(" 11. New version and icon for every Wine bundle:\n");
+   printf("     %s --update --version 9.0 --icon wine.png --sign - \\\n", progname);
+   printf("       '/Applications/Wine/*.app'\n\n");
+
+   printf(" 12. Preview syncing a directory to a manifest:\n");
+   printf("     %s --reconcile apps.manifest --dry-run ~/Applications\n\n", progname);
+
    printf("Notes:\n");
    printf("  - May require sudo/root depending on destination directory\n");
-   printf("  - Icon generation requires macOS utilities: sips, iconutil, qlmanage\n");
+   printf("  - PNG icons are converted in-process; SVG icons require qlmanage\n");
    printf("  - Code signing requires valid signing identity in Keychain\n");
    printf("  - Generated bundles are compatible with macOS 12+ (Monterey and later)\n\n");
 
@@ -140,6 +212,65 @@ int usage(char *progname)
    return 1;
 }
 
+/* SOURCE_DATE_EPOCH, as defined by reproducible-builds.org; unset means 0 */
+static BOOL read_source_date_epoch(long long *epoch)
+{
+    const char *value = getenv("SOURCE_DATE_EPOCH");
+    char *end;
+
+    *epoch = 0;
+    if (!value || !*value)
+        return TRUE;
+
+    errno = 0;
+    *epoch = strtoll(value, &end, 10);
+    if (*end || errno != 0 || *epoch < 0 || value[0] < '0' || value[0] > '9') {
+        fprintf(stderr, "Error: SOURCE_DATE_EPOCH must be a non-negative number of seconds, "
+                "got '%s'\n", value);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Modes other than building one bundle; the library never sees these */
+typedef struct {
+    const char *audit_dir;          /* --audit: report on existing bundles instead of building */
+    const char *import_dir;         /* --import-desktop: build one bundle per .desktop file */
+    const char *wine_prefix;        /* --scan-wine-prefix: build one bundle per Start Menu shortcut */
+    const char *batch_file;         /* --batch: build one bundle per manifest record */
+    BOOL resume;                    /* --resume: skip records the batch journal shows as built */
+    const char *reconcile_file;     /* --reconcile: make bundle_dest match a batch manifest */
+    BOOL dry_run;                   /* --dry-run: print the reconcile plan only */
+    BOOL update;                    /* --update: change existing bundles named by the targets */
+    const char *finish_icons_list;  /* internal: render the --async-icon icons listed here */
+    const char *const *update_targets;
+    int update_target_count;
+} CommandModes;
+
+/* Each mode is its own command; main() would otherwise run only the first one given */
+static BOOL check_single_mode(const CommandModes *modes)
+{
+    static const char *const names[] = {
+        "--audit", "--import-desktop", "--scan-wine-prefix", "--batch", "--reconcile", "--update"
+    };
+    const BOOL given[] = {
+        modes->audit_dir != NULL, modes->import_dir != NULL, modes->wine_prefix != NULL,
+        modes->batch_file != NULL, modes->reconcile_file != NULL, modes->update
+    };
+    int first = -1, i;
+
+    for (i = 0; i < (int)(sizeof(given) / sizeof(given[0])); i++) {
+        if (!given[i])
+            continue;
+        if (first >= 0) {
+            fprintf(stderr, "Error: %s cannot be combined with %s\n", names[first], names[i]);
+            return FALSE;
+        }
+        first = i;
+    }
+    return TRUE;
+}
+
 /* Parse command-line arguments using getopt_long */
 static struct option long_options[] = {
     {"icon",            required_argument, 0, 'i'},
@@ -151,26 +282,49 @@ static struct option long_options[] = {
     {"min-os",          required_argument, 0, 'm'},
     {"category",        required_argument, 0, 'c'},
     {"version",         required_argument, 0, 'V'},
+    {"version-from",    required_argument, 0, 'W'},
     {"allow-jit",       no_argument,       0, 'j'},
     {"allow-unsigned",  no_argument,       0, 'u'},
     {"allow-dyld-vars", no_argument,       0, 'd'},
+    {"icon-compress",   required_argument, 0, 'C'},
+    {"icns-legacy",     no_argument,       0, 'G'},
+    {"icon-memory",     required_argument, 0, 'M'},
+    {"launcher",        required_argument, 0, 'L'},
+    {"audit",           required_argument, 0, 'A'},
+    {"jobs",            required_argument, 0, 'J'},
+    {"import-desktop",  required_argument, 0, 'D'},
+    {"associate",       required_argument, 0, 'a'},
+    {"batch",           required_argument, 0, 'B'},
+    {"plist-template",  required_argument, 0, 'T'},
+    {"localizations",   required_argument, 0, 'l'},
+    {"plist-set",       required_argument, 0, 'P'},
+    {"reproducible",    no_argument,       0, 'R'},
+    {"update",          no_argument,       0, 'U'},
+    {"async-icon",      no_argument,       0, 'Y'},
+    {"resume",          no_argument,       0, 'Z'},
+    {"scan-wine-prefix", required_argument, 0, 'X'},
+    {"bundle-dylibs",   no_argument,       0, 'K'},
+    {"reconcile",       required_argument, 0, 'E'},
+    {"dry-run",         no_argument,       0, 'n'},
+    {"finish-icons",    required_argument, 0, 'Q'},     /* internal, see finish_icons_in_background */
     {"help",            no_argument,       0, 'h'},
     {0, 0, 0, 0}
 };
 
-int parse_arguments(int argc, char *argv[], AppBundleOptions *options)
+int parse_arguments(int argc, char *argv[], AppBundleOptions *options, CommandModes *modes)
 {
     int c;
     int option_index = 0;
+    static const char **plist_settings;
+    PlistSetting setting;
+    BOOL category_given = FALSE;
 
     /* Initialize with defaults */
-    memset(options, 0, sizeof(AppBundleOptions));
-    options->min_os_version = "12.0";
-    options->app_category = "public.app-category.utilities";
-    options->version = "1.0.0";
+    appbundle_options_init(options);
+    memset(modes, 0, sizeof(CommandModes));
 
     /* Parse options */
-    while ((c = getopt_long(argc, argv, "i:s:e:I:m:c:V:hHFjud",
+    while ((c = getopt_long(argc, argv, "i:s:e:I:m:c:V:W:C:L:A:J:D:a:B:T:P:M:X:l:E:Q:hHFGKRUYZjudn",
                            long_options, &option_index)) != -1) {
         switch (c) {
             case 'i': options->icon_path = optarg; break;
@@ -180,11 +334,85 @@ int parse_arguments(int argc, char *argv[], AppBundleOptions *options)
             case 'F': options->force_sign = TRUE; break;
             case 'I': options->bundle_identifier = optarg; break;
             case 'm': options->min_os_version = optarg; break;
-            case 'c': options->app_category = optarg; break;
+            case 'c': options->app_category = optarg; category_given = TRUE; break;
             case 'V': options->version = optarg; break;
+            case 'W': options->version_source = optarg; break;
             case 'j': options->allow_jit = TRUE; break;
             case 'u': options->allow_unsigned_memory = TRUE; break;
             case 'd': options->allow_dyld_vars = TRUE; break;
+            case 'K': options->bundle_dylibs = TRUE; break;
+            case 'C':
+                if (strcmp(optarg, "fast") == 0) options->icon_compression = ICON_COMPRESS_FAST;
+                else if (strcmp(optarg, "balanced") == 0) options->icon_compression = ICON_COMPRESS_BALANCED;
+                else if (strcmp(optarg, "small") == 0) options->icon_compression = ICON_COMPRESS_SMALL;
+                else {
+                    fprintf(stderr, "Error: Unknown icon compression '%s' (fast, balanced, small)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'G': options->icns_legacy = TRUE; break;
+            case 'M': {
+                char *end;
+                long mb = strtol(optarg, &end, 10);
+
+                if (end == optarg || *end || mb <= 0 || mb > MAX_ICON_MEMORY_MB) {
+                    fprintf(stderr, "Error: --icon-memory expects a size in MB from 1 to %d, got '%s'\n",
+                            MAX_ICON_MEMORY_MB, optarg);
+                    return 1;
+                }
+                options->icon_memory_mb = (int)mb;
+                break;
+            }
+            case 'L':
+                if (strcmp(optarg, "script") == 0) options->launcher_mode = LAUNCHER_SCRIPT;
+                else if (strcmp(optarg, "exec") == 0) options->launcher_mode = LAUNCHER_EXEC;
+                else if (strcmp(optarg, "direct") == 0) options->launcher_mode = LAUNCHER_DIRECT;
+                else {
+                    fprintf(stderr, "Error: Unknown launcher mode '%s' (script, exec, direct)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'A': modes->audit_dir = optarg; break;
+            case 'J': {
+                char *end;
+                long jobs = strtol(optarg, &end, 10);
+
+                if (end == optarg || *end || jobs <= 0) {
+                    fprintf(stderr, "Error: --jobs expects a positive number, got '%s'\n", optarg);
+                    return 1;
+                }
+                if (jobs > MAX_JOBS) {
+                    fprintf(stderr, "Warning: --jobs %s is more than %d; using %d\n", optarg, MAX_JOBS, MAX_JOBS);
+                    jobs = MAX_JOBS;
+                }
+                options->jobs = (int)jobs;
+                break;
+            }
+            case 'D': modes->import_dir = optarg; break;
+            case 'a': options->associations = optarg; break;
+            case 'B': modes->batch_file = optarg; break;
+            case 'T': options->plist_template = optarg; break;
+            case 'l': options->localizations = optarg; break;
+            case 'P':
+                if (!plist_setting_parse(optarg, &setting)) {
+                    fprintf(stderr, "Error: --plist-set expects KEY=TYPE:VALUE with TYPE string, "
+                            "integer, real, bool or array, got '%s'\n", optarg);
+                    return 1;
+                }
+                /* Never more settings than arguments; lives until exit */
+                if (!plist_settings && !(plist_settings = calloc(argc, sizeof(char *))))
+                    return 1;
+                plist_settings[options->plist_setting_count++] = optarg;
+                options->plist_settings = plist_settings;
+                break;
+            case 'R': options->reproducible = TRUE; break;
+            case 'U': modes->update = TRUE; break;
+            case 'Y': options->async_icon = TRUE; break;
+            case 'Z': modes->resume = TRUE; break;
+            case 'X': modes->wine_prefix = optarg; break;
+            case 'E': modes->reconcile_file = optarg; break;
+            case 'n': modes->dry_run = TRUE; break;
+            case 'Q': modes->finish_icons_list = optarg; break;
             case 'h': return usage(argv[0]);
             case '?': /* Unknown option or missing argument */
                 fprintf(stderr, "\nTry '%s --help' for more information.\n", argv[0]);
@@ -194,6 +422,103 @@ int parse_arguments(int argc, char *argv[], AppBundleOptions *options)
         }
     }
 
+    /* The background half of --async-icon; the list names its bundles */
+    if (modes->finish_icons_list)
+        return 0;
+
+    if (!check_single_mode(modes))
+        return 1;
+
+    if (options->reproducible && !read_source_date_epoch(&options->source_date_epoch))
+        return 1;
+
+    /* The swap touches the bundle after normalization would have run */
+    if (options->reproducible && options->async_icon) {
+        fprintf(stderr, "Error: --async-icon cannot be combined with --reproducible\n");
+        return 1;
+    }
+
+    /* Check the table once here rather than failing every bundle of a batch on it */
+    if (options->localizations) {
+        LocalizationTable table;
+
+        if (!localization_table_load(options->localizations, &table))
+            return 1;
+        localization_table_free(&table);
+    }
+
+    /* Importers always write script launchers, which have no Frameworks to fill */
+    if (options->bundle_dylibs && (modes->import_dir || modes->wine_prefix)) {
+        fprintf(stderr, "Error: --bundle-dylibs cannot be combined with %s\n",
+                modes->import_dir ? "--import-desktop" : "--scan-wine-prefix");
+        return 1;
+    }
+
+    /* Batch records pick their own launcher; only direct ones bundle libraries */
+    if (options->bundle_dylibs && options->launcher_mode != LAUNCHER_DIRECT &&
+        !modes->batch_file && !modes->reconcile_file) {
+        fprintf(stderr, "Error: --bundle-dylibs needs --launcher direct\n");
+        return 1;
+    }
+
+    if (modes->dry_run && !modes->reconcile_file) {
+        fprintf(stderr, "Error: --dry-run only applies to --reconcile\n");
+        return 1;
+    }
+
+    /*
+     * Batch journals and reconcile digests describe finished bundles; a
+     * placeholder icon whose background render died would look final
+     */
+    if ((modes->batch_file || modes->reconcile_file) && options->async_icon) {
+        fprintf(stderr, "Error: --async-icon cannot be combined with %s\n",
+                modes->batch_file ? "--batch" : "--reconcile");
+        return 1;
+    }
+
+    if (modes->resume && !modes->batch_file) {
+        fprintf(stderr, "Error: --resume only applies to --batch\n");
+        return 1;
+    }
+
+    /* Audit mode works on existing bundles and takes no positional arguments */
+    if (modes->audit_dir) {
+        return 0;
+    }
+
+    /* Update mode changes only what was asked for, so the build defaults do not apply */
+    if (modes->update) {
+        if (!category_given) options->app_category = NULL;
+
+        if (argc - optind < 1) {
+            fprintf(stderr, "Error: --update needs at least one bundle or pattern\n\n");
+            return usage(argv[0]);
+        }
+        if (!options->bundle_identifier && !options->version && !options->min_os_version &&
+            !options->app_category && !options->associations && !options->plist_template &&
+            options->plist_setting_count == 0 && !options->icon_path) {
+            fprintf(stderr, "Error: --update needs at least one of --identifier, --version, "
+                    "--min-os, --category, --associate, --plist-template, --plist-set or --icon\n");
+            return 1;
+        }
+        modes->update_targets = (const char *const *)&argv[optind];
+        modes->update_target_count = argc - optind;
+        return 0;
+    }
+
+    /* Desktop import, prefix scans, batch builds and reconciles only need the destination directory */
+    if (modes->import_dir || modes->wine_prefix || modes->batch_file || modes->reconcile_file) {
+        if (argc - optind < 1) {
+            fprintf(stderr, "Error: %s needs a DestinationDir\n\n",
+                    modes->import_dir ? "--import-desktop" :
+                    modes->wine_prefix ? "--scan-wine-prefix" :
+                    modes->batch_file ? "--batch" : "--reconcile");
+            return usage(argv[0]);
+        }
+        options->bundle_dest = argv[optind];
+        return 0;
+    }
+
     /* Parse positional arguments */
     if (argc - optind < 3) {
         fprintf(stderr, "Error: Missing required arguments\n\n");
@@ -212,54 +537,47 @@ int parse_arguments(int argc, char *argv[], AppBundleOptions *options)
     return 0;
 }
 
-/* Error handling functions */
-void print_error(ErrorCode code, const char *details)
-{
-    fprintf(stderr, "ERROR: %s", error_code_to_string(code));
-    if (details) {
-        fprintf(stderr, " - %s", details);
-    }
-    fprintf(stderr, "\n");
-}
-
-const char* error_code_to_string(ErrorCode code)
-{
-    switch (code) {
-        case ERR_SUCCESS:
-            return "Success";
-        case ERR_INVALID_ARGS:
-            return "Invalid arguments";
-        case ERR_DIR_CREATION_FAILED:
-            return "Failed to create directory structure";
-        case ERR_PLIST_GENERATION_FAILED:
-            return "Failed to generate Info.plist";
-        case ERR_SCRIPT_GENERATION_FAILED:
-            return "Failed to generate launcher script";
-        case ERR_ICON_CONVERSION_FAILED:
-            return "Failed to convert icon";
-        case ERR_CODE_SIGNING_FAILED:
-            return "Code signing failed";
-        case ERR_FILE_NOT_FOUND:
-            return "File not found";
-        case ERR_PERMISSION_DENIED:
-            return "Permission denied";
-        default:
-            return "Unknown error";
-    }
-}
-
 int main(int argc, char *argv[])
 {
     AppBundleOptions options;
+    CommandModes modes;
+    AppBundleContext *ctx;
+    ErrorCode err;
     char *bundle_path = NULL;
-    char *temp_entitlements = NULL;
-    int ret = 0;
 
     /* Parse command-line arguments */
-    if (parse_arguments(argc, argv, &options) != 0) {
+    if (parse_arguments(argc, argv, &options, &modes) != 0) {
         return 1;
     }
 
+    if (modes.finish_icons_list) {
+        return finish_icons_from_list(modes.finish_icons_list, &options) ? 0 : 1;
+    }
+
+    if (modes.audit_dir) {
+        return audit_bundles(modes.audit_dir, options.jobs) ? 0 : 1;
+    }
+
+    if (modes.import_dir) {
+        return import_desktop_entries(modes.import_dir, &options) ? 0 : 1;
+    }
+
+    if (modes.wine_prefix) {
+        return scan_wine_prefix(modes.wine_prefix, &options) ? 0 : 1;
+    }
+
+    if (modes.batch_file) {
+        return run_batch(modes.batch_file, &options, modes.resume) ? 0 : 1;
+    }
+
+    if (modes.reconcile_file) {
+        return run_reconcile(modes.reconcile_file, &options, modes.dry_run) ? 0 : 1;
+    }
+
+    if (modes.update) {
+        return run_update(modes.update_targets, modes.update_target_count, &options) ? 0 : 1;
+    }
+
     /* Display configuration (for debugging) */
     printf("Creating app bundle:\n");
     printf("  Name: %s\n", options.bundle_name);
@@ -274,73 +592,35 @@ int main(int argc, char *argv[])
     }
     printf("\n");
 
-    /* Phase 1: Build bundle structure (includes icon if provided) */
-    printf("Building bundle structure...\n");
-    if (!build_app_bundle(&options)) {
-        print_error(ERR_DIR_CREATION_FAILED, "Bundle creation failed");
+    ctx = appbundle_context_create(options.jobs);
+    if (!ctx) {
+        print_error(ERR_DIR_CREATION_FAILED, "Could not create scratch directory");
         return 1;
     }
 
-    printf("Bundle structure created successfully\n");
-
-    /* Calculate bundle path for code signing operations */
-    bundle_path = heap_printf("%s/%s.app", options.bundle_dest, options.bundle_name);
-
-    /* Phase 2: Code signing (if requested) */
-    if (options.signing_identity) {
-        CodeSignOptions sign_opts = {0};
-
-        /* Phase 2a: Generate entitlements if needed */
-        if (!options.entitlements_file && options.enable_hardened_runtime) {
-            /* Auto-generate entitlements file */
-            temp_entitlements = heap_printf("/tmp/appbundle_%d.entitlements", getpid());
-            printf("Generating entitlements...\n");
-
-            if (!generate_entitlements_file(temp_entitlements, options.enable_hardened_runtime,
-                                          options.allow_jit, options.allow_unsigned_memory,
-                                          options.allow_dyld_vars)) {
-                print_error(ERR_CODE_SIGNING_FAILED, "Failed to generate entitlements");
-                ret = 1;
-                goto cleanup;
-            }
-
-            sign_opts.entitlements_path = temp_entitlements;
-        } else if (options.entitlements_file) {
-            sign_opts.entitlements_path = options.entitlements_file;
-        }
-
-        /* Phase 2b: Configure signing options */
-        sign_opts.identity = options.signing_identity;
-        sign_opts.enable_hardened_runtime = options.enable_hardened_runtime;
-        sign_opts.force = options.force_sign;
-        sign_opts.timestamp = TRUE;  /* Always timestamp for distribution */
-
-        /* Phase 2c: Perform code signing */
-        printf("Code signing bundle...\n");
-        if (!codesign_bundle(bundle_path, &sign_opts)) {
-            print_error(ERR_CODE_SIGNING_FAILED, "Code signing failed");
-            ret = 1;
-            goto cleanup;
-        }
-
-        /* Phase 2d: Verify signature */
-        printf("Verifying code signature...\n");
-        if (!verify_codesign(bundle_path)) {
-            print_error(ERR_CODE_SIGNING_FAILED, "Code signature verification failed");
-            ret = 1;
-            goto cleanup;
-        }
+    /* Build, sign and verify the bundle */
+    printf("Building bundle%s...\n", options.signing_identity ? " and code signing" : "");
+    err = appbundle_build(ctx, &options);
+    appbundle_context_destroy(ctx);
 
-        printf("Code signing completed successfully\n");
+    if (err != ERR_SUCCESS) {
+        print_error(err, err == ERR_CODE_SIGNING_FAILED ?
+                    "Code signing or signature verification failed" : "Bundle creation failed");
+        return 1;
     }
 
+    bundle_path = heap_printf("%s/%s.app", options.bundle_dest, options.bundle_name);
+
     printf("\n====================================\n");
     printf("Bundle created successfully!\n");
     printf("====================================\n");
     printf("Location: %s\n", bundle_path);
     printf("\n");
 
-    if (options.icon_path) {
+    if (options.icon_path && options.async_icon) {
+        printf("Icon: Placeholder; the real icon is being rendered in the background\n");
+        finish_icons_in_background(&options, NULL, 1);
+    } else if (options.icon_path) {
         printf("Icon: Converted and added\n");
     }
 
@@ -352,17 +632,7 @@ int main(int argc, char *argv[])
     }
 
     printf("\nYou can now run: open %s\n", bundle_path);
+    free(bundle_path);
 
-cleanup:
-    /* Cleanup */
-    if (temp_entitlements) {
-        unlink(temp_entitlements);
-        free(temp_entitlements);
-    }
-
-    if (bundle_path) {
-        free(bundle_path);
-    }
-
-    return ret;
+    return 0;
 }
@@ -0,0 +1,375 @@
+/*
+ * Nested Code Signing for AppBundleGenerator
+ * Signs the code inside a bundle before the bundle itself: helper tools,
+ * dylibs and nested .app, .xpc, .appex and .framework bundles.
+ *
+ * The bundle is walked once to build a containment tree: every Mach-O file
+ * and nested bundle hangs under the innermost bundle that contains it.
+ * A node's level is its height in that tree (leaves are 0, a bundle is one
+ * above its highest child), so every node of a level is independent of the
+ * others in it. Levels are signed in order, with up to jobs codesign runs
+ * at a time within a level; the caller then signs the outer bundle. Given
+ * a thread budget, a level instead runs on the calling thread plus the
+ * signer threads it can borrow, so concurrent builds stay within --jobs.
+ *
+ * A bundle's main executable is sealed by the bundle's own signature and
+ * is not a node of its own. Nested code gets the identity, hardened runtime
+ * and timestamp settings of the outer bundle, but not its entitlements, and
+ * is always re-signed (--force), replacing ad-hoc linker signatures.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+#define MAX_NESTING_DEPTH   32
+
+typedef struct {
+    char *path;
+    int parent;                     /* enclosing nested bundle, -1 for the outer bundle */
+    int level;                      /* 0 for leaves, else 1 + highest child level */
+    BOOL bundle;
+    char *main_executable;          /* bundles: the file their own signature seals */
+} CodeNode;
+
+typedef struct {
+    CodeNode *nodes;
+    int count;
+    int capacity;
+} CodeTree;
+
+static BOOL has_bundle_extension(const char *name)
+{
+    static const char *const extensions[] = {
+        ".app", ".framework", ".xpc", ".appex", ".bundle", ".plugin", NULL
+    };
+    const char *dot = strrchr(name, '.');
+    int i;
+
+    for (i = 0; dot && extensions[i]; i++) {
+        if (strcmp(dot, extensions[i]) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static BOOL is_macho_file(const char *path)
+{
+    uint8_t header[8];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    BOOL ret;
+
+    if (fd < 0)
+        return FALSE;
+
+    ret = read(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+          macho_check_magic(header, sizeof(header));
+    close(fd);
+    return ret;
+}
+
+/*
+ * The file a bundle's signature seals as its executable: CFBundleExecutable
+ * under Contents/MacOS, or a framework's binary named after the framework
+ * (checked per version in is_main_executable).
+ */
+static char *find_main_executable(const char *bundle_path)
+{
+    PlistDocument doc;
+    const PlistNode *exec;
+    char *plist_path = heap_printf("%s/Contents/Info.plist", bundle_path);
+    char *name = NULL, *ret = NULL;
+
+    if (plist_path && plist_document_open(&doc, plist_path)) {
+        exec = plist_dict_get(&doc, plist_root(&doc), "CFBundleExecutable");
+        name = exec ? plist_string_dup(exec) : NULL;
+        plist_document_close(&doc);
+    }
+    free(plist_path);
+
+    if (name && !strchr(name, '/'))
+        ret = heap_printf("%s/Contents/MacOS/%s", bundle_path, name);
+    free(name);
+    return ret;
+}
+
+/* X.framework/X and X.framework/Versions/<v>/X belong to the framework */
+static BOOL is_main_executable(const char *bundle_path, const char *main_executable,
+                               const char *path)
+{
+    const char *name, *ext, *rest;
+    size_t bundle_len = strlen(bundle_path), name_len;
+
+    if (main_executable)
+        return strcmp(main_executable, path) == 0;
+
+    ext = strrchr(bundle_path, '.');
+    name = strrchr(bundle_path, '/');
+    name = name ? name + 1 : bundle_path;
+    if (!ext || strcmp(ext, ".framework") != 0 || strncmp(path, bundle_path, bundle_len) != 0)
+        return FALSE;
+
+    name_len = (size_t)(ext - name);
+    rest = path + bundle_len;
+    if (strncmp(rest, "/Versions/", 10) == 0) {
+        rest = strchr(rest + 10, '/');
+        if (!rest) return FALSE;
+    }
+    return rest[0] == '/' && strncmp(rest + 1, name, name_len) == 0 && rest[1 + name_len] == '\0';
+}
+
+static int add_node(CodeTree *tree, char *path, int parent, BOOL bundle)
+{
+    CodeNode *node;
+
+    if (tree->count == tree->capacity) {
+        int capacity = tree->capacity ? tree->capacity * 2 : 32;
+        CodeNode *nodes = realloc(tree->nodes, capacity * sizeof(CodeNode));
+
+        if (!nodes) {
+            free(path);
+            return -1;
+        }
+        tree->nodes = nodes;
+        tree->capacity = capacity;
+    }
+
+    node = &tree->nodes[tree->count];
+    memset(node, 0, sizeof(CodeNode));
+    node->path = path;
+    node->parent = parent;
+    node->bundle = bundle;
+    if (bundle)
+        node->main_executable = find_main_executable(path);
+    return tree->count++;
+}
+
+/*
+ * Walk dir, which lies in the bundle at bundle_path (node parent, -1 for
+ * the outer bundle). Symbolic links are not followed: frameworks link
+ * their current version, which is walked once under Versions.
+ */
+static BOOL collect_nested_code(CodeTree *tree, const char *dir_path, const char *bundle_path,
+                                const char *main_executable, int parent, int depth)
+{
+    struct dirent *entry;
+    BOOL ret = TRUE;
+    DIR *dir;
+
+    if (depth > MAX_NESTING_DEPTH) {
+        fprintf(stderr, "Error: %s is nested too deeply to sign\n", dir_path);
+        return FALSE;
+    }
+    if (!(dir = opendir(dir_path)))
+        return TRUE;
+
+    while (ret && (entry = readdir(dir)) != NULL) {
+        struct stat st;
+        char *child;
+        int node;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strcmp(entry->d_name, "_CodeSignature") == 0)
+            continue;
+
+        child = heap_printf("%s/%s", dir_path, entry->d_name);
+        if (!child) {
+            ret = FALSE;
+            break;
+        }
+        if (lstat(child, &st) != 0 || S_ISLNK(st.st_mode)) {
+            free(child);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode) && has_bundle_extension(entry->d_name)) {
+            node = add_node(tree, child, parent, TRUE);
+            ret = node >= 0 && collect_nested_code(tree, child, child, tree->nodes[node].main_executable,
+                                                   node, depth + 1);
+        } else if (S_ISDIR(st.st_mode)) {
+            ret = collect_nested_code(tree, child, bundle_path, main_executable, parent, depth + 1);
+            free(child);
+        } else if (S_ISREG(st.st_mode) && !is_main_executable(bundle_path, main_executable, child) &&
+                   is_macho_file(child)) {
+            ret = add_node(tree, child, parent, FALSE) >= 0;
+        } else {
+            free(child);
+        }
+    }
+
+    closedir(dir);
+    return ret;
+}
+
+static void free_code_tree(CodeTree *tree)
+{
+    int i;
+
+    for (i = 0; i < tree->count; i++) {
+        free(tree->nodes[i].path);
+        free(tree->nodes[i].main_executable);
+    }
+    free(tree->nodes);
+}
+
+/*
+ * Fill argv (CODESIGN_MAX_ARGS entries) with the codesign command that
+ * signs path; returns the argument count. Arguments are passed as-is, no
+ * shell quoting.
+ */
+int codesign_arguments(const char **argv, const char *path, const CodeSignOptions *options)
+{
+    int argc = 0;
+
+    argv[argc++] = "codesign";
+    argv[argc++] = "-s";
+    argv[argc++] = options->identity;
+
+    /* Add hardened runtime flag */
+    if (options->enable_hardened_runtime) {
+        argv[argc++] = "-o";
+        argv[argc++] = "runtime";
+    }
+
+    /* Add force flag to replace existing signature */
+    if (options->force) {
+        argv[argc++] = "--force";
+    }
+
+    /* Add timestamp for distribution (recommended); otherwise explicitly none,
+     * since codesign would add one for Developer ID identities by default */
+    if (options->timestamp) {
+        argv[argc++] = "--timestamp";
+    } else {
+        argv[argc++] = "--timestamp=none";
+    }
+
+    /* Add entitlements if provided */
+    if (options->entitlements_path) {
+        argv[argc++] = "--entitlements";
+        argv[argc++] = options->entitlements_path;
+    }
+
+    /* Add verbose output for debugging */
+    argv[argc++] = "--verbose";
+
+    argv[argc++] = path;
+    argv[argc] = NULL;
+    return argc;
+}
+
+typedef struct {
+    const CodeTree *tree;
+    const CodeSignOptions *options;
+    const int *members;             /* node indexes of this level */
+    BOOL *failed;                   /* per member */
+} LevelRun;
+
+/* Each signer waits for its own codesign child, so other builds' tools are not disturbed */
+static void sign_node(void *arg, int index)
+{
+    LevelRun *run = arg;
+    const char *path = run->tree->nodes[run->members[index]].path;
+    const char *argv[CODESIGN_MAX_ARGS];
+
+    DEBUG_PRINT("  Signing nested %s\n", path);
+    codesign_arguments(argv, path, run->options);
+    if (run_command(argv, RUN_STDERR_STDOUT) != 0) {
+        fprintf(stderr, "Error: could not sign %s\n", path);
+        run->failed[index] = TRUE;
+    }
+}
+
+/*
+ * Sign every node of one level with up to options->jobs codesign runs at a
+ * time, or with a budget, one plus the threads borrowed from it (possibly
+ * none, signing serially)
+ */
+static BOOL sign_level(const CodeTree *tree, int level, const CodeSignOptions *options)
+{
+    LevelRun run;
+    int *members = calloc(tree->count, sizeof(int));
+    BOOL *failed = calloc(tree->count, sizeof(BOOL));
+    int i, count = 0, jobs = options->jobs, borrowed = 0;
+    BOOL ret = members && failed;
+
+    for (i = 0; ret && i < tree->count; i++) {
+        if (tree->nodes[i].level == level)
+            members[count++] = i;
+    }
+
+    if (ret) {
+        run.tree = tree;
+        run.options = options;
+        run.members = members;
+        run.failed = failed;
+        if (options->threads) {
+            borrowed = thread_budget_take(options->threads, count - 1);
+            jobs = borrowed + 1;
+        }
+        parallel_for(count, jobs, sign_node, &run);
+        if (borrowed)
+            thread_budget_return(options->threads, borrowed);
+        for (i = 0; i < count; i++)
+            ret = ret && !failed[i];
+    }
+
+    free(members);
+    free(failed);
+    return ret;
+}
+
+/*
+ * Sign the code nested in bundle_path inside-out, so that the bundle can
+ * be signed next. TRUE if there was nothing to sign.
+ */
+BOOL codesign_nested_code(const char *bundle_path, const CodeSignOptions *options)
+{
+    CodeSignOptions nested = *options;
+    CodeTree tree = {0};
+    char *main_executable;
+    int i, level, max_level = 0;
+    BOOL ret;
+    struct stat st;
+
+    if (stat(bundle_path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return TRUE;
+
+    main_executable = find_main_executable(bundle_path);
+    ret = collect_nested_code(&tree, bundle_path, bundle_path, main_executable, -1, 0);
+    free(main_executable);
+    if (!ret) {
+        free_code_tree(&tree);
+        return FALSE;
+    }
+
+    /* Children come after their parent in walk order, so one backward pass sets every level */
+    for (i = tree.count - 1; i >= 0; i--) {
+        CodeNode *node = &tree.nodes[i];
+
+        if (node->parent >= 0 && tree.nodes[node->parent].level < node->level + 1)
+            tree.nodes[node->parent].level = node->level + 1;
+        if (node->level > max_level)
+            max_level = node->level;
+    }
+
+    if (tree.count > 0)
+        DEBUG_PRINT("Signing %d nested item(s) in %d level(s)\n", tree.count, max_level + 1);
+
+    /* Entitlements describe the app, not its helpers and libraries */
+    nested.entitlements_path = NULL;
+    nested.force = TRUE;
+
+    ret = TRUE;
+    for (level = 0; ret && tree.count > 0 && level <= max_level; level++)
+        ret = sign_level(&tree, level, &nested);
+
+    free_code_tree(&tree);
+    return ret;
+}
@@ -0,0 +1,443 @@
+/*
+ * PE Resource Reader for AppBundleGenerator
+ * Finds the application icon and version information of a Windows
+ * PE/PE32+ executable or DLL.
+ *
+ * The file is memory mapped and only the headers, the resource directory
+ * path to the resource in question and the resource itself are ever
+ * touched, so large executables cost a handful of page faults rather than
+ * a read of the whole file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define PE_RT_ICON          3
+#define PE_RT_GROUP_ICON    14
+#define PE_RT_VERSION       16
+#define PE_DIR_RESOURCE     2
+#define PE_MAX_ICONS        64
+
+typedef struct {
+    uint32_t virtual_address;
+    uint32_t raw_offset;
+    uint32_t raw_size;
+} PeSection;
+
+typedef struct {
+    MappedFile file;
+    PeSection sections[96];
+    int nsections;
+    uint32_t rsrc_rva;
+    uint32_t rsrc_size;
+    const uint8_t *rsrc;            /* resource directory root inside the mapping */
+    size_t rsrc_avail;              /* bytes of .rsrc present in the file from rsrc onward */
+} PeFile;
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Translate a relative virtual address into a pointer into the file.
+ * *avail receives how many bytes from there lie inside both the section's
+ * raw data and the file; NULL if fewer than len.
+ */
+static const uint8_t *pe_rva(const PeFile *pe, uint32_t rva, uint32_t len, size_t *avail)
+{
+    int i;
+
+    for (i = 0; i < pe->nsections; i++) {
+        const PeSection *s = &pe->sections[i];
+        uint64_t offset, span;
+
+        if (rva < s->virtual_address || rva - s->virtual_address >= s->raw_size)
+            continue;
+
+        offset = (uint64_t)s->raw_offset + (rva - s->virtual_address);
+        if (offset >= pe->file.len)
+            return NULL;
+
+        span = s->raw_size - (rva - s->virtual_address);
+        if (span > pe->file.len - offset)
+            span = pe->file.len - offset;
+        if (span < len)
+            return NULL;
+
+        if (avail) *avail = (size_t)span;
+        return pe->file.data + offset;
+    }
+    return NULL;
+}
+
+static BOOL pe_parse_headers(PeFile *pe)
+{
+    const uint8_t *d = pe->file.data;
+    size_t len = pe->file.len;
+    uint32_t pe_off, opt_off, opt_size, dir_off, ndirs;
+    uint16_t magic;
+    int i;
+
+    if (len < 64 || d[0] != 'M' || d[1] != 'Z')
+        return FALSE;
+
+    pe_off = get_le32(d + 0x3C);
+    if ((uint64_t)pe_off + 24 > len || memcmp(d + pe_off, "PE\0\0", 4) != 0)
+        return FALSE;
+
+    pe->nsections = get_le16(d + pe_off + 6);
+    opt_size = get_le16(d + pe_off + 20);
+    opt_off = pe_off + 24;
+    if ((uint64_t)opt_off + opt_size > len || opt_size < 2)
+        return FALSE;
+
+    /* PE32 and PE32+ differ only in where the data directories start */
+    magic = get_le16(d + opt_off);
+    if (magic == 0x10B) {
+        if (opt_size < 96) return FALSE;
+        ndirs = get_le32(d + opt_off + 92);
+        dir_off = opt_off + 96;
+    } else if (magic == 0x20B) {
+        if (opt_size < 112) return FALSE;
+        ndirs = get_le32(d + opt_off + 108);
+        dir_off = opt_off + 112;
+    } else {
+        return FALSE;
+    }
+
+    if (ndirs <= PE_DIR_RESOURCE || dir_off + (PE_DIR_RESOURCE + 1) * 8 > opt_off + opt_size)
+        return FALSE;
+    pe->rsrc_rva = get_le32(d + dir_off + PE_DIR_RESOURCE * 8);
+    pe->rsrc_size = get_le32(d + dir_off + PE_DIR_RESOURCE * 8 + 4);
+    if (!pe->rsrc_rva || !pe->rsrc_size)
+        return FALSE;
+
+    if (pe->nsections > (int)(sizeof(pe->sections) / sizeof(pe->sections[0])) ||
+        (uint64_t)opt_off + opt_size + (uint64_t)pe->nsections * 40 > len)
+        return FALSE;
+
+    for (i = 0; i < pe->nsections; i++) {
+        const uint8_t *s = d + opt_off + opt_size + i * 40;
+
+        pe->sections[i].virtual_address = get_le32(s + 12);
+        pe->sections[i].raw_size = get_le32(s + 16);
+        pe->sections[i].raw_offset = get_le32(s + 20);
+    }
+
+    /* Directory offsets are relative to the root and must stay inside .rsrc */
+    pe->rsrc = pe_rva(pe, pe->rsrc_rva, 16, &pe->rsrc_avail);
+    if (!pe->rsrc)
+        return FALSE;
+    if (pe->rsrc_avail > pe->rsrc_size)
+        pe->rsrc_avail = pe->rsrc_size;
+    return TRUE;
+}
+
+/*
+ * Look up id in the resource directory at dir_offset (relative to the
+ * resource root). id < 0 takes the first entry, named entries included.
+ * Returns the entry's OffsetToData field, or 0 if not found.
+ */
+static uint32_t pe_find_entry(const PeFile *pe, uint32_t dir_offset, int id)
+{
+    uint32_t named, ids, i;
+
+    if ((uint64_t)dir_offset + 16 > pe->rsrc_avail)
+        return 0;
+
+    named = get_le16(pe->rsrc + dir_offset + 12);
+    ids = get_le16(pe->rsrc + dir_offset + 14);
+    if ((uint64_t)dir_offset + 16 + (uint64_t)(named + ids) * 8 > pe->rsrc_avail)
+        return 0;
+
+    for (i = 0; i < named + ids; i++) {
+        const uint8_t *entry = pe->rsrc + dir_offset + 16 + i * 8;
+        uint32_t name = get_le32(entry);
+
+        if (id < 0 || (!(name & 0x80000000u) && name == (uint32_t)id))
+            return get_le32(entry + 4);
+    }
+    return 0;
+}
+
+/* Follow type -> name -> language down to the resource bytes */
+static const uint8_t *pe_find_resource(const PeFile *pe, int type, int id, uint32_t *len)
+{
+    uint32_t off;
+    const uint8_t *data_entry;
+    int level;
+
+    off = pe_find_entry(pe, 0, type);
+    for (level = 0; level < 2; level++) {
+        if (!(off & 0x80000000u))
+            return NULL;
+        off = pe_find_entry(pe, off & 0x7FFFFFFFu, level == 0 ? id : -1);
+    }
+
+    /* Leaf: IMAGE_RESOURCE_DATA_ENTRY */
+    if (!off || (off & 0x80000000u) || (uint64_t)off + 16 > pe->rsrc_avail)
+        return NULL;
+    data_entry = pe->rsrc + off;
+    *len = get_le32(data_entry + 4);
+    return pe_rva(pe, get_le32(data_entry), *len, NULL);
+}
+
+/*
+ * Load the first RT_GROUP_ICON (the one Explorer shows for the file) and
+ * describe each RT_ICON image it references. Images still point into the
+ * mapping, so nothing is copied or decoded here.
+ */
+static int pe_load_icon_group(const PeFile *pe, IconEntry *entries, int max_entries)
+{
+    const uint8_t *group;
+    uint32_t group_len, i, count;
+    int n = 0;
+
+    group = pe_find_resource(pe, PE_RT_GROUP_ICON, -1, &group_len);
+    if (!group || group_len < 6 || get_le16(group + 2) != 1)
+        return 0;
+
+    count = get_le16(group + 4);
+    if (6 + (uint64_t)count * 14 > group_len)
+        return 0;
+
+    for (i = 0; i < count && n < max_entries; i++) {
+        const uint8_t *dir_entry = group + 6 + i * 14;
+        uint16_t icon_id = get_le16(dir_entry + 12);
+        const uint8_t *image;
+        uint32_t image_len;
+
+        image = pe_find_resource(pe, PE_RT_ICON, icon_id, &image_len);
+        if (!image) {
+            DEBUG_PRINT("Icon group references missing RT_ICON %u\n", icon_id);
+            continue;
+        }
+        if (icon_entry_init(&entries[n], image, image_len)) {
+            DEBUG_PRINT("RT_ICON %u: %ux%u, %u bpp%s\n", icon_id, entries[n].width,
+                        entries[n].height, entries[n].bit_count, entries[n].is_png ? " (PNG)" : "");
+            n++;
+        }
+    }
+    return n;
+}
+
+static BOOL pe_open(PeFile *pe, const char *path)
+{
+    memset(pe, 0, sizeof(PeFile));
+    if (!map_file(path, &pe->file)) {
+        DEBUG_PRINT("Cannot map %s\n", path);
+        return FALSE;
+    }
+
+    if (!pe_parse_headers(pe)) {
+        DEBUG_PRINT("%s is not a PE file with resources\n", path);
+        unmap_file(&pe->file);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Render the icon of a Windows executable straight into an ICNS file */
+BOOL convert_pe_to_icns(const char *exe_path, const char *output_icns, const IconRenderOptions *opts)
+{
+    IconEntry entries[PE_MAX_ICONS];
+    PeFile pe;
+    int count;
+    BOOL ret = FALSE;
+
+    if (!pe_open(&pe, exe_path))
+        return FALSE;
+
+    count = pe_load_icon_group(&pe, entries, PE_MAX_ICONS);
+    if (count == 0) {
+        DEBUG_PRINT("No usable icon group in %s\n", exe_path);
+        goto cleanup;
+    }
+
+    ret = icns_render_from_entries(entries, count, output_icns, opts);
+
+cleanup:
+    unmap_file(&pe.file);
+    return ret;
+}
+
+/*
+ * One node of a VS_VERSIONINFO tree: wLength, wValueLength, wType, a
+ * NUL-terminated UTF-16 key, padding to 32 bits, the value, padding, then
+ * child nodes up to wLength.
+ */
+typedef struct {
+    const uint8_t *key;
+    size_t key_units;
+    const uint8_t *value;
+    size_t value_len;               /* bytes */
+    const uint8_t *children;
+    const uint8_t *end;
+} VersionNode;
+
+static size_t align4(size_t n)
+{
+    return (n + 3) & ~(size_t)3;
+}
+
+static BOOL version_node(const uint8_t *base, const uint8_t *p, const uint8_t *limit,
+                         VersionNode *node)
+{
+    size_t length, value_len, pos;
+    uint16_t type;
+
+    if (limit - p < 6)
+        return FALSE;
+
+    length = get_le16(p);
+    value_len = get_le16(p + 2);
+    type = get_le16(p + 4);
+    if (length < 6 || (size_t)(limit - p) < length)
+        return FALSE;
+
+    node->end = p + length;
+    node->key = p + 6;
+    for (pos = 6; pos + 1 < length && (p[pos] || p[pos + 1]); pos += 2)
+        ;
+    if (pos + 1 >= length)
+        return FALSE;
+    node->key_units = (pos - 6) / 2;
+
+    /* Alignment is relative to the start of the resource */
+    pos = align4((size_t)(p - base) + pos + 2) - (size_t)(p - base);
+
+    /* Text values count UTF-16 units, binary values count bytes */
+    if (type == 1) value_len *= 2;
+    if (pos > length) pos = length;
+    if (value_len > length - pos) value_len = length - pos;
+
+    node->value = p + pos;
+    node->value_len = value_len;
+
+    pos = align4((size_t)(p - base) + pos + value_len) - (size_t)(p - base);
+    node->children = pos < length ? p + pos : node->end;
+    return TRUE;
+}
+
+static BOOL version_key_is(const VersionNode *node, const char *ascii)
+{
+    size_t i, n = strlen(ascii);
+
+    if (node->key_units != n) return FALSE;
+    for (i = 0; i < n; i++) {
+        if (node->key[i * 2] != (uint8_t)ascii[i] || node->key[i * 2 + 1] != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void version_string_value(const VersionNode *node, PeString *out)
+{
+    size_t units = node->value_len / 2;
+
+    /* Drop the terminator and any padding NULs */
+    while (units > 0 && node->value[(units - 1) * 2] == 0 && node->value[(units - 1) * 2 + 1] == 0)
+        units--;
+
+    out->utf16 = node->value;
+    out->units = units;
+}
+
+static void read_string_table(const uint8_t *base, const VersionNode *table, PeVersionInfo *info)
+{
+    const uint8_t *p = table->children;
+    VersionNode node;
+
+    while (p < table->end && version_node(base, p, table->end, &node)) {
+        if (version_key_is(&node, "FileVersion"))
+            version_string_value(&node, &info->file_version_str);
+        else if (version_key_is(&node, "ProductVersion"))
+            version_string_value(&node, &info->product_version_str);
+        else if (version_key_is(&node, "LegalCopyright"))
+            version_string_value(&node, &info->copyright);
+        else if (version_key_is(&node, "FileDescription"))
+            version_string_value(&node, &info->description);
+        else if (version_key_is(&node, "ProductName"))
+            version_string_value(&node, &info->product_name);
+        p = node.end + ((align4((size_t)(node.end - base)) - (size_t)(node.end - base)));
+    }
+}
+
+/*
+ * Map path and locate its VS_VERSIONINFO. Strings are left as UTF-16LE
+ * views into the mapping, which stays open until pe_version_info_close().
+ * The first StringTable is used unless a US English one (0409) exists.
+ */
+BOOL pe_version_info_open(const char *path, PeVersionInfo *info)
+{
+    const uint8_t *res, *p, *limit;
+    uint32_t res_len;
+    VersionNode root, node, table, chosen;
+    BOOL have_table = FALSE;
+    PeFile pe;
+
+    memset(info, 0, sizeof(PeVersionInfo));
+    if (!pe_open(&pe, path))
+        return FALSE;
+
+    res = pe_find_resource(&pe, PE_RT_VERSION, -1, &res_len);
+    if (!res || !version_node(res, res, res + res_len, &root) ||
+        !version_key_is(&root, "VS_VERSION_INFO")) {
+        DEBUG_PRINT("No VS_VERSIONINFO in %s\n", path);
+        unmap_file(&pe.file);
+        return FALSE;
+    }
+
+    /* VS_FIXEDFILEINFO: signature, struct version, then MS/LS dwords */
+    if (root.value_len >= 52 && get_le32(root.value) == 0xFEEF04BDu) {
+        const uint8_t *v = root.value;
+
+        info->has_fixed = TRUE;
+        info->file_version[0] = get_le16(v + 10);
+        info->file_version[1] = get_le16(v + 8);
+        info->file_version[2] = get_le16(v + 14);
+        info->file_version[3] = get_le16(v + 12);
+        info->product_version[0] = get_le16(v + 18);
+        info->product_version[1] = get_le16(v + 16);
+        info->product_version[2] = get_le16(v + 22);
+        info->product_version[3] = get_le16(v + 20);
+    }
+
+    for (p = root.children; p < root.end && version_node(res, p, root.end, &node);
+         p = node.end + (align4((size_t)(node.end - res)) - (size_t)(node.end - res))) {
+        if (!version_key_is(&node, "StringFileInfo"))
+            continue;
+
+        limit = node.end;
+        for (p = node.children; p < limit && version_node(res, p, limit, &table);
+             p = table.end + (align4((size_t)(table.end - res)) - (size_t)(table.end - res))) {
+            if (!have_table || (table.key_units >= 4 && table.key[0] == '0' && table.key[2] == '4' &&
+                                table.key[4] == '0' && table.key[6] == '9')) {
+                chosen = table;
+                have_table = TRUE;
+            }
+        }
+        break;
+    }
+
+    if (have_table)
+        read_string_table(res, &chosen, info);
+
+    info->file = pe.file;
+    return TRUE;
+}
+
+void pe_version_info_close(PeVersionInfo *info)
+{
+    unmap_file(&info->file);
+    memset(info, 0, sizeof(PeVersionInfo));
+}
@@ -0,0 +1,805 @@
+/*
+ * Native Property List Reader for AppBundleGenerator
+ * Parses binary (bplist00) and XML plists straight out of an mmap'd file.
+ * String, date and data values are not copied: nodes point back into the
+ * mapping and are decoded on demand by the plist_string_* helpers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "shared.h"
+
+/* Nesting limit; also stops reference cycles in malformed binary plists */
+#define PLIST_MAX_DEPTH 128
+
+static uint32_t plist_new_node(PlistDocument *doc, PlistNodeType type)
+{
+    PlistNode *node;
+
+    if (doc->count == doc->capacity) {
+        uint32_t capacity = doc->capacity ? doc->capacity * 2 : 64;
+        PlistNode *nodes = realloc(doc->nodes, capacity * sizeof(PlistNode));
+        if (!nodes) return 0;
+        doc->nodes = nodes;
+        doc->capacity = capacity;
+    }
+
+    node = &doc->nodes[doc->count];
+    memset(node, 0, sizeof(PlistNode));
+    node->type = type;
+    return doc->count++;
+}
+
+/* Link child as the last child of parent; tail tracks the current last child */
+static void plist_append_child(PlistDocument *doc, uint32_t parent, uint32_t *tail, uint32_t child)
+{
+    if (*tail)
+        doc->nodes[*tail].next_sibling = child;
+    else
+        doc->nodes[parent].first_child = child;
+    *tail = child;
+    doc->nodes[parent].count++;
+}
+
+/* ========== Binary format ========== */
+
+typedef struct {
+    const uint8_t *base;
+    size_t len;
+    const uint8_t *offsets;
+    uint8_t offset_size;
+    uint8_t ref_size;
+    uint64_t num_objects;
+    uint64_t max_nodes;             /* one per reference in the file, plus the root */
+} BinaryPlist;
+
+static uint64_t read_be(const uint8_t *p, unsigned n)
+{
+    uint64_t v = 0;
+    while (n--) v = (v << 8) | *p++;
+    return v;
+}
+
+static BOOL bplist_object_offset(const BinaryPlist *bp, uint64_t ref, size_t *offset)
+{
+    uint64_t off;
+
+    if (ref >= bp->num_objects) return FALSE;
+    off = read_be(bp->offsets + ref * bp->offset_size, bp->offset_size);
+    if (off >= bp->len) return FALSE;
+    *offset = (size_t)off;
+    return TRUE;
+}
+
+/* Decode the length that follows a marker; 0xF means an int object follows */
+static BOOL bplist_count(const BinaryPlist *bp, size_t *pos, uint8_t marker, uint64_t *count)
+{
+    uint8_t info = marker & 0x0F;
+    uint8_t intmarker;
+    unsigned size;
+
+    if (info != 0x0F) {
+        *count = info;
+        return TRUE;
+    }
+
+    if (*pos >= bp->len) return FALSE;
+    intmarker = bp->base[(*pos)++];
+    if ((intmarker & 0xF0) != 0x10) return FALSE;
+    size = 1u << (intmarker & 0x0F);
+    if (size > 8 || *pos + size > bp->len) return FALSE;
+    *count = read_be(bp->base + *pos, size);
+    *pos += size;
+    return TRUE;
+}
+
+static uint32_t bplist_parse_object(PlistDocument *doc, const BinaryPlist *bp, uint64_t ref, int depth)
+{
+    size_t pos;
+    uint8_t marker;
+    uint64_t count, i;
+    uint32_t node, tail = 0;
+    unsigned size;
+
+    /*
+     * Shared references are expanded into copies, so containers that each
+     * reference the same child twice would double the tree per level
+     */
+    if (depth > PLIST_MAX_DEPTH || doc->count > bp->max_nodes) return 0;
+    if (!bplist_object_offset(bp, ref, &pos)) return 0;
+
+    marker = bp->base[pos++];
+
+    switch (marker & 0xF0) {
+        case 0x00:
+            if (marker == 0x08 || marker == 0x09) {
+                node = plist_new_node(doc, PLIST_NODE_BOOL);
+                if (node) doc->nodes[node].value.integer = (marker == 0x09);
+                return node;
+            }
+            return 0;
+
+        case 0x10:
+            size = 1u << (marker & 0x0F);
+            if (size > 16 || pos + size > bp->len) return 0;
+            node = plist_new_node(doc, PLIST_NODE_INTEGER);
+            /* 16-byte ints only carry a sign extension in the high half */
+            if (node) doc->nodes[node].value.integer =
+                (int64_t)read_be(bp->base + pos + (size > 8 ? size - 8 : 0), size > 8 ? 8 : size);
+            return node;
+
+        case 0x20:
+        case 0x30:
+            size = (marker == 0x33) ? 8 : 1u << (marker & 0x0F);
+            if ((size != 4 && size != 8) || pos + size > bp->len) return 0;
+            node = plist_new_node(doc, marker == 0x33 ? PLIST_NODE_DATE : PLIST_NODE_REAL);
+            if (node) {
+                uint64_t bits = read_be(bp->base + pos, size);
+                if (size == 4) {
+                    uint32_t b32 = (uint32_t)bits;
+                    float f;
+                    memcpy(&f, &b32, sizeof(f));
+                    doc->nodes[node].value.real = f;
+                } else {
+                    memcpy(&doc->nodes[node].value.real, &bits, sizeof(double));
+                }
+                doc->nodes[node].encoding = PLIST_TEXT_NONE;
+            }
+            return node;
+
+        case 0x40:
+        case 0x50:
+        case 0x60:
+            if (!bplist_count(bp, &pos, marker, &count)) return 0;
+            if (count > bp->len - pos) return 0;
+            if ((marker & 0xF0) == 0x60) count *= 2;
+            if (count > bp->len - pos) return 0;
+            node = plist_new_node(doc, (marker & 0xF0) == 0x40 ? PLIST_NODE_DATA : PLIST_NODE_STRING);
+            if (node) {
+                doc->nodes[node].ptr = (const char *)bp->base + pos;
+                doc->nodes[node].len = (size_t)count;
+                doc->nodes[node].encoding = (marker & 0xF0) == 0x60 ? PLIST_TEXT_UTF16BE : PLIST_TEXT_RAW;
+            }
+            return node;
+
+        case 0x80:
+            size = (marker & 0x0F) + 1;
+            if (pos + size > bp->len) return 0;
+            node = plist_new_node(doc, PLIST_NODE_INTEGER);
+            if (node) doc->nodes[node].value.integer = (int64_t)read_be(bp->base + pos, size);
+            return node;
+
+        case 0xA0:
+        case 0xD0: {
+            BOOL is_dict = (marker & 0xF0) == 0xD0;
+            uint64_t nrefs;
+
+            if (!bplist_count(bp, &pos, marker, &count)) return 0;
+            if (count > bp->len) return 0;
+            nrefs = is_dict ? count * 2 : count;
+            if (nrefs > (bp->len - pos) / bp->ref_size) return 0;
+
+            node = plist_new_node(doc, is_dict ? PLIST_NODE_DICT : PLIST_NODE_ARRAY);
+            if (!node) return 0;
+
+            for (i = 0; i < count; i++) {
+                uint32_t child;
+
+                if (is_dict) {
+                    uint64_t keyref = read_be(bp->base + pos + i * bp->ref_size, bp->ref_size);
+                    child = bplist_parse_object(doc, bp, keyref, depth + 1);
+                    if (!child || doc->nodes[child].type != PLIST_NODE_STRING) return 0;
+                    doc->nodes[child].type = PLIST_NODE_KEY;
+                    plist_append_child(doc, node, &tail, child);
+                }
+
+                child = bplist_parse_object(doc, bp,
+                    read_be(bp->base + pos + (is_dict ? count + i : i) * bp->ref_size, bp->ref_size),
+                    depth + 1);
+                if (!child) return 0;
+                plist_append_child(doc, node, &tail, child);
+            }
+
+            /* Dict count is the number of pairs, not children */
+            if (is_dict) doc->nodes[node].count = (uint32_t)count;
+            return node;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+static BOOL bplist_parse(PlistDocument *doc, const uint8_t *base, size_t len)
+{
+    BinaryPlist bp;
+    const uint8_t *trailer;
+    uint64_t top, table;
+
+    if (len < 8 + 32 || memcmp(base, "bplist00", 8) != 0)
+        return FALSE;
+
+    trailer = base + len - 32;
+    bp.base = base;
+    bp.len = len;
+    bp.offset_size = trailer[6];
+    bp.ref_size = trailer[7];
+    bp.num_objects = read_be(trailer + 8, 8);
+    top = read_be(trailer + 16, 8);
+    table = read_be(trailer + 24, 8);
+
+    if (bp.offset_size < 1 || bp.offset_size > 8 || bp.ref_size < 1 || bp.ref_size > 8)
+        return FALSE;
+    if (table >= len - 32 || bp.num_objects > (len - 32 - table) / bp.offset_size)
+        return FALSE;
+    bp.offsets = base + table;
+    bp.max_nodes = len / bp.ref_size + 1;
+
+    doc->format = PLIST_FORMAT_BINARY;
+    doc->root = bplist_parse_object(doc, &bp, top, 0);
+    return doc->root != 0;
+}
+
+/* ========== XML format ========== */
+
+typedef struct {
+    uint32_t node;
+    uint32_t tail;
+} XmlFrame;
+
+static const char *xml_skip_to(const char *p, const char *end, const char *needle)
+{
+    size_t n = strlen(needle);
+
+    while (p + n <= end) {
+        if (*p == *needle && memcmp(p, needle, n) == 0)
+            return p + n;
+        p++;
+    }
+    return NULL;
+}
+
+static BOOL xml_name_is(const char *name, size_t len, const char *expected)
+{
+    return strlen(expected) == len && memcmp(name, expected, len) == 0;
+}
+
+static BOOL xml_parse(PlistDocument *doc, const char *p, const char *end)
+{
+    XmlFrame stack[PLIST_MAX_DEPTH];
+    int depth = 0;
+
+    doc->format = PLIST_FORMAT_XML;
+
+    while (p < end) {
+        const char *name, *tag_end;
+        size_t name_len;
+        BOOL closing = FALSE, empty = FALSE;
+        PlistNodeType type;
+        uint32_t node;
+
+        /* Character data between container elements is whitespace; skip it */
+        p = memchr(p, '<', end - p);
+        if (!p) break;
+        p++;
+        if (p >= end) return FALSE;
+
+        if (*p == '?') {
+            if (!(p = xml_skip_to(p, end, "?>"))) return FALSE;
+            continue;
+        }
+        if (*p == '!') {
+            if (end - p >= 3 && p[1] == '-' && p[2] == '-')
+                p = xml_skip_to(p, end, "-->");
+            else
+                p = xml_skip_to(p, end, ">");
+            if (!p) return FALSE;
+            continue;
+        }
+
+        if (*p == '/') {
+            closing = TRUE;
+            p++;
+        }
+
+        name = p;
+        while (p < end && *p != '>' && *p != '/' && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+            p++;
+        name_len = p - name;
+
+        tag_end = memchr(p, '>', end - p);
+        if (!tag_end) return FALSE;
+        empty = tag_end > p && tag_end[-1] == '/';
+        p = tag_end + 1;
+
+        if (xml_name_is(name, name_len, "plist"))
+            continue;
+
+        if (closing) {
+            if (xml_name_is(name, name_len, "dict") || xml_name_is(name, name_len, "array")) {
+                if (depth == 0) return FALSE;
+                depth--;
+            }
+            continue;
+        }
+
+        if (xml_name_is(name, name_len, "dict")) type = PLIST_NODE_DICT;
+        else if (xml_name_is(name, name_len, "array")) type = PLIST_NODE_ARRAY;
+        else if (xml_name_is(name, name_len, "key")) type = PLIST_NODE_KEY;
+        else if (xml_name_is(name, name_len, "string")) type = PLIST_NODE_STRING;
+        else if (xml_name_is(name, name_len, "integer")) type = PLIST_NODE_INTEGER;
+        else if (xml_name_is(name, name_len, "real")) type = PLIST_NODE_REAL;
+        else if (xml_name_is(name, name_len, "true")) type = PLIST_NODE_BOOL;
+        else if (xml_name_is(name, name_len, "false")) type = PLIST_NODE_BOOL;
+        else if (xml_name_is(name, name_len, "date")) type = PLIST_NODE_DATE;
+        else if (xml_name_is(name, name_len, "data")) type = PLIST_NODE_DATA;
+        else {
+            DEBUG_PRINT("Unexpected plist element <%.*s>\n", (int)name_len, name);
+            return FALSE;
+        }
+
+        node = plist_new_node(doc, type);
+        if (!node) return FALSE;
+
+        if (type == PLIST_NODE_BOOL) {
+            doc->nodes[node].value.integer = (name[0] == 't');
+        } else if (type != PLIST_NODE_DICT && type != PLIST_NODE_ARRAY && !empty) {
+            /* Leaf: text runs to the matching close tag */
+            const char *text = p;
+            const char *close = memchr(p, '<', end - p);
+            PlistNode *n = &doc->nodes[node];
+
+            if (!close) return FALSE;
+            n->ptr = text;
+            n->len = close - text;
+            n->encoding = memchr(text, '&', close - text) ? PLIST_TEXT_XML : PLIST_TEXT_RAW;
+            if (type == PLIST_NODE_DATA) n->encoding = PLIST_TEXT_BASE64;
+
+            if (type == PLIST_NODE_INTEGER || type == PLIST_NODE_REAL) {
+                char number[64];
+                size_t len = n->len < sizeof(number) - 1 ? n->len : sizeof(number) - 1;
+                memcpy(number, text, len);
+                number[len] = '\0';
+                if (type == PLIST_NODE_INTEGER) {
+                    /* Decimal only: a leading 0 is not octal here, as in CoreFoundation */
+                    char *rest;
+
+                    n->value.integer = strtoll(number, &rest, 10);
+                    while (*rest == ' ' || *rest == '\t' || *rest == '\n' || *rest == '\r') rest++;
+                    if (rest == number || *rest) return FALSE;
+                } else {
+                    n->value.real = strtod(number, NULL);
+                }
+            }
+
+            if (!(p = xml_skip_to(close, end, ">"))) return FALSE;
+        }
+
+        if (depth == 0) {
+            if (doc->root) return FALSE;   /* more than one top-level object */
+            doc->root = node;
+        } else {
+            XmlFrame *frame = &stack[depth - 1];
+            plist_append_child(doc, frame->node, &frame->tail, node);
+        }
+
+        if ((type == PLIST_NODE_DICT || type == PLIST_NODE_ARRAY) && !empty) {
+            if (depth == PLIST_MAX_DEPTH) return FALSE;
+            stack[depth].node = node;
+            stack[depth].tail = 0;
+            depth++;
+        }
+    }
+
+    if (depth != 0 || !doc->root) return FALSE;
+
+    /* Dict counts were accumulated per child; report pairs like the binary parser */
+    for (uint32_t i = 1; i < doc->count; i++) {
+        if (doc->nodes[i].type == PLIST_NODE_DICT)
+            doc->nodes[i].count /= 2;
+    }
+
+    return TRUE;
+}
+
+/* ========== Document API ========== */
+
+/* Parse an in-memory plist; bytes must stay valid for the life of doc */
+BOOL plist_document_parse(PlistDocument *doc, const void *bytes, size_t len)
+{
+    const char *p = bytes;
+
+    memset(doc, 0, sizeof(PlistDocument));
+    if (!bytes || len == 0) return FALSE;
+
+    /* Slot 0 is the "no node" sentinel */
+    plist_new_node(doc, PLIST_NODE_NONE);
+    if (doc->count != 1) return FALSE;
+
+    if (len >= 8 && memcmp(p, "bplist00", 8) == 0) {
+        if (bplist_parse(doc, bytes, len)) return TRUE;
+    } else if (xml_parse(doc, p, p + len)) {
+        return TRUE;
+    }
+
+    DEBUG_PRINT("Failed to parse property list\n");
+    free(doc->nodes);
+    doc->nodes = NULL;
+    doc->count = doc->capacity = 0;
+    doc->root = 0;
+    return FALSE;
+}
+
+/* mmap path read-only and parse it in place */
+BOOL plist_document_open(PlistDocument *doc, const char *path)
+{
+    MappedFile file;
+
+    memset(doc, 0, sizeof(PlistDocument));
+
+    if (!map_file(path, &file))
+        return FALSE;
+
+    if (!plist_document_parse(doc, file.data, file.len)) {
+        unmap_file(&file);
+        return FALSE;
+    }
+
+    doc->map = (void *)file.data;
+    doc->map_len = file.len;
+    return TRUE;
+}
+
+void plist_document_close(PlistDocument *doc)
+{
+    if (!doc) return;
+
+    free(doc->nodes);
+    if (doc->map)
+        munmap(doc->map, doc->map_len);
+    memset(doc, 0, sizeof(PlistDocument));
+}
+
+const PlistNode *plist_root(const PlistDocument *doc)
+{
+    return (doc && doc->root) ? &doc->nodes[doc->root] : NULL;
+}
+
+const PlistNode *plist_first_child(const PlistDocument *doc, const PlistNode *node)
+{
+    return (node && node->first_child) ? &doc->nodes[node->first_child] : NULL;
+}
+
+const PlistNode *plist_next_sibling(const PlistDocument *doc, const PlistNode *node)
+{
+    return (node && node->next_sibling) ? &doc->nodes[node->next_sibling] : NULL;
+}
+
+/* Look up key in a dict node; returns the value node or NULL */
+const PlistNode *plist_dict_get(const PlistDocument *doc, const PlistNode *dict, const char *key)
+{
+    const PlistNode *child;
+
+    if (!dict || dict->type != PLIST_NODE_DICT) return NULL;
+
+    for (child = plist_first_child(doc, dict); child; child = plist_next_sibling(doc, child)) {
+        const PlistNode *value = plist_next_sibling(doc, child);
+        if (!value) break;
+        if (child->type == PLIST_NODE_KEY && plist_string_equals(child, key))
+            return value;
+        child = value;
+    }
+
+    return NULL;
+}
+
+static size_t utf8_put(char *out, uint32_t cp)
+{
+    if (cp < 0x80) { out[0] = (char)cp; return 1; }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/*
+ * The code point of a &#N; or &#xN; reference of n bytes, ';' included.
+ * FALSE for anything that is not a character UTF-8 can carry in a C
+ * string: NUL, surrogates and values past U+10FFFF, or a malformed number.
+ */
+static BOOL parse_char_ref(const char *s, size_t n, uint32_t *cp)
+{
+    BOOL hex = s[2] == 'x' || s[2] == 'X';
+    size_t i = hex ? 3 : 2;
+    uint32_t value = 0;
+
+    if (i >= n - 1)
+        return FALSE;
+
+    for (; i < n - 1; i++) {
+        char c = s[i];
+        uint32_t digit;
+
+        if (c >= '0' && c <= '9') digit = (uint32_t)(c - '0');
+        else if (hex && c >= 'a' && c <= 'f') digit = (uint32_t)(c - 'a' + 10);
+        else if (hex && c >= 'A' && c <= 'F') digit = (uint32_t)(c - 'A' + 10);
+        else return FALSE;
+
+        value = value * (hex ? 16 : 10) + digit;
+        if (value > 0x10FFFF)
+            return FALSE;
+    }
+
+    if (value == 0 || (value >= 0xD800 && value < 0xE000))
+        return FALSE;
+    *cp = value;
+    return TRUE;
+}
+
+/*
+ * Decode a string/key/date node to NUL-terminated UTF-8.
+ * Returns the decoded length; output is truncated to bufsize - 1.
+ */
+size_t plist_string_copy(const PlistNode *node, char *buf, size_t bufsize)
+{
+    char tmp[4];
+    size_t out = 0, i, n;
+
+    if (!node || !buf || bufsize == 0) return 0;
+
+#define PLIST_EMIT(src, count) do { \
+        for (size_t k_ = 0; k_ < (count); k_++) { \
+            if (out + 1 < bufsize) buf[out] = (src)[k_]; \
+            out++; \
+        } \
+    } while (0)
+
+    switch (node->encoding) {
+        case PLIST_TEXT_UTF16BE:
+            for (i = 0; i + 1 < node->len; i += 2) {
+                const uint8_t *u = (const uint8_t *)node->ptr + i;
+                uint32_t cp = ((uint32_t)u[0] << 8) | u[1];
+
+                if (cp >= 0xD800 && cp < 0xDC00 && i + 3 < node->len) {
+                    uint32_t lo = ((uint32_t)u[2] << 8) | u[3];
+                    if (lo >= 0xDC00 && lo < 0xE000) {
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        i += 2;
+                    }
+                }
+                /* Unpaired surrogates have no UTF-8 form, and NUL would end the string */
+                if (cp == 0 || (cp >= 0xD800 && cp < 0xE000))
+                    cp = 0xFFFD;
+                n = utf8_put(tmp, cp);
+                PLIST_EMIT(tmp, n);
+            }
+            break;
+
+        case PLIST_TEXT_XML:
+            for (i = 0; i < node->len; i++) {
+                const char *s = node->ptr + i;
+                const char *semi;
+                uint32_t cp;
+
+                if (*s != '&' || !(semi = memchr(s, ';', node->len - i))) {
+                    PLIST_EMIT(s, 1);
+                    continue;
+                }
+
+                n = semi - s + 1;
+                if (n == 4 && memcmp(s, "&lt;", 4) == 0) PLIST_EMIT("<", 1);
+                else if (n == 4 && memcmp(s, "&gt;", 4) == 0) PLIST_EMIT(">", 1);
+                else if (n == 5 && memcmp(s, "&amp;", 5) == 0) PLIST_EMIT("&", 1);
+                else if (n == 6 && memcmp(s, "&quot;", 6) == 0) PLIST_EMIT("\"", 1);
+                else if (n == 6 && memcmp(s, "&apos;", 6) == 0) PLIST_EMIT("'", 1);
+                else if (n > 3 && s[1] == '#' && parse_char_ref(s, n, &cp)) {
+                    size_t len = utf8_put(tmp, cp);
+                    PLIST_EMIT(tmp, len);
+                } else {
+                    PLIST_EMIT(s, n);
+                }
+                i += n - 1;
+            }
+            break;
+
+        default:
+            PLIST_EMIT(node->ptr, node->len);
+            break;
+    }
+
+#undef PLIST_EMIT
+
+    buf[out < bufsize ? out : bufsize - 1] = '\0';
+    return out;
+}
+
+/* Heap-allocated UTF-8 copy of a string node; caller frees */
+char *plist_string_dup(const PlistNode *node)
+{
+    char probe[1];
+    size_t len;
+    char *s;
+
+    if (!node || (node->type != PLIST_NODE_STRING && node->type != PLIST_NODE_KEY &&
+                  node->type != PLIST_NODE_DATE))
+        return NULL;
+
+    len = plist_string_copy(node, probe, sizeof(probe));
+    s = malloc(len + 1);
+    if (!s) return NULL;
+    plist_string_copy(node, s, len + 1);
+    return s;
+}
+
+/* Compare without allocating in the common (unescaped) case */
+BOOL plist_string_equals(const PlistNode *node, const char *s)
+{
+    char buf[256];
+    size_t len;
+
+    if (!node || !s) return FALSE;
+
+    if (node->encoding == PLIST_TEXT_RAW)
+        return strlen(s) == node->len && memcmp(node->ptr, s, node->len) == 0;
+
+    len = plist_string_copy(node, buf, sizeof(buf));
+    return len < sizeof(buf) && strcmp(buf, s) == 0;
+}
+
+static int base64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/*
+ * Return the bytes of a data node. Binary plists hand back a pointer into
+ * the mapping; XML base64 is decoded into a malloc'd buffer stored in *owned.
+ */
+const uint8_t *plist_data_bytes(const PlistNode *node, size_t *len, uint8_t **owned)
+{
+    uint8_t *out;
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t i, n = 0;
+
+    *owned = NULL;
+    *len = 0;
+    if (!node || node->type != PLIST_NODE_DATA) return NULL;
+
+    if (node->encoding != PLIST_TEXT_BASE64) {
+        *len = node->len;
+        return (const uint8_t *)node->ptr;
+    }
+
+    out = malloc(node->len / 4 * 3 + 3);
+    if (!out) return NULL;
+
+    for (i = 0; i < node->len; i++) {
+        int v = base64_value(node->ptr[i]);
+        if (v < 0) continue;   /* whitespace, padding */
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out[n++] = (uint8_t)(acc >> bits);
+        }
+    }
+
+    *owned = out;
+    *len = n;
+    return out;
+}
+
+/* Seconds since 2001-01-01 00:00:00 UTC, the property list epoch */
+#define PLIST_EPOCH_OFFSET 978307200
+
+/*
+ * Value of a date node in seconds since 2001-01-01 UTC. Binary plists store
+ * that directly; XML dates are ISO 8601 in UTC ("2024-05-01T12:00:00Z").
+ */
+BOOL plist_date_value(const PlistNode *node, double *seconds)
+{
+    char text[32];
+    struct tm tm;
+    int year, month, day, hour = 0, minute = 0, second = 0;
+
+    if (!node || node->type != PLIST_NODE_DATE) return FALSE;
+
+    if (node->encoding == PLIST_TEXT_NONE) {
+        *seconds = node->value.real;
+        return TRUE;
+    }
+
+    plist_string_copy(node, text, sizeof(text));
+    if (sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2d", &year, &month, &day, &hour, &minute, &second) < 3)
+        return FALSE;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = year - 1900;
+    tm.tm_mon = month - 1;
+    tm.tm_mday = day;
+    tm.tm_hour = hour;
+    tm.tm_min = minute;
+    tm.tm_sec = second;
+    *seconds = (double)timegm(&tm) - PLIST_EPOCH_OFFSET;
+    return TRUE;
+}
+
+/*
+ * Parse a --plist-set KEY=TYPE:VALUE setting. TYPE is string, integer,
+ * real, bool (true/false/yes/no/1/0) or array (comma-separated strings).
+ * key and value point into spec.
+ */
+BOOL plist_setting_parse(const char *spec, PlistSetting *setting)
+{
+    static const struct {
+        const char *name;
+        PlistNodeType type;
+    } types[] = {
+        { "string", PLIST_NODE_STRING },
+        { "integer", PLIST_NODE_INTEGER },
+        { "real", PLIST_NODE_REAL },
+        { "bool", PLIST_NODE_BOOL },
+        { "array", PLIST_NODE_ARRAY }
+    };
+    const char *eq, *colon, *value;
+    char *end;
+    size_t i, type_len;
+
+    memset(setting, 0, sizeof(PlistSetting));
+    if (!spec || !(eq = strchr(spec, '=')) || eq == spec || !(colon = strchr(eq + 1, ':')))
+        return FALSE;
+
+    type_len = (size_t)(colon - eq - 1);
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (strlen(types[i].name) == type_len && memcmp(types[i].name, eq + 1, type_len) == 0)
+            break;
+    }
+    if (i == sizeof(types) / sizeof(types[0]))
+        return FALSE;
+
+    value = colon + 1;
+    setting->key = spec;
+    setting->key_len = (size_t)(eq - spec);
+    setting->type = types[i].type;
+    setting->value = value;
+
+    switch (setting->type) {
+        case PLIST_NODE_INTEGER:
+            /* Decimal only, so 010 is ten as in an XML plist */
+            setting->integer = strtoll(value, &end, 10);
+            return *value && !*end;
+        case PLIST_NODE_REAL:
+            setting->real = strtod(value, &end);
+            return *value && !*end;
+        case PLIST_NODE_BOOL:
+            if (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0)
+                setting->integer = 1;
+            else if (strcmp(value, "false") != 0 && strcmp(value, "no") != 0 && strcmp(value, "0") != 0)
+                return FALSE;
+            return TRUE;
+        default:
+            return TRUE;
+    }
+}
@@ -0,0 +1,451 @@
+/*
+ * Binary Property List Writer for AppBundleGenerator
+ * Serializes CF property lists to bplist00 with dictionary keys in sorted
+ * order, so the same dictionary always produces the same bytes no matter
+ * how CF happens to order it internally. Equal strings are stored once.
+ *
+ * A PlistWriter keeps its object table and output buffer between calls;
+ * reuse one to serialize many small plists without reallocating.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "shared.h"
+
+/* Nesting limit, matching the reader */
+#define PLIST_WRITE_MAX_DEPTH 128
+
+struct PlistWriter {
+    /* Flattened objects; containers list their children's indexes in refs */
+    CFTypeRef *objects;
+    uint32_t *first_ref;            /* per object: start of its refs (containers only) */
+    uint32_t object_count;
+    uint32_t object_capacity;
+    uint32_t *refs;
+    uint32_t ref_count;
+    uint32_t ref_capacity;
+
+    /* Open-addressing set of string objects already flattened */
+    uint32_t *string_slots;         /* object index + 1, 0 = empty */
+    uint32_t string_slot_count;     /* power of two */
+    uint32_t string_count;
+
+    uint64_t *offsets;              /* per object: position in data */
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+    UInt8 *scratch;                 /* string encoding buffer */
+    size_t scratch_capacity;
+};
+
+PlistWriter *plist_writer_create(void)
+{
+    return calloc(1, sizeof(PlistWriter));
+}
+
+void plist_writer_destroy(PlistWriter *writer)
+{
+    if (!writer) return;
+
+    free(writer->objects);
+    free(writer->first_ref);
+    free(writer->refs);
+    free(writer->string_slots);
+    free(writer->offsets);
+    free(writer->data);
+    free(writer->scratch);
+    free(writer);
+}
+
+static BOOL grow_refs(PlistWriter *writer, uint32_t needed)
+{
+    uint32_t capacity = writer->ref_capacity ? writer->ref_capacity : 64;
+    uint32_t *refs;
+
+    if (needed <= writer->ref_capacity) return TRUE;
+    while (capacity < needed) capacity *= 2;
+
+    refs = realloc(writer->refs, capacity * sizeof(uint32_t));
+    if (!refs) return FALSE;
+    writer->refs = refs;
+    writer->ref_capacity = capacity;
+    return TRUE;
+}
+
+static BOOL put_bytes(PlistWriter *writer, const void *bytes, size_t n)
+{
+    if (writer->len + n > writer->capacity) {
+        size_t capacity = writer->capacity ? writer->capacity : 4096;
+        uint8_t *data;
+
+        while (capacity < writer->len + n) capacity *= 2;
+        data = realloc(writer->data, capacity);
+        if (!data) return FALSE;
+        writer->data = data;
+        writer->capacity = capacity;
+    }
+    memcpy(writer->data + writer->len, bytes, n);
+    writer->len += n;
+    return TRUE;
+}
+
+static BOOL put_be(PlistWriter *writer, uint64_t value, unsigned size)
+{
+    uint8_t bytes[8];
+    unsigned i;
+
+    for (i = 0; i < size; i++)
+        bytes[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    return put_bytes(writer, bytes, size);
+}
+
+/* Smallest of 1, 2, 4 or 8 bytes that holds value */
+static unsigned int_size(uint64_t value)
+{
+    if (value <= 0xFF) return 1;
+    if (value <= 0xFFFF) return 2;
+    if (value <= 0xFFFFFFFFu) return 4;
+    return 8;
+}
+
+/* log2 of a 1, 2, 4 or 8 byte integer size, as stored in markers */
+static uint8_t size_exponent(unsigned size)
+{
+    return size == 1 ? 0 : size == 2 ? 1 : size == 4 ? 2 : 3;
+}
+
+static BOOL put_int(PlistWriter *writer, int64_t value)
+{
+    /* Negative values are always stored in 8 bytes */
+    unsigned size = value < 0 ? 8 : int_size((uint64_t)value);
+    uint8_t marker = (uint8_t)(0x10 | size_exponent(size));
+
+    return put_bytes(writer, &marker, 1) && put_be(writer, (uint64_t)value, size);
+}
+
+/* Marker with a count: in the low nibble if it fits, else 0xF and an int */
+static BOOL put_marker(PlistWriter *writer, uint8_t type, uint64_t count)
+{
+    uint8_t marker = (uint8_t)(type | (count < 15 ? count : 0x0F));
+
+    if (!put_bytes(writer, &marker, 1)) return FALSE;
+    return count < 15 || put_int(writer, (int64_t)count);
+}
+
+/* Index of an already flattened equal string, or -1 */
+static int64_t find_string(const PlistWriter *writer, CFStringRef str, uint32_t *slot)
+{
+    uint32_t mask = writer->string_slot_count - 1;
+    uint32_t i = (uint32_t)CFHash(str) & mask;
+
+    while (writer->string_slots[i]) {
+        uint32_t index = writer->string_slots[i] - 1;
+
+        if (CFEqual(writer->objects[index], str))
+            return index;
+        i = (i + 1) & mask;
+    }
+    *slot = i;
+    return -1;
+}
+
+static BOOL grow_string_set(PlistWriter *writer)
+{
+    uint32_t count = writer->string_slot_count ? writer->string_slot_count * 2 : 256;
+    uint32_t *slots = calloc(count, sizeof(uint32_t));
+    uint32_t i;
+
+    if (!slots) return FALSE;
+
+    for (i = 0; i < writer->string_slot_count; i++) {
+        uint32_t index = writer->string_slots[i];
+        uint32_t j;
+
+        if (!index) continue;
+        j = (uint32_t)CFHash(writer->objects[index - 1]) & (count - 1);
+        while (slots[j]) j = (j + 1) & (count - 1);
+        slots[j] = index;
+    }
+
+    free(writer->string_slots);
+    writer->string_slots = slots;
+    writer->string_slot_count = count;
+    return TRUE;
+}
+
+/* objects, first_ref and offsets share one capacity */
+static BOOL grow_objects(PlistWriter *writer)
+{
+    uint32_t capacity = writer->object_capacity ? writer->object_capacity * 2 : 64;
+    CFTypeRef *objects = realloc(writer->objects, capacity * sizeof(CFTypeRef));
+    uint32_t *first_ref;
+    uint64_t *offsets;
+
+    if (!objects) return FALSE;
+    writer->objects = objects;
+    first_ref = realloc(writer->first_ref, capacity * sizeof(uint32_t));
+    if (!first_ref) return FALSE;
+    writer->first_ref = first_ref;
+    offsets = realloc(writer->offsets, capacity * sizeof(uint64_t));
+    if (!offsets) return FALSE;
+    writer->offsets = offsets;
+
+    writer->object_capacity = capacity;
+    return TRUE;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    return (int)CFStringCompare(*(CFStringRef const *)a, *(CFStringRef const *)b, 0);
+}
+
+/* Add object (and, depth first, everything it contains); returns its index or -1 */
+static int64_t flatten(PlistWriter *writer, CFTypeRef object, int depth)
+{
+    CFTypeID type = CFGetTypeID(object);
+    uint32_t index, slot = 0, i, n, first;
+
+    if (depth > PLIST_WRITE_MAX_DEPTH) return -1;
+
+    if (type == CFStringGetTypeID()) {
+        int64_t existing;
+
+        if ((writer->string_count + 1) * 2 > writer->string_slot_count && !grow_string_set(writer))
+            return -1;
+        existing = find_string(writer, object, &slot);
+        if (existing >= 0) return existing;
+    }
+
+    if (writer->object_count == writer->object_capacity && !grow_objects(writer))
+        return -1;
+
+    index = writer->object_count++;
+    writer->objects[index] = object;
+    writer->first_ref[index] = 0;
+
+    if (type == CFStringGetTypeID()) {
+        writer->string_slots[slot] = index + 1;
+        writer->string_count++;
+    } else if (type == CFArrayGetTypeID()) {
+        n = (uint32_t)CFArrayGetCount(object);
+        first = writer->ref_count;
+        if (!grow_refs(writer, first + n))
+            return -1;
+        writer->ref_count += n;
+        writer->first_ref[index] = first;
+
+        for (i = 0; i < n; i++) {
+            int64_t child = flatten(writer, CFArrayGetValueAtIndex(object, i), depth + 1);
+
+            if (child < 0) return -1;
+            writer->refs[first + i] = (uint32_t)child;
+        }
+    } else if (type == CFDictionaryGetTypeID()) {
+        const void **keys;
+        n = (uint32_t)CFDictionaryGetCount(object);
+        first = writer->ref_count;
+        if (!grow_refs(writer, first + 2 * n))
+            return -1;
+        writer->ref_count += 2 * n;
+        writer->first_ref[index] = first;
+
+        keys = malloc((n ? n : 1) * sizeof(void *));
+        if (!keys) return -1;
+        CFDictionaryGetKeysAndValues(object, keys, NULL);
+
+        for (i = 0; i < n; i++) {
+            if (CFGetTypeID(keys[i]) != CFStringGetTypeID()) {
+                free(keys);
+                return -1;
+            }
+        }
+        qsort(keys, n, sizeof(void *), compare_keys);
+
+        /* Keys first, then values, in the same order */
+        for (i = 0; i < n; i++) {
+            int64_t key = flatten(writer, keys[i], depth + 1);
+            int64_t value = key >= 0 ? flatten(writer, CFDictionaryGetValue(object, keys[i]), depth + 1) : -1;
+
+            if (value < 0) {
+                free(keys);
+                return -1;
+            }
+            writer->refs[first + i] = (uint32_t)key;
+            writer->refs[first + n + i] = (uint32_t)value;
+        }
+        free(keys);
+    } else if (type != CFNumberGetTypeID() && type != CFBooleanGetTypeID() &&
+               type != CFDateGetTypeID() && type != CFDataGetTypeID()) {
+        DEBUG_PRINT("Cannot write object of CF type %lu to a property list\n", (unsigned long)type);
+        return -1;
+    }
+
+    return index;
+}
+
+static BOOL put_string(PlistWriter *writer, CFStringRef str)
+{
+    CFIndex length = CFStringGetLength(str), used = 0;
+    CFRange range = CFRangeMake(0, length);
+    size_t needed = (size_t)length * 2;
+
+    if (needed > writer->scratch_capacity) {
+        UInt8 *scratch = realloc(writer->scratch, needed);
+
+        if (!scratch) return FALSE;
+        writer->scratch = scratch;
+        writer->scratch_capacity = needed;
+    }
+
+    /* ASCII when every character fits, UTF-16BE otherwise */
+    if (CFStringGetBytes(str, range, kCFStringEncodingASCII, 0, false, writer->scratch,
+                        (CFIndex)writer->scratch_capacity, &used) == length)
+        return put_marker(writer, 0x50, (uint64_t)length) && put_bytes(writer, writer->scratch, (size_t)used);
+
+    if (CFStringGetBytes(str, range, kCFStringEncodingUTF16BE, 0, false, writer->scratch,
+                        (CFIndex)writer->scratch_capacity, &used) != length)
+        return FALSE;
+    return put_marker(writer, 0x60, (uint64_t)length) && put_bytes(writer, writer->scratch, (size_t)used);
+}
+
+static BOOL put_refs(PlistWriter *writer, uint32_t first, uint32_t count, unsigned ref_size)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        if (!put_be(writer, writer->refs[first + i], ref_size))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL put_object(PlistWriter *writer, uint32_t index, unsigned ref_size)
+{
+    CFTypeRef object = writer->objects[index];
+    CFTypeID type = CFGetTypeID(object);
+    uint64_t bits;
+    double real;
+    uint8_t marker;
+
+    if (type == CFStringGetTypeID())
+        return put_string(writer, object);
+
+    if (type == CFBooleanGetTypeID()) {
+        marker = CFBooleanGetValue(object) ? 0x09 : 0x08;
+        return put_bytes(writer, &marker, 1);
+    }
+
+    if (type == CFNumberGetTypeID()) {
+        if (CFNumberIsFloatType(object)) {
+            CFNumberGetValue(object, kCFNumberDoubleType, &real);
+            memcpy(&bits, &real, sizeof(bits));
+            marker = 0x23;
+            return put_bytes(writer, &marker, 1) && put_be(writer, bits, 8);
+        } else {
+            int64_t value = 0;
+
+            CFNumberGetValue(object, kCFNumberSInt64Type, &value);
+            return put_int(writer, value);
+        }
+    }
+
+    if (type == CFDateGetTypeID()) {
+        real = CFDateGetAbsoluteTime(object);
+        memcpy(&bits, &real, sizeof(bits));
+        marker = 0x33;
+        return put_bytes(writer, &marker, 1) && put_be(writer, bits, 8);
+    }
+
+    if (type == CFDataGetTypeID()) {
+        CFIndex len = CFDataGetLength(object);
+
+        return put_marker(writer, 0x40, (uint64_t)len) &&
+               put_bytes(writer, CFDataGetBytePtr(object), (size_t)len);
+    }
+
+    if (type == CFArrayGetTypeID()) {
+        uint32_t count = (uint32_t)CFArrayGetCount(object);
+
+        return put_marker(writer, 0xA0, count) &&
+               put_refs(writer, writer->first_ref[index], count, ref_size);
+    }
+
+    if (type == CFDictionaryGetTypeID()) {
+        uint32_t count = (uint32_t)CFDictionaryGetCount(object);
+
+        return put_marker(writer, 0xD0, count) &&
+               put_refs(writer, writer->first_ref[index], 2 * count, ref_size);
+    }
+
+    return FALSE;
+}
+
+/*
+ * Serialize property_list (a CFPropertyListRef) to bplist00. Returns a
+ * pointer into the writer's buffer, valid until the next call.
+ */
+const uint8_t *plist_writer_serialize(PlistWriter *writer, const void *property_list, size_t *len)
+{
+    unsigned ref_size, offset_size;
+    uint64_t table_offset;
+    uint32_t i;
+    uint8_t trailer[6] = {0};
+
+    if (!writer || !property_list) return NULL;
+
+    writer->object_count = 0;
+    writer->ref_count = 0;
+    writer->string_count = 0;
+    writer->len = 0;
+    if (writer->string_slots)
+        memset(writer->string_slots, 0, writer->string_slot_count * sizeof(uint32_t));
+
+    if (flatten(writer, property_list, 0) < 0)
+        return NULL;
+
+    ref_size = int_size(writer->object_count);
+    if (!put_bytes(writer, "bplist00", 8))
+        return NULL;
+
+    for (i = 0; i < writer->object_count; i++) {
+        writer->offsets[i] = writer->len;
+        if (!put_object(writer, i, ref_size))
+            return NULL;
+    }
+
+    table_offset = writer->len;
+    offset_size = int_size(table_offset);
+    for (i = 0; i < writer->object_count; i++) {
+        if (!put_be(writer, writer->offsets[i], offset_size))
+            return NULL;
+    }
+
+    /* Trailer: 6 unused bytes, sizes, object count, top object, table offset */
+    if (!put_bytes(writer, trailer, sizeof(trailer)) ||
+        !put_be(writer, offset_size, 1) || !put_be(writer, ref_size, 1) ||
+        !put_be(writer, writer->object_count, 8) || !put_be(writer, 0, 8) ||
+        !put_be(writer, table_offset, 8))
+        return NULL;
+
+    *len = writer->len;
+    return writer->data;
+}
+
+/* Serialize property_list and write it to path */
+BOOL plist_writer_write_file(PlistWriter *writer, const void *property_list, const char *path)
+{
+    const uint8_t *bytes;
+    size_t len;
+
+    bytes = plist_writer_serialize(writer, property_list, &len);
+    if (!bytes) {
+        DEBUG_PRINT("Property list serialization failed for %s\n", path);
+        return FALSE;
+    }
+
+    return write_file(path, bytes, len, FALSE);
+}
@@ -0,0 +1,999 @@
+/*
+ * PNG Codec for AppBundleGenerator
+ * Decoder for icon sources and the encoder used to write ICNS payloads.
+ *
+ * The encoder picks a filter per row (minimum sum of absolute differences),
+ * reduces to RGB or a palette when that is lossless, and splits large
+ * images into fixed-size pieces that are deflated on separate threads and
+ * stitched into one zlib stream the way pigz does. Piece boundaries depend
+ * only on the image, never on the thread count, so output is stable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "shared.h"
+
+static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+/* Filtered bytes per parallel deflate piece; each piece primes its window from the previous one */
+#define PNG_PIECE_SIZE (128 * 1024)
+#define PNG_WINDOW_SIZE 32768
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* Read the IHDR of an in-memory PNG without touching the image data */
+BOOL png_read_header(const uint8_t *data, size_t len, PngHeader *header)
+{
+    if (len < 33 || memcmp(data, png_signature, 8) != 0 || memcmp(data + 12, "IHDR", 4) != 0)
+        return FALSE;
+
+    header->width = get_be32(data + 16);
+    header->height = get_be32(data + 20);
+    header->bit_depth = data[24];
+    header->color_type = data[25];
+    header->interlace = data[28];
+    return header->width > 0 && header->height > 0;
+}
+
+/* ========== Decoder ========== */
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = (int)a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+static BOOL unfilter_row(uint8_t *row, const uint8_t *prev, size_t rowbytes, unsigned bpp, uint8_t filter)
+{
+    size_t i;
+
+    switch (filter) {
+        case 0:
+            break;
+        case 1:
+            for (i = bpp; i < rowbytes; i++) row[i] += row[i - bpp];
+            break;
+        case 2:
+            if (prev) for (i = 0; i < rowbytes; i++) row[i] += prev[i];
+            break;
+        case 3:
+            for (i = 0; i < rowbytes; i++) {
+                unsigned left = i >= bpp ? row[i - bpp] : 0;
+                unsigned up = prev ? prev[i] : 0;
+                row[i] += (uint8_t)((left + up) >> 1);
+            }
+            break;
+        case 4:
+            for (i = 0; i < rowbytes; i++) {
+                uint8_t left = i >= bpp ? row[i - bpp] : 0;
+                uint8_t up = prev ? prev[i] : 0;
+                uint8_t upleft = (prev && i >= bpp) ? prev[i - bpp] : 0;
+                row[i] += paeth(left, up, upleft);
+            }
+            break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Channels per pixel for a PNG color type, or 0 if the type is unknown or
+ * the spec does not allow the bit depth with it. The row buffers are sized
+ * from the depth and png_expand_row reads whole samples by color type, so
+ * an RGBA image claiming 1 bit per sample must never get that far.
+ */
+static unsigned png_channels(uint8_t color_type, uint8_t bit_depth)
+{
+    BOOL sub_byte = bit_depth == 1 || bit_depth == 2 || bit_depth == 4;
+
+    switch (color_type) {
+        case 0: return sub_byte || bit_depth == 8 || bit_depth == 16 ? 1 : 0;
+        case 2: return bit_depth == 8 || bit_depth == 16 ? 3 : 0;
+        case 3: return sub_byte || bit_depth == 8 ? 1 : 0;
+        case 4: return bit_depth == 8 || bit_depth == 16 ? 2 : 0;
+        case 6: return bit_depth == 8 || bit_depth == 16 ? 4 : 0;
+        default: return 0;
+    }
+}
+
+/*
+ * Expand one unfiltered scanline to RGBA8. Shared with the streaming
+ * decoder, so it only needs the header, palette and transparency info.
+ */
+void png_expand_row(const PngDecodeInfo *info, const uint8_t *row, uint8_t *out)
+{
+    uint32_t x;
+    unsigned depth = info->header.bit_depth;
+    unsigned maxval = (1u << (depth > 8 ? 8 : depth)) - 1;
+
+    for (x = 0; x < info->header.width; x++) {
+        uint8_t *o = out + (size_t)x * 4;
+        unsigned v;
+
+        switch (info->header.color_type) {
+            case 0:
+            case 3:
+                if (depth == 16) {
+                    v = row[x * 2];
+                } else if (depth == 8) {
+                    v = row[x];
+                } else {
+                    unsigned per_byte = 8 / depth;
+                    unsigned shift = 8 - depth * (1 + x % per_byte);
+                    v = (row[x / per_byte] >> shift) & maxval;
+                }
+
+                if (info->header.color_type == 3) {
+                    memcpy(o, info->palette[v & 0xFF], 4);
+                } else {
+                    uint8_t g = (uint8_t)(depth >= 8 ? v : v * 255 / maxval);
+                    o[0] = o[1] = o[2] = g;
+                    o[3] = 255;
+                    if (info->has_trns) {
+                        unsigned raw = depth == 16 ? ((unsigned)row[x * 2] << 8 | row[x * 2 + 1])
+                                                   : (depth == 8 ? row[x] : v);
+                        if (raw == info->trns[0]) o[3] = 0;
+                    }
+                }
+                break;
+
+            case 2:
+                if (depth == 16) {
+                    const uint8_t *p = row + (size_t)x * 6;
+                    o[0] = p[0]; o[1] = p[2]; o[2] = p[4];
+                    o[3] = (info->has_trns &&
+                            ((unsigned)p[0] << 8 | p[1]) == info->trns[0] &&
+                            ((unsigned)p[2] << 8 | p[3]) == info->trns[1] &&
+                            ((unsigned)p[4] << 8 | p[5]) == info->trns[2]) ? 0 : 255;
+                } else {
+                    const uint8_t *p = row + (size_t)x * 3;
+                    o[0] = p[0]; o[1] = p[1]; o[2] = p[2];
+                    o[3] = (info->has_trns && p[0] == info->trns[0] &&
+                            p[1] == info->trns[1] && p[2] == info->trns[2]) ? 0 : 255;
+                }
+                break;
+
+            case 4: {
+                const uint8_t *p = row + (size_t)x * (depth == 16 ? 4 : 2);
+                o[0] = o[1] = o[2] = p[0];
+                o[3] = depth == 16 ? p[2] : p[1];
+                break;
+            }
+
+            case 6:
+                if (depth == 16) {
+                    const uint8_t *p = row + (size_t)x * 8;
+                    o[0] = p[0]; o[1] = p[2]; o[2] = p[4]; o[3] = p[6];
+                } else {
+                    memcpy(o, row + (size_t)x * 4, 4);
+                }
+                break;
+        }
+    }
+}
+
+/*
+ * Walk the chunks once, validating the header and collecting PLTE/tRNS.
+ * idat_cb is called for each IDAT payload in order.
+ */
+BOOL png_scan_chunks(const uint8_t *data, size_t len, PngDecodeInfo *info,
+                     BOOL (*idat_cb)(void *ctx, const uint8_t *bytes, size_t n), void *ctx)
+{
+    size_t pos = 8;
+    unsigned channels;
+    uint32_t i;
+
+    memset(info, 0, sizeof(PngDecodeInfo));
+    if (!png_read_header(data, len, &info->header))
+        return FALSE;
+
+    channels = png_channels(info->header.color_type, info->header.bit_depth);
+    if (!channels || info->header.interlace > 1)
+        return FALSE;
+
+    info->bpp = (channels * info->header.bit_depth + 7) / 8;
+    info->rowbytes = ((size_t)info->header.width * channels * info->header.bit_depth + 7) / 8;
+
+    for (i = 0; i < 256; i++) {
+        info->palette[i][0] = info->palette[i][1] = info->palette[i][2] = 0;
+        info->palette[i][3] = 255;
+    }
+
+    while (pos + 12 <= len) {
+        uint32_t chunk_len = get_be32(data + pos);
+        const uint8_t *type = data + pos + 4;
+        const uint8_t *body = data + pos + 8;
+
+        if (chunk_len > len - pos - 12)
+            return FALSE;
+
+        if (memcmp(type, "PLTE", 4) == 0) {
+            for (i = 0; i < chunk_len / 3 && i < 256; i++) {
+                info->palette[i][0] = body[i * 3];
+                info->palette[i][1] = body[i * 3 + 1];
+                info->palette[i][2] = body[i * 3 + 2];
+            }
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            if (info->header.color_type == 3) {
+                for (i = 0; i < chunk_len && i < 256; i++)
+                    info->palette[i][3] = body[i];
+            } else if (info->header.color_type == 0 && chunk_len >= 2) {
+                info->trns[0] = (uint16_t)(body[0] << 8 | body[1]);
+                info->has_trns = TRUE;
+            } else if (info->header.color_type == 2 && chunk_len >= 6) {
+                for (i = 0; i < 3; i++)
+                    info->trns[i] = (uint16_t)(body[i * 2] << 8 | body[i * 2 + 1]);
+                info->has_trns = TRUE;
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            if (idat_cb && !idat_cb(ctx, body, chunk_len))
+                return FALSE;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            return TRUE;
+        }
+
+        pos += 12 + chunk_len;
+    }
+
+    return TRUE;
+}
+
+/* Inflates IDAT data one scanline at a time; only two filtered rows are kept */
+typedef struct {
+    const PngDecodeInfo *info;
+    z_stream zs;
+    uint8_t *rows[2];               /* filter byte + rowbytes, current and previous */
+    uint8_t *rgba;
+    uint32_t y;
+    PngRowFunc fn;
+    void *ctx;
+    BOOL error;
+} RowStream;
+
+static BOOL finish_row(RowStream *st)
+{
+    uint8_t *cur = st->rows[st->y & 1];
+    const uint8_t *prev = st->y > 0 ? st->rows[(st->y - 1) & 1] + 1 : NULL;
+
+    if (!unfilter_row(cur + 1, prev, st->info->rowbytes, st->info->bpp, cur[0]))
+        return FALSE;
+    png_expand_row(st->info, cur + 1, st->rgba);
+    if (!st->fn(st->ctx, st->y, st->rgba))
+        return FALSE;
+
+    st->y++;
+    st->zs.next_out = st->rows[st->y & 1];
+    st->zs.avail_out = (uInt)(st->info->rowbytes + 1);
+    return TRUE;
+}
+
+static BOOL inflate_rows(void *ctx, const uint8_t *bytes, size_t n)
+{
+    RowStream *st = ctx;
+    int zret;
+
+    st->zs.next_in = (Bytef *)bytes;
+    st->zs.avail_in = (uInt)n;
+
+    while (st->zs.avail_in > 0 && st->y < st->info->header.height) {
+        zret = inflate(&st->zs, Z_NO_FLUSH);
+        if (zret != Z_OK && zret != Z_STREAM_END) {
+            st->error = TRUE;
+            return FALSE;
+        }
+        if (st->zs.avail_out == 0 && !finish_row(st)) {
+            st->error = TRUE;
+            return FALSE;
+        }
+        if (zret == Z_STREAM_END) break;
+    }
+    return TRUE;
+}
+
+/*
+ * Decode a non-interlaced PNG held in memory one scanline at a time,
+ * calling fn with each row as RGBA8, top to bottom. Working memory is two
+ * filtered rows, one RGBA row and zlib's window, whatever the image size.
+ */
+BOOL png_decode_rows(const uint8_t *data, size_t len, PngRowFunc fn, void *ctx)
+{
+    PngDecodeInfo info;
+    PngHeader header;
+    RowStream st;
+    unsigned channels;
+    size_t rowbytes;
+    BOOL ret = FALSE;
+
+    memset(&st, 0, sizeof(st));
+
+    if (!png_read_header(data, len, &header))
+        return FALSE;
+    if (header.interlace != 0) {
+        DEBUG_PRINT("Interlaced PNG is not supported by the native decoder\n");
+        return FALSE;
+    }
+    channels = png_channels(header.color_type, header.bit_depth);
+    if (!channels || header.width > 65535)
+        return FALSE;
+
+    /* Size the row buffers from the header before inflating */
+    rowbytes = ((size_t)header.width * channels * header.bit_depth + 7) / 8;
+    st.info = &info;
+    st.fn = fn;
+    st.ctx = ctx;
+    st.rows[0] = malloc(rowbytes + 1);
+    st.rows[1] = malloc(rowbytes + 1);
+    st.rgba = malloc((size_t)header.width * 4);
+    if (!st.rows[0] || !st.rows[1] || !st.rgba || inflateInit(&st.zs) != Z_OK)
+        goto done;
+    st.zs.next_out = st.rows[0];
+    st.zs.avail_out = (uInt)(rowbytes + 1);
+
+    if (!png_scan_chunks(data, len, &info, inflate_rows, &st) || st.error ||
+        st.y != info.header.height) {
+        DEBUG_PRINT("PNG image data is truncated or corrupt\n");
+        goto cleanup;
+    }
+    ret = TRUE;
+
+cleanup:
+    inflateEnd(&st.zs);
+done:
+    free(st.rows[0]);
+    free(st.rows[1]);
+    free(st.rgba);
+    return ret;
+}
+
+static BOOL store_image_row(void *ctx, uint32_t y, const uint8_t *rgba)
+{
+    RgbaImage *image = ctx;
+
+    memcpy(image->pixels + (size_t)y * image->width * 4, rgba, (size_t)image->width * 4);
+    return TRUE;
+}
+
+/* Decode a non-interlaced PNG held in memory into an RGBA image */
+BOOL png_decode(const uint8_t *data, size_t len, RgbaImage *image)
+{
+    PngHeader header;
+
+    memset(image, 0, sizeof(RgbaImage));
+    if (!png_read_header(data, len, &header) || !rgba_image_alloc(image, header.width, header.height))
+        return FALSE;
+
+    if (!png_decode_rows(data, len, store_image_row, image)) {
+        rgba_image_free(image);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL scale_row(void *ctx, uint32_t y, const uint8_t *rgba)
+{
+    (void)y;
+    return rgba_scaler_push_row(ctx, rgba);
+}
+
+/*
+ * Decode straight to a width x height image without ever holding the
+ * full-size one: each scanline goes into a streaming resampler as it is
+ * inflated. For sources far larger than the output.
+ */
+BOOL png_decode_scaled(const uint8_t *data, size_t len, uint32_t width, uint32_t height,
+                       RgbaImage *image)
+{
+    PngHeader header;
+    RgbaScaler *scaler;
+    BOOL ret;
+
+    memset(image, 0, sizeof(RgbaImage));
+    if (!png_read_header(data, len, &header))
+        return FALSE;
+
+    scaler = rgba_scaler_create(header.width, header.height, width, height);
+    if (!scaler)
+        return FALSE;
+
+    ret = png_decode_rows(data, len, scale_row, scaler) && rgba_scaler_finish(scaler, image);
+    rgba_scaler_destroy(scaler);
+    return ret;
+}
+
+/* Approximate peak allocation of png_decode_scaled, for memory budgets */
+size_t png_decode_scaled_footprint(const PngHeader *header, uint32_t width, uint32_t height)
+{
+    size_t rowbytes = (size_t)header->width * 8;    /* 16-bit RGBA, the widest row */
+
+    /* Two filtered rows, the RGBA row, and zlib's window and state */
+    return 2 * (rowbytes + 1) + (size_t)header->width * 4 + 48 * 1024 +
+           rgba_scaler_footprint(header->width, header->height, width, height);
+}
+
+/* Map a PNG file and decode it */
+BOOL png_decode_file(const char *path, RgbaImage *image)
+{
+    MappedFile file;
+    BOOL ret;
+
+    if (!map_file(path, &file))
+        return FALSE;
+
+    ret = png_decode(file.data, file.len, image);
+    unmap_file(&file);
+    return ret;
+}
+
+/* ========== Encoder ========== */
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} ByteBuffer;
+
+static BOOL buffer_append(ByteBuffer *buf, const void *bytes, size_t n)
+{
+    if (buf->len + n > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : 4096;
+        uint8_t *data;
+
+        while (cap < buf->len + n) cap *= 2;
+        data = realloc(buf->data, cap);
+        if (!data) return FALSE;
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, bytes, n);
+    buf->len += n;
+    return TRUE;
+}
+
+static BOOL write_chunk(ByteBuffer *buf, const char *type, const uint8_t *body, size_t len)
+{
+    uint8_t head[8], tail[4];
+    uLong crc;
+
+    put_be32(head, (uint32_t)len);
+    memcpy(head + 4, type, 4);
+    crc = crc32(0L, (const Bytef *)type, 4);
+    if (len) crc = crc32(crc, body, (uInt)len);
+    put_be32(tail, (uint32_t)crc);
+
+    return buffer_append(buf, head, 8) &&
+           (len == 0 || buffer_append(buf, body, len)) &&
+           buffer_append(buf, tail, 4);
+}
+
+/* Sum of absolute values of filtered bytes viewed as signed; lower compresses better */
+static unsigned long filter_cost(const uint8_t *row, size_t n)
+{
+    unsigned long sum = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        sum += row[i] < 128 ? row[i] : 256 - row[i];
+    return sum;
+}
+
+static void apply_filter(uint8_t filter, const uint8_t *row, const uint8_t *prev,
+                         size_t n, unsigned bpp, uint8_t *out)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        uint8_t left = i >= bpp ? row[i - bpp] : 0;
+        uint8_t up = prev ? prev[i] : 0;
+        uint8_t upleft = (prev && i >= bpp) ? prev[i - bpp] : 0;
+
+        switch (filter) {
+            case 0: out[i] = row[i]; break;
+            case 1: out[i] = row[i] - left; break;
+            case 2: out[i] = row[i] - up; break;
+            case 3: out[i] = row[i] - (uint8_t)(((unsigned)left + up) >> 1); break;
+            default: out[i] = row[i] - paeth(left, up, upleft); break;
+        }
+    }
+}
+
+/*
+ * Filter every row of raw (height rows of rowbytes) into out, which holds
+ * height * (rowbytes + 1) bytes. max_filter limits the candidates tried.
+ */
+static BOOL filter_image(const uint8_t *raw, size_t rowbytes, uint32_t height, unsigned bpp,
+                         uint8_t max_filter, uint8_t *out)
+{
+    uint8_t *trial = malloc(rowbytes);
+    uint32_t y;
+
+    if (!trial) return FALSE;
+
+    for (y = 0; y < height; y++) {
+        const uint8_t *row = raw + (size_t)y * rowbytes;
+        const uint8_t *prev = y ? row - rowbytes : NULL;
+        uint8_t *dest = out + (size_t)y * (rowbytes + 1);
+        unsigned long best_cost = (unsigned long)-1;
+        uint8_t f, best = 0;
+
+        for (f = 0; f <= max_filter; f++) {
+            unsigned long cost;
+
+            apply_filter(f, row, prev, rowbytes, bpp, trial);
+            cost = filter_cost(trial, rowbytes);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = f;
+                memcpy(dest + 1, trial, rowbytes);
+            }
+        }
+        dest[0] = best;
+    }
+
+    free(trial);
+    return TRUE;
+}
+
+typedef struct {
+    const uint8_t *input;           /* whole filtered stream */
+    size_t start;
+    size_t len;
+    BOOL last;
+    int level;
+    uint8_t *out;
+    size_t out_len;
+    uLong adler;
+    BOOL ok;
+} DeflatePiece;
+
+static void deflate_piece(DeflatePiece *piece)
+{
+    z_stream zs;
+    uLong bound;
+    int zret;
+
+    memset(&zs, 0, sizeof(zs));
+    piece->ok = FALSE;
+
+    /* Raw deflate: the zlib header and trailer are written once for the whole stream */
+    if (deflateInit2(&zs, piece->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return;
+
+    if (piece->start > 0) {
+        size_t dict = piece->start < PNG_WINDOW_SIZE ? piece->start : PNG_WINDOW_SIZE;
+
+        if (deflateSetDictionary(&zs, piece->input + piece->start - dict, (uInt)dict) != Z_OK) {
+            deflateEnd(&zs);
+            return;
+        }
+    }
+
+    bound = deflateBound(&zs, (uLong)piece->len) + 16;
+    piece->out = malloc(bound);
+    if (!piece->out) {
+        deflateEnd(&zs);
+        return;
+    }
+
+    zs.next_in = (Bytef *)(piece->input + piece->start);
+    zs.avail_in = (uInt)piece->len;
+    zs.next_out = piece->out;
+    zs.avail_out = (uInt)bound;
+
+    /* Non-final pieces end on a byte boundary with an empty stored block */
+    zret = deflate(&zs, piece->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((piece->last && zret == Z_STREAM_END) || (!piece->last && zret == Z_OK && zs.avail_in == 0)) {
+        piece->out_len = bound - zs.avail_out;
+        piece->adler = adler32(1L, piece->input + piece->start, (uInt)piece->len);
+        piece->ok = TRUE;
+    }
+
+    deflateEnd(&zs);
+}
+
+typedef struct {
+    DeflatePiece *pieces;
+    size_t count;
+    size_t next;
+    pthread_mutex_t lock;
+} PieceQueue;
+
+static void *deflate_worker(void *arg)
+{
+    PieceQueue *queue = arg;
+
+    for (;;) {
+        size_t i;
+
+        pthread_mutex_lock(&queue->lock);
+        i = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (i >= queue->count) break;
+
+        deflate_piece(&queue->pieces[i]);
+    }
+    return NULL;
+}
+
+/*
+ * zlib-wrap filtered data, compressing PNG_PIECE_SIZE pieces on the calling
+ * thread plus whatever threads can be borrowed from the budget (without
+ * one, up to the online CPUs).
+ */
+static BOOL compress_parallel(const uint8_t *input, size_t len, int level, ThreadBudget *threads,
+                              ByteBuffer *out)
+{
+    PieceQueue queue;
+    pthread_t workers[63];
+    size_t i, npieces = (len + PNG_PIECE_SIZE - 1) / PNG_PIECE_SIZE;
+    int helpers, borrowed = 0, started = 0;
+    uLong adler = 1L;
+    uint8_t header[2], trailer[4];
+    BOOL ret = TRUE;
+
+    if (npieces == 0) npieces = 1;
+
+    queue.pieces = calloc(npieces, sizeof(DeflatePiece));
+    if (!queue.pieces) return FALSE;
+    queue.count = npieces;
+    queue.next = 0;
+    pthread_mutex_init(&queue.lock, NULL);
+
+    for (i = 0; i < npieces; i++) {
+        queue.pieces[i].input = input;
+        queue.pieces[i].start = i * PNG_PIECE_SIZE;
+        queue.pieces[i].len = (i == npieces - 1) ? len - i * PNG_PIECE_SIZE : PNG_PIECE_SIZE;
+        queue.pieces[i].last = (i == npieces - 1);
+        queue.pieces[i].level = level;
+    }
+
+    /* The calling thread always takes part, so a single piece needs no threads */
+    helpers = npieces - 1 < 63 ? (int)npieces - 1 : 63;
+    if (threads)
+        helpers = borrowed = thread_budget_take(threads, helpers);
+    else if (helpers > work_queue_default_threads() - 1)
+        helpers = work_queue_default_threads() - 1;
+
+    for (i = 0; i < (size_t)helpers; i++) {
+        if (pthread_create(&workers[started], NULL, deflate_worker, &queue) == 0)
+            started++;
+    }
+    deflate_worker(&queue);
+    for (i = 0; i < (size_t)started; i++)
+        pthread_join(workers[i], NULL);
+    if (borrowed)
+        thread_budget_return(threads, borrowed);
+    pthread_mutex_destroy(&queue.lock);
+
+    /* CMF/FLG with the level hint; FCHECK makes the pair a multiple of 31 */
+    header[0] = 0x78;
+    header[1] = level <= 1 ? 0x01 : level <= 5 ? 0x5E : level == 6 ? 0x9C : 0xDA;
+    ret = buffer_append(out, header, 2);
+
+    for (i = 0; i < npieces; i++) {
+        DeflatePiece *piece = &queue.pieces[i];
+
+        if (ret && piece->ok) {
+            ret = buffer_append(out, piece->out, piece->out_len);
+            adler = i == 0 ? piece->adler : adler32_combine(adler, piece->adler, (z_off_t)piece->len);
+        } else {
+            ret = FALSE;
+        }
+        free(piece->out);
+    }
+    free(queue.pieces);
+
+    put_be32(trailer, (uint32_t)adler);
+    return ret && buffer_append(out, trailer, 4);
+}
+
+/* Exact palette of at most 256 RGBA colors, or FALSE if the image has more */
+typedef struct {
+    uint32_t colors[256];
+    unsigned count;
+    uint8_t *indices;
+} PaletteInfo;
+
+static BOOL build_palette(const RgbaImage *image, PaletteInfo *pal)
+{
+    uint32_t table[1024];
+    uint16_t slot_index[1024];
+    size_t i, n = (size_t)image->width * image->height;
+
+    memset(table, 0, sizeof(table));
+    memset(slot_index, 0xFF, sizeof(slot_index));
+    pal->count = 0;
+    pal->indices = malloc(n);
+    if (!pal->indices) return FALSE;
+
+    for (i = 0; i < n; i++) {
+        const uint8_t *p = image->pixels + i * 4;
+        /* Fully transparent pixels all collapse onto one entry */
+        uint32_t c = p[3] ? ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]) : 0;
+        uint32_t h = (c * 2654435761u) >> 22;
+
+        while (slot_index[h] != 0xFFFF && table[h] != c)
+            h = (h + 1) & 1023;
+
+        if (slot_index[h] == 0xFFFF) {
+            if (pal->count == 256) {
+                free(pal->indices);
+                pal->indices = NULL;
+                return FALSE;
+            }
+            table[h] = c;
+            slot_index[h] = (uint16_t)pal->count;
+            pal->colors[pal->count++] = c;
+        }
+        pal->indices[i] = (uint8_t)slot_index[h];
+    }
+
+    return TRUE;
+}
+
+/* Encode an RGBA image as a palette PNG, translucent entries first to keep tRNS short */
+static BOOL encode_palette(const RgbaImage *image, PaletteInfo *pal, int level, ThreadBudget *threads,
+                           ByteBuffer *out)
+{
+    uint8_t remap[256], plte[768], trns[256], ihdr[13];
+    unsigned i, ntrans = 0, next = 0, depth;
+    size_t rowbytes, y, x;
+    uint8_t *raw = NULL, *filtered = NULL;
+    BOOL ret = FALSE;
+
+    for (i = 0; i < pal->count; i++)
+        if ((pal->colors[i] & 0xFF) != 0xFF) remap[i] = (uint8_t)next++;
+    ntrans = next;
+    for (i = 0; i < pal->count; i++)
+        if ((pal->colors[i] & 0xFF) == 0xFF) remap[i] = (uint8_t)next++;
+
+    for (i = 0; i < pal->count; i++) {
+        uint32_t c = pal->colors[i];
+        plte[remap[i] * 3 + 0] = (uint8_t)(c >> 24);
+        plte[remap[i] * 3 + 1] = (uint8_t)(c >> 16);
+        plte[remap[i] * 3 + 2] = (uint8_t)(c >> 8);
+        trns[remap[i]] = (uint8_t)c;
+    }
+
+    depth = pal->count <= 2 ? 1 : pal->count <= 4 ? 2 : pal->count <= 16 ? 4 : 8;
+    rowbytes = ((size_t)image->width * depth + 7) / 8;
+
+    raw = calloc(rowbytes, image->height);
+    filtered = malloc((rowbytes + 1) * image->height);
+    if (!raw || !filtered) goto cleanup;
+
+    for (y = 0; y < image->height; y++) {
+        uint8_t *row = raw + y * rowbytes;
+        for (x = 0; x < image->width; x++) {
+            uint8_t idx = remap[pal->indices[y * image->width + x]];
+            unsigned per_byte = 8 / depth;
+            row[x / per_byte] |= (uint8_t)(idx << (8 - depth * (1 + x % per_byte)));
+        }
+    }
+
+    /* Filtering rarely helps indexed data; None for every row */
+    if (!filter_image(raw, rowbytes, image->height, 1, 0, filtered))
+        goto cleanup;
+
+    put_be32(ihdr, image->width);
+    put_be32(ihdr + 4, image->height);
+    ihdr[8] = (uint8_t)depth;
+    ihdr[9] = 3;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    ret = buffer_append(out, png_signature, 8) &&
+          write_chunk(out, "IHDR", ihdr, 13) &&
+          write_chunk(out, "PLTE", plte, pal->count * 3) &&
+          (ntrans == 0 || write_chunk(out, "tRNS", trns, ntrans));
+    if (ret) {
+        ByteBuffer z = {0};
+        ret = compress_parallel(filtered, (rowbytes + 1) * image->height, level, threads, &z) &&
+              write_chunk(out, "IDAT", z.data, z.len) &&
+              write_chunk(out, "IEND", NULL, 0);
+        free(z.data);
+    }
+
+cleanup:
+    free(raw);
+    free(filtered);
+    return ret;
+}
+
+/* Truecolor encode, dropping the alpha channel when every pixel is opaque */
+static BOOL encode_truecolor(const RgbaImage *image, BOOL reduce, uint8_t max_filter, int level,
+                             ThreadBudget *threads, ByteBuffer *out)
+{
+    size_t npix = (size_t)image->width * image->height, i;
+    BOOL opaque = reduce;
+    unsigned channels;
+    size_t rowbytes;
+    const uint8_t *raw = image->pixels;
+    uint8_t *rgb = NULL, *filtered = NULL;
+    uint8_t ihdr[13];
+    BOOL ret = FALSE;
+
+    for (i = 0; opaque && i < npix; i++)
+        if (image->pixels[i * 4 + 3] != 255) opaque = FALSE;
+
+    channels = opaque ? 3 : 4;
+    rowbytes = (size_t)image->width * channels;
+
+    if (opaque) {
+        rgb = malloc(npix * 3);
+        if (!rgb) return FALSE;
+        for (i = 0; i < npix; i++)
+            memcpy(rgb + i * 3, image->pixels + i * 4, 3);
+        raw = rgb;
+    }
+
+    filtered = malloc((rowbytes + 1) * image->height);
+    if (!filtered || !filter_image(raw, rowbytes, image->height, channels, max_filter, filtered))
+        goto cleanup;
+
+    put_be32(ihdr, image->width);
+    put_be32(ihdr + 4, image->height);
+    ihdr[8] = 8;
+    ihdr[9] = opaque ? 2 : 6;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    ret = buffer_append(out, png_signature, 8) && write_chunk(out, "IHDR", ihdr, 13);
+    if (ret) {
+        ByteBuffer z = {0};
+        ret = compress_parallel(filtered, (rowbytes + 1) * image->height, level, threads, &z) &&
+              write_chunk(out, "IDAT", z.data, z.len) &&
+              write_chunk(out, "IEND", NULL, 0);
+        free(z.data);
+    }
+
+cleanup:
+    free(rgb);
+    free(filtered);
+    return ret;
+}
+
+/*
+ * Encode an RGBA image as PNG. The result carries no timestamps or text
+ * chunks. Caller frees *out.
+ *
+ * fast:     deflate level 1, None/Sub/Up filters, no color reduction
+ * balanced: level 6, all filters, RGB reduction, palettes up to 64px
+ * small:    level 9, all filters, RGB reduction, palettes at every size
+ *
+ * Large images are deflated in pieces on threads borrowed from threads.
+ */
+BOOL png_encode(const RgbaImage *image, IconCompression preset, ThreadBudget *threads,
+                uint8_t **out, size_t *out_len)
+{
+    ByteBuffer buf = {0};
+    PaletteInfo pal;
+    BOOL reduce = preset != ICON_COMPRESS_FAST;
+    BOOL try_palette;
+    int level;
+    uint8_t max_filter;
+    BOOL ret = FALSE;
+
+    *out = NULL;
+    *out_len = 0;
+    if (!image || !image->pixels) return FALSE;
+
+    switch (preset) {
+        case ICON_COMPRESS_FAST:
+            level = 1;
+            max_filter = 2;
+            try_palette = FALSE;
+            break;
+        case ICON_COMPRESS_SMALL:
+            level = 9;
+            max_filter = 4;
+            try_palette = TRUE;
+            break;
+        default:
+            level = 6;
+            max_filter = 4;
+            try_palette = image->width <= 64 && image->height <= 64;
+            break;
+    }
+
+    if (try_palette && build_palette(image, &pal)) {
+        ret = encode_palette(image, &pal, level, threads, &buf);
+        free(pal.indices);
+
+        /* Keep whichever representation is smaller */
+        if (ret && preset == ICON_COMPRESS_SMALL) {
+            ByteBuffer alt = {0};
+            if (encode_truecolor(image, reduce, max_filter, level, threads, &alt) && alt.len < buf.len) {
+                free(buf.data);
+                buf = alt;
+            } else {
+                free(alt.data);
+            }
+        }
+    }
+
+    if (!ret) {
+        free(buf.data);
+        memset(&buf, 0, sizeof(buf));
+        ret = encode_truecolor(image, reduce, max_filter, level, threads, &buf);
+    }
+
+    if (!ret) {
+        free(buf.data);
+        return FALSE;
+    }
+
+    *out = buf.data;
+    *out_len = buf.len;
+    return TRUE;
+}
+
+/* Ancillary chunks that record when or by what an image was made */
+static BOOL is_metadata_chunk(const uint8_t *type)
+{
+    return memcmp(type, "tIME", 4) == 0 || memcmp(type, "tEXt", 4) == 0 ||
+           memcmp(type, "zTXt", 4) == 0 || memcmp(type, "iTXt", 4) == 0 ||
+           memcmp(type, "eXIf", 4) == 0;
+}
+
+/*
+ * Copy a PNG without its timestamp and text chunks; pixel data and color
+ * information are kept byte for byte. Returns FALSE, with *out NULL, when
+ * there is nothing to remove or the stream is malformed.
+ */
+BOOL png_strip_metadata(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len)
+{
+    ByteBuffer buf = {0};
+    size_t pos = 8;
+    BOOL found = FALSE;
+
+    *out = NULL;
+    *out_len = 0;
+    if (len < 8 || memcmp(data, png_signature, 8) != 0)
+        return FALSE;
+
+    /* First pass only looks, so the common case allocates nothing */
+    while (pos + 12 <= len) {
+        uint32_t chunk_len = get_be32(data + pos);
+
+        if (chunk_len > len - pos - 12) return FALSE;
+        if (is_metadata_chunk(data + pos + 4)) found = TRUE;
+        pos += 12 + chunk_len;
+    }
+    if (!found)
+        return FALSE;
+
+    if (!buffer_append(&buf, data, 8))
+        return FALSE;
+    for (pos = 8; pos + 12 <= len; ) {
+        uint32_t chunk_len = get_be32(data + pos);
+
+        if (!is_metadata_chunk(data + pos + 4) && !buffer_append(&buf, data + pos, 12 + chunk_len)) {
+            free(buf.data);
+            return FALSE;
+        }
+        pos += 12 + chunk_len;
+    }
+
+    *out = buf.data;
+    *out_len = buf.len;
+    return TRUE;
+}
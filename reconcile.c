@@ -0,0 +1,575 @@
+/*
+ * Reconcile Mode for AppBundleGenerator
+ * Brings a directory of bundles in line with a batch manifest (--reconcile)
+ * instead of deleting and rebuilding all of it. Every bundle built this
+ * way records in its Info.plist what it was built from:
+ *
+ *   AppBundleGeneratorCommand     the launcher command (or executable)
+ *   AppBundleGeneratorDigest      everything but identifier, version and icon,
+ *                                 and whether the identifier and version were given
+ *   AppBundleGeneratorIconDigest  the icon source files and render settings
+ *
+ * Those keys, CFBundleIdentifier and CFBundleVersion are read natively
+ * from each bundle, in parallel, and compared with the manifest. A record
+ * with no bundle is created, a managed bundle with no record is deleted,
+ * and a bundle whose identifier, version or icon alone changed is updated
+ * in place; any other difference is a rebuild. Bundles without the keys
+ * are never deleted, and are rebuilt (adopted) only when a record names
+ * them. Deletions run first, so a rename on a case-insensitive volume
+ * cannot race with its own creation; everything else then runs on the
+ * pool. --dry-run prints the plan and its estimated cost instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+#define KEY_COMMAND         "AppBundleGeneratorCommand"
+#define KEY_DIGEST          "AppBundleGeneratorDigest"
+#define KEY_ICON_DIGEST     "AppBundleGeneratorIconDigest"
+#define STATE_KEY_COUNT     3
+
+/* Rough costs for --dry-run estimates, in milliseconds of one worker */
+#define COST_BUILD_MS       15      /* directories, Info.plist, launcher */
+#define COST_ICON_MS        400     /* one icon render; each source renders once per run */
+#define COST_SIGN_MS        300     /* one codesign run */
+#define COST_PLIST_MS       2       /* in-place Info.plist rewrite */
+#define COST_DELETE_MS      5
+
+typedef enum {
+    RECONCILE_KEEP,
+    RECONCILE_CREATE,
+    RECONCILE_UPDATE,
+    RECONCILE_REBUILD,
+    RECONCILE_DELETE
+} ReconcileAction;
+
+/* A bundle found in the destination, as its Info.plist describes it */
+typedef struct {
+    char *name;                     /* without .app */
+    char *identifier;
+    char *version;
+    char *command;                  /* NULL: not built by reconcile */
+    uint64_t digest;
+    uint64_t icon_digest;
+    BOOL gave_identifier;           /* built with an explicit identifier */
+    BOOL gave_version;
+    BOOL readable;                  /* Info.plist parsed */
+    BOOL matched;                   /* named by a manifest record */
+} BundleState;
+
+typedef struct {
+    ReconcileAction action;
+    const char *name;
+    char *bundle_path;
+    const BundleState *state;       /* NULL for creations */
+    AppBundleOptions options;       /* record options plus the state keys; creations, updates, rebuilds */
+    const char **settings;          /* options.plist_settings: --plist-set entries, then the state keys */
+    char *state_settings[STATE_KEY_COUNT];
+    uint64_t icon_digest;
+    const char *reason;             /* rebuilds */
+    BOOL new_identifier;            /* updates: what changed */
+    BOOL new_version;
+    BOOL new_icon;
+    const char *entitlements;       /* for re-signing updates */
+    BOOL ok;
+    BOOL stale_signature;
+} ReconcileItem;
+
+static void free_state(BundleState *state)
+{
+    free(state->name);
+    free(state->identifier);
+    free(state->version);
+    free(state->command);
+}
+
+static int compare_states(const void *a, const void *b)
+{
+    return strcmp(((const BundleState *)a)->name, ((const BundleState *)b)->name);
+}
+
+/* <hex digest>, then 'i' and 'v' if the identifier and version were given */
+static uint64_t parse_digest(const PlistDocument *doc, const char *key, BOOL *identifier, BOOL *version)
+{
+    const PlistNode *node = plist_dict_get(doc, plist_root(doc), key);
+    char buf[32], *flags;
+    uint64_t digest;
+
+    if (!node || node->type != PLIST_NODE_STRING || plist_string_copy(node, buf, sizeof(buf)) == 0)
+        return 0;
+    digest = strtoull(buf, &flags, 16);
+    if (identifier) *identifier = strchr(flags, 'i') != NULL;
+    if (version) *version = strchr(flags, 'v') != NULL;
+    return digest;
+}
+
+static char *dup_string(const PlistDocument *doc, const char *key)
+{
+    const PlistNode *node = plist_dict_get(doc, plist_root(doc), key);
+
+    return node && node->type == PLIST_NODE_STRING ? plist_string_dup(node) : NULL;
+}
+
+typedef struct {
+    const char *dest;
+    BundleState *states;
+} StateScan;
+
+/* Read one bundle's Info.plist straight from its mapping */
+static void read_state(void *arg, int index)
+{
+    StateScan *scan = arg;
+    BundleState *state = &scan->states[index];
+    char *plist_path = heap_printf("%s/%s.app/Contents/Info.plist", scan->dest, state->name);
+    PlistDocument doc;
+
+    if (!plist_path || !plist_document_open(&doc, plist_path)) {
+        free(plist_path);
+        return;
+    }
+
+    state->readable = plist_root(&doc) && plist_root(&doc)->type == PLIST_NODE_DICT;
+    if (state->readable) {
+        state->identifier = dup_string(&doc, "CFBundleIdentifier");
+        state->version = dup_string(&doc, "CFBundleVersion");
+        state->command = dup_string(&doc, KEY_COMMAND);
+        state->digest = parse_digest(&doc, KEY_DIGEST, &state->gave_identifier, &state->gave_version);
+        state->icon_digest = parse_digest(&doc, KEY_ICON_DIGEST, NULL, NULL);
+    }
+    plist_document_close(&doc);
+    free(plist_path);
+}
+
+/* Every <name>.app directory directly under dest, sorted by name */
+static BOOL scan_destination(const char *dest, int jobs, BundleState **states, int *count)
+{
+    StateScan scan;
+    struct dirent *entry;
+    int capacity = 0;
+    DIR *dir;
+
+    *states = NULL;
+    *count = 0;
+    if (!(dir = opendir(dest)))
+        return TRUE;                /* nothing there yet */
+
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        char *path;
+        struct stat st;
+
+        if (len <= 4 || entry->d_name[0] == '.' || strcmp(entry->d_name + len - 4, ".app") != 0)
+            continue;
+        path = heap_printf("%s/%s", dest, entry->d_name);
+        if (!path || lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            free(path);
+            continue;
+        }
+        free(path);
+
+        if (*count == capacity) {
+            BundleState *grown;
+
+            capacity = capacity ? capacity * 2 : 256;
+            if (!(grown = realloc(*states, capacity * sizeof(BundleState)))) {
+                closedir(dir);
+                return FALSE;
+            }
+            *states = grown;
+        }
+        memset(&(*states)[*count], 0, sizeof(BundleState));
+        if (!((*states)[*count].name = strndup(entry->d_name, len - 4))) {
+            closedir(dir);
+            return FALSE;
+        }
+        (*count)++;
+    }
+    closedir(dir);
+
+    qsort(*states, *count, sizeof(BundleState), compare_states);
+
+    scan.dest = dest;
+    scan.states = *states;
+    parallel_for(*count, jobs, read_state, &scan);
+    return TRUE;
+}
+
+static BundleState *find_state(BundleState *states, int count, const char *name)
+{
+    BundleState key;
+
+    key.name = (char *)name;
+    return bsearch(&key, states, count, sizeof(BundleState), compare_states);
+}
+
+/* What decides the bundle other than its identifier, version and icon */
+static uint64_t structure_digest(const AppBundleOptions *options)
+{
+    AppBundleOptions structure = *options;
+
+    structure.bundle_identifier = NULL;
+    structure.version = NULL;
+    structure.icon_path = NULL;
+    structure.icon_compression = 0;
+    structure.icns_legacy = FALSE;
+    structure.icon_memory_mb = 0;
+    return batch_options_digest(&structure);
+}
+
+static uint64_t icon_digest(const AppBundleOptions *options)
+{
+    AppBundleOptions icon;
+
+    memset(&icon, 0, sizeof(icon));
+    icon.icon_path = options->icon_path;
+    icon.icon_compression = options->icon_compression;
+    icon.icns_legacy = options->icns_legacy;
+    icon.icon_memory_mb = options->icon_memory_mb;
+    return batch_options_digest(&icon);
+}
+
+/* Record options plus --plist-set entries for the state keys */
+static BOOL prepare_options(ReconcileItem *item, const BatchRecord *record, const AppBundleOptions *base)
+{
+    AppBundleOptions *options = &item->options;
+    uint64_t digest;
+    int i;
+
+    batch_record_options(record, base, options);
+
+    digest = structure_digest(options);
+    item->icon_digest = icon_digest(options);
+    item->state_settings[0] = heap_printf(KEY_COMMAND "=string:%s", options->executable_path);
+    item->state_settings[1] = heap_printf(KEY_DIGEST "=string:%016llx%s%s", (unsigned long long)digest,
+                                          options->bundle_identifier ? "i" : "",
+                                          options->version ? "v" : "");
+    item->state_settings[2] = heap_printf(KEY_ICON_DIGEST "=string:%016llx",
+                                          (unsigned long long)item->icon_digest);
+    item->settings = calloc(base->plist_setting_count + STATE_KEY_COUNT, sizeof(char *));
+    for (i = 0; i < STATE_KEY_COUNT; i++) {
+        if (!item->state_settings[i] || !item->settings)
+            return FALSE;
+    }
+
+    /* The state keys go last, so no template or --plist-set can hide them */
+    for (i = 0; i < base->plist_setting_count; i++)
+        item->settings[i] = base->plist_settings[i];
+    for (i = 0; i < STATE_KEY_COUNT; i++)
+        item->settings[base->plist_setting_count + i] = item->state_settings[i];
+    options->plist_settings = item->settings;
+    options->plist_setting_count = base->plist_setting_count + STATE_KEY_COUNT;
+
+    if (!item->state)
+        item->action = RECONCILE_CREATE;
+    else if (!item->state->readable)
+        item->reason = "Info.plist unreadable";
+    else if (!item->state->command)
+        item->reason = "not built by --reconcile";
+    else if (strcmp(item->state->command, options->executable_path) != 0)
+        item->reason = "command changed";
+    else if (item->state->digest != digest)
+        item->reason = "options or inputs changed";
+    /* Without one, the value comes from the template or the name; only a build derives it */
+    else if (item->state->gave_identifier && !options->bundle_identifier)
+        item->reason = "identifier removed";
+    else if (item->state->gave_version && !options->version)
+        item->reason = "version removed";
+    else {
+        item->new_identifier = options->bundle_identifier &&
+            (!item->state->identifier || strcmp(item->state->identifier, options->bundle_identifier) != 0);
+        item->new_version = options->version &&
+            (!item->state->version || strcmp(item->state->version, options->version) != 0);
+        item->new_icon = item->state->icon_digest != item->icon_digest;
+        if (item->new_icon && !options->icon_path)
+            item->reason = "icon removed";
+        item->action = item->new_identifier || item->new_version || item->new_icon ?
+                       RECONCILE_UPDATE : RECONCILE_KEEP;
+    }
+    if (item->reason)
+        item->action = RECONCILE_REBUILD;
+    return TRUE;
+}
+
+/* Identifier, version and icon in place, then the state keys */
+static BOOL update_in_place(ReconcileItem *item, AppBundleContext *ctx)
+{
+    const AppBundleOptions *options = &item->options;
+    AppBundleOptions changes;
+    IconRenderOptions icon_opts;
+    char *resources;
+    BOOL ret;
+
+    if (item->new_icon) {
+        resources = heap_printf("%s/Contents/Resources", item->bundle_path);
+        icon_render_options(ctx, options, &icon_opts);
+        ret = resources && create_directories(resources) &&
+              context_add_icon(ctx, options->icon_path, resources, &icon_opts);
+        free(resources);
+        if (!ret) {
+            fprintf(stderr, "Error: could not replace the icon of %s\n", item->bundle_path);
+            return FALSE;
+        }
+    }
+
+    /* Only the keys that changed, plus the state keys (last in the settings) */
+    memset(&changes, 0, sizeof(changes));
+    if (item->new_identifier) changes.bundle_identifier = options->bundle_identifier;
+    if (item->new_version) changes.version = options->version;
+    changes.plist_settings = options->plist_settings + options->plist_setting_count - STATE_KEY_COUNT;
+    changes.plist_setting_count = STATE_KEY_COUNT;
+    return update_bundle_in_place(item->bundle_path, &changes, item->new_icon, item->new_icon,
+                                  options, item->entitlements, &item->stale_signature) != UPDATE_FAILED;
+}
+
+typedef struct {
+    ReconcileItem *item;
+    AppBundleContext *ctx;
+} ReconcileTask;
+
+static void apply_item(void *arg)
+{
+    ReconcileTask *task = arg;
+    ReconcileItem *item = task->item;
+
+    switch (item->action) {
+        case RECONCILE_KEEP:
+            item->ok = TRUE;
+            break;
+        case RECONCILE_DELETE:
+            item->ok = remove_tree(item->bundle_path);
+            break;
+        case RECONCILE_REBUILD:
+            /* Start from nothing, so files the old build left behind go too */
+            if (!remove_tree(item->bundle_path)) {
+                item->ok = FALSE;
+                break;
+            }
+            /* fall through */
+        case RECONCILE_CREATE:
+            item->ok = appbundle_build(task->ctx, &item->options) == ERR_SUCCESS;
+            break;
+        case RECONCILE_UPDATE:
+            item->ok = update_in_place(item, task->ctx);
+            break;
+    }
+}
+
+/* Run the deletions, or every other change, on the pool and wait for them */
+static void apply_items(ReconcileItem *items, int count, BOOL deletions, AppBundleContext *ctx,
+                        ReconcileTask *tasks)
+{
+    WorkQueue *queue = context_queue(ctx);
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if ((items[i].action == RECONCILE_DELETE) != deletions || items[i].action == RECONCILE_KEEP)
+            continue;
+        tasks[i].item = &items[i];
+        tasks[i].ctx = ctx;
+        if (!queue || !work_queue_submit(queue, apply_item, &tasks[i]))
+            apply_item(&tasks[i]);
+    }
+    if (queue)
+        work_queue_wait(queue);
+}
+
+/* Distinct icon sources among the items that render one */
+static int count_icon_renders(const ReconcileItem *items, int count)
+{
+    int i, j, renders = 0;
+
+    for (i = 0; i < count; i++) {
+        const ReconcileItem *item = &items[i];
+        BOOL renders_icon = item->options.icon_path &&
+            (item->action == RECONCILE_CREATE || item->action == RECONCILE_REBUILD ||
+             (item->action == RECONCILE_UPDATE && item->new_icon));
+
+        if (!renders_icon)
+            continue;
+        for (j = 0; j < i; j++) {
+            if (items[j].icon_digest == item->icon_digest && items[j].options.icon_path &&
+                items[j].action != RECONCILE_KEEP && items[j].action != RECONCILE_DELETE &&
+                (items[j].action != RECONCILE_UPDATE || items[j].new_icon))
+                break;
+        }
+        renders += j == i;
+    }
+    return renders;
+}
+
+static void print_plan(const ReconcileItem *items, int count, int counts[], const AppBundleOptions *base,
+                       BOOL dry_run)
+{
+    static const char *const labels[] = {"keep", "create", "update", "rebuild", "delete"};
+    int i, builds, signatures, renders, jobs;
+    long long serial_ms;
+
+    for (i = 0; i < count; i++) {
+        const ReconcileItem *item = &items[i];
+
+        if (item->action == RECONCILE_KEEP)
+            continue;
+        printf("  %-7s %s.app", labels[item->action], item->name);
+        if (item->action == RECONCILE_REBUILD)
+            printf(" (%s)", item->reason);
+        if (item->action == RECONCILE_UPDATE) {
+            printf(" (");
+            if (item->new_identifier)
+                printf("identifier %s -> %s%s", item->state->identifier ? item->state->identifier : "none",
+                       item->options.bundle_identifier, item->new_version || item->new_icon ? ", " : "");
+            if (item->new_version)
+                printf("version %s -> %s%s", item->state->version ? item->state->version : "none",
+                       item->options.version, item->new_icon ? ", " : "");
+            if (item->new_icon)
+                printf("icon");
+            printf(")");
+        }
+        printf("\n");
+    }
+
+    builds = counts[RECONCILE_CREATE] + counts[RECONCILE_REBUILD];
+    signatures = base->signing_identity ? builds + counts[RECONCILE_UPDATE] : 0;
+    renders = count_icon_renders(items, count);
+    jobs = base->jobs > 0 ? base->jobs : work_queue_default_threads();
+    serial_ms = (long long)builds * COST_BUILD_MS + (long long)renders * COST_ICON_MS +
+                (long long)signatures * COST_SIGN_MS + (long long)counts[RECONCILE_UPDATE] * COST_PLIST_MS +
+                (long long)counts[RECONCILE_DELETE] * COST_DELETE_MS;
+
+    printf("Plan: %d to create, %d to update, %d to rebuild, %d to delete, %d unchanged\n",
+           counts[RECONCILE_CREATE], counts[RECONCILE_UPDATE], counts[RECONCILE_REBUILD],
+           counts[RECONCILE_DELETE], counts[RECONCILE_KEEP]);
+    printf("%s cost: %d build(s), %d icon render(s), %d signature(s), %d plist rewrite(s), "
+           "%d deletion(s); about %.1fs of work, %.1fs with %d job(s)\n",
+           dry_run ? "Estimated" : "Expected", builds, renders, signatures, counts[RECONCILE_UPDATE],
+           counts[RECONCILE_DELETE], serial_ms / 1000.0, serial_ms / 1000.0 / jobs, jobs);
+}
+
+/*
+ * Make base->bundle_dest match manifest_path: create, update, rebuild and
+ * delete bundles as needed, or with dry_run only print the plan.
+ * TRUE if everything planned succeeded.
+ */
+BOOL run_reconcile(const char *manifest_path, const AppBundleOptions *base, BOOL dry_run)
+{
+    BatchManifest manifest;
+    BundleState *states = NULL;
+    ReconcileItem *items = NULL;
+    ReconcileTask *tasks = NULL;
+    AppBundleContext *ctx = NULL;
+    char *entitlements = NULL;
+    const char *resign_with = NULL;
+    int state_count = 0, item_count = 0, i, j;
+    int counts[RECONCILE_DELETE + 1] = {0}, failures = 0, stale = 0;
+    BOOL ok = FALSE;
+
+    if (!batch_manifest_load(manifest_path, &manifest))
+        return FALSE;
+
+    if (!scan_destination(base->bundle_dest, base->jobs, &states, &state_count)) {
+        print_error(ERR_DIR_CREATION_FAILED, base->bundle_dest);
+        goto cleanup;
+    }
+
+    items = calloc(manifest.count + state_count + 1, sizeof(ReconcileItem));
+    if (!items)
+        goto cleanup;
+
+    for (i = 0; i < manifest.count; i++) {
+        ReconcileItem *item = &items[item_count++];
+        BundleState *state = find_state(states, state_count, manifest.records[i].name);
+
+        if (state)
+            state->matched = TRUE;
+        item->state = state;
+        item->name = manifest.records[i].name;
+        item->bundle_path = heap_printf("%s/%s.app", base->bundle_dest, item->name);
+        if (!item->bundle_path || !prepare_options(item, &manifest.records[i], base))
+            goto cleanup;
+    }
+
+    /* Only bundles this mode built are removed; anything else in the directory is left alone */
+    for (j = 0; j < state_count; j++) {
+        ReconcileItem *item;
+
+        if (states[j].matched || !states[j].command)
+            continue;
+        item = &items[item_count++];
+        item->action = RECONCILE_DELETE;
+        item->state = &states[j];
+        item->name = states[j].name;
+        item->bundle_path = heap_printf("%s/%s.app", base->bundle_dest, item->name);
+        if (!item->bundle_path)
+            goto cleanup;
+    }
+
+    for (i = 0; i < item_count; i++)
+        counts[items[i].action]++;
+
+    printf("%s: %d record(s), %d bundle(s) in %s\n", manifest_path, manifest.count, state_count,
+           base->bundle_dest);
+    print_plan(items, item_count, counts, base, dry_run);
+    if (dry_run || counts[RECONCILE_KEEP] == item_count) {
+        ok = TRUE;
+        goto cleanup;
+    }
+
+    ctx = appbundle_context_create(base->jobs);
+    tasks = calloc(item_count, sizeof(ReconcileTask));
+    if (!ctx || !tasks || !create_directories((char *)base->bundle_dest)) {
+        print_error(ERR_DIR_CREATION_FAILED, "Could not create scratch directory");
+        goto cleanup;
+    }
+
+    /* One entitlements file serves every update, as signing options come from the command line */
+    if (counts[RECONCILE_UPDATE] > 0 && base->signing_identity) {
+        if (!(resign_with = resign_entitlements(ctx, base, &entitlements)))
+            goto cleanup;
+        for (i = 0; i < item_count; i++)
+            items[i].entitlements = resign_with;
+    }
+
+    apply_items(items, item_count, TRUE, ctx, tasks);
+    apply_items(items, item_count, FALSE, ctx, tasks);
+
+    for (i = 0; i < item_count; i++) {
+        if (items[i].action == RECONCILE_KEEP)
+            continue;
+        if (!items[i].ok) {
+            failures++;
+            fprintf(stderr, "ERROR: could not %s %s.app\n",
+                    items[i].action == RECONCILE_CREATE ? "create" :
+                    items[i].action == RECONCILE_UPDATE ? "update" :
+                    items[i].action == RECONCILE_REBUILD ? "rebuild" : "delete", items[i].name);
+        }
+        stale += items[i].stale_signature;
+    }
+
+    printf("Reconciled %s: %d of %d change(s) applied\n", base->bundle_dest,
+           item_count - counts[RECONCILE_KEEP] - failures, item_count - counts[RECONCILE_KEEP]);
+    if (stale)
+        fprintf(stderr, "Warning: %d updated bundle(s) had a code signature that is now invalid\n",
+                stale);
+    ok = failures == 0;
+
+cleanup:
+    appbundle_context_destroy(ctx);     /* removes the generated entitlements */
+    for (i = 0; items && i < item_count; i++) {
+        free(items[i].bundle_path);
+        free(items[i].settings);
+        for (j = 0; j < STATE_KEY_COUNT; j++)
+            free(items[i].state_settings[j]);
+    }
+    for (i = 0; i < state_count; i++)
+        free_state(&states[i]);
+    free(states);
+    free(items);
+    free(tasks);
+    free(entitlements);
+    batch_manifest_free(&manifest);
+    return ok;
+}
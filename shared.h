@@ -1,10 +1,13 @@
 #ifndef _SHARED_H
 #define _SHARED_H
 
-#define false 0
-#define true 1
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "appbundler.h"
 
-/* or DEFINE BOOL int */
 typedef int BOOL;
 
 #ifndef FALSE
@@ -15,61 +18,38 @@ typedef int BOOL;
 #define TRUE                1
 #endif
 
+#define false 0
+#define true 1
+
 #ifdef DEBUG
 #define DEBUG_PRINT(...) do{ fprintf( stderr, __VA_ARGS__ ); } while( false )
 #else
 #define DEBUG_PRINT(...) do{ } while ( false )
 #endif
 
-/* Error codes for better error handling */
-typedef enum {
-    ERR_SUCCESS = 0,
-    ERR_INVALID_ARGS,
-    ERR_DIR_CREATION_FAILED,
-    ERR_PLIST_GENERATION_FAILED,
-    ERR_SCRIPT_GENERATION_FAILED,
-    ERR_ICON_CONVERSION_FAILED,
-    ERR_CODE_SIGNING_FAILED,
-    ERR_FILE_NOT_FOUND,
-    ERR_PERMISSION_DENIED
-} ErrorCode;
-
 /* Icon format types */
 typedef enum {
     ICON_FORMAT_UNKNOWN,
     ICON_FORMAT_PNG,
     ICON_FORMAT_SVG,
-    ICON_FORMAT_ICNS
+    ICON_FORMAT_ICNS,
+    ICON_FORMAT_PE,                 /* Windows .exe/.dll: icon taken from its resources */
+    ICON_FORMAT_ICO,                /* Windows .ico */
+    ICON_FORMAT_ICONSET             /* .iconset directory or comma-separated PNG list */
 } IconFormat;
 
-/* Application bundle options structure */
+/* Options for the native icon pipeline */
 typedef struct {
-    /* Required arguments */
-    const char *bundle_name;
-    const char *bundle_dest;
-    const char *executable_path;
-
-    /* Optional - icon */
-    const char *icon_path;
-
-    /* Optional - code signing */
-    const char *signing_identity;
-    BOOL enable_hardened_runtime;
-    const char *entitlements_file;
-    BOOL force_sign;
+    IconCompression compression;
+    BOOL legacy_chunks;             /* allow is32/il32/it32 + masks and ic04/ic05 when smaller */
+    const char *scratch_dir;        /* parent for temporary files (NULL = $TMPDIR) */
+    BOOL reproducible;              /* no timestamps or text chunks; never fall back to sips */
+    size_t memory_limit;            /* bytes for one decoded source (0 = default) */
+    struct ThreadBudget *threads;   /* extra deflate threads to borrow (NULL = online CPUs) */
+} IconRenderOptions;
 
-    /* Optional - Info.plist customization */
-    const char *bundle_identifier;
-    const char *min_os_version;
-    const char *app_category;
-    const char *version;
-    const char *short_version;
-
-    /* Optional - entitlement exceptions */
-    BOOL allow_jit;
-    BOOL allow_unsigned_memory;
-    BOOL allow_dyld_vars;
-} AppBundleOptions;
+/* Larger sources are streamed down to the biggest icon size instead */
+#define ICON_MEMORY_LIMIT_DEFAULT   ((size_t)64 << 20)
 
 /* Code signing options structure */
 typedef struct {
@@ -78,17 +58,187 @@ typedef struct {
     const char *entitlements_path;  /* Path to entitlements plist (optional) */
     BOOL force;                     /* Replace existing signature */
     BOOL timestamp;                 /* Include timestamp (required for distribution) */
+    int jobs;                       /* concurrent codesign runs for nested code (0 = online CPUs) */
+    struct ThreadBudget *threads;   /* extra signer threads to borrow instead of jobs (NULL = jobs) */
 } CodeSignOptions;
 
-/* Main bundle generation function (updated signature) */
-BOOL build_app_bundle(const AppBundleOptions *options);
+/* Main bundle generation function: build and, with an identity, sign */
+ErrorCode build_app_bundle(AppBundleContext *ctx, const AppBundleOptions *options);
+ErrorCode finish_bundle_icon(AppBundleContext *ctx, const AppBundleOptions *options);
+BOOL update_bundle_plist(const char *path_to_bundle_contents, const AppBundleOptions *options,
+                         BOOL set_icon_file, BOOL *changed);
+
+/* Build context internals (context.c) */
+const char *context_scratch_dir(const AppBundleContext *ctx);
+struct ThreadBudget *context_thread_budget(const AppBundleContext *ctx);
+char *context_scratch_path(AppBundleContext *ctx, const char *suffix);
+struct WorkQueue *context_queue(AppBundleContext *ctx);
+BOOL context_add_icon(AppBundleContext *ctx, const char *icon_src,
+                      const char *path_to_bundle_resources, const IconRenderOptions *opts);
+BOOL context_copy_cached_icon(AppBundleContext *ctx, const char *icon_src,
+                              const char *path_to_bundle_resources, const IconRenderOptions *opts);
+void finish_icons_in_background(const AppBundleOptions *options, const ErrorCode *results,
+                                int count);
+BOOL finish_icons_from_list(const char *list_path, const AppBundleOptions *base);
+int build_many_finishing_icons(AppBundleContext *ctx, const AppBundleOptions *options,
+                               int count, ErrorCode *results);
+void icon_render_options(AppBundleContext *ctx, const AppBundleOptions *options,
+                         IconRenderOptions *icon_opts);
+
+/* Shared helpers (utils.c) */
+char *heap_printf(const char *format, ...);
+BOOL create_directories(char *directory);
+BOOL write_file(const char *path, const void *data, size_t len, BOOL executable);
+BOOL replace_file(const char *path, const void *data, size_t len, BOOL *changed);
+char *create_scratch_dir(const char *base, const char *prefix);
+BOOL remove_tree(const char *path);
+BOOL normalize_tree(const char *path, time_t epoch);
+int run_command(const char *const argv[], int stderr_mode);
+pid_t spawn_command(const char *const argv[], int stderr_mode);
+int wait_command(pid_t pid);
+
+#define RUN_STDERR_INHERIT  0
+#define RUN_STDERR_NULL     1       /* discard the child's stderr */
+#define RUN_STDERR_STDOUT   2       /* send the child's stderr to our stdout */
+
+/* Read-only file mapping */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} MappedFile;
 
 /* Icon utility functions */
 IconFormat detect_icon_format(const char *path);
 BOOL copy_file(const char *src, const char *dst);
-BOOL convert_png_to_icns(const char *png_path, const char *output_icns);
-BOOL convert_svg_to_icns(const char *svg_path, const char *output_icns);
+BOOL map_file(const char *path, MappedFile *file);
+void unmap_file(MappedFile *file);
+BOOL convert_png_to_icns(const char *png_path, const char *output_icns, const IconRenderOptions *opts);
+BOOL convert_svg_to_icns(const char *svg_path, const char *output_icns, const IconRenderOptions *opts);
+BOOL convert_pe_to_icns(const char *exe_path, const char *output_icns, const IconRenderOptions *opts);
+BOOL convert_iconset_to_icns(const char *source, const char *output_icns,
+                             const IconRenderOptions *opts);
 BOOL generate_iconset_from_png(const char *source_png, const char *iconset_dir);
+BOOL add_icns_for_bundle(const char *icon_src, const char *path_to_bundle_resources,
+                         const IconRenderOptions *opts);
+
+/* In-memory RGBA images (image.c) */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint8_t *pixels;                /* width * height * 4, non-premultiplied RGBA */
+} RgbaImage;
+
+BOOL rgba_image_alloc(RgbaImage *image, uint32_t width, uint32_t height);
+void rgba_image_free(RgbaImage *image);
+BOOL rgba_image_resize(const RgbaImage *src, RgbaImage *dst, uint32_t width, uint32_t height);
+
+typedef struct RgbaScaler RgbaScaler;
+
+RgbaScaler *rgba_scaler_create(uint32_t src_width, uint32_t src_height,
+                               uint32_t width, uint32_t height);
+BOOL rgba_scaler_push_row(RgbaScaler *scaler, const uint8_t *rgba);
+BOOL rgba_scaler_finish(RgbaScaler *scaler, RgbaImage *dst);
+void rgba_scaler_destroy(RgbaScaler *scaler);
+size_t rgba_scaler_footprint(uint32_t src_width, uint32_t src_height,
+                             uint32_t width, uint32_t height);
+
+/* PNG codec (png_codec.c) */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint8_t bit_depth;
+    uint8_t color_type;
+    uint8_t interlace;
+} PngHeader;
+
+typedef struct {
+    PngHeader header;
+    uint8_t palette[256][4];        /* RGBA, alpha from tRNS */
+    uint16_t trns[3];               /* gray/RGB transparent color */
+    BOOL has_trns;
+    unsigned bpp;                   /* bytes per complete pixel, for filtering */
+    size_t rowbytes;
+} PngDecodeInfo;
+
+BOOL png_read_header(const uint8_t *data, size_t len, PngHeader *header);
+BOOL png_scan_chunks(const uint8_t *data, size_t len, PngDecodeInfo *info,
+                     BOOL (*idat_cb)(void *ctx, const uint8_t *bytes, size_t n), void *ctx);
+void png_expand_row(const PngDecodeInfo *info, const uint8_t *row, uint8_t *out);
+typedef BOOL (*PngRowFunc)(void *ctx, uint32_t y, const uint8_t *rgba);
+
+BOOL png_decode_rows(const uint8_t *data, size_t len, PngRowFunc fn, void *ctx);
+BOOL png_decode(const uint8_t *data, size_t len, RgbaImage *image);
+BOOL png_decode_scaled(const uint8_t *data, size_t len, uint32_t width, uint32_t height,
+                       RgbaImage *image);
+size_t png_decode_scaled_footprint(const PngHeader *header, uint32_t width, uint32_t height);
+BOOL png_decode_file(const char *path, RgbaImage *image);
+BOOL png_encode(const RgbaImage *image, IconCompression preset, struct ThreadBudget *threads,
+                uint8_t **out, size_t *out_len);
+BOOL png_strip_metadata(const uint8_t *data, size_t len, uint8_t **out, size_t *out_len);
+
+/* Windows icon images (ico.c) */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint16_t bit_count;
+    BOOL is_png;
+    const uint8_t *data;            /* PNG stream or DIB, not owned */
+    size_t len;
+    const RgbaImage *image;         /* already decoded source instead of data */
+    const char *slot_name;          /* .iconset file name it was supplied as, if any */
+} IconEntry;
+
+BOOL icon_entry_init(IconEntry *entry, const uint8_t *data, size_t len);
+BOOL icon_entry_decodable(const IconEntry *entry);
+BOOL icon_entry_decode(const IconEntry *entry, RgbaImage *image);
+const IconEntry *icon_entry_pick(const IconEntry *entries, int count, uint32_t size);
+BOOL convert_ico_to_icns(const char *ico_path, const char *output_icns, const IconRenderOptions *opts);
+
+/* PE version resources (pe_resources.c) */
+typedef struct {
+    const uint8_t *utf16;           /* UTF-16LE inside the mapping, not terminated */
+    size_t units;
+} PeString;
+
+typedef struct {
+    MappedFile file;
+    BOOL has_fixed;                 /* VS_FIXEDFILEINFO present */
+    uint16_t file_version[4];
+    uint16_t product_version[4];
+    PeString file_version_str;
+    PeString product_version_str;
+    PeString copyright;
+    PeString description;
+    PeString product_name;
+} PeVersionInfo;
+
+BOOL pe_version_info_open(const char *path, PeVersionInfo *info);
+void pe_version_info_close(PeVersionInfo *info);
+
+/* Native ICNS writer (icns.c) */
+#define ICON_SLOT_COUNT 10
+
+typedef struct {
+    uint32_t size;                  /* pixel width and height */
+    const char *iconset_name;       /* file name inside an .iconset directory */
+    const char *icns_type;          /* four-character ICNS chunk type */
+} IconSlot;
+
+typedef struct {
+    const char *type;
+    const uint8_t *data;
+    size_t len;
+} IcnsChunk;
+
+extern const IconSlot icon_slots[ICON_SLOT_COUNT];
+
+BOOL icns_write_file(const char *path, const IcnsChunk *chunks, int count);
+BOOL icns_render_from_entries(const IconEntry *entries, int count, const char *output_icns,
+                              const IconRenderOptions *opts);
+BOOL icns_render_from_image(const RgbaImage *source, const char *output_icns,
+                            const IconRenderOptions *opts);
+BOOL icns_render_from_png(const char *png_path, const char *output_icns,
+                          const IconRenderOptions *opts);
 
 /* Entitlements generation */
 BOOL generate_entitlements_file(const char *output_path, BOOL hardened_runtime,
@@ -99,8 +249,272 @@ BOOL generate_entitlements_file(const char *output_path, BOOL hardened_runtime,
 BOOL codesign_bundle(const char *bundle_path, const CodeSignOptions *options);
 BOOL verify_codesign(const char *bundle_path);
 
+/* Mach-O headers (macho.c) */
+#define MACHO_MAX_SLICES    8
+
+typedef struct {
+    uint32_t cputype;
+    uint32_t cpusubtype;
+    uint32_t min_os;                /* xxxx.yy.zz, 0 if the slice does not say */
+    uint32_t sdk;
+} MachOSlice;
+
+typedef struct {
+    MachOSlice slices[MACHO_MAX_SLICES];
+    int count;
+} MachOInfo;
+
+typedef enum {
+    MACHO_PATH_DYLIB,               /* LC_LOAD_DYLIB and the re-export, lazy and upward forms */
+    MACHO_PATH_WEAK_DYLIB,          /* LC_LOAD_WEAK_DYLIB: may be missing at run time */
+    MACHO_PATH_ID,                  /* LC_ID_DYLIB: a library's own install name */
+    MACHO_PATH_RPATH                /* LC_RPATH */
+} MachOPathKind;
+
+typedef BOOL (*MachOPathFunc)(void *arg, MachOPathKind kind, char *path, size_t room);
+
+BOOL macho_check_magic(const uint8_t *header, size_t len);
+BOOL macho_read_info(const char *path, MachOInfo *info);
+BOOL macho_for_each_path(uint8_t *data, size_t len, MachOPathFunc fn, void *arg);
+
+/* Dylib bundling (dylibs.c) */
+BOOL bundle_dylibs(const char *path_to_bundle_contents, const char *executable_path,
+                   const char *bundle_executable, struct ThreadBudget *threads,
+                   BOOL adhoc_sign);
+const char *macho_arch_name(const MachOSlice *slice);
+void macho_version_string(uint32_t version, char *buf, size_t size);
+uint32_t macho_parse_version(const char *s);
+
+/* Inside-out signing of code nested in a bundle (nested_sign.c) */
+BOOL codesign_nested_code(const char *bundle_path, const CodeSignOptions *options);
+int codesign_arguments(const char **argv, const char *path, const CodeSignOptions *options);
+
+#define CODESIGN_MAX_ARGS   16
+
+/* Worker pool (workqueue.c) */
+typedef struct WorkQueue WorkQueue;
+typedef void (*WorkFunc)(void *arg);
+
+WorkQueue *work_queue_create(int nthreads);
+BOOL work_queue_submit(WorkQueue *queue, WorkFunc fn, void *arg);
+void work_queue_wait(WorkQueue *queue);
+void work_queue_destroy(WorkQueue *queue);
+int work_queue_thread_count(const WorkQueue *queue);
+int work_queue_default_threads(void);
+
+typedef void (*ForFunc)(void *arg, int index);
+void parallel_for(int count, int nthreads, ForFunc fn, void *arg);
+
+typedef struct ThreadBudget ThreadBudget;
+
+ThreadBudget *thread_budget_create(int threads);
+void thread_budget_destroy(ThreadBudget *budget);
+int thread_budget_take(ThreadBudget *budget, int want);
+void thread_budget_return(ThreadBudget *budget, int threads);
+
+/* Dependency graphs of build steps run on a worker pool (taskgraph.c) */
+#define TASK_GRAPH_MAX_TASKS 16
+
+typedef struct TaskGraph TaskGraph;
+typedef BOOL (*TaskFunc)(void *arg);
+
+TaskGraph *task_graph_create(void);
+int task_graph_add(TaskGraph *graph, const char *name, TaskFunc fn, void *arg);
+BOOL task_graph_depend(TaskGraph *graph, int task, int dependency);
+BOOL task_graph_run(TaskGraph *graph, WorkQueue *queue);
+BOOL task_graph_succeeded(const TaskGraph *graph, int task);
+void task_graph_destroy(TaskGraph *graph);
+
+/* Native property list reader (plist_parse.c) */
+typedef enum {
+    PLIST_NODE_NONE,
+    PLIST_NODE_DICT,
+    PLIST_NODE_ARRAY,
+    PLIST_NODE_KEY,
+    PLIST_NODE_STRING,
+    PLIST_NODE_INTEGER,
+    PLIST_NODE_REAL,
+    PLIST_NODE_BOOL,
+    PLIST_NODE_DATE,
+    PLIST_NODE_DATA
+} PlistNodeType;
+
+typedef enum {
+    PLIST_TEXT_NONE,
+    PLIST_TEXT_RAW,                 /* bytes are usable as-is */
+    PLIST_TEXT_XML,                 /* contains XML entities */
+    PLIST_TEXT_UTF16BE,             /* binary plist unicode string */
+    PLIST_TEXT_BASE64               /* XML <data> payload */
+} PlistTextEncoding;
+
+typedef enum {
+    PLIST_FORMAT_XML,
+    PLIST_FORMAT_BINARY
+} PlistFormat;
+
+typedef struct {
+    PlistNodeType type;
+    PlistTextEncoding encoding;
+    uint32_t first_child;           /* node index, 0 = none */
+    uint32_t next_sibling;          /* node index, 0 = none */
+    uint32_t count;                 /* array elements or dict pairs */
+    const char *ptr;                /* points into the parsed buffer */
+    size_t len;
+    union {
+        int64_t integer;
+        double real;
+    } value;
+} PlistNode;
+
+typedef struct {
+    PlistNode *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t root;
+    PlistFormat format;
+    void *map;
+    size_t map_len;
+} PlistDocument;
+
+BOOL plist_document_open(PlistDocument *doc, const char *path);
+BOOL plist_document_parse(PlistDocument *doc, const void *bytes, size_t len);
+void plist_document_close(PlistDocument *doc);
+const PlistNode *plist_root(const PlistDocument *doc);
+const PlistNode *plist_first_child(const PlistDocument *doc, const PlistNode *node);
+const PlistNode *plist_next_sibling(const PlistDocument *doc, const PlistNode *node);
+const PlistNode *plist_dict_get(const PlistDocument *doc, const PlistNode *dict, const char *key);
+size_t plist_string_copy(const PlistNode *node, char *buf, size_t bufsize);
+char *plist_string_dup(const PlistNode *node);
+BOOL plist_string_equals(const PlistNode *node, const char *s);
+const uint8_t *plist_data_bytes(const PlistNode *node, size_t *len, uint8_t **owned);
+BOOL plist_date_value(const PlistNode *node, double *seconds);
+
+/* One --plist-set KEY=TYPE:VALUE; key and value point into the argument */
+typedef struct {
+    const char *key;
+    size_t key_len;
+    PlistNodeType type;             /* STRING, INTEGER, REAL, BOOL or ARRAY (of strings) */
+    const char *value;
+    int64_t integer;                /* INTEGER and BOOL */
+    double real;
+} PlistSetting;
+
+BOOL plist_setting_parse(const char *spec, PlistSetting *setting);
+
+/* Deterministic binary property list writer (plist_write.c) */
+typedef struct PlistWriter PlistWriter;
+
+PlistWriter *plist_writer_create(void);
+const uint8_t *plist_writer_serialize(PlistWriter *writer, const void *property_list, size_t *len);
+BOOL plist_writer_write_file(PlistWriter *writer, const void *property_list, const char *path);
+void plist_writer_destroy(PlistWriter *writer);
+
+/* Bundle audit (audit.c) */
+BOOL audit_bundles(const char *root_dir, int jobs);
+
+/* XDG desktop entry import (desktop_import.c) */
+BOOL import_desktop_entries(const char *desktop_dir, const AppBundleOptions *base);
+
+/* Wine prefix Start Menu shortcuts (wine_prefix.c) */
+BOOL scan_wine_prefix(const char *prefix, const AppBundleOptions *base);
+
+/* Document type associations (associations.c, table from uti_types.txt) */
+typedef struct {
+    const char *ext;                /* lower case, no dot */
+    const char *uti;
+    const char *mime;
+    const char *conforms;           /* NULL if macOS declares the type itself */
+    const char *description;
+} UtiType;
+
+const UtiType *uti_lookup_extension(const char *ext);
+const UtiType *uti_lookup_mime(const char *mime, int *count);
+char *extensions_for_mime_types(const char *mime_types);
+
+/* Localized InfoPlist.strings (localize.c) */
+typedef struct {
+    char *locale;                   /* lproj name: en, pt-BR, zh-Hans */
+    char **keys;                    /* InfoPlist.strings keys */
+    char **values;
+    int count;
+    int capacity;
+    int line;
+} LocaleStrings;
+
+typedef struct {
+    LocaleStrings *locales;
+    int count;
+    int capacity;
+} LocalizationTable;
+
+BOOL localization_table_load(const char *path, LocalizationTable *table);
+void localization_table_free(LocalizationTable *table);
+BOOL localization_table_has_display_name(const LocalizationTable *table);
+BOOL write_localizations(const char *path_to_bundle_resources, const LocalizationTable *table);
+
+/* Batch manifests (batch.c) */
+typedef struct {
+    char *name;                     /* [Section] header: the bundle name */
+    char *exec;
+    char *icon;
+    char *associations;
+    char *identifier;
+    char *version;
+    char *category;
+    char *min_os;
+    int launcher;                   /* LauncherMode, -1 = command line setting */
+    int line;
+} BatchRecord;
+
+typedef struct {
+    BatchRecord *records;
+    int count;
+    int capacity;
+} BatchManifest;
+
+/* Called per [Section] header and per Key=Value line; FALSE stops the read */
+typedef BOOL (*ManifestSectionFunc)(void *arg, const char *name, size_t len, int line);
+typedef BOOL (*ManifestKeyFunc)(void *arg, const char *key, size_t key_len, const char *value,
+                                size_t value_len, int line);
+
+BOOL read_manifest_file(const char *path, const char *section_label, ManifestSectionFunc section,
+                        ManifestKeyFunc key, void *arg);
+BOOL batch_manifest_load(const char *path, BatchManifest *manifest);
+void batch_manifest_free(BatchManifest *manifest);
+void batch_record_options(const BatchRecord *record, const AppBundleOptions *base,
+                          AppBundleOptions *options);
+BOOL run_batch(const char *manifest_path, const AppBundleOptions *base, BOOL resume);
+
+/* Batch journals for --resume (journal.c) */
+typedef struct BatchJournal BatchJournal;
+
+uint64_t batch_options_digest(const AppBundleOptions *options);
+BatchJournal *batch_journal_open(const char *path, BOOL resume);
+BOOL batch_journal_done(const BatchJournal *journal, uint64_t digest, const char *bundle_path);
+void batch_journal_record(BatchJournal *journal, uint64_t digest, const char *bundle_path,
+                          const char *name);
+void batch_journal_close(BatchJournal *journal);
+
+/* Syncing a directory of bundles to a manifest (reconcile.c) */
+BOOL run_reconcile(const char *manifest_path, const AppBundleOptions *base, BOOL dry_run);
+
+/* In-place updates of existing bundles (update.c) */
+typedef enum {
+    UPDATE_UNCHANGED,
+    UPDATE_CHANGED,
+    UPDATE_SIGNED,
+    UPDATE_FAILED
+} UpdateResult;
+
+BOOL run_update(const char *const *targets, int count, const AppBundleOptions *options);
+const char *resign_entitlements(AppBundleContext *ctx, const AppBundleOptions *options,
+                                char **generated);
+UpdateResult update_bundle_in_place(const char *bundle_path, const AppBundleOptions *plist_options,
+                                    BOOL set_icon_file, BOOL icon_changed,
+                                    const AppBundleOptions *sign_options, const char *entitlements,
+                                    BOOL *stale_signature);
+
 /* Error handling */
 void print_error(ErrorCode code, const char *details);
-const char* error_code_to_string(ErrorCode code);
 
 #endif
@@ -0,0 +1,240 @@
+/*
+ * Task Graphs for AppBundleGenerator
+ * Runs a small dependency graph of build steps on a worker pool. A task
+ * starts once everything it depends on has finished; tasks downstream of
+ * a failure are skipped.
+ *
+ * The thread in task_graph_run never just sleeps while its graph has ready
+ * tasks: it takes them itself. Runner items queued on the pool do the
+ * same from the other side, so whichever gets to a ready task first runs
+ * it. That keeps a graph moving even when every pool thread is busy, or
+ * when task_graph_run is itself called from a pool task.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "shared.h"
+
+typedef enum {
+    TASK_WAITING,
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_DONE,
+    TASK_FAILED,
+    TASK_SKIPPED
+} TaskState;
+
+typedef struct {
+    const char *name;
+    TaskFunc fn;
+    void *arg;
+    TaskState state;
+    int unmet;                      /* dependencies not yet finished */
+    BOOL upstream_failed;
+    int dependents[TASK_GRAPH_MAX_TASKS];
+    int dependent_count;
+} GraphTask;
+
+struct TaskGraph {
+    pthread_mutex_t lock;           /* guards everything below */
+    pthread_cond_t changed;         /* a task became ready or finished */
+    GraphTask tasks[TASK_GRAPH_MAX_TASKS];
+    int count;
+    int ready[TASK_GRAPH_MAX_TASKS];
+    int ready_count;
+    int finished;
+    int refs;                       /* owner plus runner items still queued */
+    WorkQueue *queue;               /* set by task_graph_run */
+};
+
+TaskGraph *task_graph_create(void)
+{
+    TaskGraph *graph = calloc(1, sizeof(TaskGraph));
+
+    if (!graph) return NULL;
+
+    pthread_mutex_init(&graph->lock, NULL);
+    pthread_cond_init(&graph->changed, NULL);
+    graph->refs = 1;
+    return graph;
+}
+
+static void release_graph(TaskGraph *graph)
+{
+    int refs;
+
+    pthread_mutex_lock(&graph->lock);
+    refs = --graph->refs;
+    pthread_mutex_unlock(&graph->lock);
+
+    if (refs == 0) {
+        pthread_cond_destroy(&graph->changed);
+        pthread_mutex_destroy(&graph->lock);
+        free(graph);
+    }
+}
+
+/* Runner items may outlive task_graph_run; the last reference frees the graph */
+void task_graph_destroy(TaskGraph *graph)
+{
+    if (graph)
+        release_graph(graph);
+}
+
+/* Add fn(arg) as a task; returns its id, or -1 if the graph is full */
+int task_graph_add(TaskGraph *graph, const char *name, TaskFunc fn, void *arg)
+{
+    GraphTask *task;
+
+    if (!graph || !fn || graph->count == TASK_GRAPH_MAX_TASKS)
+        return -1;
+
+    task = &graph->tasks[graph->count];
+    memset(task, 0, sizeof(GraphTask));
+    task->name = name;
+    task->fn = fn;
+    task->arg = arg;
+    return graph->count++;
+}
+
+/* task may not start until dependency has finished; both ids from task_graph_add */
+BOOL task_graph_depend(TaskGraph *graph, int task, int dependency)
+{
+    GraphTask *dep;
+
+    if (!graph || task < 0 || task >= graph->count || dependency < 0 ||
+        dependency >= graph->count || task == dependency)
+        return FALSE;
+
+    dep = &graph->tasks[dependency];
+    dep->dependents[dep->dependent_count++] = task;
+    graph->tasks[task].unmet++;
+    return TRUE;
+}
+
+static void runner(void *arg);
+
+/* Called with the lock held */
+static void make_ready(TaskGraph *graph, int id)
+{
+    graph->tasks[id].state = TASK_READY;
+    graph->ready[graph->ready_count++] = id;
+
+    /* The queued runner may find the task already taken; that is fine */
+    graph->refs++;
+    if (!graph->queue || !work_queue_submit(graph->queue, runner, graph))
+        graph->refs--;
+    pthread_cond_broadcast(&graph->changed);
+}
+
+/* Record a finished task and release its dependents; called with the lock held */
+static void finish_task(TaskGraph *graph, int id, TaskState state)
+{
+    int stack[TASK_GRAPH_MAX_TASKS];
+    int top = 0, i;
+
+    graph->tasks[id].state = state;
+    graph->finished++;
+    stack[top++] = id;
+
+    /* Skipped tasks finish immediately, which may release further tasks */
+    while (top > 0) {
+        GraphTask *done = &graph->tasks[stack[--top]];
+
+        for (i = 0; i < done->dependent_count; i++) {
+            GraphTask *next = &graph->tasks[done->dependents[i]];
+
+            if (done->state != TASK_DONE)
+                next->upstream_failed = TRUE;
+            if (--next->unmet > 0)
+                continue;
+
+            if (next->upstream_failed) {
+                DEBUG_PRINT("Skipping %s: a task it needs failed\n", next->name);
+                next->state = TASK_SKIPPED;
+                graph->finished++;
+                stack[top++] = done->dependents[i];
+            } else {
+                make_ready(graph, done->dependents[i]);
+            }
+        }
+    }
+    pthread_cond_broadcast(&graph->changed);
+}
+
+/* Take one ready task and run it; called with the lock held, returns with it held */
+static BOOL run_one(TaskGraph *graph)
+{
+    GraphTask *task;
+    int id;
+    BOOL ok;
+
+    if (graph->ready_count == 0)
+        return FALSE;
+
+    id = graph->ready[--graph->ready_count];
+    task = &graph->tasks[id];
+    task->state = TASK_RUNNING;
+    pthread_mutex_unlock(&graph->lock);
+
+    DEBUG_PRINT("Task %s started\n", task->name);
+    ok = task->fn(task->arg);
+    DEBUG_PRINT("Task %s %s\n", task->name, ok ? "finished" : "failed");
+
+    pthread_mutex_lock(&graph->lock);
+    finish_task(graph, id, ok ? TASK_DONE : TASK_FAILED);
+    return TRUE;
+}
+
+static void runner(void *arg)
+{
+    TaskGraph *graph = arg;
+
+    pthread_mutex_lock(&graph->lock);
+    run_one(graph);
+    pthread_mutex_unlock(&graph->lock);
+
+    release_graph(graph);
+}
+
+/*
+ * Run every task, using queue (may be NULL) for parallelism, and return
+ * once all have finished or been skipped. TRUE if none failed. A graph is
+ * run once.
+ */
+BOOL task_graph_run(TaskGraph *graph, WorkQueue *queue)
+{
+    BOOL ok = TRUE;
+    int i;
+
+    if (!graph) return FALSE;
+
+    pthread_mutex_lock(&graph->lock);
+    graph->queue = queue;
+    for (i = 0; i < graph->count; i++) {
+        if (graph->tasks[i].unmet == 0)
+            make_ready(graph, i);
+    }
+
+    while (graph->finished < graph->count) {
+        if (!run_one(graph))
+            pthread_cond_wait(&graph->changed, &graph->lock);
+    }
+
+    for (i = 0; i < graph->count; i++) {
+        if (graph->tasks[i].state != TASK_DONE)
+            ok = FALSE;
+    }
+    pthread_mutex_unlock(&graph->lock);
+
+    return ok;
+}
+
+/* TRUE if the task ran and succeeded */
+BOOL task_graph_succeeded(const TaskGraph *graph, int task)
+{
+    return graph && task >= 0 && task < graph->count && graph->tasks[task].state == TASK_DONE;
+}
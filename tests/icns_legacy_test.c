@@ -0,0 +1,303 @@
+/*
+ * Legacy ICNS chunk round-trip test
+ * Renders synthetic sources with legacy chunks allowed, unpacks whatever
+ * the writer chose for the 16, 32 and 128px slots (ic04/ic05 ARGB, or
+ * is32/il32/it32 RGB with an s8mk/l8mk/t8mk mask) and compares every
+ * channel with the PNG the same slot gets when legacy chunks are off.
+ * The sources are picked so that each form the writer can choose is chosen
+ * at least once. is32 never is: 16px alpha packs to at most 258 bytes, so
+ * ic04 always undercuts is32 plus a 256-byte s8mk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shared.h"
+
+#define SOURCE_SIZE     128
+
+static int failures;
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+typedef struct {
+    uint8_t *data;                  /* the whole file */
+    size_t len;
+} IcnsFile;
+
+static BOOL read_icns(const char *path, IcnsFile *icns)
+{
+    FILE *f = fopen(path, "rb");
+    long len;
+
+    memset(icns, 0, sizeof(IcnsFile));
+    if (!f) return FALSE;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 8 && fseek(f, 0, SEEK_SET) == 0 &&
+        (icns->data = malloc((size_t)len)) && fread(icns->data, 1, (size_t)len, f) == (size_t)len)
+        icns->len = (size_t)len;
+    fclose(f);
+    return icns->len >= 8 && memcmp(icns->data, "icns", 4) == 0 && get_be32(icns->data + 4) == icns->len;
+}
+
+/* Payload of the chunk of this type, or NULL */
+static const uint8_t *find_chunk(const IcnsFile *icns, const char *type, size_t *len)
+{
+    size_t pos = 8;
+
+    while (pos + 8 <= icns->len) {
+        uint32_t chunk_len = get_be32(icns->data + pos + 4);
+
+        if (chunk_len < 8 || chunk_len > icns->len - pos)
+            return NULL;
+        if (memcmp(icns->data + pos, type, 4) == 0) {
+            *len = chunk_len - 8;
+            return icns->data + pos + 8;
+        }
+        pos += chunk_len;
+    }
+    return NULL;
+}
+
+/*
+ * Unpack one channel of count bytes into every 4th byte of out; returns
+ * the packed bytes consumed, 0 if the runs do not add up to count
+ */
+static size_t unpack_channel(const uint8_t *src, size_t len, size_t count, uint8_t *out)
+{
+    size_t i = 0, o = 0;
+
+    while (o < count) {
+        size_t n;
+
+        if (i >= len) return 0;
+        if (src[i] < 0x80) {
+            n = (size_t)src[i] + 1;
+            if (i + 1 + n > len || o + n > count) return 0;
+            while (n--)
+                out[4 * o++] = src[++i];
+            i++;
+        } else {
+            n = (size_t)src[i] - 125;
+            if (i + 1 >= len || o + n > count) return 0;
+            while (n--)
+                out[4 * o++] = src[i + 1];
+            i += 2;
+        }
+    }
+    return i;
+}
+
+/* Unpack channels (RGBA byte offsets, in chunk order) that fill the chunk exactly */
+static BOOL unpack_channels(const uint8_t *src, size_t len, const int *channels, int nchannels,
+                            size_t npix, uint8_t *rgba)
+{
+    size_t pos = 0, used;
+    int c;
+
+    for (c = 0; c < nchannels; c++) {
+        used = unpack_channel(src + pos, len - pos, npix, rgba + channels[c]);
+        if (!used) return FALSE;
+        pos += used;
+    }
+    return pos == len;
+}
+
+typedef struct {
+    const char *png_type;
+    const char *argb_type;          /* NULL if the size has none */
+    const char *rgb_type;
+    const char *mask_type;
+    uint32_t size;
+    BOOL rgb_prefix;
+} LegacySlot;
+
+static const LegacySlot legacy_slots[] = {
+    {"icp4", "ic04", "is32", "s8mk", 16,  FALSE},
+    {"icp5", "ic05", "il32", "l8mk", 32,  FALSE},
+    {"ic07", NULL,   "it32", "t8mk", 128, TRUE}
+};
+
+#define LEGACY_FORMS    5           /* ic04, ic05, il32, it32 and PNG-only */
+
+/* Which forms the runs chose, by index into the names below */
+static BOOL seen[LEGACY_FORMS];
+static const char *const form_names[LEGACY_FORMS] = {"ic04", "ic05", "il32", "it32", "png"};
+
+static void mark_seen(const char *type)
+{
+    int i;
+
+    for (i = 0; i < LEGACY_FORMS; i++) {
+        if (strcmp(form_names[i], type) == 0)
+            seen[i] = TRUE;
+    }
+}
+
+/* Decode the slot from the legacy file and compare with the PNG in the reference file */
+static void check_slot(const char *source, const LegacySlot *slot, const IcnsFile *legacy,
+                       const IcnsFile *reference)
+{
+    static const int rgb_channels[] = {0, 1, 2};
+    static const int argb_channels[] = {3, 0, 1, 2};
+    size_t npix = (size_t)slot->size * slot->size, len, i;
+    const uint8_t *png, *data, *mask;
+    RgbaImage expected;
+    uint8_t *rgba;
+    BOOL ok = FALSE;
+
+    memset(&expected, 0, sizeof(expected));
+    png = find_chunk(reference, slot->png_type, &len);
+    if (!png || !png_decode(png, len, &expected) || expected.width != slot->size) {
+        fprintf(stderr, "FAIL: %s: no %s PNG to compare with\n", source, slot->png_type);
+        failures++;
+        rgba_image_free(&expected);
+        return;
+    }
+
+    /* The writer keeps the PNG when no legacy form is smaller */
+    if (find_chunk(legacy, slot->png_type, &len)) {
+        mark_seen("png");
+        rgba_image_free(&expected);
+        return;
+    }
+
+    rgba = calloc(npix, 4);
+    if (slot->argb_type && (data = find_chunk(legacy, slot->argb_type, &len))) {
+        mark_seen(slot->argb_type);
+        ok = rgba && len >= 4 && memcmp(data, "ARGB", 4) == 0 &&
+             unpack_channels(data + 4, len - 4, argb_channels, 4, npix, rgba);
+    } else if ((data = find_chunk(legacy, slot->rgb_type, &len)) != NULL) {
+        size_t mask_len, prefix = slot->rgb_prefix ? 4 : 0;
+
+        mark_seen(slot->rgb_type);
+        mask = find_chunk(legacy, slot->mask_type, &mask_len);
+        ok = rgba && mask && mask_len == npix && len >= prefix &&
+             (!prefix || memcmp(data, "\0\0\0\0", 4) == 0) &&
+             unpack_channels(data + prefix, len - prefix, rgb_channels, 3, npix, rgba);
+        for (i = 0; ok && i < npix; i++)
+            rgba[i * 4 + 3] = mask[i];
+    }
+
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s: %upx slot has no well-formed chunk\n", source, slot->size);
+        failures++;
+    } else if (memcmp(rgba, expected.pixels, npix * 4) != 0) {
+        fprintf(stderr, "FAIL: %s: %upx legacy pixels differ from the PNG\n", source, slot->size);
+        failures++;
+    }
+    rgba_image_free(&expected);
+    free(rgba);
+}
+
+/* Render image with and without legacy chunks and check each legacy slot */
+static void check_source(const char *name, const RgbaImage *image, const char *dir)
+{
+    IconRenderOptions opts;
+    IcnsFile legacy, reference;
+    char *legacy_path = heap_printf("%s/%s-legacy.icns", dir, name);
+    char *reference_path = heap_printf("%s/%s.icns", dir, name);
+    size_t i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.compression = ICON_COMPRESS_BALANCED;
+    opts.scratch_dir = dir;
+    opts.reproducible = TRUE;
+
+    memset(&legacy, 0, sizeof(legacy));
+    memset(&reference, 0, sizeof(reference));
+    opts.legacy_chunks = TRUE;
+    if (!icns_render_from_image(image, legacy_path, &opts) || !read_icns(legacy_path, &legacy)) {
+        fprintf(stderr, "FAIL: %s: legacy render\n", name);
+        failures++;
+        goto cleanup;
+    }
+    opts.legacy_chunks = FALSE;
+    if (!icns_render_from_image(image, reference_path, &opts) || !read_icns(reference_path, &reference)) {
+        fprintf(stderr, "FAIL: %s: reference render\n", name);
+        failures++;
+        goto cleanup;
+    }
+
+    for (i = 0; i < sizeof(legacy_slots) / sizeof(legacy_slots[0]); i++)
+        check_slot(name, &legacy_slots[i], &legacy, &reference);
+
+cleanup:
+    free(legacy.data);
+    free(reference.data);
+    unlink(legacy_path);
+    unlink(reference_path);
+    free(legacy_path);
+    free(reference_path);
+}
+
+static uint32_t next_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 24;
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/icns_legacy_test.XXXXXX";
+    RgbaImage image;
+    uint32_t x, y, state = 1;
+    int i;
+
+    if (!mkdtemp(dir) || !rgba_image_alloc(&image, SOURCE_SIZE, SOURCE_SIZE)) {
+        fprintf(stderr, "FAIL: setup\n");
+        return 1;
+    }
+
+    /* One opaque color: at 32px even ARGB runs undercut the PNG framing */
+    for (i = 0; i < SOURCE_SIZE * SOURCE_SIZE; i++)
+        memcpy(image.pixels + (size_t)i * 4, "\x50\xa0\xf0\xff", 4);
+    check_source("solid", &image, dir);
+
+    /* Opaque flat quadrants: the ARGB chunks pack to a few runs per channel */
+    for (y = 0; y < SOURCE_SIZE; y++) {
+        for (x = 0; x < SOURCE_SIZE; x++) {
+            uint8_t *p = image.pixels + ((size_t)y * SOURCE_SIZE + x) * 4;
+
+            p[0] = x < SOURCE_SIZE / 2 ? 200 : 30;
+            p[1] = y < SOURCE_SIZE / 2 ? 90 : 160;
+            p[2] = 60;
+            p[3] = 255;
+        }
+    }
+    check_source("quadrants", &image, dir);
+
+    /* One color with noisy alpha: the raw mask beats packed or deflated alpha */
+    for (i = 0; i < SOURCE_SIZE * SOURCE_SIZE; i++) {
+        uint8_t *p = image.pixels + (size_t)i * 4;
+
+        p[0] = 20;
+        p[1] = 120;
+        p[2] = 220;
+        p[3] = (uint8_t)next_random(&state);
+    }
+    check_source("noisy-alpha", &image, dir);
+
+    /* Noise everywhere: literal runs, and PNG is as small as any legacy form */
+    for (i = 0; i < SOURCE_SIZE * SOURCE_SIZE * 4; i++)
+        image.pixels[i] = (uint8_t)next_random(&state);
+    check_source("noise", &image, dir);
+
+    rgba_image_free(&image);
+    remove_tree(dir);
+
+    for (i = 0; i < LEGACY_FORMS; i++) {
+        if (!seen[i]) {
+            fprintf(stderr, "FAIL: no source was stored as %s\n", form_names[i]);
+            failures++;
+        }
+    }
+
+    if (failures == 0)
+        printf("icns_legacy_test: legacy chunks of 4 sources match their PNGs\n");
+    return failures == 0 ? 0 : 1;
+}
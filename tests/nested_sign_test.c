@@ -0,0 +1,250 @@
+/*
+ * Nested code signing test
+ * Builds a synthetic bundle of Mach-O headers, frameworks, helpers and
+ * non-code files, signs its nested code with the stand-in codesign in
+ * tests/bin and checks from its log what was signed, and in what order.
+ * Run with tests/bin first in PATH, as make check does.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+#define MAX_LOG_LINES   64
+
+static const char *root;
+static int failures;
+
+static void check(BOOL condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void make_parent(const char *path)
+{
+    char *dir = strdup(path);
+
+    *strrchr(dir, '/') = '\0';
+    create_directories(dir);
+    free(dir);
+}
+
+static void put_file(const char *relative, const void *data, size_t len)
+{
+    char *path = heap_printf("%s/%s", root, relative);
+
+    make_parent(path);
+    if (!write_file(path, data, len, TRUE))
+        check(FALSE, relative);
+    free(path);
+}
+
+/* A thin 64-bit header, or a universal one; the magic is all the walk reads */
+static void put_macho(const char *relative, BOOL universal)
+{
+    static const uint8_t thin[32] = {0xcf, 0xfa, 0xed, 0xfe, 0x07, 0x00, 0x00, 0x01};
+    static const uint8_t fat[32] = {0xca, 0xfe, 0xba, 0xbe, 0x00, 0x00, 0x00, 0x02};
+
+    put_file(relative, universal ? fat : thin, 32);
+}
+
+static void put_info_plist(const char *bundle, const char *executable)
+{
+    char *relative = heap_printf("%s/Contents/Info.plist", bundle);
+    char *plist = heap_printf("<?xml version=\"1.0\"?><plist version=\"1.0\"><dict>"
+                              "<key>CFBundleExecutable</key><string>%s</string></dict></plist>",
+                              executable);
+
+    put_file(relative, plist, strlen(plist));
+    free(plist);
+    free(relative);
+}
+
+static void put_link(const char *target, const char *relative)
+{
+    char *path = heap_printf("%s/%s", root, relative);
+
+    check(symlink(target, path) == 0, relative);
+    free(path);
+}
+
+static void make_bundle(void)
+{
+    static const uint8_t java_class[32] = {0xca, 0xfe, 0xba, 0xbe, 0x00, 0x00, 0x00, 0x34};
+
+    put_info_plist("Outer.app", "Outer");
+    put_macho("Outer.app/Contents/MacOS/Outer", FALSE);
+    put_macho("Outer.app/Contents/MacOS/helper", FALSE);
+
+    put_macho("Outer.app/Contents/Frameworks/Foo.framework/Versions/A/Foo", FALSE);
+    put_macho("Outer.app/Contents/Frameworks/Foo.framework/Versions/A/Libraries/libbar.dylib", FALSE);
+    put_link("A", "Outer.app/Contents/Frameworks/Foo.framework/Versions/Current");
+    put_link("Versions/Current/Foo", "Outer.app/Contents/Frameworks/Foo.framework/Foo");
+    put_macho("Outer.app/Contents/Frameworks/libz.dylib", TRUE);
+
+    put_info_plist("Outer.app/Contents/Library/LoginItems/Helper.app", "Helper");
+    put_macho("Outer.app/Contents/Library/LoginItems/Helper.app/Contents/MacOS/Helper", FALSE);
+    put_macho("Outer.app/Contents/Library/LoginItems/Helper.app/Contents/Frameworks/Inner.framework/Inner",
+              FALSE);
+    put_info_plist("Outer.app/Contents/Library/LoginItems/Helper.app/Contents/XPCServices/Svc.xpc", "Svc");
+    put_macho("Outer.app/Contents/Library/LoginItems/Helper.app/Contents/XPCServices/Svc.xpc/Contents/MacOS/Svc",
+              FALSE);
+
+    /* Not code: a Java class shares the universal magic, and signatures are skipped */
+    put_file("Outer.app/Contents/Resources/A.class", java_class, sizeof(java_class));
+    put_file("Outer.app/Contents/Resources/readme.txt", "hi", 2);
+    put_macho("Outer.app/Contents/_CodeSignature/CodeResources", FALSE);
+}
+
+typedef struct {
+    char *lines[MAX_LOG_LINES];
+    int count;
+} SignLog;
+
+static void read_log(const char *path, SignLog *log)
+{
+    char line[4096];
+    FILE *f = fopen(path, "r");
+
+    log->count = 0;
+    while (f && log->count < MAX_LOG_LINES && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        log->lines[log->count++] = strdup(line);
+    }
+    if (f) fclose(f);
+}
+
+/* Line of "<event> <root>/Outer.app/<item>", -1 if there is none */
+static int find_event(const SignLog *log, const char *event, const char *item)
+{
+    char *prefix = heap_printf("%s %s/Outer.app/%s", event, root, item);
+    size_t len = strlen(prefix);
+    int i, found = -1;
+
+    for (i = 0; i < log->count && found < 0; i++) {
+        if (strncmp(log->lines[i], prefix, len) == 0 &&
+            (log->lines[i][len] == '\0' || log->lines[i][len] == ' '))
+            found = i;
+    }
+    free(prefix);
+    return found;
+}
+
+static void check_before(const SignLog *log, const char *inner, const char *outer)
+{
+    char *what = heap_printf("%s signed before %s", inner, outer);
+    int end = find_event(log, "end", inner), start = find_event(log, "start", outer);
+
+    check(end >= 0 && start >= 0 && end < start, what);
+    free(what);
+}
+
+int main(void)
+{
+    static const char *const signed_items[] = {
+        "Contents/MacOS/helper",
+        "Contents/Frameworks/Foo.framework/Versions/A/Libraries/libbar.dylib",
+        "Contents/Frameworks/Foo.framework",
+        "Contents/Frameworks/libz.dylib",
+        "Contents/Library/LoginItems/Helper.app/Contents/Frameworks/Inner.framework",
+        "Contents/Library/LoginItems/Helper.app/Contents/XPCServices/Svc.xpc",
+        "Contents/Library/LoginItems/Helper.app",
+        NULL
+    };
+    static const char *const unsigned_items[] = {
+        "Contents/MacOS/Outer",
+        "Contents/Frameworks/Foo.framework/Versions/A/Foo",
+        "Contents/Frameworks/Foo.framework/Foo",
+        "Contents/Library/LoginItems/Helper.app/Contents/MacOS/Helper",
+        "Contents/Resources/A.class",
+        "Contents/Resources/readme.txt",
+        "Contents/_CodeSignature/CodeResources",
+        NULL
+    };
+    char dir[] = "/tmp/nested_sign_test.XXXXXX";
+    CodeSignOptions options;
+    SignLog log;
+    char *bundle, *log_path;
+    int i, starts = 0, overlap = 0;
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "FAIL: could not create a scratch directory\n");
+        return 1;
+    }
+    root = dir;
+    bundle = heap_printf("%s/Outer.app", root);
+    log_path = heap_printf("%s/codesign.log", root);
+    setenv("CODESIGN_LOG", log_path, 1);
+    make_bundle();
+
+    memset(&options, 0, sizeof(options));
+    options.identity = "-";
+    options.entitlements_path = "/nonexistent/app.entitlements";
+    options.jobs = 4;
+    check(codesign_nested_code(bundle, &options), "nested signing succeeds");
+
+    read_log(log_path, &log);
+    for (i = 0; signed_items[i]; i++) {
+        int end = find_event(&log, "end", signed_items[i]);
+        char *what = heap_printf("%s signed once, forced, without entitlements", signed_items[i]);
+
+        check(end >= 0 && strstr(log.lines[end], " --force ") &&
+              !strstr(log.lines[end], "--entitlements"), what);
+        free(what);
+    }
+    for (i = 0; unsigned_items[i]; i++)
+        check(find_event(&log, "start", unsigned_items[i]) < 0, unsigned_items[i]);
+    for (i = 0; i < log.count; i++)
+        starts += strncmp(log.lines[i], "start ", 6) == 0;
+    check(starts == 7, "exactly seven codesign runs");
+
+    /* Inside-out, and every level finished before the next starts */
+    check_before(&log, signed_items[1], signed_items[2]);
+    check_before(&log, signed_items[4], signed_items[6]);
+    check_before(&log, signed_items[5], signed_items[6]);
+    check_before(&log, signed_items[0], signed_items[2]);
+    check_before(&log, signed_items[3], signed_items[6]);
+
+    /* The five leaves run up to four at a time: some start before any ends */
+    for (i = 0; i < log.count && strncmp(log.lines[i], "start ", 6) == 0; i++)
+        overlap++;
+    check(overlap > 1, "leaves signed concurrently");
+
+    for (i = 0; i < log.count; i++)
+        free(log.lines[i]);
+
+    /* With an exhausted budget, as when every --jobs thread is building, signing runs serially */
+    options.threads = thread_budget_create(0);
+    unlink(log_path);
+    check(codesign_nested_code(bundle, &options), "signing with no free threads succeeds");
+    read_log(log_path, &log);
+    overlap = log.count == 14;
+    for (i = 0; i + 1 < log.count; i += 2)
+        overlap = overlap && strncmp(log.lines[i], "start ", 6) == 0 &&
+                  strncmp(log.lines[i + 1], "end ", 4) == 0;
+    check(overlap, "no signer threads borrowed from an empty budget");
+    check(thread_budget_take(options.threads, 1) == 0, "the budget is left as it was");
+    for (i = 0; i < log.count; i++)
+        free(log.lines[i]);
+    thread_budget_destroy(options.threads);
+    options.threads = NULL;
+
+    /* A failing run fails the whole walk */
+    put_macho("Outer.app/Contents/MacOS/fail-helper", FALSE);
+    check(!codesign_nested_code(bundle, &options), "a codesign failure is reported");
+
+    remove_tree(root);
+    free(bundle);
+    free(log_path);
+
+    if (failures == 0)
+        printf("nested_sign_test: 7 items signed inside-out, leaves concurrently or serially\n");
+    return failures == 0 ? 0 : 1;
+}
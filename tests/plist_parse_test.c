@@ -0,0 +1,217 @@
+/*
+ * Property list parser test
+ * Feeds the native reader the inputs its fixes were about: a binary plist
+ * whose shared references would expand to 2^30 nodes, XML integers with
+ * leading zeros or hex digits, numeric character references outside what
+ * UTF-8 can carry, and UTF-16 strings with lone surrogates and NULs. Also
+ * checks that --plist-set integers are decimal like the XML reader's.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shared.h"
+
+#define BOMB_LEVELS     30
+
+static int failures;
+static int checks;
+
+static void check(BOOL ok, const char *what)
+{
+    checks++;
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+typedef struct {
+    uint8_t data[4096];
+    size_t len;
+    uint8_t offsets[256];           /* one byte per object */
+    int count;
+} BinaryBuilder;
+
+static void bplist_begin(BinaryBuilder *b)
+{
+    memset(b, 0, sizeof(BinaryBuilder));
+    memcpy(b->data, "bplist00", 8);
+    b->len = 8;
+}
+
+/* Start the next object; returns its reference */
+static int bplist_object(BinaryBuilder *b, const uint8_t *bytes, size_t len)
+{
+    b->offsets[b->count] = (uint8_t)b->len;
+    memcpy(b->data + b->len, bytes, len);
+    b->len += len;
+    return b->count++;
+}
+
+/* Offset table and trailer with 1-byte offsets and references */
+static size_t bplist_end(BinaryBuilder *b, int top)
+{
+    size_t table = b->len;
+    uint8_t *trailer;
+
+    memcpy(b->data + b->len, b->offsets, b->count);
+    b->len += b->count;
+    trailer = b->data + b->len;
+    memset(trailer, 0, 32);
+    trailer[6] = 1;
+    trailer[7] = 1;
+    trailer[15] = (uint8_t)b->count;
+    trailer[23] = (uint8_t)top;
+    trailer[31] = (uint8_t)table;
+    b->len += 32;
+    return b->len;
+}
+
+static void test_binary_expansion(void)
+{
+    BinaryBuilder b;
+    PlistDocument doc;
+    const uint8_t leaf[] = {0x51, 'x'};
+    int i, prev;
+
+    /* One string referenced twice: expanded copies are fine at this size */
+    bplist_begin(&b);
+    prev = bplist_object(&b, leaf, sizeof(leaf));
+    {
+        const uint8_t pair[] = {0xA2, (uint8_t)prev, (uint8_t)prev};
+        prev = bplist_object(&b, pair, sizeof(pair));
+    }
+    check(plist_document_parse(&doc, b.data, bplist_end(&b, prev)) &&
+          plist_root(&doc)->count == 2, "a shared reference is expanded");
+    plist_document_close(&doc);
+
+    /* Every level references the one below twice: 2^30 nodes if expanded */
+    bplist_begin(&b);
+    prev = bplist_object(&b, leaf, sizeof(leaf));
+    for (i = 0; i < BOMB_LEVELS; i++) {
+        const uint8_t pair[] = {0xA2, (uint8_t)prev, (uint8_t)prev};
+        prev = bplist_object(&b, pair, sizeof(pair));
+    }
+    check(!plist_document_parse(&doc, b.data, bplist_end(&b, prev)),
+          "a doubling binary plist is rejected");
+}
+
+/* The <integer> of <plist><integer>text</integer></plist>, or FALSE */
+static BOOL parse_xml_integer(const char *text, int64_t *value)
+{
+    PlistDocument doc;
+    char *xml = heap_printf("<plist version=\"1.0\"><integer>%s</integer></plist>", text);
+    BOOL ret = xml && plist_document_parse(&doc, xml, strlen(xml));
+
+    if (ret) {
+        ret = plist_root(&doc)->type == PLIST_NODE_INTEGER;
+        *value = plist_root(&doc)->value.integer;
+        plist_document_close(&doc);
+    }
+    free(xml);
+    return ret;
+}
+
+static void test_integers(void)
+{
+    PlistSetting setting;
+    int64_t value = 0;
+
+    check(parse_xml_integer("010", &value) && value == 10, "XML 010 is ten");
+    check(parse_xml_integer("-42\n", &value) && value == -42, "XML -42 with a newline");
+    check(!parse_xml_integer("0x10", &value), "XML 0x10 is rejected");
+    check(!parse_xml_integer("12abc", &value), "XML 12abc is rejected");
+    check(!parse_xml_integer("", &value), "an empty XML integer is rejected");
+
+    check(plist_setting_parse("Foo=integer:010", &setting) && setting.integer == 10,
+          "--plist-set integer:010 is ten");
+    check(!plist_setting_parse("Foo=integer:0x10", &setting), "--plist-set integer:0x10 is rejected");
+}
+
+/* Decode <plist><string>text</string></plist> and compare with expected */
+static void check_xml_string(const char *text, const char *expected)
+{
+    PlistDocument doc;
+    char buf[256];
+    char *xml = heap_printf("<plist version=\"1.0\"><string>%s</string></plist>", text);
+    char *what = heap_printf("XML string '%s'", text);
+    BOOL ok = xml && plist_document_parse(&doc, xml, strlen(xml));
+
+    if (ok) {
+        ok = plist_string_copy(plist_root(&doc), buf, sizeof(buf)) == strlen(expected) &&
+             strcmp(buf, expected) == 0;
+        plist_document_close(&doc);
+    }
+    check(ok, what);
+    free(what);
+    free(xml);
+}
+
+static void test_char_refs(void)
+{
+    check_xml_string("&#65;&#x42;&amp;", "AB&");
+    check_xml_string("&#x1F600;", "\xf0\x9f\x98\x80");
+    check_xml_string("a&#0;b", "a&#0;b");
+    check_xml_string("&#xD800;", "&#xD800;");
+    check_xml_string("&#xDFFF;", "&#xDFFF;");
+    check_xml_string("&#x110000;", "&#x110000;");
+    check_xml_string("&#4294967361;", "&#4294967361;");
+    check_xml_string("&#;&#x;&#12a;", "&#;&#x;&#12a;");
+}
+
+/* Decode a binary plist whose root is the UTF-16BE string units */
+static void check_utf16_string(const uint16_t *units, int count, const char *expected,
+                               const char *what)
+{
+    BinaryBuilder b;
+    PlistDocument doc;
+    uint8_t object[1 + 2 * 15];
+    char buf[256];
+    int i;
+    BOOL ok;
+
+    object[0] = (uint8_t)(0x60 | count);
+    for (i = 0; i < count; i++) {
+        object[1 + 2 * i] = (uint8_t)(units[i] >> 8);
+        object[2 + 2 * i] = (uint8_t)units[i];
+    }
+    bplist_begin(&b);
+    bplist_object(&b, object, 1 + 2 * (size_t)count);
+
+    ok = plist_document_parse(&doc, b.data, bplist_end(&b, 0));
+    if (ok) {
+        ok = plist_string_copy(plist_root(&doc), buf, sizeof(buf)) == strlen(expected) &&
+             strcmp(buf, expected) == 0;
+        plist_document_close(&doc);
+    }
+    check(ok, what);
+}
+
+static void test_utf16(void)
+{
+    static const uint16_t pair[] = {'A', 0xD83D, 0xDE00, 0x00E9};
+    static const uint16_t lone_high[] = {0xD800, 'A'};
+    static const uint16_t lone_low[] = {'A', 0xDC00};
+    static const uint16_t trailing_high[] = {'A', 0xDBFF};
+    static const uint16_t nul[] = {'a', 0x0000, 'b'};
+
+    check_utf16_string(pair, 4, "A\xf0\x9f\x98\x80\xc3\xa9", "a UTF-16 surrogate pair");
+    check_utf16_string(lone_high, 2, "\xef\xbf\xbd" "A", "a lone high surrogate");
+    check_utf16_string(lone_low, 2, "A\xef\xbf\xbd", "a lone low surrogate");
+    check_utf16_string(trailing_high, 2, "A\xef\xbf\xbd", "a high surrogate at the end");
+    check_utf16_string(nul, 3, "a\xef\xbf\xbd" "b", "a UTF-16 NUL");
+}
+
+int main(void)
+{
+    test_binary_expansion();
+    test_integers();
+    test_char_refs();
+    test_utf16();
+
+    if (failures == 0)
+        printf("plist_parse_test: %d checks passed\n", checks);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+/*
+ * PNG header validation test
+ * Decodes a small image in every color type and bit depth combination,
+ * legal or not, through both the whole-image and the row decoder. The
+ * combinations the PNG spec allows must decode; the others (RGBA at 1 bit
+ * per sample, say) must be rejected before any row is read, since their
+ * row buffers are too small for the samples the color type implies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "shared.h"
+
+#define TEST_WIDTH      64
+#define TEST_HEIGHT     4
+
+static int failures;
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static size_t put_chunk(uint8_t *out, const char *type, const uint8_t *data, uint32_t len)
+{
+    uLong crc;
+
+    put_be32(out, len);
+    memcpy(out + 4, type, 4);
+    if (len)
+        memcpy(out + 8, data, len);
+    crc = crc32(crc32(0, NULL, 0), out + 4, 4 + len);
+    put_be32(out + 8 + len, (uint32_t)crc);
+    return 12 + len;
+}
+
+/* A zero-filled image whose IHDR claims color_type at bit_depth; caller frees */
+static uint8_t *make_png(uint8_t color_type, uint8_t bit_depth, size_t *len)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    /* Sized for the widest legal row: RGBA at 16 bits */
+    size_t raw_len = (size_t)TEST_HEIGHT * (1 + TEST_WIDTH * 8);
+    uLongf packed_len = compressBound(raw_len);
+    uint8_t *raw = calloc(raw_len, 1), *packed = malloc(packed_len);
+    uint8_t *png = malloc(8 + 25 + 12 + 3 * 256 + 12 + packed_len + 12);
+    uint8_t ihdr[13] = {0};
+    uint8_t palette[3 * 256] = {0};
+    size_t pos = 0;
+
+    if (!raw || !packed || !png || compress(packed, &packed_len, raw, raw_len) != Z_OK) {
+        free(raw);
+        free(packed);
+        free(png);
+        return NULL;
+    }
+
+    put_be32(ihdr, TEST_WIDTH);
+    put_be32(ihdr + 4, TEST_HEIGHT);
+    ihdr[8] = bit_depth;
+    ihdr[9] = color_type;
+
+    memcpy(png, signature, 8);
+    pos = 8;
+    pos += put_chunk(png + pos, "IHDR", ihdr, 13);
+    if (color_type == 3)
+        pos += put_chunk(png + pos, "PLTE", palette, sizeof(palette));
+    pos += put_chunk(png + pos, "IDAT", packed, (uint32_t)packed_len);
+    pos += put_chunk(png + pos, "IEND", NULL, 0);
+
+    free(raw);
+    free(packed);
+    *len = pos;
+    return png;
+}
+
+static BOOL count_row(void *ctx, uint32_t y, const uint8_t *rgba)
+{
+    (void)y;
+    (void)rgba;
+    (*(int *)ctx)++;
+    return TRUE;
+}
+
+static void check_combination(uint8_t color_type, uint8_t bit_depth, BOOL legal)
+{
+    RgbaImage image;
+    size_t len;
+    uint8_t *png = make_png(color_type, bit_depth, &len);
+    BOOL decoded;
+    int rows = 0;
+
+    if (!png) {
+        fprintf(stderr, "FAIL: could not build a type %u, %u-bit PNG\n", color_type, bit_depth);
+        failures++;
+        return;
+    }
+
+    memset(&image, 0, sizeof(image));
+    decoded = png_decode(png, len, &image);
+    if (decoded)
+        rgba_image_free(&image);
+    if (decoded != legal) {
+        fprintf(stderr, "FAIL: type %u at %u bits %s\n", color_type, bit_depth,
+                legal ? "was rejected" : "was decoded");
+        failures++;
+    }
+
+    decoded = png_decode_rows(png, len, count_row, &rows);
+    if (decoded != legal || rows != (legal ? TEST_HEIGHT : 0)) {
+        fprintf(stderr, "FAIL: row decoder, type %u at %u bits: %s, %d row(s)\n", color_type,
+                bit_depth, decoded ? "decoded" : "rejected", rows);
+        failures++;
+    }
+    free(png);
+}
+
+int main(void)
+{
+    static const uint8_t types[] = {0, 2, 3, 4, 6, 1, 5, 7};
+    static const uint8_t depths[] = {1, 2, 4, 8, 16, 0, 3, 32};
+    size_t t, d;
+    int checked = 0;
+
+    for (t = 0; t < sizeof(types); t++) {
+        for (d = 0; d < sizeof(depths); d++) {
+            uint8_t type = types[t], depth = depths[d];
+            BOOL legal = depth == 8 || depth == 16 || ((type == 0 || type == 3) && depth <= 4 &&
+                                                       (depth == 1 || depth == 2 || depth == 4));
+
+            if (type == 1 || type == 5 || type == 7)
+                legal = FALSE;
+            if (type == 3 && depth == 16)
+                legal = FALSE;
+            check_combination(type, depth, legal);
+            checked++;
+        }
+    }
+
+    if (failures == 0)
+        printf("png_header_test: %d color type and bit depth combinations checked\n", checked);
+    return failures == 0 ? 0 : 1;
+}
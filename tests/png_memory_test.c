@@ -0,0 +1,167 @@
+/*
+ * Peak memory test for the streaming PNG icon path
+ * Writes synthetic RGBA PNGs, a 16384x16384 one and a 1024x100000 one,
+ * renders each to ICNS with the default icon memory limit and checks the
+ * process never held anything close to what a full decode would need:
+ * 1 GB and 400 MB.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <zlib.h>
+
+#include "shared.h"
+
+#define SOURCE_SIZE     16384
+#define THIN_WIDTH      1024        /* under the largest slot one way only */
+#define THIN_HEIGHT     100000
+#define MAX_PEAK_MB     96          /* the 64 MB default limit plus slack */
+
+static BOOL write_chunk(FILE *f, const char *type, const uint8_t *data, uint32_t len)
+{
+    uint8_t header[8] = {len >> 24, len >> 16, len >> 8, len, type[0], type[1], type[2], type[3]};
+    uLong crc = crc32(crc32(0, NULL, 0), header + 4, 4);
+    uint8_t trailer[4];
+
+    crc = crc32(crc, data, len);
+    trailer[0] = crc >> 24; trailer[1] = crc >> 16; trailer[2] = crc >> 8; trailer[3] = crc;
+    return fwrite(header, 1, 8, f) == 8 && fwrite(data, 1, len, f) == len &&
+           fwrite(trailer, 1, 4, f) == 4;
+}
+
+/*
+ * One row at a time through deflate, so the writer stays small too. The
+ * gradients compress well: the decoder maps its source, and a large file
+ * would count toward the peak without being decoder memory.
+ */
+static BOOL write_synthetic_png(const char *path, uint32_t width, uint32_t height)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    uint8_t ihdr[13] = {width >> 24, width >> 16, width >> 8, width, height >> 24, height >> 16,
+                        height >> 8, height, 8, 6, 0, 0, 0};
+    size_t row_len = 1 + (size_t)width * 4;
+    uint8_t *row = malloc(row_len), *out = malloc(1 << 16);
+    FILE *f = fopen(path, "wb");
+    z_stream z;
+    BOOL ok = row && out && f && fwrite(signature, 1, 8, f) == 8 && write_chunk(f, "IHDR", ihdr, 13);
+    uint32_t y, x;
+
+    memset(&z, 0, sizeof(z));
+    if (ok && deflateInit(&z, Z_BEST_SPEED) != Z_OK)
+        ok = FALSE;
+
+    for (y = 0; ok && y <= height; y++) {
+        int flush = y == height ? Z_FINISH : Z_NO_FLUSH, err;
+
+        if (y < height) {
+            row[0] = 0;
+            for (x = 0; x < width; x++) {
+                uint8_t *p = row + 1 + (size_t)x * 4;
+
+                p[0] = (uint8_t)(x >> 6);
+                p[1] = (uint8_t)(y >> 6);
+                p[2] = (uint8_t)((x + y) >> 7);
+                p[3] = 255;
+            }
+            z.next_in = row;
+            z.avail_in = (uInt)row_len;
+        }
+        do {
+            z.next_out = out;
+            z.avail_out = 1 << 16;
+            err = deflate(&z, flush);
+            if (err == Z_STREAM_ERROR || ((1 << 16) - z.avail_out > 0 &&
+                                          !write_chunk(f, "IDAT", out, (1 << 16) - z.avail_out)))
+                ok = FALSE;
+        } while (ok && (z.avail_out == 0 || (flush == Z_FINISH && err != Z_STREAM_END)));
+    }
+
+    deflateEnd(&z);
+    ok = ok && write_chunk(f, "IEND", NULL, 0);
+    if (f && fclose(f) != 0)
+        ok = FALSE;
+    free(row);
+    free(out);
+    return ok;
+}
+
+static long peak_rss_mb(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss >> 20;   /* bytes */
+#else
+    return usage.ru_maxrss >> 10;   /* kilobytes */
+#endif
+}
+
+/* Render one source and check the ICNS has its 1024px chunk: streamed, not skipped */
+static BOOL render(const char *dir, uint32_t width, uint32_t height)
+{
+    IconRenderOptions opts;
+    char *png = heap_printf("%s/source.png", dir), *icns = heap_printf("%s/icon.icns", dir);
+    MappedFile file;
+    long before, peak;
+    BOOL ok = FALSE;
+
+    if (!png || !icns || !write_synthetic_png(png, width, height)) {
+        fprintf(stderr, "FAIL: could not write a %ux%u PNG\n", width, height);
+        goto cleanup;
+    }
+
+    before = peak_rss_mb();
+    memset(&opts, 0, sizeof(opts));
+    if (!icns_render_from_png(png, icns, &opts)) {
+        fprintf(stderr, "FAIL: rendering %ux%u PNG\n", width, height);
+        goto cleanup;
+    }
+    peak = peak_rss_mb();
+
+    if (!map_file(icns, &file)) {
+        fprintf(stderr, "FAIL: no ICNS written for %ux%u\n", width, height);
+        goto cleanup;
+    }
+    ok = memmem(file.data, file.len, "ic10", 4) != NULL;
+    unmap_file(&file);
+    if (!ok) {
+        fprintf(stderr, "FAIL: ICNS for %ux%u has no 1024x1024 image\n", width, height);
+        goto cleanup;
+    }
+
+    printf("png_memory_test: %ux%u source, peak RSS %ld MB (%ld MB before rendering)\n",
+           width, height, peak, before);
+    if (peak > MAX_PEAK_MB) {
+        fprintf(stderr, "FAIL: peak RSS %ld MB is over %d MB\n", peak, MAX_PEAK_MB);
+        ok = FALSE;
+    }
+
+cleanup:
+    if (png) unlink(png);
+    if (icns) unlink(icns);
+    free(png);
+    free(icns);
+    return ok;
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/png_memory_test.XXXXXX";
+    BOOL ok;
+
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "FAIL: could not set up %s\n", dir);
+        return 1;
+    }
+
+    /* Peak RSS only grows, so the smaller case goes first */
+    ok = render(dir, THIN_WIDTH, THIN_HEIGHT);
+    ok = render(dir, SOURCE_SIZE, SOURCE_SIZE) && ok;
+
+    rmdir(dir);
+    return ok ? 0 : 1;
+}
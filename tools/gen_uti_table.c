@@ -0,0 +1,290 @@
+/*
+ * UTI Table Generator for AppBundleGenerator
+ * Turns uti_types.txt into uti_table.h: the type list plus two minimal
+ * perfect hashes (extension -> type, MIME type -> first type with it), so
+ * lookups at run time are two hash computations and one string compare.
+ *
+ * Hash-and-displace: keys are split into buckets by a first hash, then,
+ * largest bucket first, each bucket gets the smallest seed that sends all
+ * of its keys to unused slots of the final table.
+ *
+ * Build-time only; runs on the build host and needs nothing but libc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#define MAX_TYPES       4096
+#define MAX_SEED        10000000u
+
+typedef struct {
+    char *ext;
+    char *uti;
+    char *mime;
+    char *conforms;                 /* NULL when macOS declares the type */
+    char *description;
+    int line;
+} TypeRow;
+
+typedef struct {
+    const char *keys[MAX_TYPES];
+    int values[MAX_TYPES];
+    int count;
+    int buckets;
+    int slots;
+    uint32_t *seeds;                /* per bucket */
+    int *table;                     /* per slot: value, -1 if empty */
+} PerfectHash;
+
+static TypeRow rows[MAX_TYPES];
+static int row_count;
+
+/* Must match uti_hash() in associations.c */
+static uint32_t uti_hash(uint32_t seed, const char *s)
+{
+    uint32_t h = 2166136261u ^ seed;
+
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static char *next_field(char **p)
+{
+    char *start;
+
+    while (**p == ' ' || **p == '\t') (*p)++;
+    if (!**p) return NULL;
+    start = *p;
+    while (**p && **p != ' ' && **p != '\t') (*p)++;
+    if (**p) *(*p)++ = '\0';
+    return strdup(start);
+}
+
+static int read_types(const char *path)
+{
+    char line[1024];
+    FILE *file = fopen(path, "r");
+    int lineno = 0;
+
+    if (!file) {
+        perror(path);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        TypeRow *row = &rows[row_count];
+        char *p = line, *end;
+        int i;
+
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p || *p == '#') continue;
+
+        if (row_count == MAX_TYPES) {
+            fprintf(stderr, "%s:%d: too many types\n", path, lineno);
+            fclose(file);
+            return 0;
+        }
+
+        row->ext = next_field(&p);
+        row->uti = next_field(&p);
+        row->mime = next_field(&p);
+        row->conforms = next_field(&p);
+        while (*p == ' ' || *p == '\t') p++;
+        end = p + strlen(p);
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+        row->description = strdup(p);
+        row->line = lineno;
+
+        if (!row->conforms || !*row->description) {
+            fprintf(stderr, "%s:%d: expected extension, UTI, MIME, conforms-to and description\n",
+                    path, lineno);
+            fclose(file);
+            return 0;
+        }
+        for (i = 0; row->ext[i]; i++)
+            row->ext[i] = (char)tolower((unsigned char)row->ext[i]);
+        if (strcmp(row->conforms, "-") == 0) {
+            free(row->conforms);
+            row->conforms = NULL;
+        }
+        row_count++;
+    }
+
+    fclose(file);
+    return 1;
+}
+
+/* Same-MIME rows end up adjacent, so the MIME hash can point at the first */
+static int compare_rows(const void *a, const void *b)
+{
+    const TypeRow *ra = a, *rb = b;
+    int c = strcmp(ra->mime, rb->mime);
+
+    return c ? c : strcmp(ra->ext, rb->ext);
+}
+
+static int *bucket_sizes;
+
+static int compare_buckets(const void *a, const void *b)
+{
+    int sa = bucket_sizes[*(const int *)a], sb = bucket_sizes[*(const int *)b];
+
+    return sb != sa ? sb - sa : *(const int *)a - *(const int *)b;
+}
+
+static int try_build(PerfectHash *ph)
+{
+    int *order, *members, i, k;
+    char *used;
+
+    ph->seeds = calloc(ph->buckets, sizeof(uint32_t));
+    ph->table = malloc(ph->slots * sizeof(int));
+    bucket_sizes = calloc(ph->buckets, sizeof(int));
+    order = malloc(ph->buckets * sizeof(int));
+    members = malloc(ph->count * sizeof(int));
+    used = calloc(ph->slots, 1);
+    if (!ph->seeds || !ph->table || !bucket_sizes || !order || !members || !used) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    for (i = 0; i < ph->slots; i++) ph->table[i] = -1;
+    for (i = 0; i < ph->count; i++)
+        bucket_sizes[uti_hash(0, ph->keys[i]) % ph->buckets]++;
+    for (i = 0; i < ph->buckets; i++) order[i] = i;
+    qsort(order, ph->buckets, sizeof(int), compare_buckets);
+
+    for (k = 0; k < ph->buckets && bucket_sizes[order[k]] > 0; k++) {
+        int bucket = order[k], n = 0, j;
+        uint32_t seed;
+
+        for (i = 0; i < ph->count; i++) {
+            if ((int)(uti_hash(0, ph->keys[i]) % ph->buckets) == bucket)
+                members[n++] = i;
+        }
+
+        for (seed = 1; seed < MAX_SEED; seed++) {
+            for (i = 0; i < n; i++) {
+                int slot = uti_hash(seed, ph->keys[members[i]]) % ph->slots;
+
+                if (used[slot]) break;
+                for (j = 0; j < i; j++) {
+                    if ((int)(uti_hash(seed, ph->keys[members[j]]) % ph->slots) == slot) break;
+                }
+                if (j < i) break;
+            }
+            if (i == n) break;
+        }
+        if (seed == MAX_SEED) {
+            free(order); free(members); free(used); free(bucket_sizes);
+            free(ph->seeds); free(ph->table);
+            return 0;
+        }
+
+        ph->seeds[bucket] = seed;
+        for (i = 0; i < n; i++) {
+            int slot = uti_hash(seed, ph->keys[members[i]]) % ph->slots;
+            used[slot] = 1;
+            ph->table[slot] = ph->values[members[i]];
+        }
+    }
+
+    free(order); free(members); free(used); free(bucket_sizes);
+    return 1;
+}
+
+/* Minimal if possible; one spare slot at a time otherwise */
+static void build_hash(PerfectHash *ph)
+{
+    ph->buckets = ph->count / 3 + 1;
+    for (ph->slots = ph->count > 0 ? ph->count : 1; !try_build(ph); ph->slots++)
+        ;
+}
+
+static void print_string(const char *s)
+{
+    if (!s) {
+        printf("NULL");
+        return;
+    }
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+static void print_hash(const char *macro, const char *name, const PerfectHash *ph)
+{
+    int i;
+
+    printf("#define %s_BUCKETS %d\n#define %s_SLOTS %d\n\n", macro, ph->buckets, macro, ph->slots);
+    printf("static const uint32_t %s_seeds[%s_BUCKETS] = {", name, macro);
+    for (i = 0; i < ph->buckets; i++)
+        printf("%s%u", i == 0 ? "\n    " : i % 10 ? ", " : ",\n    ", ph->seeds[i]);
+    printf("\n};\n\nstatic const int16_t %s_slots[%s_SLOTS] = {", name, macro);
+    for (i = 0; i < ph->slots; i++)
+        printf("%s%d", i == 0 ? "\n    " : i % 16 ? ", " : ",\n    ", ph->table[i]);
+    printf("\n};\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static PerfectHash ext_hash, mime_hash;
+    int i, j;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s uti_types.txt > uti_table.h\n", argv[0]);
+        return 1;
+    }
+    if (!read_types(argv[1]))
+        return 1;
+
+    qsort(rows, row_count, sizeof(TypeRow), compare_rows);
+
+    for (i = 0; i < row_count; i++) {
+        for (j = 0; j < ext_hash.count; j++) {
+            if (strcmp(ext_hash.keys[j], rows[i].ext) == 0) {
+                fprintf(stderr, "%s:%d: duplicate extension '%s'\n", argv[1], rows[i].line, rows[i].ext);
+                return 1;
+            }
+        }
+        ext_hash.keys[ext_hash.count] = rows[i].ext;
+        ext_hash.values[ext_hash.count++] = i;
+
+        if (i == 0 || strcmp(rows[i].mime, rows[i - 1].mime) != 0) {
+            mime_hash.keys[mime_hash.count] = rows[i].mime;
+            mime_hash.values[mime_hash.count++] = i;
+        }
+    }
+
+    build_hash(&ext_hash);
+    build_hash(&mime_hash);
+
+    printf("/* Generated from %s by tools/gen_uti_table. Do not edit. */\n\n", argv[1]);
+    printf("#define UTI_TYPE_COUNT %d\n\n", row_count);
+    printf("static const UtiType uti_types[UTI_TYPE_COUNT] = {\n");
+    for (i = 0; i < row_count; i++) {
+        printf("    {");
+        print_string(rows[i].ext);      printf(", ");
+        print_string(rows[i].uti);      printf(", ");
+        print_string(rows[i].mime);     printf(", ");
+        print_string(rows[i].conforms); printf(", ");
+        print_string(rows[i].description);
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    print_hash("UTI_EXT", "uti_ext", &ext_hash);
+    print_hash("UTI_MIME", "uti_mime", &mime_hash);
+    return 0;
+}
@@ -0,0 +1,353 @@
+/*
+ * Bundle Updates for AppBundleGenerator
+ * Changes Info.plist keys and/or the icon of existing bundles in place,
+ * instead of rebuilding them. Targets are bundle paths or glob patterns
+ * ("-" reads a list from stdin, one path per line).
+ *
+ * The icon is rendered once and the same bytes go to every bundle. Each
+ * bundle is a work item on the pool; a bundle whose Info.plist and icon
+ * already match is left alone, so only bundles that really changed get
+ * new files, and only those are re-signed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "shared.h"
+
+typedef struct {
+    const AppBundleOptions *options;
+    const MappedFile *icon;         /* rendered icon.icns, NULL if no --icon */
+    const char *entitlements;       /* for re-signing, NULL if not signing */
+} UpdatePlan;
+
+typedef struct {
+    const UpdatePlan *plan;
+    const char *bundle_path;
+    UpdateResult result;
+    BOOL stale_signature;           /* changed, was signed, and not re-signed */
+} UpdateTask;
+
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} TargetList;
+
+static BOOL add_target(TargetList *list, const char *path)
+{
+    size_t len = strlen(path);
+    int i;
+
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+
+    for (i = 0; i < list->count; i++) {
+        if (strlen(list->paths[i]) == len && memcmp(list->paths[i], path, len) == 0)
+            return TRUE;
+    }
+
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+
+        if (!paths) return FALSE;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+
+    list->paths[list->count] = strndup(path, len);
+    return list->paths[list->count++] != NULL;
+}
+
+static void free_targets(TargetList *list)
+{
+    int i;
+
+    for (i = 0; i < list->count; i++)
+        free(list->paths[i]);
+    free(list->paths);
+}
+
+/* A pattern that matches nothing is an error, so a typo does not pass as "0 updated" */
+static BOOL expand_target(TargetList *list, const char *pattern)
+{
+    glob_t matches;
+    size_t i;
+    BOOL ok = TRUE;
+
+    if (glob(pattern, GLOB_MARK, NULL, &matches) != 0) {
+        fprintf(stderr, "Error: no bundle matches '%s'\n", pattern);
+        return FALSE;
+    }
+
+    for (i = 0; ok && i < matches.gl_pathc; i++)
+        ok = add_target(list, matches.gl_pathv[i]);
+
+    globfree(&matches);
+    return ok;
+}
+
+static BOOL read_target_list(TargetList *list, FILE *file)
+{
+    char line[4096];
+
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (*line && *line != '#' && !add_target(list, line))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Replace Resources/icon.icns unless it already holds exactly these bytes */
+static BOOL update_icon(char *resources, const MappedFile *icon, BOOL *changed)
+{
+    char *icns_path = heap_printf("%s/icon.icns", resources);
+    BOOL ret;
+
+    *changed = FALSE;
+    ret = icns_path && create_directories(resources) &&
+          replace_file(icns_path, icon->data, icon->len, changed);
+
+    free(icns_path);
+    return ret;
+}
+
+/* Re-sign a changed bundle with options' identity and the given entitlements */
+static BOOL resign_bundle(const char *bundle_path, const AppBundleOptions *options,
+                          const char *entitlements)
+{
+    CodeSignOptions sign_opts = {0};
+
+    sign_opts.identity = options->signing_identity;
+    sign_opts.enable_hardened_runtime = options->enable_hardened_runtime;
+    sign_opts.entitlements_path = entitlements;
+    sign_opts.force = TRUE;             /* the old signature is invalid now */
+    sign_opts.timestamp = !options->reproducible;
+    sign_opts.jobs = options->jobs;
+
+    return codesign_bundle(bundle_path, &sign_opts) && verify_codesign(bundle_path);
+}
+
+/*
+ * The rest of an in-place change, once the icon (if any) is in Resources:
+ * write plist_options' keys to Info.plist and, if the icon or the plist
+ * changed, re-sign with sign_options' identity or, without one, report in
+ * *stale_signature a signature the change broke. The bundle is touched so
+ * Finder and Launch Services notice, or with sign_options->reproducible
+ * normalized again like a fresh reproducible build.
+ */
+UpdateResult update_bundle_in_place(const char *bundle_path, const AppBundleOptions *plist_options,
+                                    BOOL set_icon_file, BOOL icon_changed,
+                                    const AppBundleOptions *sign_options, const char *entitlements,
+                                    BOOL *stale_signature)
+{
+    char *contents = heap_printf("%s/Contents", bundle_path), *signature = NULL;
+    UpdateResult result = UPDATE_FAILED;
+    BOOL plist_changed = FALSE;
+    struct stat st;
+
+    *stale_signature = FALSE;
+    if (!contents || !update_bundle_plist(contents, plist_options, set_icon_file, &plist_changed))
+        goto cleanup;
+
+    if (!icon_changed && !plist_changed) {
+        result = UPDATE_UNCHANGED;
+        goto cleanup;
+    }
+
+    result = UPDATE_CHANGED;
+    if (sign_options->signing_identity) {
+        if (resign_bundle(bundle_path, sign_options, entitlements))
+            result = UPDATE_SIGNED;
+        else
+            result = UPDATE_FAILED;
+    } else {
+        signature = heap_printf("%s/_CodeSignature", contents);
+        *stale_signature = signature && stat(signature, &st) == 0;
+    }
+
+    if (!sign_options->reproducible)
+        utimes(bundle_path, NULL);
+    else if (!normalize_tree(bundle_path, (time_t)sign_options->source_date_epoch))
+        result = UPDATE_FAILED;
+
+cleanup:
+    free(signature);
+    free(contents);
+    return result;
+}
+
+static void update_bundle_task(void *arg)
+{
+    UpdateTask *task = arg;
+    const UpdatePlan *plan = task->plan;
+    char *contents, *resources = NULL;
+    BOOL icon_changed = FALSE;
+    struct stat st;
+
+    task->result = UPDATE_FAILED;
+    contents = heap_printf("%s/Contents", task->bundle_path);
+    if (!contents || stat(contents, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: %s is not an application bundle\n", task->bundle_path);
+        goto cleanup;
+    }
+
+    if (plan->icon) {
+        resources = heap_printf("%s/Resources", contents);
+        if (!resources || !update_icon(resources, plan->icon, &icon_changed)) {
+            fprintf(stderr, "Error: could not replace the icon of %s\n", task->bundle_path);
+            goto cleanup;
+        }
+    }
+
+    task->result = update_bundle_in_place(task->bundle_path, plan->options, plan->icon != NULL,
+                                          icon_changed, plan->options, plan->entitlements,
+                                          &task->stale_signature);
+
+cleanup:
+    free(resources);
+    free(contents);
+}
+
+/*
+ * Entitlements for re-signing bundles built with options: the user's file,
+ * or one generated once into the context's scratch space and returned in
+ * *generated for the caller to free. NULL with *generated unset when not
+ * signing; NULL on failure otherwise.
+ */
+const char *resign_entitlements(AppBundleContext *ctx, const AppBundleOptions *options,
+                                char **generated)
+{
+    *generated = NULL;
+    if (!options->signing_identity)
+        return NULL;
+    if (options->entitlements_file)
+        return options->entitlements_file;
+
+    *generated = context_scratch_path(ctx, ".entitlements");
+    if (!*generated ||
+        !generate_entitlements_file(*generated, options->enable_hardened_runtime,
+                                    options->allow_jit, options->allow_unsigned_memory,
+                                    options->allow_dyld_vars)) {
+        print_error(ERR_CODE_SIGNING_FAILED, "Could not write entitlements");
+        free(*generated);
+        *generated = NULL;
+    }
+    return *generated;
+}
+
+/* Render the icon once into the context's scratch directory */
+static BOOL render_icon(AppBundleContext *ctx, const AppBundleOptions *options, MappedFile *icon)
+{
+    IconRenderOptions icon_opts;
+    char *render_dir, *icns_path = NULL;
+    BOOL ret = FALSE;
+
+    icon_render_options(ctx, options, &icon_opts);
+
+    render_dir = context_scratch_path(ctx, ".icon");
+    if (render_dir && create_directories(render_dir) &&
+        add_icns_for_bundle(options->icon_path, render_dir, &icon_opts)) {
+        icns_path = heap_printf("%s/icon.icns", render_dir);
+        ret = icns_path && map_file(icns_path, icon);
+    }
+
+    free(icns_path);
+    free(render_dir);
+    return ret;
+}
+
+/* Update every bundle named by targets; TRUE if none failed */
+BOOL run_update(const char *const *targets, int count, const AppBundleOptions *options)
+{
+    TargetList list = {0};
+    UpdatePlan plan = {0};
+    UpdateTask *tasks = NULL;
+    AppBundleContext *ctx = NULL;
+    WorkQueue *queue;
+    MappedFile icon = {0};
+    char *entitlements = NULL;
+    int i, counts[UPDATE_FAILED + 1] = {0}, stale = 0;
+    BOOL ok = TRUE;
+
+    for (i = 0; ok && i < count; i++) {
+        if (strcmp(targets[i], "-") == 0)
+            ok = read_target_list(&list, stdin);
+        else
+            ok = expand_target(&list, targets[i]);
+    }
+    if (!ok || list.count == 0) {
+        if (ok) fprintf(stderr, "Error: no bundles to update\n");
+        free_targets(&list);
+        return FALSE;
+    }
+
+    ctx = appbundle_context_create(options->jobs);
+    tasks = calloc(list.count, sizeof(UpdateTask));
+    if (!ctx || !tasks) {
+        print_error(ERR_DIR_CREATION_FAILED, "Could not create scratch directory");
+        ok = FALSE;
+        goto cleanup;
+    }
+
+    plan.options = options;
+    if (options->icon_path) {
+        if (!render_icon(ctx, options, &icon)) {
+            print_error(ERR_ICON_CONVERSION_FAILED, options->icon_path);
+            ok = FALSE;
+            goto cleanup;
+        }
+        plan.icon = &icon;
+    }
+
+    /* One entitlements file serves every bundle, as all share the options */
+    plan.entitlements = resign_entitlements(ctx, options, &entitlements);
+    if (options->signing_identity && !plan.entitlements) {
+        ok = FALSE;
+        goto cleanup;
+    }
+
+    printf("Updating %d bundle(s)\n", list.count);
+
+    queue = context_queue(ctx);
+    for (i = 0; i < list.count; i++) {
+        tasks[i].plan = &plan;
+        tasks[i].bundle_path = list.paths[i];
+        if (!queue || !work_queue_submit(queue, update_bundle_task, &tasks[i]))
+            update_bundle_task(&tasks[i]);
+    }
+    if (queue)
+        work_queue_wait(queue);
+
+    for (i = 0; i < list.count; i++) {
+        static const char *const labels[] = {"unchanged", "updated", "updated and re-signed", "FAILED"};
+
+        counts[tasks[i].result]++;
+        stale += tasks[i].stale_signature;
+        printf("  %s: %s%s\n", tasks[i].bundle_path, labels[tasks[i].result],
+               tasks[i].stale_signature ? " (signature no longer valid, use --sign)" : "");
+    }
+
+    printf("Updated %d, re-signed %d, unchanged %d, failed %d of %d bundle(s)\n",
+           counts[UPDATE_CHANGED] + counts[UPDATE_SIGNED], counts[UPDATE_SIGNED],
+           counts[UPDATE_UNCHANGED], counts[UPDATE_FAILED], list.count);
+    if (stale)
+        fprintf(stderr, "Warning: %d updated bundle(s) had a code signature that is now invalid\n",
+                stale);
+    ok = counts[UPDATE_FAILED] == 0;
+
+cleanup:
+    if (icon.data) unmap_file(&icon);
+    appbundle_context_destroy(ctx);     /* removes the rendered icon and entitlements */
+    free(entitlements);
+    free(tasks);
+    free_targets(&list);
+    return ok;
+}
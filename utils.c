@@ -0,0 +1,366 @@
+/*
+ * Shared Utilities for AppBundleGenerator
+ * String formatting, directory helpers, scratch space and error reporting
+ * used by both the CLI and libappbundler
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include "shared.h"
+
+extern char **environ;
+
+char* heap_printf(const char *format, ...)
+{
+    va_list args;
+    int size = 4096;
+    char *buffer, *ret;
+    int n;
+
+    while (1)
+    {
+        buffer = malloc(size);
+        if (buffer == NULL)
+            break;
+        va_start(args, format);
+        n = vsnprintf(buffer, size, format, args);
+        va_end(args);
+        if (n == -1)
+            size *= 2;
+        else if (n >= size)
+            size = n + 1;
+        else
+            break;
+        free(buffer);
+    }
+
+    if (!buffer) return NULL;
+    ret = realloc( buffer, strlen(buffer) + 1 );
+    if (!ret) ret = buffer;
+    return ret;
+}
+
+/*
+ * mkdir -p. The directory itself is tried first: its parent usually
+ * exists, and then that is the only syscall.
+ */
+BOOL create_directories(char *directory)
+{
+    BOOL ret = TRUE;
+    int i;
+
+    if (mkdir(directory, 0777) == 0 || errno == EEXIST)
+        return TRUE;
+    if (errno != ENOENT)
+        return FALSE;
+
+    for (i = 0; directory[i]; i++)
+    {
+        if (i > 0 && directory[i] == '/')
+        {
+            directory[i] = 0;
+            mkdir(directory, 0777);
+            directory[i] = '/';
+        }
+    }
+    if (mkdir(directory, 0777) && errno != EEXIST)
+       ret = FALSE;
+
+    return ret;
+}
+
+/*
+ * Create a private, uniquely named directory under base (or $TMPDIR when
+ * base is NULL). Unlike pid-derived names this cannot collide between
+ * threads or between contexts in one process. Caller frees the result.
+ */
+char *create_scratch_dir(const char *base, const char *prefix)
+{
+    const char *tmp = base;
+    char *path;
+
+    if (!tmp) tmp = getenv("TMPDIR");
+    if (!tmp || !*tmp) tmp = "/tmp";
+
+    path = heap_printf("%s/%s.XXXXXX", tmp, prefix ? prefix : "appbundle");
+    if (!path) return NULL;
+
+    if (!mkdtemp(path)) {
+        DEBUG_PRINT("Failed to create scratch directory %s\n", path);
+        free(path);
+        return NULL;
+    }
+
+    return path;
+}
+
+/* Recursively delete path without following symlinks */
+BOOL remove_tree(const char *path)
+{
+    struct stat st;
+    struct dirent *entry;
+    DIR *dir;
+    BOOL ret = TRUE;
+
+    if (lstat(path, &st) != 0)
+        return errno == ENOENT;
+
+    if (!S_ISDIR(st.st_mode))
+        return unlink(path) == 0;
+
+    dir = opendir(path);
+    if (!dir) return FALSE;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char *child;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        child = heap_printf("%s/%s", path, entry->d_name);
+        if (!child || !remove_tree(child))
+            ret = FALSE;
+        free(child);
+    }
+    closedir(dir);
+
+    if (rmdir(path) != 0)
+        ret = FALSE;
+    return ret;
+}
+
+/* Write all of data to fd, retrying short writes */
+static BOOL write_all(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        len -= (size_t)n;
+    }
+    return TRUE;
+}
+
+/*
+ * Create or replace path with len bytes of data in a single write: no
+ * stdio buffering, and the mode is set on the open descriptor rather than
+ * by path afterwards. Executables get 0755, other files the usual
+ * 0666 & ~umask.
+ */
+BOOL write_file(const char *path, const void *data, size_t len, BOOL executable)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, executable ? 0777 : 0666);
+    BOOL ret;
+
+    if (fd < 0) {
+        DEBUG_PRINT("Failed to create %s: %s\n", path, strerror(errno));
+        return FALSE;
+    }
+
+    ret = write_all(fd, data, len);
+    if (executable && fchmod(fd, 0755) != 0)
+        ret = FALSE;
+    if (close(fd) != 0)
+        ret = FALSE;
+    return ret;
+}
+
+/*
+ * Give path exactly these contents unless it already has them. The new
+ * file is written beside the old one and renamed over it, so a reader sees
+ * one or the other, never a mix. The temporary name is unique, since
+ * --update, --reconcile and an --async-icon finisher may replace the same
+ * file at once. The file keeps its mode (0644 when new). *changed tells
+ * whether it was replaced.
+ */
+BOOL replace_file(const char *path, const void *data, size_t len, BOOL *changed)
+{
+    MappedFile current;
+    struct stat st;
+    char *temp_path;
+    mode_t mode = 0644;
+    BOOL ret = FALSE;
+    int fd;
+
+    *changed = FALSE;
+    if (map_file(path, &current)) {
+        BOOL same = current.len == len && memcmp(current.data, data, len) == 0;
+
+        unmap_file(&current);
+        if (same)
+            return TRUE;
+    }
+    if (stat(path, &st) == 0)
+        mode = st.st_mode & 07777;
+
+    temp_path = heap_printf("%s.XXXXXX", path);
+    if (!temp_path)
+        return FALSE;
+    if ((fd = mkstemp(temp_path)) < 0) {
+        DEBUG_PRINT("Failed to create a file beside %s: %s\n", path, strerror(errno));
+        free(temp_path);
+        return FALSE;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    ret = write_all(fd, data, len) && fchmod(fd, mode) == 0;
+    if (close(fd) != 0)
+        ret = FALSE;
+    if (ret && rename(temp_path, path) == 0) {
+        *changed = TRUE;
+    } else {
+        ret = FALSE;
+        unlink(temp_path);
+    }
+
+    free(temp_path);
+    return ret;
+}
+
+/*
+ * Give everything under path fixed permissions and the timestamp epoch,
+ * so a tree's metadata no longer depends on umask or build time. Files
+ * with any execute bit become 0755, other files 0644, directories 0755;
+ * symlinks keep their mode. Children are done before their directory,
+ * whose mtime would otherwise change again.
+ */
+BOOL normalize_tree(const char *path, time_t epoch)
+{
+    struct timespec times[2];
+    struct stat st;
+    BOOL ret = TRUE;
+
+    if (lstat(path, &st) != 0)
+        return FALSE;
+
+    if (S_ISDIR(st.st_mode)) {
+        struct dirent *entry;
+        DIR *dir = opendir(path);
+
+        if (!dir) return FALSE;
+        while ((entry = readdir(dir)) != NULL) {
+            char *child;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+
+            child = heap_printf("%s/%s", path, entry->d_name);
+            if (!child || !normalize_tree(child, epoch))
+                ret = FALSE;
+            free(child);
+        }
+        closedir(dir);
+
+        if (chmod(path, 0755) != 0)
+            ret = FALSE;
+    } else if (S_ISREG(st.st_mode)) {
+        if (chmod(path, (st.st_mode & 0111) ? 0755 : 0644) != 0)
+            ret = FALSE;
+    }
+
+    times[0].tv_sec = times[1].tv_sec = epoch;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW) != 0)
+        ret = FALSE;
+    return ret;
+}
+
+/*
+ * Start argv[0] (searched in PATH) with argv without waiting for it.
+ * Unlike system() this does not go through sh, so arguments need no
+ * quoting, and it does not touch process-wide signal dispositions, so
+ * concurrent builds may each run tools. Returns the pid, or -1.
+ */
+pid_t spawn_command(const char *const argv[], int stderr_mode)
+{
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    if (stderr_mode == RUN_STDERR_NULL)
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    else if (stderr_mode == RUN_STDERR_STDOUT)
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    err = posix_spawnp(&pid, argv[0], &actions, NULL, (char *const *)argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        DEBUG_PRINT("Failed to run %s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/* Wait for a spawn_command child; its exit status, or -1 if it did not exit */
+int wait_command(pid_t pid)
+{
+    int status;
+
+    if (pid < 0)
+        return -1;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* Run argv[0] as spawn_command does and wait for it */
+int run_command(const char *const argv[], int stderr_mode)
+{
+    return wait_command(spawn_command(argv, stderr_mode));
+}
+
+/* Error handling functions */
+void print_error(ErrorCode code, const char *details)
+{
+    fprintf(stderr, "ERROR: %s", error_code_to_string(code));
+    if (details) {
+        fprintf(stderr, " - %s", details);
+    }
+    fprintf(stderr, "\n");
+}
+
+const char* error_code_to_string(ErrorCode code)
+{
+    switch (code) {
+        case ERR_SUCCESS:
+            return "Success";
+        case ERR_INVALID_ARGS:
+            return "Invalid arguments";
+        case ERR_DIR_CREATION_FAILED:
+            return "Failed to create directory structure";
+        case ERR_PLIST_GENERATION_FAILED:
+            return "Failed to generate Info.plist";
+        case ERR_SCRIPT_GENERATION_FAILED:
+            return "Failed to generate launcher script";
+        case ERR_ICON_CONVERSION_FAILED:
+            return "Failed to convert icon";
+        case ERR_CODE_SIGNING_FAILED:
+            return "Code signing failed";
+        case ERR_FILE_NOT_FOUND:
+            return "File not found";
+        case ERR_PERMISSION_DENIED:
+            return "Permission denied";
+        default:
+            return "Unknown error";
+    }
+}
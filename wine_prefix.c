@@ -0,0 +1,886 @@
+/*
+ * Wine Prefix Scanning for AppBundleGenerator
+ * Builds a bundle for every Start Menu shortcut in a Wine prefix.
+ *
+ * The .lnk files are read natively (MS-SHLLINK). The target comes from
+ * LinkInfo, the environment variable block, the LinkTargetIDList or the
+ * relative path, in that order; arguments, working directory and icon
+ * come from StringData. Windows paths are mapped through the prefix's
+ * dosdevices links, matching each component case-insensitively the way
+ * Wine itself does, and become launcher commands of the form
+ *
+ *   env WINEPREFIX="/prefix" wine "/prefix/drive_c/Program Files/App/app.exe" "arg"
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+
+/* ShellLinkHeader.LinkFlags */
+#define SLDF_HAS_ID_LIST        0x00000001
+#define SLDF_HAS_LINK_INFO      0x00000002
+#define SLDF_HAS_NAME           0x00000004
+#define SLDF_HAS_RELPATH        0x00000008
+#define SLDF_HAS_WORKINGDIR     0x00000010
+#define SLDF_HAS_ARGS           0x00000020
+#define SLDF_HAS_ICONLOCATION   0x00000040
+#define SLDF_UNICODE            0x00000080
+#define SLDF_HAS_EXP_SZ         0x00000200
+#define SLDF_HAS_EXP_ICON_SZ    0x00004000
+
+#define SHELL_LINK_HEADER_SIZE  0x4c
+#define EXP_SZ_LINK_SIG         0xa0000001  /* EnvironmentVariableDataBlock */
+#define EXP_SZ_ICON_SIG         0xa0000007  /* IconEnvironmentDataBlock */
+#define MAX_SCAN_DEPTH          16
+
+/* What a shortcut points at; all strings are UTF-8 */
+typedef struct {
+    char *target;                   /* Windows path */
+    char *relative_path;            /* relative to the .lnk's folder */
+    char *arguments;
+    char *working_dir;
+    char *icon_location;
+} ShellLink;
+
+typedef struct {
+    char *lnk_path;
+    char *bundle_name;
+    char *command;
+    char *icon_path;                /* NULL if none */
+} WineShortcut;
+
+typedef struct {
+    WineShortcut *items;
+    int count;
+    int capacity;
+} ShortcutList;
+
+static uint16_t read16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* UTF-16LE, at most units long or up to a NUL, to UTF-8 */
+static char *utf16_dup(const uint8_t *p, size_t units)
+{
+    char *out = malloc(units * 3 + 1), *w = out;
+    size_t i;
+
+    if (!out) return NULL;
+
+    for (i = 0; i < units; i++) {
+        uint32_t c = read16(p + i * 2);
+
+        if (c == 0) break;
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < units) {
+            uint32_t lo = read16(p + (i + 1) * 2);
+
+            if (lo >= 0xdc00 && lo < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+                i++;
+            }
+        }
+        if (c < 0x80) {
+            *w++ = (char)c;
+        } else if (c < 0x800) {
+            *w++ = (char)(0xc0 | c >> 6);
+            *w++ = (char)(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            *w++ = (char)(0xe0 | c >> 12);
+            *w++ = (char)(0x80 | (c >> 6 & 0x3f));
+            *w++ = (char)(0x80 | (c & 0x3f));
+        } else {
+            *w++ = (char)(0xf0 | c >> 18);
+            *w++ = (char)(0x80 | (c >> 12 & 0x3f));
+            *w++ = (char)(0x80 | (c >> 6 & 0x3f));
+            *w++ = (char)(0x80 | (c & 0x3f));
+        }
+    }
+    *w = '\0';
+    return out;
+}
+
+/* Code-page strings, taken as Latin-1, which covers what installers put there */
+static char *ansi_dup(const uint8_t *p, size_t max)
+{
+    char *out = malloc(max * 2 + 1), *w = out;
+    size_t i;
+
+    if (!out) return NULL;
+
+    for (i = 0; i < max && p[i]; i++) {
+        if (p[i] < 0x80) {
+            *w++ = (char)p[i];
+        } else {
+            *w++ = (char)(0xc0 | p[i] >> 6);
+            *w++ = (char)(0x80 | (p[i] & 0x3f));
+        }
+    }
+    *w = '\0';
+    return out;
+}
+
+/* NUL-terminated string at offset off of a block that is len long */
+static char *block_string(const uint8_t *block, size_t len, size_t off, BOOL unicode)
+{
+    if (off == 0 || off >= len)
+        return NULL;
+    return unicode ? utf16_dup(block + off, (len - off) / 2) : ansi_dup(block + off, len - off);
+}
+
+static char *join_path(char *base, const char *suffix)
+{
+    char *joined;
+
+    if (!base || !suffix || !*suffix)
+        return base;
+    joined = heap_printf("%s%s%s", base,
+                         base[0] && base[strlen(base) - 1] != '\\' ? "\\" : "", suffix);
+    free(base);
+    return joined;
+}
+
+/* LinkInfo: LocalBasePath plus CommonPathSuffix, Unicode versions when present */
+static char *parse_link_info(const uint8_t *info, size_t len)
+{
+    uint32_t header_size, flags;
+    char *base, *suffix;
+
+    if (len < 0x1c)
+        return NULL;
+
+    header_size = read32(info + 4);
+    flags = read32(info + 8);
+    if (!(flags & 1))               /* VolumeIDAndLocalBasePath */
+        return NULL;
+
+    if (header_size >= 0x24 && len >= 0x24 && read32(info + 0x1c)) {
+        base = block_string(info, len, read32(info + 0x1c), TRUE);
+        suffix = block_string(info, len, read32(info + 0x20), TRUE);
+    } else {
+        base = block_string(info, len, read32(info + 0x10), FALSE);
+        suffix = block_string(info, len, read32(info + 0x18), FALSE);
+    }
+
+    base = join_path(base, suffix);
+    free(suffix);
+    return base;
+}
+
+/*
+ * Long name of a file entry shell item, from its 0xbeef0004 extension
+ * block when it has one, else the 8.3 (Windows) or long (Wine) name that
+ * follows the fixed fields.
+ */
+static char *file_item_name(const uint8_t *item, size_t len)
+{
+    size_t i;
+
+    for (i = 14; i + 8 <= len; i += 2) {
+        const uint8_t *ext = item + i;
+        uint16_t ext_size = read16(ext), version = read16(ext + 2);
+        size_t off = 18;
+
+        if (read32(ext + 4) != 0xbeef0004 || ext_size > len - i)
+            continue;
+        if (version >= 7) off += 18;
+        if (version >= 3) off += 2;
+        if (version >= 9) off += 4;
+        if (version >= 8) off += 4;
+        if (off < ext_size)
+            return utf16_dup(ext + off, (ext_size - off) / 2);
+    }
+
+    return len > 14 ? ansi_dup(item + 14, len - 14) : NULL;
+}
+
+/* LinkTargetIDList: a volume item ("C:\") followed by file entry items */
+static char *parse_id_list(const uint8_t *list, size_t len)
+{
+    char *path = NULL;
+    size_t off = 0;
+
+    while (off + 2 <= len) {
+        uint16_t size = read16(list + off);
+        const uint8_t *item = list + off;
+        uint8_t type;
+
+        if (size == 0) break;
+        if (size < 3 || size > len - off) {
+            free(path);
+            return NULL;
+        }
+
+        type = item[2] & 0x70;
+        if (type == 0x20 && size >= 6) {
+            free(path);
+            path = ansi_dup(item + 3, size - 3);
+        } else if (type == 0x30 && path) {
+            char *name = file_item_name(item, size);
+
+            path = join_path(path, name);
+            free(name);
+        }
+        off += size;
+    }
+
+    return path;
+}
+
+/* One StringData entry: a character count and that many characters */
+static BOOL read_string_data(const uint8_t *data, size_t len, size_t *off, BOOL unicode,
+                             char **out)
+{
+    size_t count, bytes;
+
+    if (*off + 2 > len)
+        return FALSE;
+    count = read16(data + *off);
+    bytes = unicode ? count * 2 : count;
+    if (*off + 2 + bytes > len)
+        return FALSE;
+
+    if (out) {
+        char *s = malloc(bytes + 2);
+
+        if (!s) return FALSE;
+        memcpy(s, data + *off + 2, bytes);
+        s[bytes] = s[bytes + 1] = 0;
+        *out = unicode ? utf16_dup((const uint8_t *)s, count) : ansi_dup((const uint8_t *)s, count);
+        free(s);
+    }
+    *off += 2 + bytes;
+    return TRUE;
+}
+
+static void free_shell_link(ShellLink *link)
+{
+    free(link->target);
+    free(link->relative_path);
+    free(link->arguments);
+    free(link->working_dir);
+    free(link->icon_location);
+    memset(link, 0, sizeof(ShellLink));
+}
+
+/* Parse a .lnk file; FALSE if it is not one or has no usable target */
+static BOOL parse_shell_link(const uint8_t *data, size_t len, ShellLink *link)
+{
+    static const uint8_t link_clsid[16] = {
+        0x01, 0x14, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46
+    };
+    uint32_t flags;
+    size_t off = SHELL_LINK_HEADER_SIZE;
+    char *id_list_target = NULL;
+    BOOL unicode;
+
+    memset(link, 0, sizeof(ShellLink));
+    if (len < SHELL_LINK_HEADER_SIZE || read32(data) != SHELL_LINK_HEADER_SIZE ||
+        memcmp(data + 4, link_clsid, 16) != 0)
+        return FALSE;
+
+    flags = read32(data + 0x14);
+    unicode = (flags & SLDF_UNICODE) != 0;
+
+    if (flags & SLDF_HAS_ID_LIST) {
+        size_t size;
+
+        if (off + 2 > len) return FALSE;
+        size = read16(data + off);
+        if (off + 2 + size > len) return FALSE;
+        id_list_target = parse_id_list(data + off + 2, size);
+        off += 2 + size;
+    }
+
+    if (flags & SLDF_HAS_LINK_INFO) {
+        size_t size;
+
+        if (off + 4 > len) goto fail;
+        size = read32(data + off);
+        if (size < 4 || off + size > len) goto fail;
+        link->target = parse_link_info(data + off, size);
+        off += size;
+    }
+
+    if (((flags & SLDF_HAS_NAME) && !read_string_data(data, len, &off, unicode, NULL)) ||
+        ((flags & SLDF_HAS_RELPATH) &&
+         !read_string_data(data, len, &off, unicode, &link->relative_path)) ||
+        ((flags & SLDF_HAS_WORKINGDIR) &&
+         !read_string_data(data, len, &off, unicode, &link->working_dir)) ||
+        ((flags & SLDF_HAS_ARGS) &&
+         !read_string_data(data, len, &off, unicode, &link->arguments)) ||
+        ((flags & SLDF_HAS_ICONLOCATION) &&
+         !read_string_data(data, len, &off, unicode, &link->icon_location)))
+        goto fail;
+
+    /* ExtraData: the %VAR% forms of the target and icon, 260 ANSI then 260 wide chars */
+    while (off + 8 <= len) {
+        uint32_t size = read32(data + off), sig = read32(data + off + 4);
+        char **field = NULL;
+
+        if (size < 8 || off + size > len) break;
+        if (sig == EXP_SZ_LINK_SIG && (flags & SLDF_HAS_EXP_SZ) && !link->target)
+            field = &link->target;
+        else if (sig == EXP_SZ_ICON_SIG && (flags & SLDF_HAS_EXP_ICON_SZ))
+            field = &link->icon_location;
+
+        if (field && size >= 8 + 260 + 520) {
+            char *value = utf16_dup(data + off + 8 + 260, 260);
+
+            if (value && !*value) {
+                free(value);
+                value = ansi_dup(data + off + 8, 260);
+            }
+            if (value && *value) {
+                free(*field);
+                *field = value;
+            } else {
+                free(value);
+            }
+        }
+        off += size;
+    }
+
+    if (!link->target) {
+        link->target = id_list_target;
+        id_list_target = NULL;
+    }
+    free(id_list_target);
+
+    if ((link->target && *link->target) || (link->relative_path && *link->relative_path))
+        return TRUE;
+
+fail:
+    free(id_list_target);
+    free_shell_link(link);
+    return FALSE;
+}
+
+/* ---- Windows paths to prefix paths ---- */
+
+/* The variables installers use in shortcuts, as Wine sets them up */
+static char *expand_environment(const char *path)
+{
+    static const struct {
+        const char *name;
+        const char *value;
+    } vars[] = {
+        {"%ProgramFiles%",          "C:\\Program Files"},
+        {"%ProgramFiles(x86)%",     "C:\\Program Files (x86)"},
+        {"%ProgramW6432%",          "C:\\Program Files"},
+        {"%CommonProgramFiles%",    "C:\\Program Files\\Common Files"},
+        {"%SystemRoot%",            "C:\\windows"},
+        {"%windir%",                "C:\\windows"},
+        {"%SystemDrive%",           "C:"},
+        {"%ProgramData%",           "C:\\ProgramData"},
+        {"%ALLUSERSPROFILE%",       "C:\\ProgramData"},
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        size_t n = strlen(vars[i].name);
+
+        if (strncasecmp(path, vars[i].name, n) == 0)
+            return heap_printf("%s%s", vars[i].value, path + n);
+    }
+    return strdup(path);
+}
+
+/*
+ * Append the components of a Windows path to an existing Unix directory,
+ * matching each one case-insensitively. NULL if a component is missing.
+ */
+static char *resolve_components(const char *unix_base, const char *win_path)
+{
+    char *path = strdup(unix_base);
+    const char *p = win_path;
+
+    while (path && *p) {
+        size_t len = strcspn(p, "\\/");
+        char name[NAME_MAX + 1], *next;
+        struct stat st;
+
+        if (len == 0 || (len == 1 && *p == '.')) {
+            p += len + (p[len] != '\0');
+            continue;
+        }
+        if (len > NAME_MAX) {
+            free(path);
+            return NULL;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len + (p[len] != '\0');
+
+        if (strcmp(name, "..") == 0) {
+            char *slash = strrchr(path, '/');
+
+            if (slash && slash != path) *slash = '\0';
+            continue;
+        }
+
+        next = heap_printf("%s/%s", path, name);
+        if (next && stat(next, &st) != 0) {
+            DIR *dir = opendir(path);
+            struct dirent *entry;
+
+            free(next);
+            next = NULL;
+            while (dir && (entry = readdir(dir)) != NULL) {
+                if (strcasecmp(entry->d_name, name) == 0) {
+                    next = heap_printf("%s/%s", path, entry->d_name);
+                    break;
+                }
+            }
+            if (dir) closedir(dir);
+        }
+
+        free(path);
+        path = next;
+    }
+
+    return path;
+}
+
+/* "C:\dir\file" to <prefix>/dosdevices/c:/dir/file; NULL for UNC paths or missing files */
+static char *prefix_path(const char *prefix, const char *win_path)
+{
+    char *expanded = expand_environment(win_path), *drive_dir, *ret = NULL;
+    struct stat st;
+
+    if (!expanded)
+        return NULL;
+
+    if (((expanded[0] >= 'a' && expanded[0] <= 'z') || (expanded[0] >= 'A' && expanded[0] <= 'Z')) &&
+        expanded[1] == ':') {
+        char letter = (char)(expanded[0] | 0x20);
+
+        drive_dir = heap_printf("%s/dosdevices/%c:", prefix, letter);
+        if (drive_dir && stat(drive_dir, &st) != 0 && letter == 'c') {
+            free(drive_dir);
+            drive_dir = heap_printf("%s/drive_c", prefix);
+        }
+        if (drive_dir)
+            ret = resolve_components(drive_dir, expanded + 2);
+        free(drive_dir);
+    }
+
+    free(expanded);
+    return ret;
+}
+
+/* ---- Launcher commands ---- */
+
+/* s in double quotes, with the characters sh treats specially there escaped */
+static char *shell_quote(const char *s)
+{
+    char *out = malloc(strlen(s) * 2 + 3), *w = out;
+
+    if (!out) return NULL;
+
+    *w++ = '"';
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\' || *s == '$' || *s == '`')
+            *w++ = '\\';
+        *w++ = *s;
+    }
+    *w++ = '"';
+    *w = '\0';
+    return out;
+}
+
+static char *append_quoted(char *command, const char *s)
+{
+    char *quoted = shell_quote(s), *out = NULL;
+
+    if (quoted)
+        out = heap_printf("%s %s", command, quoted);
+    free(quoted);
+    free(command);
+    return out;
+}
+
+/*
+ * Split a Windows command line the way CommandLineToArgvW does and append
+ * each argument, so the program sees the same argv it would on Windows.
+ */
+static char *append_windows_arguments(char *command, const char *args)
+{
+    char *arg = malloc(strlen(args) + 1);
+    const char *p = args;
+
+    if (!arg) {
+        free(command);
+        return NULL;
+    }
+
+    while (command) {
+        char *w = arg;
+        BOOL quoted = FALSE;
+
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+
+        while (*p && (quoted || (*p != ' ' && *p != '\t'))) {
+            size_t backslashes = 0;
+
+            while (*p == '\\') {
+                backslashes++;
+                p++;
+            }
+            if (*p == '"') {
+                /* 2n backslashes + quote: n backslashes, quote toggles; 2n+1: literal quote */
+                for (; backslashes >= 2; backslashes -= 2) *w++ = '\\';
+                if (backslashes) {
+                    *w++ = '"';
+                } else if (quoted && p[1] == '"') {
+                    *w++ = '"';
+                    p++;
+                } else {
+                    quoted = !quoted;
+                }
+                p++;
+            } else {
+                for (; backslashes > 0; backslashes--) *w++ = '\\';
+                if (*p && (quoted || (*p != ' ' && *p != '\t')))
+                    *w++ = *p++;
+            }
+        }
+        *w = '\0';
+        command = append_quoted(command, arg);
+    }
+
+    free(arg);
+    return command;
+}
+
+static BOOL has_extension(const char *path, const char *const *extensions)
+{
+    const char *dot = strrchr(path, '.');
+
+    for (; dot && *extensions; extensions++) {
+        if (strcasecmp(dot, *extensions) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/*
+ * env WINEPREFIX="<prefix>" wine "<target>" args, behind a cd into the
+ * working directory when the shortcut has one. Documents and other
+ * non-programs are opened through Wine's start, as Explorer would.
+ */
+static char *launcher_command(const char *prefix, const char *target, const ShellLink *link,
+                              const char *working_dir)
+{
+    static const char *const programs[] = {".exe", ".com", ".bat", ".cmd", ".msi", NULL};
+    char *quoted_prefix = shell_quote(prefix), *quoted_dir = NULL, *command = NULL;
+
+    if (working_dir)
+        quoted_dir = shell_quote(working_dir);
+
+    if (quoted_prefix && (!working_dir || quoted_dir))
+        command = heap_printf("%s%s%senv WINEPREFIX=%s wine%s",
+                              quoted_dir ? "cd " : "", quoted_dir ? quoted_dir : "",
+                              quoted_dir ? " && exec " : "", quoted_prefix,
+                              has_extension(target, programs) ? "" : " start /unix");
+    if (command)
+        command = append_quoted(command, target);
+    if (command && link->arguments && *link->arguments)
+        command = append_windows_arguments(command, link->arguments);
+
+    free(quoted_dir);
+    free(quoted_prefix);
+    return command;
+}
+
+/* ---- Scanning ---- */
+
+static BOOL has_lnk_extension(const char *name)
+{
+    size_t len = strlen(name);
+    return len > 4 && strcasecmp(name + len - 4, ".lnk") == 0;
+}
+
+static void collect_shortcuts(const char *path, ShortcutList *list, int depth)
+{
+    struct dirent *entry;
+    DIR *dir;
+
+    if (depth > MAX_SCAN_DEPTH || !(dir = opendir(path)))
+        return;
+
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        char *child;
+
+        if (entry->d_name[0] == '.')
+            continue;
+
+        child = heap_printf("%s/%s", path, entry->d_name);
+        if (!child || stat(child, &st) != 0) {
+            free(child);
+            continue;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            collect_shortcuts(child, list, depth + 1);
+            free(child);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || !has_lnk_extension(entry->d_name)) {
+            free(child);
+            continue;
+        }
+
+        if (list->count == list->capacity) {
+            int capacity = list->capacity ? list->capacity * 2 : 32;
+            WineShortcut *items = realloc(list->items, capacity * sizeof(WineShortcut));
+
+            if (!items) {
+                free(child);
+                break;
+            }
+            list->items = items;
+            list->capacity = capacity;
+        }
+        memset(&list->items[list->count], 0, sizeof(WineShortcut));
+        list->items[list->count++].lnk_path = child;
+    }
+
+    closedir(dir);
+}
+
+/* The shared and per-user Start Menus of current and older prefix layouts */
+static void collect_start_menus(const char *prefix, ShortcutList *list)
+{
+    static const char *const user_menus[] = {
+        "AppData/Roaming/Microsoft/Windows/Start Menu",
+        "Start Menu",
+    };
+    char *path, *users;
+    struct dirent *entry;
+    DIR *dir;
+    size_t i;
+
+    path = heap_printf("%s/drive_c/ProgramData/Microsoft/Windows/Start Menu", prefix);
+    if (path) collect_shortcuts(path, list, 0);
+    free(path);
+    path = heap_printf("%s/drive_c/windows/profiles/All Users/Start Menu", prefix);
+    if (path) collect_shortcuts(path, list, 0);
+    free(path);
+
+    users = heap_printf("%s/drive_c/users", prefix);
+    dir = users ? opendir(users) : NULL;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        for (i = 0; i < sizeof(user_menus) / sizeof(user_menus[0]); i++) {
+            path = heap_printf("%s/%s/%s", users, entry->d_name, user_menus[i]);
+            if (path) collect_shortcuts(path, list, 0);
+            free(path);
+        }
+    }
+    if (dir) closedir(dir);
+    free(users);
+}
+
+static int compare_shortcut_paths(const void *a, const void *b)
+{
+    return strcmp(((const WineShortcut *)a)->lnk_path, ((const WineShortcut *)b)->lnk_path);
+}
+
+static void free_shortcut(WineShortcut *shortcut)
+{
+    free(shortcut->lnk_path);
+    free(shortcut->bundle_name);
+    free(shortcut->command);
+    free(shortcut->icon_path);
+}
+
+/* Resolve one .lnk into a bundle name, command and icon; FALSE to skip it */
+static BOOL load_shortcut(const char *prefix, WineShortcut *shortcut)
+{
+    MappedFile file;
+    ShellLink link;
+    char *target = NULL, *working_dir = NULL, *lnk_dir, *slash;
+    const char *name;
+    BOOL ok;
+
+    if (!map_file(shortcut->lnk_path, &file))
+        return FALSE;
+    ok = parse_shell_link(file.data, file.len, &link);
+    unmap_file(&file);
+    if (!ok) {
+        DEBUG_PRINT("%s is not a shell link\n", shortcut->lnk_path);
+        return FALSE;
+    }
+
+    if (link.target && *link.target)
+        target = prefix_path(prefix, link.target);
+    if (!target && link.relative_path && (lnk_dir = strdup(shortcut->lnk_path)) != NULL) {
+        if ((slash = strrchr(lnk_dir, '/')) != NULL) *slash = '\0';
+        target = resolve_components(lnk_dir, link.relative_path);
+        free(lnk_dir);
+    }
+    if (!target) {
+        DEBUG_PRINT("%s: target %s is not in the prefix\n", shortcut->lnk_path,
+                    link.target ? link.target : link.relative_path);
+        free_shell_link(&link);
+        return FALSE;
+    }
+
+    if (link.working_dir && *link.working_dir)
+        working_dir = prefix_path(prefix, link.working_dir);
+    shortcut->command = launcher_command(prefix, target, &link, working_dir);
+
+    /* IconLocation is "path" or "path,index"; the index is not used */
+    if (link.icon_location && *link.icon_location) {
+        char *comma = strrchr(link.icon_location, ',');
+
+        if (comma && comma[1] && strspn(comma + 1, "-0123456789") == strlen(comma + 1))
+            *comma = '\0';
+        shortcut->icon_path = prefix_path(prefix, link.icon_location);
+    }
+    if (!shortcut->icon_path && detect_icon_format(target) == ICON_FORMAT_PE)
+        shortcut->icon_path = strdup(target);
+
+    name = strrchr(shortcut->lnk_path, '/');
+    name = name ? name + 1 : shortcut->lnk_path;
+    shortcut->bundle_name = strndup(name, strlen(name) - 4);
+    for (slash = shortcut->bundle_name; slash && *slash; slash++) {
+        if (*slash == '/') *slash = '-';
+    }
+
+    free(working_dir);
+    free(target);
+    free_shell_link(&link);
+    return shortcut->command && shortcut->bundle_name;
+}
+
+/*
+ * Keep one shortcut per command (the shared and per-user menus often both
+ * have it) and number the rest when their names collide, ignoring case as
+ * the default macOS volumes do.
+ */
+static BOOL make_unique(WineShortcut *items, int count, WineShortcut *shortcut)
+{
+    int n = 1, i;
+    char *candidate;
+
+    for (i = 0; i < count; i++) {
+        if (strcmp(items[i].command, shortcut->command) == 0)
+            return FALSE;
+    }
+
+    for (candidate = strdup(shortcut->bundle_name); candidate; ) {
+        for (i = 0; i < count && strcasecmp(items[i].bundle_name, candidate) != 0; i++)
+            ;
+        if (i == count) break;
+        free(candidate);
+        candidate = heap_printf("%s (%d)", shortcut->bundle_name, ++n);
+    }
+    if (!candidate)
+        return FALSE;
+
+    free(shortcut->bundle_name);
+    shortcut->bundle_name = candidate;
+    return TRUE;
+}
+
+/*
+ * Build a bundle for every Start Menu shortcut in the Wine prefix into
+ * base->bundle_dest. base supplies signing, launcher and icon settings.
+ */
+BOOL scan_wine_prefix(const char *prefix_arg, const AppBundleOptions *base)
+{
+    ShortcutList list = {0};
+    AppBundleOptions *options = NULL;
+    ErrorCode *results = NULL;
+    AppBundleContext *ctx = NULL;
+    char prefix[PATH_MAX], *drive_c;
+    int i, count = 0, failures = 0, skipped = 0;
+    struct stat st;
+
+    drive_c = realpath(prefix_arg, prefix) ? heap_printf("%s/drive_c", prefix) : NULL;
+    if (!drive_c || stat(drive_c, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        free(drive_c);
+        print_error(ERR_FILE_NOT_FOUND, "not a Wine prefix (no drive_c)");
+        return FALSE;
+    }
+    free(drive_c);
+
+    collect_start_menus(prefix, &list);
+
+    /* readdir order varies; sort so duplicate names are numbered the same every run */
+    if (list.count > 1)
+        qsort(list.items, list.count, sizeof(WineShortcut), compare_shortcut_paths);
+
+    for (i = 0; i < list.count; i++) {
+        WineShortcut shortcut = list.items[i];
+
+        if (!load_shortcut(prefix, &shortcut) || !make_unique(list.items, count, &shortcut)) {
+            free_shortcut(&shortcut);
+            skipped++;
+            continue;
+        }
+        list.items[count++] = shortcut;
+    }
+
+    printf("Found %d shortcut(s) in %s (%d skipped)\n", count, prefix, skipped);
+    if (count == 0)
+        goto cleanup;
+
+    options = calloc(count, sizeof(AppBundleOptions));
+    results = calloc(count, sizeof(ErrorCode));
+    ctx = appbundle_context_create(base->jobs);
+    if (!options || !results || !ctx) {
+        failures = count;
+        goto cleanup;
+    }
+
+    for (i = 0; i < count; i++) {
+        options[i] = *base;
+        options[i].bundle_name = list.items[i].bundle_name;
+        options[i].executable_path = list.items[i].command;
+        if (list.items[i].icon_path)
+            options[i].icon_path = list.items[i].icon_path;
+        /* The command is a shell line; there is no single file to place in the bundle */
+        if (options[i].launcher_mode == LAUNCHER_DIRECT)
+            options[i].launcher_mode = LAUNCHER_SCRIPT;
+    }
+
+    failures = build_many_finishing_icons(ctx, options, count, results);
+
+    for (i = 0; i < count; i++) {
+        if (results[i] == ERR_SUCCESS)
+            printf("  %s.app <- %s\n", list.items[i].bundle_name, list.items[i].lnk_path);
+        else
+            fprintf(stderr, "ERROR: %s: %s\n", list.items[i].lnk_path, error_code_to_string(results[i]));
+    }
+
+    printf("Built %d of %d shortcut(s) into %s\n", count - failures, count, base->bundle_dest);
+
+cleanup:
+    appbundle_context_destroy(ctx);
+    for (i = 0; i < count; i++)
+        free_shortcut(&list.items[i]);
+    free(list.items);
+    free(options);
+    free(results);
+
+    return failures == 0;
+}
@@ -0,0 +1,283 @@
+/*
+ * Worker Pool for AppBundleGenerator
+ * Fixed-size pthread pool used by the parallel scanning and batch paths,
+ * and parallel_for for fan-outs inside a single build step
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "shared.h"
+
+typedef struct WorkItem {
+    WorkFunc fn;
+    void *arg;
+    struct WorkItem *next;
+} WorkItem;
+
+struct WorkQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;      /* signalled when an item is queued or on shutdown */
+    pthread_cond_t idle;            /* signalled when pending drops to zero */
+    WorkItem *head;
+    WorkItem *tail;
+    size_t pending;                 /* queued + running items */
+    BOOL shutdown;
+    int nthreads;
+    pthread_t *threads;
+};
+
+/* Number of online CPUs, used when the caller does not ask for a thread count */
+int work_queue_default_threads(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (n < 1) n = 1;
+    if (n > 64) n = 64;
+    return (int)n;
+}
+
+static void *work_queue_thread(void *param)
+{
+    WorkQueue *queue = param;
+    WorkItem *item;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (!queue->head && !queue->shutdown)
+            pthread_cond_wait(&queue->work_ready, &queue->lock);
+
+        if (!queue->head && queue->shutdown)
+            break;
+
+        item = queue->head;
+        queue->head = item->next;
+        if (!queue->head)
+            queue->tail = NULL;
+        pthread_mutex_unlock(&queue->lock);
+
+        item->fn(item->arg);
+        free(item);
+
+        pthread_mutex_lock(&queue->lock);
+        if (--queue->pending == 0)
+            pthread_cond_broadcast(&queue->idle);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+WorkQueue *work_queue_create(int nthreads)
+{
+    WorkQueue *queue;
+    int i;
+
+    if (nthreads <= 0)
+        nthreads = work_queue_default_threads();
+
+    queue = calloc(1, sizeof(WorkQueue));
+    if (!queue) return NULL;
+
+    queue->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!queue->threads) {
+        free(queue);
+        return NULL;
+    }
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work_ready, NULL);
+    pthread_cond_init(&queue->idle, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&queue->threads[i], NULL, work_queue_thread, queue) != 0) {
+            DEBUG_PRINT("Failed to start worker thread %d\n", i);
+            break;
+        }
+    }
+    queue->nthreads = i;
+
+    if (queue->nthreads == 0) {
+        work_queue_destroy(queue);
+        return NULL;
+    }
+
+    DEBUG_PRINT("Started worker pool with %d threads\n", queue->nthreads);
+    return queue;
+}
+
+/* Queue fn(arg); may be called from inside a running work item */
+BOOL work_queue_submit(WorkQueue *queue, WorkFunc fn, void *arg)
+{
+    WorkItem *item;
+
+    if (!queue || !fn) return FALSE;
+
+    item = malloc(sizeof(WorkItem));
+    if (!item) return FALSE;
+
+    item->fn = fn;
+    item->arg = arg;
+    item->next = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail)
+        queue->tail->next = item;
+    else
+        queue->head = item;
+    queue->tail = item;
+    queue->pending++;
+    pthread_cond_signal(&queue->work_ready);
+    pthread_mutex_unlock(&queue->lock);
+
+    return TRUE;
+}
+
+/* Block until every submitted item, including ones queued by other items, has run */
+void work_queue_wait(WorkQueue *queue)
+{
+    if (!queue) return;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->pending > 0)
+        pthread_cond_wait(&queue->idle, &queue->lock);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int work_queue_thread_count(const WorkQueue *queue)
+{
+    return queue ? queue->nthreads : 0;
+}
+
+void work_queue_destroy(WorkQueue *queue)
+{
+    int i;
+
+    if (!queue) return;
+
+    pthread_mutex_lock(&queue->lock);
+    queue->shutdown = TRUE;
+    pthread_cond_broadcast(&queue->work_ready);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (i = 0; i < queue->nthreads; i++)
+        pthread_join(queue->threads[i], NULL);
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->work_ready);
+    pthread_cond_destroy(&queue->idle);
+    free(queue->threads);
+    free(queue);
+}
+
+typedef struct {
+    ForFunc fn;
+    void *arg;
+    int count;
+    int next;                       /* next index to hand out */
+    pthread_mutex_t lock;
+} ParallelFor;
+
+static void *parallel_for_thread(void *param)
+{
+    ParallelFor *run = param;
+
+    for (;;) {
+        int index;
+
+        pthread_mutex_lock(&run->lock);
+        index = run->next < run->count ? run->next++ : -1;
+        pthread_mutex_unlock(&run->lock);
+
+        if (index < 0)
+            break;
+        run->fn(run->arg, index);
+    }
+    return NULL;
+}
+
+/*
+ * Call fn(arg, i) for every i below count, on the calling thread plus up
+ * to nthreads - 1 threads started for the call (0 = online CPUs). Unlike
+ * the pool this never waits on other queued work, so it may be used from
+ * inside a pool task, e.g. by a build step.
+ */
+void parallel_for(int count, int nthreads, ForFunc fn, void *arg)
+{
+    ParallelFor run;
+    pthread_t threads[64];
+    int i, started = 0;
+
+    if (nthreads <= 0)
+        nthreads = work_queue_default_threads();
+    if (nthreads > count)
+        nthreads = count;
+    if (nthreads > (int)(sizeof(threads) / sizeof(threads[0])))
+        nthreads = (int)(sizeof(threads) / sizeof(threads[0]));
+
+    run.fn = fn;
+    run.arg = arg;
+    run.count = count;
+    run.next = 0;
+    pthread_mutex_init(&run.lock, NULL);
+
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[started], NULL, parallel_for_thread, &run) == 0)
+            started++;
+    }
+    parallel_for_thread(&run);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_mutex_destroy(&run.lock);
+}
+
+/*
+ * Extra threads that fan-outs inside concurrent builds share, so that N
+ * pool builds each compressing an icon do not start N times the CPU count.
+ * Threads are borrowed without waiting: a caller gets what is free now,
+ * possibly none, and always works on its own thread as well.
+ */
+struct ThreadBudget {
+    pthread_mutex_t lock;
+    int available;
+};
+
+ThreadBudget *thread_budget_create(int threads)
+{
+    ThreadBudget *budget = calloc(1, sizeof(ThreadBudget));
+
+    if (!budget) return NULL;
+    pthread_mutex_init(&budget->lock, NULL);
+    budget->available = threads > 0 ? threads : 0;
+    return budget;
+}
+
+void thread_budget_destroy(ThreadBudget *budget)
+{
+    if (!budget) return;
+    pthread_mutex_destroy(&budget->lock);
+    free(budget);
+}
+
+/* Borrow up to want threads; returns how many were granted */
+int thread_budget_take(ThreadBudget *budget, int want)
+{
+    int granted;
+
+    pthread_mutex_lock(&budget->lock);
+    granted = want < budget->available ? want : budget->available;
+    if (granted < 0) granted = 0;
+    budget->available -= granted;
+    pthread_mutex_unlock(&budget->lock);
+    return granted;
+}
+
+void thread_budget_return(ThreadBudget *budget, int threads)
+{
+    pthread_mutex_lock(&budget->lock);
+    budget->available += threads;
+    pthread_mutex_unlock(&budget->lock);
+}